@@ -11,6 +11,8 @@
 #include <limits.h>
 #include <assert.h>
 
+#include <vector>
+
 #ifdef ENABLE_NO_FUSE
 #include "nofuse.h"
 #else
@@ -34,6 +36,18 @@ using namespace aznfsc;
 // Min/Max values for various aznfsc_cfg options.
 #define AZNFSCFG_NCONNECT_MIN   1
 #define AZNFSCFG_NCONNECT_MAX   256
+#define AZNFSCFG_NUMA_NODE_MIN  0
+#define AZNFSCFG_NUMA_NODE_MAX  1023
+#define AZNFSCFG_RPC_BATCH_USECS_MIN 0
+#define AZNFSCFG_RPC_BATCH_USECS_MAX 1000
+#define AZNFSCFG_RPC_BATCH_QDEPTH_MIN 2
+#define AZNFSCFG_RPC_BATCH_QDEPTH_MAX 1024
+#define AZNFSCFG_LOOPBACK_LATENCY_USECS_MIN 0
+#define AZNFSCFG_LOOPBACK_LATENCY_USECS_MAX 10000000
+#define AZNFSCFG_LOOPBACK_BANDWIDTH_MBPS_MIN 0
+#define AZNFSCFG_LOOPBACK_BANDWIDTH_MBPS_MAX 1000000
+#define AZNFSCFG_LOOPBACK_ERROR_PCT_MIN 0
+#define AZNFSCFG_LOOPBACK_ERROR_PCT_MAX 100
 #define AZNFSCFG_TIMEO_MIN      100
 #define AZNFSCFG_TIMEO_MAX      6000
 #define AZNFSCFG_RSIZE_MIN      1048576
@@ -43,19 +57,37 @@ using namespace aznfsc;
 static_assert(AZNFSCFG_WSIZE_MAX == AZNFSCFG_RSIZE_MAX);
 #define AZNFSCFG_READDIR_MIN    8192
 #define AZNFSCFG_READDIR_MAX    4194304
+#define AZNFSCFG_READDIR_PREFETCH_MIN 1
+#define AZNFSCFG_READDIR_PREFETCH_MAX 64
+#define AZNFSCFG_READDIR_PREFETCH_DEF 4
 #define AZNFSCFG_READAHEAD_KB_MIN 128
 #define AZNFSCFG_READAHEAD_KB_MAX 1048576
 #define AZNFSCFG_FUSE_MAX_BG_MIN 1
 #define AZNFSCFG_FUSE_MAX_BG_MAX 65536
 #define AZNFSCFG_FUSE_MAX_BG_DEF 4096
+#define AZNFSCFG_MAX_RPC_TASKS_MIN 4096
+#define AZNFSCFG_MAX_RPC_TASKS_MAX 65536
+#define AZNFSCFG_MAX_RPC_TASKS_DEF 65536
 #define AZNFSCFG_CACHE_MAX_MB_MIN 512
 #define AZNFSCFG_CACHE_MAX_MB_MAX (1024 * 1024)
 #define AZNFSCFG_CACHE_MAX_MB_DEF (4 * 1024)
+#define AZNFSCFG_BULK_REVALIDATE_THRESHOLD_MIN 2
+#define AZNFSCFG_BULK_REVALIDATE_THRESHOLD_MAX 1000000
+#define AZNFSCFG_NEGATIVE_MAX_PER_DIR_MIN 16
+#define AZNFSCFG_NEGATIVE_MAX_PER_DIR_MAX 65536
+#define AZNFSCFG_NEGATIVE_MAX_PER_DIR_DEF 256
+#define AZNFSCFG_INODE_MAX_COUNT_MIN 1024
+#define AZNFSCFG_INODE_MAX_COUNT_MAX (100 * 1000 * 1000)
+#define AZNFSCFG_STREAM_WRITE_MAX_DIRTY_MB_MIN 4
+#define AZNFSCFG_STREAM_WRITE_MAX_DIRTY_MB_MAX 4096
+#define AZNFSCFG_STREAM_WRITE_MAX_DIRTY_MB_DEF 64
 #define AZNFSCFG_FILECACHE_MAX_GB_MIN 1
 #define AZNFSCFG_FILECACHE_MAX_GB_MAX (1024 * 1024)
 #define AZNFSCFG_FILECACHE_MAX_GB_DEF (1024)
 #define AZNFSCFG_RETRANS_MIN    1
 #define AZNFSCFG_RETRANS_MAX    100
+#define AZNFSCFG_WRITE_GAP_FILL_KB_MIN 4
+#define AZNFSCFG_WRITE_GAP_FILL_KB_MAX 1024
 #define AZNFSCFG_ACTIMEO_MIN    1
 #define AZNFSCFG_ACTIMEO_MAX    3600
 #define AZNFSCFG_LOOKUPCACHE_NONE   1
@@ -160,6 +192,20 @@ typedef struct aznfsc_cfg
     // Number of connections to be established to the server.
     int nconnect = -1;
 
+    /*
+     * Minimum number of connections that must be established for the mount
+     * to succeed. If less than nconnect connections could be established,
+     * we run in degraded mode and keep trying to establish the rest in the
+     * background.
+     */
+    int nconnect_min = -1;
+
+    /*
+     * Scale the number of connections b/w nconnect_min and nconnect based on
+     * the load. Mount starts with nconnect_min connections.
+     */
+    bool nconnect_dynamic = false;
+
     // Maximum size of read request.
     int rsize = -1;
 
@@ -204,12 +250,52 @@ typedef struct aznfsc_cfg
     // Maximum number of readdir entries that can be requested in a single call.
     int readdir_maxcount = -1;
 
+    /*
+     * Number of READDIRPLUS responses worth of directory entries to
+     * prefetch ahead of the application enumerating a directory, 0 to
+     * disable.
+     */
+    int readdir_prefetch = -1;
+
     // Readahead size in KB.
     int readahead_kb = -1;
 
+    /*
+     * Max gap (in KB) b/w two dirty extents that we will fill with cached
+     * (uptodate and clean) file data, so that both extents can be written
+     * to the server in a single WRITE. 0 disables gap filling.
+     */
+    int write_gap_fill_kb = -1;
+
     // Fuse max_background config value.
     int fuse_max_background = -1;
 
+    /*
+     * Max rpc_tasks that we will allocate, this caps the number of RPCs
+     * that can be outstanding at any time. rpc_tasks are allocated on
+     * demand and freed when not needed, so this doesn't cost memory unless
+     * we actually have these many outstanding RPCs.
+     */
+    int max_rpc_tasks = -1;
+
+    /*
+     * CPUs to run the libnfs service threads on, in the Linux cpu list
+     * format, f.e., "0-3,8-11". Connection #i's service thread is pinned to
+     * the (i % ncpus)th cpu in the list. Alternatively service_thread_numa_node
+     * can be used to run them on the cpus of a NUMA node.
+     */
+    const char *service_thread_cpus = nullptr;
+    int service_thread_numa_node = -1;
+
+    /*
+     * RPC batching.
+     * When a connection has rpc_batch_qdepth or more RPCs outstanding, new
+     * requests are held for upto rpc_batch_usecs so that they go out in as
+     * few TCP segments as possible. 0 disables batching.
+     */
+    int rpc_batch_usecs = -1;
+    int rpc_batch_qdepth = -1;
+
     /*************************************************
      **              Cconsistency config            **
      *************************************************/
@@ -235,6 +321,25 @@ typedef struct aznfsc_cfg
              */
             struct {
                 bool enable = true;
+
+                /*
+                 * Pick attribute cache timeouts (within actimeo min/max)
+                 * based on how long the file/dir has been unchanged.
+                 */
+                bool adaptive_actimeo = true;
+
+                /*
+                 * Refresh attributes of all children of a directory with
+                 * READDIRPLUS when this many of them expire together,
+                 * 0 to disable.
+                 */
+                int bulk_revalidate_threshold = -1;
+
+                /*
+                 * Max names per directory cached as not existing, 0 to
+                 * disable. Used only with lookupcache=all.
+                 */
+                int negative_max_per_dir = -1;
             } user;
         } attr;
 
@@ -251,6 +356,13 @@ typedef struct aznfsc_cfg
              */
             struct {
                 bool enable = false;
+
+                /*
+                 * When a directory changes, keep the inodes of its cached
+                 * entries till it's read again, so that unchanged entries
+                 * get the same inodes back.
+                 */
+                bool incremental = true;
             } user;
         } readdir;
 
@@ -272,6 +384,15 @@ typedef struct aznfsc_cfg
                 int max_size_mb = -1;
             } user;
         } data;
+
+        struct {
+            /*
+             * Max inodes we keep, 0 for no limit.
+             * Beyond this, readdir caches of cold directories are purged
+             * to free the inodes held only by them.
+             */
+            int max_count = -1;
+        } inode;
     } cache;
 
     struct {
@@ -283,6 +404,45 @@ typedef struct aznfsc_cfg
         // Max filecache size in GB.
         int max_size_gb = -1;
     } filecache;
+
+    /*
+     * Streaming write config.
+     * Files written strictly sequentially (this includes O_APPEND writers)
+     * are considered streaming and their dirty data is written to the server as
+     * soon as a full wsize worth of contiguous data is available, instead of
+     * letting it accumulate in the cache. Dirty data per stream is capped at
+     * max_dirty_mb, when it goes above that writers are made to wait for
+     * the oldest WRITEs till it's a couple of WRITEs below max_dirty_mb.
+     */
+    struct {
+        bool enable = false;
+
+        // Max dirty data (in MB) held in the cache for a streaming writer.
+        int max_dirty_mb = -1;
+    } stream_write;
+
+    /*
+     * In-process NFS server stand-in, see loopback_server.
+     * When enabled we start an in-memory NFSv3 server on 127.0.0.1:port and
+     * mount from that instead of the Blob NFS endpoint, to test and
+     * benchmark the client on a single box.
+     */
+    struct {
+        bool enable = false;
+
+        // Port to listen on, 2047 or 2048, as that decides client behaviour.
+        int port = -1;
+
+        // Delay added to every reply, in usecs.
+        int latency_usecs = -1;
+
+        // Bandwidth shared by all connections, in Mbps, 0 is unlimited.
+        int bandwidth_mbps = -1;
+
+        // Percentage of NFS requests to fail with NFS3ERR_JUKEBOX.
+        int error_pct = -1;
+    } loopback_server;
+
     /*
      * TODO:
      * - Add auth related config.
@@ -301,6 +461,13 @@ typedef struct aznfsc_cfg
     std::string server;
     std::string export_path;
 
+    /**
+     * Final list of cpus to pin the libnfs service threads to, from
+     * service_thread_cpus or service_thread_numa_node. Empty if service
+     * threads are not to be pinned.
+     */
+    std::vector<int> service_thread_cpu_list;
+
     /**
      * Local mountpoint.
      * This is not present in the config file, but is taken from the
@@ -0,0 +1,102 @@
+#ifndef __AZNFSC_IOCTL_H__
+#define __AZNFSC_IOCTL_H__
+
+/*
+ * ioctls supported by aznfsclient.
+ * This header is meant to be included by applications too, so it must only
+ * use C types.
+ */
+#include <stdint.h>
+#include <stddef.h>
+#include <sys/ioctl.h>
+
+/*
+ * Bulk stat.
+ * Metadata heavy tools (du, rsync, dataset indexers) stat every file in a
+ * directory, costing a fuse LOOKUP and GETATTR round trip per file. These
+ * ioctls, issued on an open directory fd, return the attributes of many
+ * children of the directory in one call, served from the client's readdir
+ * and attribute caches and filled with READDIRPLUS when not cached.
+ *
+ * AZNFSC_IOC_BULKSTAT_DIR
+ *   Enumerate the directory. On input cookie is 0 for the first call, else
+ *   the cookie returned by the previous call. On return buf has count
+ *   entries (buflen bytes), cookie is to be passed to the next call and
+ *   AZNFSC_BULKSTAT_EOF is set in flags once the whole directory has been
+ *   returned. "." and ".." are not returned.
+ *
+ * AZNFSC_IOC_BULKSTAT_NAMES
+ *   Stat the given names. On input buf has buflen bytes of NUL terminated
+ *   names. On return buf has one entry for each name, in the same order,
+ *   with error set to the errno (f.e. ENOENT) for names that could not be
+ *   stat'ed. If the entries don't fit in buf, count is less than the number
+ *   of names and the caller must call again for the rest.
+ *
+ * Entries are packed in buf one after the other, each reclen bytes long
+ * (8 byte aligned), see AZNFSC_BULKSTAT_NEXT().
+ */
+#define AZNFSC_IOC_MAGIC                'Z'
+
+/*
+ * fuse only allows ioctls whose argument size is encoded in the cmd, so
+ * struct aznfsc_bulkstat must fit in _IOC_SIZE, i.e., be less than 16KB.
+ */
+#define AZNFSC_BULKSTAT_BUFSIZE         16352
+
+#define AZNFSC_BULKSTAT_EOF             0x1
+
+struct aznfsc_bulkstat_entry
+{
+    uint16_t reclen;
+    uint16_t namelen;
+    int32_t error;
+
+    // Directory cookie of the entry, AZNFSC_IOC_BULKSTAT_DIR only.
+    uint64_t cookie;
+
+    // Attributes, valid only if error is 0.
+    uint64_t ino;
+    uint64_t size;
+    uint64_t blocks;
+    uint64_t rdev;
+    uint32_t mode;
+    uint32_t nlink;
+    uint32_t uid;
+    uint32_t gid;
+    int64_t atime_sec;
+    int64_t mtime_sec;
+    int64_t ctime_sec;
+    uint32_t atime_nsec;
+    uint32_t mtime_nsec;
+    uint32_t ctime_nsec;
+    uint32_t pad;
+
+    // NUL terminated name, namelen bytes w/o the NUL.
+    char name[];
+};
+
+struct aznfsc_bulkstat
+{
+    uint64_t cookie;
+    uint32_t count;
+    uint32_t flags;
+    uint32_t buflen;
+    uint32_t pad;
+    char buf[AZNFSC_BULKSTAT_BUFSIZE];
+};
+
+#define AZNFSC_BULKSTAT_NEXT(e) \
+    ((struct aznfsc_bulkstat_entry *) (((char *) (e)) + (e)->reclen))
+
+#define AZNFSC_IOC_BULKSTAT_DIR \
+    _IOWR(AZNFSC_IOC_MAGIC, 1, struct aznfsc_bulkstat)
+#define AZNFSC_IOC_BULKSTAT_NAMES \
+    _IOWR(AZNFSC_IOC_MAGIC, 2, struct aznfsc_bulkstat)
+
+#ifdef __cplusplus
+static_assert(sizeof(struct aznfsc_bulkstat) < 16384);
+static_assert((offsetof(struct aznfsc_bulkstat, buf) % 8) == 0);
+static_assert((offsetof(struct aznfsc_bulkstat_entry, name) % 8) == 0);
+#endif
+
+#endif /* __AZNFSC_IOCTL_H__ */
@@ -1,9 +1,68 @@
 #ifndef __NFS_CONNECTION_H__
 #define __NFS_CONNECTION_H__
 
+#include <atomic>
+#include <algorithm>
+#include <mutex>
+
 #include "aznfsc.h"
 #include "nfs_internal.h"
 
+/*
+ * RTT floor used when computing connection load, so that a connection with
+ * no (or very low) RTT samples yet is not treated as infinitely fast.
+ */
+#define CONN_MIN_RTT_USEC 100
+
+/*
+ * Connection health tracking, see nfs_connection::check_health().
+ * CONN_HEALTH_CHECK_SECS:  How often the health of connections is checked.
+ * CONN_UNHEALTHY_TIMEOUTS: These many RPC timeouts in one check interval
+ *                          make the connection unhealthy. Any major
+ *                          timeout or reconnect also does.
+ * CONN_RTT_SPIKE_FACTOR:   RTT these many times the median RTT of the
+ *                          healthy connections, and more than
+ *                          CONN_RTT_SPIKE_MIN_USEC, also makes the
+ *                          connection unhealthy.
+ * CONN_RECOVER_CHECKS:     An unhealthy connection is considered healthy
+ *                          again after these many good checks.
+ * CONN_REPLACE_CHECKS:     A connection found bad in these many checks in a
+ *                          row is replaced by a new connection.
+ * CONN_RETIRE_GRACE_SECS:  A replaced connection is destroyed only after
+ *                          it has no outstanding RPCs for these many secs.
+ * CONN_PIN_BUCKETS:        Number of conn_pin buckets files are hashed to.
+ * CONN_PIN_MAX_SECS:       A bucket pinned to a connection other than the
+ *                          one its files now map to, moves to the mapped
+ *                          connection after these many secs even if it
+ *                          never drains, see conn_pin.
+ */
+#define CONN_HEALTH_CHECK_SECS  5
+#define CONN_UNHEALTHY_TIMEOUTS 2
+#define CONN_RTT_SPIKE_FACTOR   8
+#define CONN_RTT_SPIKE_MIN_USEC 100000
+#define CONN_RECOVER_CHECKS     3
+#define CONN_REPLACE_CHECKS     6
+#define CONN_RETIRE_GRACE_SECS  60
+#define CONN_PIN_BUCKETS        1024
+#define CONN_PIN_MAX_SECS       10
+
+/*
+ * Dynamic nconnect, see rpc_transport::scale_connections().
+ * Connections are added when the average number of outstanding RPCs per
+ * connection is CONN_SCALE_UP_QDEPTH or more for CONN_SCALE_UP_SECS, and
+ * removed when it's less than CONN_SCALE_DOWN_QDEPTH for CONN_SCALE_DOWN_SECS.
+ */
+#define CONN_SCALE_UP_QDEPTH    16
+#define CONN_SCALE_UP_SECS      3
+#define CONN_SCALE_DOWN_QDEPTH  1
+#define CONN_SCALE_DOWN_SECS    60
+
+/*
+ * CONN_SCHED_CPU_LOCAL uses a local connection only if its load is not more
+ * than these many times the load of the least loaded connection.
+ */
+#define CONN_LOCAL_MAX_LOAD_FACTOR 4
+
 /**
  * This represents one connection to the NFS server.
  * For achieving higher throughput we can have more than one connections to the
@@ -33,6 +92,80 @@ private:
      */
     int idx = -1;
 
+    /*
+     * Load on this connection, used by CONN_SCHED_LEAST_LOADED.
+     * outstanding_rpcs is the number of RPCs issued over this connection
+     * which have not completed yet, and rtt_ewma_usec is the exponentially
+     * weighted moving average of the server RTT seen on this connection,
+     * giving 1/8 weight to the latest sample, like TCP SRTT.
+     */
+    std::atomic<int> outstanding_rpcs = 0;
+    std::atomic<uint64_t> rtt_ewma_usec = 0;
+
+    /*
+     * Health of this connection, see check_health().
+     * Unhealthy connections are not used for new RPCs, unless there's no
+     * healthy connection. bad_checks and good_checks count consecutive bad
+     * and good checks, and last_* are the libnfs stats at the last check.
+     * Except healthy, these are only accessed by the health monitor thread.
+     */
+    std::atomic<bool> healthy = true;
+    int bad_checks = 0;
+    int good_checks = 0;
+    uint64_t last_timedout = 0;
+    uint64_t last_major_timedout = 0;
+    uint64_t last_reconnects = 0;
+
+    /*
+     * CPU the libnfs service thread of this connection is pinned to and its
+     * NUMA node, -1 if not pinned. See aznfsc_cfg.service_thread_cpus.
+     */
+    int cpu = -1;
+    int numa_node = -1;
+
+    /*
+     * RPC batching, see aznfsc_cfg.rpc_batch_usecs.
+     * When rpc_batch_qdepth or more RPCs are outstanding, the socket is
+     * corked so that the kernel coalesces the small request PDUs that follow
+     * into full segments, and uncorked by rpc_transport::batch_flusher()
+     * after rpc_batch_usecs. corked_usecs is when the socket was corked.
+     * cork_lock_46 serializes the cork/uncork transitions so that the
+     * socket state always matches corked. corked_fd is the socket fd we
+     * corked, libnfs replaces the socket on reconnect and the new one is
+     * not corked, see uncork_if_expired().
+     * num_batches is the number of times we corked and num_batched_rpcs is
+     * the number of RPCs issued while corked.
+     */
+    std::atomic<bool> corked = false;
+    std::atomic<int> corked_fd = -1;
+    std::atomic<uint64_t> corked_usecs = 0;
+
+    /*
+     * Set once the connection is replaced or scaled down, see retire().
+     * Retired connections are never corked, as batch_flusher() only
+     * uncorks the active connections.
+     */
+    std::atomic<bool> retired = false;
+
+    /*
+     * Number of conn_pin buckets pinned to this connection. A retired
+     * connection must lose all its pins before it's destroyed.
+     */
+    std::atomic<int> num_pins = 0;
+    std::mutex cork_lock_46;
+    std::atomic<uint64_t> num_batches = 0;
+    std::atomic<uint64_t> num_batched_rpcs = 0;
+
+    /*
+     * Set/clear TCP_CORK on the socket fd, returns false on failure.
+     */
+    bool set_cork(int fd, bool cork);
+
+    /*
+     * Start the libnfs service thread, pinned to cpu if set.
+     */
+    bool start_service_thread();
+
 public:
     nfs_connection(struct nfs_client* _client, int _idx):
         client(_client),
@@ -47,6 +180,8 @@ public:
     {
         // Must have been closed when destructor is called.
         assert(nfs_context == nullptr);
+        // No file must be pinned to us.
+        assert(num_pins == 0);
     }
 
     /*
@@ -57,6 +192,151 @@ public:
         return nfs_context;
     }
 
+    int get_idx() const
+    {
+        return idx;
+    }
+
+    /*
+     * Called when an RPC is issued over this connection.
+     */
+    void on_rpc_issue()
+    {
+        const int outstanding = ++outstanding_rpcs;
+
+        if (!corked && !retired && aznfsc_cfg.rpc_batch_usecs > 0 &&
+            outstanding >= aznfsc_cfg.rpc_batch_qdepth) {
+            cork();
+        }
+
+        if (corked) {
+            num_batched_rpcs++;
+        }
+    }
+
+    /*
+     * Cork/uncork the socket for batching RPCs.
+     * uncork_if_expired() uncorks if the socket has been corked for
+     * rpc_batch_usecs or more, as of now_usecs, or if libnfs has replaced
+     * the socket since we corked it.
+     */
+    void cork();
+    void uncork();
+    void uncork_if_expired(uint64_t now_usecs);
+
+    /*
+     * Called by the health monitor when it stops scheduling new RPCs over
+     * this connection. RPCs of files pinned to it can still be issued over
+     * it till they drain, see conn_pin.
+     */
+    void retire()
+    {
+        retired = true;
+        uncork();
+    }
+
+    bool is_retired() const
+    {
+        return retired;
+    }
+
+    /*
+     * Called by conn_pin when a bucket is pinned to/unpinned from this
+     * connection.
+     */
+    void on_pin()
+    {
+        num_pins++;
+    }
+
+    void on_unpin()
+    {
+        assert(num_pins > 0);
+        num_pins--;
+    }
+
+    int get_num_pins() const
+    {
+        return num_pins;
+    }
+
+    uint64_t get_num_batches() const
+    {
+        return num_batches;
+    }
+
+    uint64_t get_num_batched_rpcs() const
+    {
+        return num_batched_rpcs;
+    }
+
+    /*
+     * Called when an RPC issued over this connection completes, or could
+     * not be issued. rtt_usec is the server RTT for completed RPCs and 0
+     * otherwise.
+     */
+    void on_rpc_done(uint64_t rtt_usec = 0)
+    {
+        assert(outstanding_rpcs > 0);
+        outstanding_rpcs--;
+
+        if (rtt_usec != 0) {
+            /*
+             * Not atomic wrt other completing RPCs, but losing an
+             * occasional sample is ok.
+             */
+            const uint64_t old_rtt = rtt_ewma_usec;
+            rtt_ewma_usec = (old_rtt == 0) ? rtt_usec :
+                            (old_rtt - (old_rtt / 8) + (rtt_usec / 8));
+        }
+    }
+
+    int get_outstanding_rpcs() const
+    {
+        return outstanding_rpcs;
+    }
+
+    uint64_t get_rtt_ewma_usec() const
+    {
+        return rtt_ewma_usec;
+    }
+
+    int get_cpu() const
+    {
+        return cpu;
+    }
+
+    int get_numa_node() const
+    {
+        return numa_node;
+    }
+
+    bool is_healthy() const
+    {
+        return healthy;
+    }
+
+    /*
+     * Check the health of this connection using the RPC timeouts and
+     * reconnects reported by libnfs since the last check, and the RTT seen
+     * on this connection compared to median_rtt_usec, the median RTT of all
+     * healthy connections (0 if not known).
+     * Called every CONN_HEALTH_CHECK_SECS by the rpc_transport health
+     * monitor. Updates healthy and returns true if the connection has been
+     * bad for long enough that it should be replaced.
+     */
+    bool check_health(uint64_t median_rtt_usec);
+
+    /*
+     * Expected wait for a new RPC sent over this connection, i.e., the time
+     * to drain the RPCs already outstanding plus the new one.
+     */
+    uint64_t get_load() const
+    {
+        return (outstanding_rpcs + 1) *
+               std::max(rtt_ewma_usec.load(), (uint64_t) CONN_MIN_RTT_USEC);
+    }
+
     /*
      * This should open the connection to the server.
      * It should init the nfs_context, make a libnfs mount call and start a
@@ -71,6 +351,7 @@ public:
     void close()
     {
         if (nfs_context) {
+            uncork();
             nfs_mt_service_thread_stop(nfs_context);
             nfs_destroy_context(nfs_context);
             nfs_context = nullptr;
@@ -78,4 +359,104 @@ public:
     }
 };
 
+/**
+ * Pins the files hashing to this bucket to one connection while they have
+ * RPCs outstanding.
+ * With CONN_SCHED_FH_HASH all requests of a file go over one connection.
+ * When the set of connections changes (dynamic nconnect scaling up/down, or
+ * an unhealthy connection being replaced), the connection a file maps to
+ * can change. The file stays on the connection it's currently using till
+ * all its outstanding RPCs complete, and only then moves to the connection
+ * it now maps to. Files are hashed to CONN_PIN_BUCKETS buckets, files
+ * sharing a bucket just move together.
+ *
+ * A bucket with continuous I/O may never drain, so the pin is bounded. The
+ * bucket moves to the connection it maps to right away if the pinned
+ * connection has been retired or is unhealthy, or if it has been pinned
+ * for CONN_PIN_MAX_SECS. RPCs already issued over the old connection
+ * complete there, so for a short while the file has RPCs outstanding on
+ * both connections. The health monitor also unpins buckets from retired
+ * connections with release() so that those connections can be destroyed.
+ */
+struct conn_pin
+{
+    std::mutex pin_lock_51;
+    struct nfs_connection *conn = nullptr;
+    int outstanding = 0;
+
+    // When conn was pinned (usecs).
+    uint64_t pinned_usecs = 0;
+
+    /*
+     * Returns the connection to use for a new RPC of a file in this bucket,
+     * mapped_conn is the connection the file currently maps to. Every get()
+     * must be matched by a put() once the RPC completes.
+     */
+    struct nfs_connection *get(struct nfs_connection *mapped_conn)
+    {
+        std::unique_lock<std::mutex> lock(pin_lock_51);
+
+        assert(mapped_conn != nullptr);
+        assert(outstanding >= 0);
+        // A bucket w/o outstanding RPCs is never pinned.
+        assert(outstanding > 0 || conn == nullptr);
+
+        outstanding++;
+
+        if (conn == nullptr) {
+            set_conn(mapped_conn);
+        } else if (conn != mapped_conn) {
+            const uint64_t now_usecs = get_current_usecs();
+
+            if (conn->is_retired() || !conn->is_healthy() ||
+                (now_usecs - pinned_usecs) >=
+                    (CONN_PIN_MAX_SECS * 1000000ULL)) {
+                set_conn(mapped_conn, now_usecs);
+            }
+        }
+
+        assert(conn != nullptr);
+        return conn;
+    }
+
+    void put()
+    {
+        std::unique_lock<std::mutex> lock(pin_lock_51);
+
+        assert(outstanding > 0);
+        if (--outstanding == 0) {
+            set_conn(nullptr);
+        }
+    }
+
+    /*
+     * Unpin this bucket if it's pinned to old_conn, the next get() will pin
+     * it to the connection its files map to then.
+     */
+    void release(struct nfs_connection *old_conn)
+    {
+        std::unique_lock<std::mutex> lock(pin_lock_51);
+
+        if (conn == old_conn) {
+            set_conn(nullptr);
+        }
+    }
+
+private:
+    void set_conn(struct nfs_connection *new_conn,
+                  uint64_t now_usecs = get_current_usecs())
+    {
+        if (conn) {
+            conn->on_unpin();
+        }
+
+        conn = new_conn;
+        pinned_usecs = now_usecs;
+
+        if (conn) {
+            conn->on_pin();
+        }
+    }
+};
+
 #endif /* __NFS_CONNECTION_H__ */
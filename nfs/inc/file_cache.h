@@ -301,6 +301,35 @@ struct membuf
     void set_dirty();
     void clear_dirty();
 
+    /**
+     * Error (+ve errno) from the last failed attempt to write this membuf,
+     * 0 if the last write didn't fail. See write_error.
+     * Caller must hold the membuf lock.
+     */
+    int get_write_error() const
+    {
+        assert(is_locked());
+        return write_error;
+    }
+
+    void set_write_error(int error)
+    {
+        assert(is_locked());
+        assert(error > 0);
+        write_error = error;
+    }
+
+    /**
+     * Drop the dirty data of a membuf whose write has failed, once the
+     * error has been conveyed to the application. After this the range is
+     * no longer dirty and won't be written again, so the same error is not
+     * reported by every later flush. This is what the kernel NFS client does
+     * too, a writeback error is reported once and the pages are then
+     * treated as clean.
+     * Caller must hold the membuf lock.
+     */
+    void clear_dirty_on_error();
+
     bool is_flushing() const
     {
         return (flag & MB_Flag::Flushing);
@@ -442,6 +471,16 @@ private:
      */
     std::atomic<uint32_t> flag = 0;
 
+    /*
+     * Error (+ve errno) from the last failed attempt to write this membuf
+     * to the Blob. This is only meaningful while the membuf is dirty, the
+     * data is still in the cache and will be written by the next flush.
+     * clear_dirty() clears it once the membuf is successfully written, and
+     * clear_dirty_on_error() once the error has been reported.
+     * Accessed only with the membuf lock held.
+     */
+    int write_error = 0;
+
     // For managing threads waiting on MB_Flag::Locked.
     std::condition_variable cv;
 
@@ -568,6 +607,15 @@ public:
      */
     bool is_new = false;
 
+    /*
+     * Set by nfs_inode::fill_write_gap() for bytes_chunks holding clean
+     * cached data which are written only to fill the gap b/w dirty
+     * bytes_chunks. Their data is same as the Blob, so if the write fails
+     * they are made clean again, see bc_iovec::on_io_fail().
+     * Like pvt, this is opaque to the cache.
+     */
+    bool is_gap_fill = false;
+
     /**
      * Return membuf corresponding to this bytes_chunk.
      * This will be used by caller to synchronize operations on the membuf.
@@ -696,6 +744,7 @@ public:
 
         pvt = rhs.pvt;
         num_backend_calls_issued = rhs.num_backend_calls_issued;
+        is_gap_fill = rhs.is_gap_fill;
     }
 
     /**
@@ -1045,6 +1094,16 @@ public:
      */
     std::vector<bytes_chunk> get_dirty_bc_range(uint64_t st_off, uint64_t end_off) const;
 
+    /*
+     * Returns chunks exactly covering the range [st_off, end_off), only if
+     * all of them are uptodate and neither dirty nor flushing, else returns
+     * an empty vector. Chunks not present in the cache are not allocated.
+     * Before returning it increases the inuse count of underlying membuf(s).
+     * This is used for filling small gaps b/w dirty extents with cached data,
+     * see nfs_inode::fill_write_gap().
+     */
+    std::vector<bytes_chunk> get_clean_bc_range(uint64_t st_off, uint64_t end_off) const;
+
     /**
      * Drop cached data in the given range.
      * This must be called only for file-backed caches. For non file-backed
@@ -1149,6 +1208,62 @@ public:
         return std::max((int64_t)(bytes_dirty - bytes_flushing), int64_t(0));
     }
 
+    /**
+     * Streaming write detection for the file, see
+     * nfs_inode::on_write_check_stream().
+     */
+    bool on_write_check_stream(uint64_t offset, uint64_t length)
+    {
+        static const uint32_t STREAM_WRITE_MIN_SEQ = 4;
+
+        const uint64_t expected = stream_next_offset.exchange(offset + length);
+
+        if (offset == expected) {
+            stream_seq_writes++;
+        } else {
+            stream_seq_writes = 0;
+        }
+
+        return (stream_seq_writes >= STREAM_WRITE_MIN_SEQ);
+    }
+
+    void reset_stream_state()
+    {
+        stream_seq_writes = 0;
+        stream_next_offset = 0;
+    }
+
+    /**
+     * Record the error from a failed write of dirty data in this cache, so
+     * that it's reported to the application by the next flush/fsync/close.
+     * Only the first error is kept till it's reported.
+     */
+    void set_write_error(int error)
+    {
+        assert(error > 0);
+
+        int expected = 0;
+        write_error.compare_exchange_strong(expected, error);
+    }
+
+    /**
+     * Returns the error saved by set_write_error(), w/o clearing it.
+     */
+    int get_write_error() const
+    {
+        return write_error;
+    }
+
+    /**
+     * Returns the error saved by set_write_error() and clears it.
+     * Only flush/fsync/close must call this, as they return the error to
+     * the application.
+     */
+    int clear_write_error()
+    {
+        return write_error.exchange(0);
+    }
+
     /**
      * This should be called by writer threads to find out if they must wait
      * for the write to complete. This will check both the cache specific and
@@ -1420,6 +1535,26 @@ private:
     int backing_file_fd = -1;
     std::atomic<uint64_t> backing_file_len = 0;
 
+    /*
+     * First error (+ve errno) from a failed write of dirty data, that has
+     * not yet been reported to the application. The failed data itself is
+     * dropped from the cache once a flush sees it failed (see
+     * membuf::clear_dirty_on_error()), so this is what makes the error stick
+     * till flush/fsync/close report it, even if some other path (getattr,
+     * inline write) did the flush that saw it.
+     */
+    std::atomic<int> write_error = 0;
+
+    /*
+     * Streaming write state, see on_write_check_stream().
+     * stream_next_offset is the offset where the next write is expected if
+     * the writer is writing strictly sequentially, and stream_seq_writes is
+     * the count of back-to-back sequential writes seen so far.
+     * This is here and not in nfs_inode, as only written files need it.
+     */
+    std::atomic<uint64_t> stream_next_offset = 0;
+    std::atomic<uint32_t> stream_seq_writes = 0;
+
     /*
      * Flag to quickly mark the cache as invalid w/o purging the entire
      * cache. Once invalidate_pending is set, next cache lookup will first
@@ -21,6 +21,14 @@ int fuse_reply_open(fuse_req_t req, const struct fuse_file_info *f)
     pxtask->res = 0;
     return 0;
 }
+
+static inline
+int fuse_reply_ioctl(fuse_req_t req, int result, const void *buf, size_t size)
+{
+    PXT *pxtask = _FR2PXT(req);
+    pxtask->res = result;
+    return 0;
+}
 #endif
 
 /*
@@ -286,6 +294,14 @@ static void aznfsc_ll_open(fuse_req_t req,
         inode->get_rastate()->reset();
     }
 
+    /*
+     * Start streaming write detection afresh for the new opener, see
+     * nfs_inode::on_write_check_stream().
+     */
+    if (inode->is_regfile()) {
+        inode->reset_stream_state();
+    }
+
     /*
      * If file cache is not allocated, allocate now.
      * Mostly it'll be allocated in nfs_client::reply_entry(), but for inodes
@@ -391,10 +407,16 @@ static void aznfsc_ll_fsync(fuse_req_t req,
                             int datasync,
                             struct fuse_file_info *fi)
 {
+    AZLogDebug("aznfsc_ll_fsync(req={}, ino={}, datasync={}, fi={})",
+               fmt::ptr(req), ino, datasync, fmt::ptr(fi));
+
     /*
-     * TODO: Fill me.
+     * We issue all WRITEs as FILE_SYNC, so once all the dirty data in the
+     * cache is written, it's stable on the server. This is exactly what
+     * flush does, and it also conveys any background write errors.
      */
-    fuse_reply_err(req, ENOSYS);
+    struct nfs_client *client = get_nfs_client_from_fuse_req(req);
+    client->flush(req, ino);
 }
 
 [[maybe_unused]]
@@ -626,6 +648,59 @@ static void aznfsc_ll_bmap(fuse_req_t req,
     fuse_reply_err(req, ENOSYS);
 }
 
+/*
+ * Serve the bulk stat ioctls, see aznfsc_ioctl.h.
+ * These are restricted ioctls, i.e., fuse copies in and out the struct
+ * aznfsc_bulkstat encoded in cmd, so in_buf has the caller's struct and we
+ * reply with the updated one.
+ */
+[[maybe_unused]]
+static void aznfsc_ioctl_bulkstat(fuse_req_t req,
+                                  fuse_ino_t ino,
+                                  unsigned int cmd,
+                                  const void *in_buf,
+                                  size_t in_bufsz,
+                                  size_t out_bufsz)
+{
+    if ((cmd != AZNFSC_IOC_BULKSTAT_DIR) &&
+        (cmd != AZNFSC_IOC_BULKSTAT_NAMES)) {
+        fuse_reply_err(req, ENOTTY);
+        return;
+    }
+
+    if ((in_bufsz < sizeof(struct aznfsc_bulkstat)) ||
+        (out_bufsz < sizeof(struct aznfsc_bulkstat))) {
+        fuse_reply_err(req, EINVAL);
+        return;
+    }
+
+    struct nfs_client *client = get_nfs_client_from_fuse_req(req);
+    const struct aznfsc_bulkstat *const in =
+        (const struct aznfsc_bulkstat *) in_buf;
+    /*
+     * Output is built in a separate buffer as BULKSTAT_NAMES reads the
+     * names from in->buf while filling the entries.
+     */
+    std::unique_ptr<struct aznfsc_bulkstat> out =
+        std::make_unique<struct aznfsc_bulkstat>();
+    int error;
+
+    if (cmd == AZNFSC_IOC_BULKSTAT_DIR) {
+        error = client->bulkstat_dir(ino, in->cookie, *out);
+    } else {
+        error = client->bulkstat_names(ino, *in, *out);
+    }
+
+    if (error != 0) {
+        fuse_reply_err(req, error);
+        return;
+    }
+
+    // Only the filled part of buf needs to be copied back to the caller.
+    fuse_reply_ioctl(req, 0, out.get(),
+                     offsetof(struct aznfsc_bulkstat, buf) + out->buflen);
+}
+
 #if FUSE_USE_VERSION < 35
 [[maybe_unused]]
 static void aznfsc_ll_ioctl(fuse_req_t req,
@@ -638,10 +713,7 @@ static void aznfsc_ll_ioctl(fuse_req_t req,
                             size_t in_bufsz,
                             size_t out_bufsz)
 {
-    /*
-     * TODO: Fill me.
-     */
-    fuse_reply_err(req, ENOSYS);
+    aznfsc_ioctl_bulkstat(req, ino, cmd, in_buf, in_bufsz, out_bufsz);
 }
 #else
 [[maybe_unused]]
@@ -655,10 +727,7 @@ static void aznfsc_ll_ioctl(fuse_req_t req,
                             size_t in_bufsz,
                             size_t out_bufsz)
 {
-    /*
-     * TODO: Fill me.
-     */
-    fuse_reply_err(req, ENOSYS);
+    aznfsc_ioctl_bulkstat(req, ino, cmd, in_buf, in_bufsz, out_bufsz);
 }
 #endif
 
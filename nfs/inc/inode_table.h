@@ -0,0 +1,207 @@
+#ifndef __INODE_TABLE_H__
+#define __INODE_TABLE_H__
+
+#include <vector>
+#include <atomic>
+#include <shared_mutex>
+
+#include "nfs_inode.h"
+
+/*
+ * Number of shards in the inode table, must be a power of 2.
+ * Each shard has its own lock, so this limits how many threads can be
+ * adding/removing inodes in parallel.
+ */
+#define INODE_TABLE_SHARDS              64
+static_assert((INODE_TABLE_SHARDS & (INODE_TABLE_SHARDS - 1)) == 0);
+
+/*
+ * Slots a shard starts with and never shrinks below, must be a power of 2.
+ */
+#define INODE_TABLE_SHARD_MIN_SLOTS     64
+static_assert((INODE_TABLE_SHARD_MIN_SLOTS &
+               (INODE_TABLE_SHARD_MIN_SLOTS - 1)) == 0);
+
+/**
+ * One shard of the inode table.
+ * This is an open addressed hash table using linear probing, with all its
+ * slots in one vector. Removed entries leave tombstones behind so that
+ * probe sequences are not broken, they are purged when the shard is
+ * rehashed.
+ */
+struct inode_table_shard
+{
+    struct slot
+    {
+        uint64_t fileid = 0;
+        uint32_t crc = 0;
+        bool tombstone = false;
+        struct nfs_inode *inode = nullptr;
+
+        bool is_empty() const
+        {
+            return !inode && !tombstone;
+        }
+    };
+
+    /*
+     * Protects slots and the inode refcnt transitions to/from 0, see
+     * inode_table.
+     */
+    mutable std::shared_mutex shard_lock_0;
+
+    std::vector<slot> slots;
+    size_t num_inodes = 0;
+    size_t num_tombstones = 0;
+
+    inode_table_shard() :
+        slots(INODE_TABLE_SHARD_MIN_SLOTS)
+    {
+    }
+};
+
+/**
+ * Table of all nfs_inodes known to nfs_client, keyed by (fileid, FH crc).
+ * It's split into INODE_TABLE_SHARDS shards, selected by the key hash, and
+ * each shard has its own lock, so lookups and inserts for different inodes
+ * rarely contend with each other.
+ *
+ * The shard lock also orders the inode refcnt transitions to/from 0, i.e.,
+ * a lookup grabs a lookupcnt ref on the inode with the shard lock held shared
+ * and an inode whose last ref is dropped is removed from the table (and
+ * freed) with the shard lock held exclusive. Since both find the shard from
+ * the key, they always use the same shard lock.
+ *
+ * Neither fileid nor FH crc are guaranteed to be unique, so more than one
+ * inode may have the same key and a lookup must match the filehandle too.
+ * All the *_nolock() methods must be called with the shard lock for the key
+ * held, exclusive for insert and erase and at least shared for find.
+ */
+class inode_table
+{
+public:
+    std::shared_mutex& get_shard_lock(uint64_t fileid, uint32_t crc) const
+    {
+        return get_shard(hash(fileid, crc)).shard_lock_0;
+    }
+
+    std::shared_mutex& get_shard_lock(const struct nfs_inode *inode) const
+    {
+        return get_shard_lock(inode->get_fileid(), inode->get_crc());
+    }
+
+    /*
+     * Find the inode with the given filehandle, fileid and FH crc.
+     * Returns nullptr if not present.
+     */
+    struct nfs_inode *find_nolock(const struct nfs_fh3 *fh,
+                                  uint64_t fileid,
+                                  uint32_t crc) const;
+
+    /*
+     * If inode is present in the table under the given key, return it with
+     * a lookupcnt ref held, else return nullptr.
+     * This is for safely using an inode pointer saved earlier, w/o holding
+     * a ref, as the inode may have been freed since. Inodes forgotten by
+     * fuse are not returned.
+     */
+    struct nfs_inode *get_held(const struct nfs_inode *inode,
+                               uint64_t fileid,
+                               uint32_t crc) const;
+
+    /*
+     * Add inode to the table.
+     */
+    void insert_nolock(struct nfs_inode *inode);
+
+    /*
+     * Remove inode from the table. Returns false if not present.
+     */
+    bool erase_nolock(struct nfs_inode *inode);
+
+    /*
+     * Number of inodes in the table.
+     */
+    size_t size() const
+    {
+        return num_inodes;
+    }
+
+    /*
+     * Memory used by the table itself (not the inodes), in bytes.
+     */
+    size_t get_mem_bytes() const;
+
+    /*
+     * Return all inodes in the table, locking each shard in turn.
+     * The caller must make sure the inodes are not freed while it uses them.
+     */
+    std::vector<struct nfs_inode*> get_all() const;
+
+    /*
+     * Return all inodes for which pred(inode) returns true, with a lookupcnt
+     * ref held on each, so they are safe to use till the caller drops the
+     * ref with decref(). pred is called with the shard lock held shared.
+     * Inodes with no refs are skipped, they are about to be freed.
+     */
+    template<typename Pred>
+    std::vector<struct nfs_inode*> get_if_held(Pred pred) const
+    {
+        std::vector<struct nfs_inode*> inodes;
+
+        for (const inode_table_shard& shard : shards) {
+            std::shared_lock<std::shared_mutex> lock(shard.shard_lock_0);
+
+            for (const inode_table_shard::slot& s : shard.slots) {
+                if (!s.inode ||
+                    ((s.inode->lookupcnt + s.inode->dircachecnt) == 0) ||
+                    !pred(s.inode)) {
+                    continue;
+                }
+
+                s.inode->incref();
+                inodes.emplace_back(s.inode);
+            }
+        }
+
+        return inodes;
+    }
+
+private:
+    static uint64_t hash(uint64_t fileid, uint32_t crc)
+    {
+        /*
+         * splitmix64 finalizer, so that sequential fileids are spread over
+         * all shards and slots.
+         */
+        uint64_t h = fileid ^ (((uint64_t) crc << 32) | crc);
+        h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+        h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+        return h ^ (h >> 31);
+    }
+
+    /*
+     * Low bits of the hash select the shard, the rest select the slot.
+     */
+    inode_table_shard& get_shard(uint64_t h) const
+    {
+        return shards[h & (INODE_TABLE_SHARDS - 1)];
+    }
+
+    static size_t get_slot(uint64_t h, size_t nslots)
+    {
+        return (h / INODE_TABLE_SHARDS) & (nslots - 1);
+    }
+
+    /*
+     * Rehash shard into a table big enough to hold its inodes at no more
+     * than 25% load, dropping all tombstones.
+     * Called with the shard lock held exclusive.
+     */
+    static void rehash_nolock(inode_table_shard& shard);
+
+    mutable inode_table_shard shards[INODE_TABLE_SHARDS];
+    std::atomic<size_t> num_inodes = 0;
+};
+
+#endif /* __INODE_TABLE_H__ */
@@ -0,0 +1,242 @@
+#ifndef __LOOPBACK_SERVER_H__
+#define __LOOPBACK_SERVER_H__
+
+#include <map>
+#include <deque>
+#include <vector>
+#include <string>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <atomic>
+
+#include "aznfsc.h"
+
+/*
+ * ONC RPC program numbers served by the loopback server.
+ */
+#define LB_MOUNT_PROGRAM        100005
+#define LB_MOUNT_V3             3
+#define LB_NFS_PROGRAM          100003
+#define LB_NFS_V3               3
+
+/*
+ * Largest RPC record we accept, enough for the largest WRITE.
+ */
+#define LB_MAX_RECORD_SIZE      (2 * AZNFSCFG_WSIZE_MAX + 65536)
+
+/*
+ * Fileid of the root directory.
+ */
+#define LB_ROOT_FILEID          1
+
+/*
+ * File data is stored in chunks of this size, see lb_file_data.
+ */
+#define LB_DATA_CHUNK_SIZE      (1024 * 1024)
+
+/**
+ * Data of a regular file, stored sparsely so that a write at a large
+ * offset or a SETATTR that extends the file doesn't allocate memory for
+ * the hole. chunks[i] holds the data at offset i*LB_DATA_CHUNK_SIZE, it's
+ * only as long as the last byte written in it, the rest reads as zeroes.
+ */
+struct lb_file_data
+{
+    uint64_t size = 0;
+    std::map<uint64_t, std::vector<char>> chunks;
+
+    /*
+     * Copy count bytes at offset to buf, holes read as zeroes.
+     * Caller must not read past size.
+     */
+    void read(uint64_t offset, uint32_t count, char *buf) const;
+
+    /*
+     * Write count bytes at offset, extending the file if needed.
+     * Returns the number of bytes of memory it allocated.
+     */
+    uint64_t write(uint64_t offset, uint32_t count, const void *buf);
+
+    /*
+     * Set file size to new_size, dropping the data past it.
+     * Returns the number of bytes of memory it freed.
+     */
+    uint64_t truncate(uint64_t new_size);
+
+    /*
+     * Bytes of memory used for the data.
+     */
+    uint64_t bytes = 0;
+};
+
+/**
+ * One file/dir/symlink in the loopback server's in-memory filesystem.
+ */
+struct lb_inode
+{
+    uint64_t fileid = 0;
+    ftype3 type = NF3REG;
+    uint32_t mode = 0;
+    uint32_t nlink = 1;
+    uint32_t uid = 0;
+    uint32_t gid = 0;
+
+    // File data, for NF3REG.
+    lb_file_data data;
+
+    // Symlink target, for NF3LNK.
+    std::string symlink;
+
+    // Directory entries and the parent directory's fileid, for NF3DIR.
+    std::map<std::string, uint64_t> entries;
+    uint64_t parent = 0;
+
+    struct timespec atime = {};
+    struct timespec mtime = {};
+    struct timespec ctime = {};
+
+    // Verifier of the exclusive CREATE that created this file, if any.
+    bool has_createverf = false;
+    char createverf[NFS3_CREATEVERFSIZE] = {};
+};
+
+/**
+ * One client connection to the loopback server.
+ * reader reads RPC calls from the socket and processes them, writer sends
+ * the replies after the simulated latency and transfer time.
+ */
+struct lb_conn
+{
+    int fd = -1;
+    std::thread reader;
+    std::thread writer;
+
+    /*
+     * Replies waiting to be sent, in the order they are due.
+     * due_usecs is when the reply must be sent.
+     */
+    struct lb_reply
+    {
+        uint64_t due_usecs;
+        std::vector<uint8_t> rec;
+    };
+
+    std::mutex reply_lock_49;
+    std::condition_variable reply_cv;
+    std::deque<lb_reply> replies;
+    bool closing = false;
+};
+
+/**
+ * In-process NFSv3 server stand-in, serving an in-memory filesystem over
+ * TCP on the loopback interface.
+ * This lets the client, f.e. the cache, readahead and write-back code, be
+ * exercised and benchmarked on a single box w/o a Blob NFS endpoint. Its
+ * behaviour is controlled by aznfsc_cfg.loopback_server, which can add
+ * fixed latency, cap the bandwidth and inject NFS3ERR_JUKEBOX errors.
+ *
+ * It speaks just enough of MOUNT v3 and NFS v3 for the client: all NFS v3
+ * procedures except MKNOD, with AUTH_UNIX credentials used for ownership of
+ * new objects but no permission checks.
+ * The whole filesystem is protected by one lock, this is not meant to
+ * measure server side scalability.
+ */
+struct loopback_server
+{
+public:
+    static loopback_server& get_instance()
+    {
+        static loopback_server server;
+        return server;
+    }
+
+    /*
+     * Start listening on 127.0.0.1:aznfsc_cfg.loopback_server.port.
+     * Returns false if the port cannot be bound.
+     */
+    bool start();
+
+    /*
+     * Close all connections and stop the server.
+     */
+    void stop();
+
+private:
+    loopback_server();
+
+    /*
+     * Credentials of the caller, from AUTH_UNIX.
+     */
+    struct lb_cred
+    {
+        uint32_t uid = 0;
+        uint32_t gid = 0;
+    };
+
+    /*
+     * Listening socket and the thread accepting connections on it.
+     */
+    int listen_fd = -1;
+    std::thread accept_thread;
+    std::atomic<bool> stopping = false;
+
+    std::mutex conns_lock_48;
+    std::vector<std::unique_ptr<lb_conn>> conns;
+
+    /*
+     * The in-memory filesystem, indexed by fileid.
+     */
+    std::mutex fs_lock_47;
+    std::map<uint64_t, std::unique_ptr<lb_inode>> inodes;
+    uint64_t next_fileid = LB_ROOT_FILEID + 1;
+
+    /*
+     * Memory used for file data, and the most we allow, which is half the
+     * physical memory. Writes that need more fail with NFS3ERR_NOSPC
+     * rather than have the server run out of memory.
+     */
+    uint64_t data_bytes = 0;
+    const uint64_t max_data_bytes;
+
+    /*
+     * Time the server started, used in filehandles (so that filehandles
+     * from a previous run are STALE) and as the write verifier.
+     */
+    const uint64_t boot_usecs;
+
+    /*
+     * Time at which the simulated link is free to carry the next reply,
+     * used for bandwidth limiting.
+     */
+    std::atomic<uint64_t> link_free_usecs = 0;
+
+    void accept_loop();
+    void reader_loop(lb_conn *conn);
+    void writer_loop(lb_conn *conn);
+
+    /*
+     * Process one RPC call record and return the reply record, w/o the
+     * record marker. Returns an empty reply if the call must be dropped.
+     */
+    std::vector<uint8_t> process_call(const std::vector<uint8_t>& call);
+
+    /*
+     * Time at which a reply of reply_bytes, to a call of call_bytes, must
+     * be sent, after accounting for the configured latency and bandwidth.
+     */
+    uint64_t get_reply_due_usecs(size_t call_bytes, size_t reply_bytes);
+
+    /*
+     * Helpers used by the NFS procedure handlers, called with fs_lock_47
+     * held.
+     */
+    lb_inode *find_inode(uint64_t fileid);
+    lb_inode *new_inode(ftype3 type, const lb_cred& cred, lb_inode *dir);
+    void unlink_inode(lb_inode *ino);
+
+    friend struct lb_handlers;
+};
+
+#endif /* __LOOPBACK_SERVER_H__ */
@@ -4,8 +4,10 @@
 #include <queue>
 
 #include "nfs_inode.h"
+#include "inode_table.h"
 #include "rpc_transport.h"
 #include "nfs_internal.h"
+#include "aznfsc_ioctl.h"
 
 /**
  * This is an informal lock registry for all locks used in the aznfsclient code.
@@ -15,7 +17,7 @@
  * order lock it's currently holding, i.e., a thread holding a lock *_lock_N
  * cannot hold any lock from *_lock_0 to *_lock_N-1 (it can only hold *_lock_N+1
  * and higher order locks).
- * - nfs_client::inode_map_lock_0
+ * - inode_table_shard::shard_lock_0
  * - nfs_inode::ilock_1
  * - nfs_inode::readdircache_lock_2
  * - nfs_client::jukebox_seeds_lock_39
@@ -25,6 +27,13 @@
  * - rpc_stats_az::stats_lock_42
  * - bytes_chunk_cache::chunkmap_lock_43
  * - membuf::mb_lock_44
+ * - flush_waiter::fw_lock_45
+ * - nfs_connection::cork_lock_46
+ * - loopback_server::fs_lock_47
+ * - loopback_server::conns_lock_48
+ * - lb_conn::reply_lock_49
+ * - nfs_client::fuse_se_lock_50
+ * - conn_pin::pin_lock_51
  */
 
 extern "C" {
@@ -56,6 +65,13 @@ extern "C" {
  */
 #define JUKEBOX_DELAY_SECS 5
 
+/**
+ * Background WRITEs that fail with a transient error (RPC error, NFS3ERR_IO
+ * or NFS3ERR_SERVERFAULT) are retried these many times, JUKEBOX_DELAY_SECS
+ * apart, before the error is recorded against the range.
+ */
+#define MAX_WRITE_RETRIES 3
+
 struct nfs_client
 {
     const uint32_t magic = NFS_CLIENT_MAGIC;
@@ -75,12 +91,12 @@ private:
     struct nfs_inode *root_fh = nullptr;
 
     /*
-     * Map of all inodes returned to fuse and which are not FORGET'ed
-     * by fuse. The idea behind this map is to make sure we never return
+     * Table of all inodes returned to fuse and which are not FORGET'ed
+     * by fuse. The idea behind this table is to make sure we never return
      * two different fuse_ino_t inode number for the same file, lest it'll
      * confuse the VFS layer. This is achieved by adding any inode we
-     * return to fuse, to this map.
-     * An inode will be removed from the map only when all the following
+     * return to fuse, to this table.
+     * An inode will be removed from the table only when all the following
      * conditions are met:
      * 1. inode->lookupcnt becomes 0.
      *    This confirms that fuse vfs does not have this inode and hence
@@ -90,9 +106,12 @@ private:
      *    directory_entry also refers to the inode and hence we need to
      *    make sure that the inode is not freed till any directory_entry
      *    is referring to it.
+     *
+     * The table is sharded by (fileid, FH crc) with a lock per shard, so
+     * that LOOKUP/READDIRPLUS responses for different files can be
+     * processed in parallel.
      */
-    std::multimap<uint64_t /* fileid */, struct nfs_inode*> inode_map;
-    std::shared_mutex inode_map_lock_0;
+    class inode_table inode_table;
 
     /*
      * Every RPC request is represented by an rpc_task which is created when
@@ -115,6 +134,32 @@ private:
     std::queue<struct jukebox_seedinfo*> jukebox_seeds;
     mutable std::mutex jukebox_seeds_lock_39;
 
+    /*
+     * Thread that keeps the number of inodes under cache.inode.max_count,
+     * by purging readdir caches of cold directories. See inode_reclaimer().
+     */
+    std::thread reclaim_thread;
+    void inode_reclaimer();
+
+    /*
+     * Purge readdir caches of cold directories till we have no more than
+     * target inodes, or there's nothing more to purge.
+     * Returns the number of directory caches purged.
+     */
+    size_t reclaim_inodes(size_t target);
+
+    /*
+     * Fuse session, used for asking the kernel to drop dentries of the
+     * directory caches purged by reclaim_inodes().
+     * fuse_se_users counts the threads using the session outside
+     * fuse_se_lock_50, set_fuse_session(nullptr) waits for them so that the
+     * session is not destroyed while it's being used.
+     */
+    struct fuse_session *fuse_se = nullptr;
+    int fuse_se_users = 0;
+    std::condition_variable fuse_se_cv;
+    std::mutex fuse_se_lock_50;
+
     /*
      * Holds info about the server, queried by FSINFO.
      */
@@ -159,14 +204,17 @@ private:
 
     /**
      * Internal method used by __get_nfs_inode() for querying nfs_inode from
-     * inode_map. It returns nfs_inode after holding a lookupcnt ref so caller
-     * can safely use that w/o worrying about the nfs_inode being removed from
-     * inode_map.
-     */
-    struct nfs_inode *__inode_from_inode_map(const nfs_fh3 *fh,
-                                             const struct fattr3 *fattr,
-                                             bool acquire_lock = true,
-                                             bool *is_forgotten = nullptr);
+     * inode_table. It returns nfs_inode after holding a lookupcnt ref so
+     * caller can safely use that w/o worrying about the nfs_inode being
+     * removed from inode_table.
+     * If acquire_lock is false the caller must hold the shard lock for the
+     * inode.
+     */
+    struct nfs_inode *__inode_from_inode_table(const nfs_fh3 *fh,
+                                               const struct fattr3 *fattr,
+                                               uint32_t crc,
+                                               bool acquire_lock = true,
+                                               bool *is_forgotten = nullptr);
 public:
     /*
      * Mount options (to be) used for mounting. These contain details of the
@@ -207,9 +255,24 @@ public:
         return rpc_task_helper;
     }
 
-    std::shared_mutex& get_inode_map_lock()
+    const class inode_table& get_inode_table() const
     {
-        return inode_map_lock_0;
+        return inode_table;
+    }
+
+    /*
+     * Set the fuse session once it's created and clear it (nullptr) before
+     * it's destroyed.
+     */
+    void set_fuse_session(struct fuse_session *se)
+    {
+        std::unique_lock<std::mutex> lock(fuse_se_lock_50);
+
+        if (!se) {
+            fuse_se_cv.wait(lock, [this] { return fuse_se_users == 0; });
+        }
+
+        fuse_se = se;
     }
 
     /*
@@ -302,7 +365,8 @@ public:
      * nlookup parameter passed by fuse FORGET. Instead of the caller
      * reducing lookupcnt and then calling put_nfs_inode(), the caller
      * passes the amount by which the lookupcnt must be dropped. This is
-     * important as we need to drop the lookupcnt inside inode_map_lock_0,
+     * important as we need to drop the lookupcnt inside the inode_table
+     * shard lock,
      * else if we drop before the lock and lookupcnt becomes 0, some other
      * thread can delete the inode while we still don't have the lock, and
      * then when we proceed to delete the inode, we would be accessing the
@@ -310,15 +374,15 @@ public:
      *
      * If the inode lookupcnt (after reducing by dropcnt), becomes 0 and it's
      * not referenced by any readdirectory_cache (inode->dircachecnt is 0)
-     * then the inode is removed from the inode_map and freed.
+     * then the inode is removed from the inode_table and freed.
      *
-     * This nolock version does not hold inode_map_lock_0 so the caller
-     * must hold the lock before calling this. Usually you will call one of
-     * the other variants which hold the lock.
+     * This nolock version does not hold the inode_table shard lock so the
+     * caller must hold it (exclusive) before calling this. Usually you will
+     * call one of the other variants which hold the lock.
      *
      * Note: Call put_nfs_inode()/put_nfs_inode_nolock() only when you are
      *       sure dropping dropcnt refs will cause the lookupcnt to become 0.
-     *       It's possible that before put_nfs_inode() acquires inode_map_lock_0,
+     *       It's possible that before put_nfs_inode() acquires the shard lock,
      *       someone may grab a fresh ref on the inode, but that's fine as
      *       put_nfs_inode_nolock() handles that. Since it expects caller to
      *       only call it when the inode lookupcnt is going to be 0, it logs
@@ -329,10 +393,11 @@ public:
     void put_nfs_inode(struct nfs_inode *inode, size_t dropcnt)
     {
         /*
-         * We need to hold inode_map_lock_0 while we check the inode for
-         * eligibility to remove (and finally remove) from the inode_map.
+         * We need to hold the shard lock while we check the inode for
+         * eligibility to remove (and finally remove) from the inode_table.
          */
-        std::unique_lock<std::shared_mutex> lock(inode_map_lock_0);
+        std::unique_lock<std::shared_mutex> lock(
+                inode_table.get_shard_lock(inode));
         put_nfs_inode_nolock(inode, dropcnt);
     }
 
@@ -454,12 +519,104 @@ public:
      * This is to be used internally and not for serving fuse requests.
      * It returns true if we are able to get a success response for the
      * LOOKUP RPC that we sent, in that case child_ino will contain the
-     * child's fuse inode number.
+     * child's fuse inode number. On failure error, if not null, is set to
+     * the errno the LOOKUP failed with. Names found missing are added to
+     * the negative DNLC.
      */
     bool lookup_sync(
         fuse_ino_t parent_ino,
         const char *name,
-        fuse_ino_t& child_ino);
+        fuse_ino_t& child_ino,
+        int *error = nullptr);
+
+    /**
+     * Sync READDIRPLUS of directory dir, starting at cookie.
+     * This is to be used internally and not for serving fuse requests.
+     * By default it doesn't create inodes or add to the readdir cache, it
+     * only updates attributes of the inodes we already have, see
+     * update_inodes_from_readdirplus(). With add_to_dircache the entries are
+     * added to dir's readdir cache instead, see add_readdirplus_entries().
+     * On success cookie and cookieverf are updated for reading the next
+     * batch, eof is set if there are no more entries and num_updated is
+     * incremented by the number of inodes updated (or entries added).
+     */
+    bool readdirplus_sync(
+        struct nfs_inode *dir,
+        cookie3& cookie,
+        cookieverf3& cookieverf,
+        bool& eof,
+        uint64_t& num_updated,
+        bool add_to_dircache = false);
+
+    /**
+     * Update attributes of the inodes we have, for the entries in a
+     * READDIRPLUS response. Entries for which we don't have an inode are
+     * skipped. Returns the number of inodes updated.
+     */
+    uint64_t update_inodes_from_readdirplus(const struct entryplus3 *entry);
+
+    /**
+     * Called when inode's cached attributes are found expired, to see if
+     * its siblings' attributes should be refreshed with READDIRPLUS of the
+     * parent directory, instead of a GETATTR each.
+     * This happens when many children of a directory expire together, f.e.
+     * when "find" or a build walks a tree after actimeo.
+     * The READDIRPLUS are sent asynchronously, the caller must still query
+     * inode's attributes with GETATTR, the siblings which are looked at
+     * later find theirs refreshed.
+     * See cache.attr.user.bulk_revalidate_threshold.
+     */
+    void bulk_revalidate(struct nfs_inode *inode);
+
+    /**
+     * Send the READDIRPLUS of dir from cookie, for bulk_revalidate().
+     * Caller must hold a ref on dir, which is dropped once the revalidation
+     * is done.
+     */
+    void bulk_revalidate_rpc(struct nfs_inode *dir,
+                             cookie3 cookie,
+                             const cookieverf3& cookieverf);
+
+    /**
+     * Prefetch directory entries (with attributes) into dir's readdir cache,
+     * ahead of where the application is reading the directory, so that its
+     * next readdirplus calls are served from the cache while we fetch more.
+     * It issues one READDIRPLUS, continuing from the last cached cookie, and
+     * on completion issues the next, till we have readdir_prefetch
+     * READDIRPLUS worth of entries cached ahead of the application or reach
+     * eof. Does nothing if a prefetch is already running for dir.
+     */
+    void readdirplus_prefetch(struct nfs_inode *dir);
+
+    /**
+     * Add the entries of a READDIRPLUS response, for the READDIRPLUS issued
+     * at cookie, to dir's readdir cache, replacing any existing entries with
+     * the same cookies, and update its cookieverf and eof. This is for
+     * READDIRPLUS not issued on behalf of a fuse readdirplus call, which
+     * adds the entries itself, see readdirplus_callback().
+     * Nothing is added if the readdir cache was purged after the READDIRPLUS
+     * was issued, as the entries may be from an older enumeration.
+     * Returns the number of entries added.
+     */
+    uint32_t add_readdirplus_entries(struct nfs_inode *dir,
+                                     cookie3 cookie,
+                                     const READDIRPLUS3resok& resok);
+
+    /**
+     * Bulk stat, see aznfsc_ioctl.h.
+     * bulkstat_dir() returns the entries of directory ino after cookie, and
+     * bulkstat_names() returns the entries for the names in names.buf.
+     * Entries are served from the readdir cache, DNLC and attribute cache,
+     * READDIRPLUS (LOOKUP for bulkstat_names()) is issued only for those not
+     * cached, and GETATTR/READDIRPLUS for those with expired attributes.
+     * Returns 0 on success with bs filled, else a +ve errno.
+     */
+    int bulkstat_dir(fuse_ino_t ino,
+                     cookie3 cookie,
+                     struct aznfsc_bulkstat& bs);
+    int bulkstat_names(fuse_ino_t ino,
+                       const struct aznfsc_bulkstat& names,
+                       struct aznfsc_bulkstat& bs);
 
     void access(
         fuse_req_t req,
@@ -500,7 +657,7 @@ public:
 
     void jukebox_read(struct api_task_info *rpc_api);
 
-    void jukebox_flush(struct api_task_info *rpc_api);
+    void jukebox_flush(struct jukebox_seedinfo *js);
 
     /**
      * Convert between NFS fattr3 and POSIX struct stat.
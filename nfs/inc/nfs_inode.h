@@ -19,6 +19,13 @@
 #define FH_VALID(fh) \
     (((fh)->data.data_len > 0) && ((fh)->data.data_val != nullptr))
 
+/*
+ * With cache.attr.user.adaptive_actimeo, attributes of a file/dir that has
+ * not changed for N secs are cached for N/ATTR_AGE_DIVISOR secs (within
+ * the actimeo min/max), see nfs_inode::get_stable_actimeo().
+ */
+#define ATTR_AGE_DIVISOR 10
+
 /**
  * C++ object to hold struct nfs_fh3 from libnfs.
  */
@@ -51,6 +58,45 @@ private:
     char fh_data[64];
 };
 
+/**
+ * Silly rename related info for an nfs_inode.
+ * If the inode has been successfully silly renamed, is_silly_renamed will
+ * be set and name will contain the silly renamed name and parent_ino is
+ * the parent directory ino. These will be needed for deleting ths silly
+ * renamed file once the last handle on the file is closed by user.
+ * level helps to get unique names in case the silly renamed file itself is
+ * deleted.
+ */
+struct silly_rename_info
+{
+    bool is_silly_renamed = false;
+    std::string name;
+    fuse_ino_t parent_ino = 0;
+    int level = 0;
+};
+
+/**
+ * Bulk attribute revalidation related info for an nfs_inode, see
+ * nfs_client::bulk_revalidate().
+ * parent is the directory whose readdir cache this inode was last added to,
+ * and parent_fileid/parent_crc its inode_table key. The directory may have
+ * been freed since, so it must only be accessed through
+ * inode_table::get_held(), which makes sure it's still present.
+ * refreshed is set when bulk_revalidate() refreshes the attributes and
+ * cleared when they are first used, for counting GETATTRs saved.
+ * expired_window_msecs is the parent's expired window in which this inode
+ * was last counted, so that it's counted once per window, see
+ * readdirectory_cache::on_child_attr_expired().
+ */
+struct bulk_revalidate_info
+{
+    std::atomic<const struct nfs_inode*> parent = nullptr;
+    std::atomic<uint64_t> parent_fileid = 0;
+    std::atomic<uint32_t> parent_crc = 0;
+    std::atomic<bool> refreshed = false;
+    std::atomic<uint64_t> expired_window_msecs = 0;
+};
+
 /**
  * This is the NFS inode structure. There is one of these per file/directory
  * and contains any global information about the file/directory., f.e.,
@@ -61,6 +107,15 @@ private:
  */
 struct nfs_inode
 {
+    /*
+     * Data members are laid out by how often they are accessed. The first
+     * cache line holds what almost every fuse request and inode lookup
+     * touches (magic, refcnts, fuse ino, crc, the cache alloced flags), the
+     * attribute and filehandle state used by specific paths comes after and
+     * rarely needed state (silly rename) is allocated only when needed.
+     * Keep this in mind when adding new members, we have millions of these.
+     */
+
     /*
      * As we typecast back-n-forth between the fuse inode number and our
      * nfs_inode structure, we use the magic number to confirm that we
@@ -68,13 +123,6 @@ struct nfs_inode
      */
     const uint32_t magic = NFS_INODE_MAGIC;
 
-    /*
-     * Inode lock.
-     * Inode must be updated only with this lock held.
-     * VFS can make multiple calls (not writes) to the same file in parallel.
-     */
-    mutable std::shared_mutex ilock_1;
-
     /*
      * S_IFREG, S_IFDIR, etc.
      * 0 is not a valid file type.
@@ -112,7 +160,7 @@ struct nfs_inode
      * vfs does not have a reference to the inode and it's not cached in
      * any of our readdirectory_cache,s.
      *
-     * See comment above inode_map.
+     * See comment above nfs_client::inode_table.
      */
     mutable std::atomic<uint64_t> lookupcnt = 0;
     mutable std::atomic<uint64_t> dircachecnt = 0;
@@ -124,27 +172,29 @@ struct nfs_inode
     std::atomic<uint64_t> opencnt = 0;
 
     /*
-     * Silly rename related info.
-     * If this inode has been successfully silly renamed, is_silly_renamed will
-     * be set and silly_renamed_name will contain the silly renamed name and
-     * parent_ino is the parent directory ino. These will be needed for
-     * deleting ths silly renamed file once the last handle on the file is
-     * closed by user.
-     * silly_rename_level helps to get unique names in case the silly renamed
-     * file itself is deleted.
+     * Fuse inode number.
+     * This is how fuse identifies this file/directory to us.
+     * Fuse expects us to ensure that if we reuse ino we must ensure that the
+     * ino/generation pair is unique for the life of the fuse filesystem (and
+     * not just unique for one mount). This is specially useful if this fuse
+     * filesystem is exported over NFS. Since NFS would issue filehandles
+     * based on the ino number and generation pair, if ino number and generation
+     * pair is not unique NFS server might issue the same FH to two different
+     * files if "fuse driver + NFS server" is restarted. To avoid that make
+     * sure generation id is unique. We use the current epoch in usecs to
+     * ensure uniqueness. Note that even if the time goes back, it's highly
+     * unlikely that we use the same ino number and usec combination, but
+     * it's technically possible.
+     *
+     * IMPORTANT: Need to ensure time is sync'ed and it doesn't go back.
      */
-    bool is_silly_renamed = false;
-    std::string silly_renamed_name;
-    fuse_ino_t parent_ino = 0;
-    int silly_rename_level = 0;
+    const fuse_ino_t ino;
+    const uint64_t generation;
 
-private:
-    /*
-     * NFSv3 filehandle returned by the server.
-     * We use this to identify this file/directory to the server.
-     */
-    const nfs_fh3_deep fh;
+    // nfs_client owning this inode.
+    struct nfs_client *const client;
 
+private:
     /*
      * CRC32 hash of fh.
      * This serves multiple purposes, most importantly it can be used to print
@@ -154,44 +204,72 @@ private:
     const uint32_t crc = 0;
 
     /*
-     * This is a handle to the chunk cache which caches data for this file.
-     * Valid only for regular files.
-     * filecache_handle starts null in the nfs_inode constructor and is later
-     * initialized only in on_fuse_open() (when we return the inode to fuse in
-     * a lookup response or the application calls open()/creat()). The idea is
-     * to allocate the cache only when really needed. For inodes returned to
-     * fuse in a readdirplus response we don't initialize the filecache_handle.
-     * Once initialized we never make it null again, though we can make the
-     * cache itself empty by invalidate_cache(). So if has_filecache() returns
-     * true we can safely access the filecache_handle shared_ptr returned by
-     * get_filecache().
-     * alloc_filecache() initializes filecache_handle and sets filecache_alloced
-     * to true.
-     * Access to this shared_ptr must be protect by ilock_1, whereas access to
-     * the bytes_chunk_cache itself must be protected by chunkmap_lock_43.
+     * Set once the corresponding shared_ptr (filecache_handle, dircache_handle
+     * and readahead_state resp.) is allocated, see filecache_handle.
+     * Kept with the hot fields so that has_cache() and friends don't have to
+     * touch the colder cache line holding the shared_ptr,s.
      */
-    std::shared_ptr<bytes_chunk_cache> filecache_handle;
     std::atomic<bool> filecache_alloced = false;
+    std::atomic<bool> dircache_alloced = false;
+    std::atomic<bool> rastate_alloced = false;
 
+public:
     /*
-     * Pointer to the readdirectory cache.
-     * Only valid for a directory, this will be nullptr for a non-directory.
-     * Access to this shared_ptr must be protect by ilock_1, whereas access to
-     * the readdirectory_cache itself must be protected by readdircache_lock_2.
-     * Also see comments above filecache_handle.
+     * attr_timeout_secs will have a value between [acregmin, acregmax] or
+     * [acdirmin, acdirmax], depending on the filetype, and holds the current
+     * attribute cache timeout value for this inode, adjusted by exponential
+     * backoff and by how long the attributes have been stable (see
+     * get_stable_actimeo()), and capped by the max limit.
+     * attr_timeout_timestamp is the absolute time in msecs when the attribute
+     * cache is going to expire.
+     *
+     * attr_timeout_secs is protected by ilock_1.
+     * attr_timeout_timestamp is updated inder ilock_1, but can be accessed
+     * w/o ilock_1, f.e., run_getattr()->attr_cache_expired().
      */
-    std::shared_ptr<readdirectory_cache> dircache_handle;
-    std::atomic<bool> dircache_alloced = false;
+    std::atomic<int64_t> attr_timeout_secs = -1;
+    std::atomic<int64_t> attr_timeout_timestamp = -1;
 
     /*
-     * For maintaining readahead state.
-     * Valid only for regular files.
-     * Access to this shared_ptr must be protect by ilock_1, whereas access to
-     * the ra_state itself must be protected by ra_lock_40.
-     * Also see comments above filecache_handle.
+     * Time in usecs we received the last cached write for this inode.
+     * See discussion in stamp_cached_write() for details.
      */
-    std::shared_ptr<ra_state> readahead_state;
-    std::atomic<bool> rastate_alloced = false;
+    std::atomic<int64_t> last_cached_write = 0;
+
+    /*
+     * How many forget count we expect from fuse.
+     * It'll be incremented whenever we are able to successfully call one of
+     * the following:
+     * - fuse_reply_create()
+     * - fuse_reply_entry()
+     * - fuse_reply_buf() (for readdirplus and not for readdir)
+     *
+     * Fuse must call exactly these many forgets on this inode and the inode
+     * can only be freed when forget_expected becomes 0. Fuse must not call
+     * more forgets than forget_expected.
+     *
+     * Note: forget_expected may become 0 indicating that fuse doesn't know
+     *       about this inode but inode may still be in use (lookupcnt or
+     *       dircachecnt can be non-zero), then we don't free the inode.
+     *
+     * We use this for forgetting all inodes on unmount, and also for
+     * debugging to see if fuse forgets to call forget :-)
+     */
+    std::atomic<int64_t> forget_expected = 0;
+
+    /*
+     * Inode lock.
+     * Inode must be updated only with this lock held.
+     * VFS can make multiple calls (not writes) to the same file in parallel.
+     */
+    mutable std::shared_mutex ilock_1;
+
+private:
+    /*
+     * NFSv3 filehandle returned by the server.
+     * We use this to identify this file/directory to the server.
+     */
+    const nfs_fh3_deep fh;
 
     /*
      * Cached attributes for this inode.
@@ -220,87 +298,71 @@ private:
      */
     struct stat attr;
 
-public:
     /*
-     * Fuse inode number.
-     * This is how fuse identifies this file/directory to us.
-     * Fuse expects us to ensure that if we reuse ino we must ensure that the
-     * ino/generation pair is unique for the life of the fuse filesystem (and
-     * not just unique for one mount). This is specially useful if this fuse
-     * filesystem is exported over NFS. Since NFS would issue filehandles
-     * based on the ino number and generation pair, if ino number and generation
-     * pair is not unique NFS server might issue the same FH to two different
-     * files if "fuse driver + NFS server" is restarted. To avoid that make
-     * sure generation id is unique. We use the current epoch in usecs to
-     * ensure uniqueness. Note that even if the time goes back, it's highly
-     * unlikely that we use the same ino number and usec combination, but
-     * it's technically possible.
-     *
-     * IMPORTANT: Need to ensure time is sync'ed and it doesn't go back.
+     * This is a handle to the chunk cache which caches data for this file.
+     * Valid only for regular files.
+     * filecache_handle starts null in the nfs_inode constructor and is later
+     * initialized only in on_fuse_open() (when we return the inode to fuse in
+     * a lookup response or the application calls open()/creat()). The idea is
+     * to allocate the cache only when really needed. For inodes returned to
+     * fuse in a readdirplus response we don't initialize the filecache_handle.
+     * Once initialized we never make it null again, though we can make the
+     * cache itself empty by invalidate_cache(). So if has_filecache() returns
+     * true we can safely access the filecache_handle shared_ptr returned by
+     * get_filecache().
+     * alloc_filecache() initializes filecache_handle and sets filecache_alloced
+     * to true.
+     * Access to this shared_ptr must be protect by ilock_1, whereas access to
+     * the bytes_chunk_cache itself must be protected by chunkmap_lock_43.
      */
-    const fuse_ino_t ino;
-    const uint64_t generation;
+    std::shared_ptr<bytes_chunk_cache> filecache_handle;
 
     /*
-     * attr_timeout_secs will have a value between [acregmin, acregmax] or
-     * [acdirmin, acdirmax], depending on the filetype, and holds the current
-     * attribute cache timeout value for this inode, adjusted by exponential
-     * backoff and capped by the max limit.
-     * attr_timeout_timestamp is the absolute time in msecs when the attribute
-     * cache is going to expire.
-     *
-     * attr_timeout_secs is protected by ilock_1.
-     * attr_timeout_timestamp is updated inder ilock_1, but can be accessed
-     * w/o ilock_1, f.e., run_getattr()->attr_cache_expired().
+     * Pointer to the readdirectory cache.
+     * Only valid for a directory, this will be nullptr for a non-directory.
+     * Access to this shared_ptr must be protect by ilock_1, whereas access to
+     * the readdirectory_cache itself must be protected by readdircache_lock_2.
+     * Also see comments above filecache_handle.
      */
-    std::atomic<int64_t> attr_timeout_secs = -1;
-    std::atomic<int64_t> attr_timeout_timestamp = -1;
+    std::shared_ptr<readdirectory_cache> dircache_handle;
 
     /*
-     * Time in usecs we received the last cached write for this inode.
-     * See discussion in stamp_cached_write() for details.
+     * For maintaining readahead state.
+     * Valid only for regular files.
+     * Access to this shared_ptr must be protect by ilock_1, whereas access to
+     * the ra_state itself must be protected by ra_lock_40.
+     * Also see comments above filecache_handle.
      */
-    std::atomic<int64_t> last_cached_write = 0;
+    std::shared_ptr<ra_state> readahead_state;
 
-    // nfs_client owning this inode.
-    struct nfs_client *const client;
+public:
+    /*
+     * Silly rename related info, see silly_rename_info.
+     * This is needed only for files unlinked while open, so it's allocated
+     * by get_silly_rename_info() on first use and freed with the inode.
+     */
+    std::atomic<struct silly_rename_info*> silly_rename_state = nullptr;
 
     /*
-     * How many forget count we expect from fuse.
-     * It'll be incremented whenever we are able to successfully call one of
-     * the following:
-     * - fuse_reply_create()
-     * - fuse_reply_entry()
-     * - fuse_reply_buf() (for readdirplus and not for readdir)
-     *
-     * Fuse must call exactly these many forgets on this inode and the inode
-     * can only be freed when forget_expected becomes 0. Fuse must not call
-     * more forgets than forget_expected.
-     *
-     * Note: forget_expected may become 0 indicating that fuse doesn't know
-     *       about this inode but inode may still be in use (lookupcnt or
-     *       dircachecnt can be non-zero), then we don't free the inode.
-     *
-     * We use this for forgetting all inodes on unmount, and also for
-     * debugging to see if fuse forgets to call forget :-)
+     * Bulk attribute revalidation info, see bulk_revalidate_info.
+     * This is needed only if bulk revalidation is enabled, so it's allocated
+     * by set_bulk_parent() only then and freed with the inode.
      */
-    std::atomic<int64_t> forget_expected = 0;
+    std::atomic<struct bulk_revalidate_info*> bulk_revalidate_state = nullptr;
 
 #ifdef ENABLE_PARANOID
     uint64_t last_forget_seen_usecs = 0;
 #endif
 
     /*
-     * Stores the write error observed when performing backend writes to this
-     * Blob. This helps us duly fail close(), if one or more IOs have failed
-     * for the Blob. Note that the application read may complete immediately
-     * after copying the data to the cache but later when sync'ing dirty
-     * membufs with the Blob we might encounter write failures. These failures
-     * MUST be conveyed to the application via close(), else it'll never know.
-     *
-     * This is either 0 (no error) or a +ve errno value.
+     * Global counts of inodes and of the per-inode state allocated on
+     * demand, used for the inode memory usage report in dump_stats().
      */
-    int write_error = 0;
+    static std::atomic<uint64_t> num_inodes_g;
+    static std::atomic<uint64_t> num_dircache_g;
+    static std::atomic<uint64_t> num_rastate_g;
+    static std::atomic<uint64_t> num_silly_rename_g;
+    static std::atomic<uint64_t> num_bulk_revalidate_g;
 
     /**
      * TODO: Initialize attr with postop attributes received in the RPC
@@ -464,6 +526,7 @@ public:
             }
 
             dircache_alloced = true;
+            num_dircache_g++;
         }
     }
 
@@ -484,6 +547,15 @@ public:
         return dircache_handle;
     }
 
+    const std::shared_ptr<readdirectory_cache>& get_dircache() const
+    {
+        assert(is_dir());
+        assert(dircache_alloced);
+        assert(dircache_handle);
+
+        return dircache_handle;
+    }
+
     /**
      * External users of this nfs_inode can check for presence of dircache by
      * calling has_dircache().
@@ -525,6 +597,7 @@ public:
             assert(!rastate_alloced);
             readahead_state = std::make_shared<ra_state>(client, this);
             rastate_alloced = true;
+            num_rastate_g++;
         }
     }
 
@@ -694,9 +767,101 @@ public:
      */
     void fattr3_from_stat(struct fattr3& fattr) const;
 
+    /**
+     * Return silly rename info for this inode, allocating it if this is
+     * the first time it's needed.
+     *
+     * LOCKS: None.
+     */
+    struct silly_rename_info& get_silly_rename_info()
+    {
+        struct silly_rename_info *sri = silly_rename_state;
+
+        if (!sri) {
+            struct silly_rename_info *new_sri = new silly_rename_info();
+
+            if (silly_rename_state.compare_exchange_strong(sri, new_sri)) {
+                sri = new_sri;
+                num_silly_rename_g++;
+            } else {
+                // Some other thread allocated it, use that.
+                delete new_sri;
+            }
+        }
+
+        assert(sri);
+        return *sri;
+    }
+
+    bool is_silly_renamed() const
+    {
+        const struct silly_rename_info *sri = silly_rename_state;
+        return sri && sri->is_silly_renamed;
+    }
+
     int get_silly_rename_level()
     {
-        return silly_rename_level++;
+        return get_silly_rename_info().level++;
+    }
+
+    /**
+     * Record dir as the directory whose readdir cache has this inode.
+     * No-op if bulk revalidation is not enabled.
+     * See bulk_revalidate_info.
+     *
+     * LOCKS: None.
+     */
+    void set_bulk_parent(const struct nfs_inode *dir)
+    {
+        assert(dir->is_dir());
+
+        if (aznfsc_cfg.cache.attr.user.bulk_revalidate_threshold == 0) {
+            return;
+        }
+
+        struct bulk_revalidate_info *bri = bulk_revalidate_state;
+
+        if (!bri) {
+            struct bulk_revalidate_info *new_bri = new bulk_revalidate_info();
+
+            if (bulk_revalidate_state.compare_exchange_strong(bri, new_bri)) {
+                bri = new_bri;
+                num_bulk_revalidate_g++;
+            } else {
+                // Some other thread allocated it, use that.
+                delete new_bri;
+            }
+        }
+
+        assert(bri);
+        if (bri->parent != dir) {
+            bri->parent_fileid = dir->get_fileid();
+            bri->parent_crc = dir->get_crc();
+            bri->parent = dir;
+        }
+    }
+
+    /**
+     * Return bulk revalidation info for this inode, nullptr if it's not
+     * allocated, i.e., set_bulk_parent() has not been called.
+     *
+     * LOCKS: None.
+     */
+    struct bulk_revalidate_info *get_bulk_revalidate_info() const
+    {
+        return bulk_revalidate_state;
+    }
+
+    /**
+     * Returns true if the attributes were refreshed by bulk revalidation
+     * since they were last used, and clears that.
+     *
+     * LOCKS: None.
+     */
+    bool clear_bulk_refreshed()
+    {
+        struct bulk_revalidate_info *bri = bulk_revalidate_state;
+        return bri && bri->refreshed && bri->refreshed.exchange(false);
     }
 
     /**
@@ -812,6 +977,23 @@ public:
         dircache_handle->dnlc_add(filename, inode);
     }
 
+    /**
+     * Negative DNLC lookup.
+     * Returns true if filename is known to not exist in this directory, as
+     * a LOOKUP found it missing and the directory has not changed since,
+     * as per its cached (and not expired) attributes.
+     *
+     * Note: Shared ilock_1 and readdircache_lock_2.
+     */
+    bool negative_lookup(const char *filename) const;
+
+    /**
+     * Add negative DNLC entry for filename, after LOOKUP failed with NOENT.
+     * dir_attr are the directory attributes returned by the LOOKUP, the
+     * entry is valid only till the directory ctime matches that.
+     */
+    void negative_add(const char *filename, const struct fattr3& dir_attr);
+
     /*
      * Find nfs_inode for 'filename' in this directory.
      * It first searches in dnlc and if not found there makes a sync LOOKUP
@@ -844,6 +1026,36 @@ public:
          }
      }
 
+    /**
+     * Reset the streaming write state on a fresh open.
+     * The state lives in the file cache, as only files that are written
+     * need it, so there's nothing to reset if it's not allocated yet.
+     */
+    void reset_stream_state()
+    {
+        assert(is_regfile());
+
+        if (has_filecache()) {
+            get_filecache()->reset_stream_state();
+        }
+    }
+
+    /**
+     * Called for every application write to update the streaming write
+     * state. Returns true if this inode is being written by a streaming
+     * writer, i.e., one that has issued at least STREAM_WRITE_MIN_SEQ
+     * strictly sequential writes. This is decided only by the write pattern,
+     * not by how the file was opened. O_APPEND writers are detected the same
+     * way, as the kernel sends their writes at the current end of file.
+     * Note that parallel writes from multiple fuse threads can arrive
+     * slightly out of order, which simply resets the detection.
+     * Must be called only after the write is copied to the file cache.
+     */
+    bool on_write_check_stream(uint64_t offset, uint64_t length)
+    {
+        return get_filecache()->on_write_check_stream(offset, length);
+    }
+
      /**
       * Should we skip setattr(mtime) call for this inode?
       * See discussion above stamp_cached_write().
@@ -975,6 +1187,19 @@ public:
      */
     int get_actimeo_max() const;
 
+    /**
+     * Attribute cache timeout (in secs) justified by how long the cached
+     * attributes have been stable, i.e., time since the file/dir was last
+     * modified (mtime or ctime, whichever is later) divided by
+     * ATTR_AGE_DIVISOR, and capped by get_actimeo_min()/get_actimeo_max().
+     * A file that changes often thus keeps a short timeout, while write-once
+     * data quickly gets the max timeout.
+     * Returns get_actimeo_min() if cache.attr.user.adaptive_actimeo is false.
+     *
+     * Caller must hold ilock_1.
+     */
+    int get_stable_actimeo() const;
+
     /**
      * Get current attribute cache timeout value (in secs) for this inode.
      * Note that the attribute cache timeout moves between the min and max
@@ -1024,6 +1249,15 @@ public:
      * and hence this only flushes that.
      * For a non-reg file inode this will be a no-op.
      * Returns 0 on success and a positive errno value on error.
+     * Note that application writes complete once the data is copied to the
+     * cache and the data is written to the Blob later. If those background
+     * writes fail, the error is recorded against the failed range (see
+     * membuf::write_error) and the data is left dirty. This retries the
+     * failed ranges once more and returns the first error from this flush.
+     * A range that fails again is dropped from the dirty data and its error
+     * is saved in the file cache (see bytes_chunk_cache::write_error), so
+     * even if the caller doesn't report it (f.e. getattr) it's not lost.
+     * flush/fsync/close report and clear it, see clear_write_error().
      *
      * Note: This doesn't take the inode lock but instead it would grab the
      *       filecache_handle lock and get the list of dirty membufs at this
@@ -1033,12 +1267,62 @@ public:
     int flush_cache_and_wait(uint64_t start_off = 0,
                              uint64_t end_off = UINT64_MAX);
 
+    /**
+     * Wait for the oldest dirty data to be written till the file has no
+     * more than max_dirty bytes of dirty data, or there's no more dirty data
+     * we can wait for. Unlike flush_cache_and_wait() this doesn't issue any
+     * WRITE and doesn't wait for all of them, so a streaming writer can
+     * keep its later WRITEs in flight while it waits.
+     * Write errors are handled and returned like flush_cache_and_wait().
+     */
+    int wait_for_dirty_below(uint64_t max_dirty);
+
+    /**
+     * Wait for the write of bc to complete, and drop the inuse count and
+     * release bc. Returns the write error if the write failed, see
+     * flush_cache_and_wait().
+     */
+    int wait_for_flush(struct bytes_chunk& bc);
+
+    /**
+     * Returns the write error saved by flush_cache_and_wait() and not yet
+     * reported to the application, and clears it.
+     * This MUST only be called by flush/fsync/close which report the error.
+     */
+    int clear_write_error()
+    {
+        if (!is_regfile() || !has_filecache()) {
+            return 0;
+        }
+
+        return filecache_handle->clear_write_error();
+    }
+
     /**
      * Sync the dirty membufs in the file cache to the NFS server.
      * All contiguous dirty membufs are clubbed together and sent to the
-     * NFS server in a single write call.
+     * NFS server in a single write call. Small gaps b/w dirty membufs may
+     * also be filled with cached data, see fill_write_gap().
+     * If waiter is passed, every write issued holds a count on it till it
+     * completes, so that the caller can wait for all of them at once.
      */
-    void sync_membufs(std::vector<bytes_chunk> &bcs, bool is_flush);
+    void sync_membufs(std::vector<bytes_chunk> &bcs, bool is_flush,
+                      struct flush_waiter *waiter = nullptr);
+
+    /**
+     * Called by sync_membufs() when bc cannot be added to flush_task as it's
+     * not contiguous to the bytes_chunks already queued in flush_task.
+     * If the gap is not larger than write_gap_fill_kb and the entire gap is
+     * cached (uptodate and clean), the gap bytes_chunks are marked dirty and
+     * added to flush_task followed by bc, and it returns true. Else it
+     * returns false and flush_task is not modified.
+     * If the write fails, only the dirty bytes_chunks get the write error,
+     * the gap bytes_chunks are made clean again. Gaps are not filled while
+     * the file or bc has a write error pending.
+     * bc must be locked and inuse, as required by rpc_task::add_bc().
+     */
+    bool fill_write_gap(struct rpc_task *flush_task,
+                        const struct bytes_chunk& bc);
 
     /**
      * Called when last open fd is closed for a file.
@@ -1158,27 +1442,6 @@ public:
         }
     }
 
-    /**
-     * Store the first error encountered while writing dirty
-     * membuf to Blob.
-     */
-    void set_write_error(int error)
-    {
-        assert(error > 0);
-
-        if (this->write_error == 0) {
-            this->write_error = error;
-        }
-    }
-
-    /**
-     * Returns the error, saved by prior call to set_write_error().
-     */
-    int get_write_error() const
-    {
-        return write_error;
-    }
-
     /**
      * Directory cache lookup method.
      *
@@ -3,14 +3,48 @@
 
 #include "aznfsc.h"
 #include <map>
+#include <deque>
+#include <unordered_set>
 #include <shared_mutex>
 #include <vector>
+#include <string_view>
 #include <ctime>
 #include <dirent.h>
 
 // 1GB
 #define MAX_CACHE_SIZE_LIMIT 1073741824
 
+/*
+ * A directory's children attributes are refreshed in bulk when at least
+ * cache.attr.user.bulk_revalidate_threshold of them, and at least 1 out of
+ * BULK_REVALIDATE_DIR_FRACTION of its cached entries, are found expired
+ * within BULK_REVALIDATE_WINDOW_MSECS. See nfs_client::bulk_revalidate().
+ */
+#define BULK_REVALIDATE_WINDOW_MSECS    10000
+#define BULK_REVALIDATE_DIR_FRACTION    16
+
+/*
+ * Inodes held by clear(keep_inodes=true) are released if the directory is
+ * not read to eof with READDIRPLUS within this time, see held_inodes.
+ */
+#define HELD_INODES_MAX_MSECS           60000
+
+/*
+ * Cookies not more than these many beyond the end of the dense entries
+ * vector are added to it (growing it), as long as it stays at least 1 in
+ * DIRCACHE_DENSE_MIN_FILL full, see dircache_entries.
+ */
+#define DIRCACHE_DENSE_MAX_GAP          4096
+#define DIRCACHE_DENSE_MIN_FILL         2
+
+/*
+ * Slots the name index starts with and never shrinks below (unless the
+ * directory cache is emptied), must be a power of 2.
+ */
+#define DIRCACHE_NAME_INDEX_MIN_SLOTS   16
+static_assert((DIRCACHE_NAME_INDEX_MIN_SLOTS &
+               (DIRCACHE_NAME_INDEX_MIN_SLOTS - 1)) == 0);
+
 //struct readdirectory_cache;
 //struct directory_entry;
 
@@ -110,13 +144,13 @@ struct directory_entry
     size_t get_cache_size() const
     {
         /*
-         * Since we store this directory_entry in a map, it will have two
-         * pointers and a key and value, all 8 bytes each, so we add those
-         * to get a closer estimate.
+         * Add the shared_ptr control block, to get a closer estimate.
+         * The slots indexing the entry are accounted separately, see
+         * dircache_entries::get_index_bytes().
          *
          * Note: It may take slightly more than this.
          */
-        return sizeof(*this) + strlen(name) + 4*sizeof(uint64_t);
+        return sizeof(*this) + strlen(name) + 3*sizeof(uint64_t);
     }
 
     /**
@@ -156,6 +190,151 @@ struct directory_entry
     }
 };
 
+/**
+ * Entries of a readdirectory_cache, indexed by cookie and by name.
+ *
+ * Blob NFS cookies start at 1 and increase by 1 for every entry, so entries
+ * are mostly kept in a vector indexed by cookie, which makes finding the
+ * next cookie while enumerating a directory an array index, and costs one
+ * shared_ptr per entry. Cookies that don't fit in the vector (the special
+ * cookies of LOOKUP added entries, or cookies from other NFS servers which
+ * are not small and dense) are kept in a map.
+ * The name index, used for DNLC lookups, is an open addressed hash table
+ * using linear probing, same as inode_table_shard. Its slots point to the
+ * names owned by the entries, so names are not copied.
+ *
+ * This is not thread safe, readdirectory_cache protects it with
+ * readdircache_lock_2.
+ */
+class dircache_entries
+{
+public:
+    size_t size() const
+    {
+        return num_entries;
+    }
+
+    bool empty() const
+    {
+        return num_entries == 0;
+    }
+
+    /*
+     * Return the entry with the given cookie, null if not present.
+     */
+    const std::shared_ptr<struct directory_entry>& find(cookie3 cookie) const;
+
+    /*
+     * Return the entry with the smallest cookie greater than cookie and not
+     * greater than max_cookie, null if there's none.
+     */
+    const std::shared_ptr<struct directory_entry>& find_next(
+            cookie3 cookie, cookie3 max_cookie) const;
+
+    /*
+     * Return the cookie of the entry with the given name, 0 if not present.
+     */
+    cookie3 find_cookie(const char *name) const;
+
+    /*
+     * Add entry, returns false if an entry with the same cookie is present.
+     * Caller must have removed any entry with the same name.
+     */
+    bool insert(const std::shared_ptr<struct directory_entry>& entry);
+
+    /*
+     * Remove the entry with the given cookie and return it, returns null if
+     * not present.
+     */
+    std::shared_ptr<struct directory_entry> erase(cookie3 cookie);
+
+    /*
+     * Call f(entry) for every entry, f may reset the entry.
+     * Caller must call clear() after this if f resets any entry.
+     */
+    template<typename F>
+    void for_each(F f)
+    {
+        for (std::shared_ptr<struct directory_entry>& entry : dense) {
+            if (entry) {
+                f(entry);
+            }
+        }
+
+        for (auto& it : sparse) {
+            f(it.second);
+        }
+    }
+
+    /*
+     * Remove all entries and free the memory used for them.
+     */
+    void clear();
+
+    /*
+     * Memory used by the containers indexing the entries, including the
+     * dense slots for cookies not cached, on top of the entries themselves
+     * (see directory_entry::get_cache_size()).
+     */
+    size_t get_index_bytes() const
+    {
+        // std::map node: 3 pointers and color, key and value.
+        constexpr size_t map_node_bytes =
+            4 * sizeof(void *) + sizeof(cookie3) +
+            sizeof(std::shared_ptr<struct directory_entry>);
+
+        return (dense.capacity() *
+                sizeof(std::shared_ptr<struct directory_entry>)) +
+               (sparse.size() * map_node_bytes) +
+               (name_slots.capacity() * sizeof(name_slot));
+    }
+
+private:
+    struct name_slot
+    {
+        const char *name = nullptr;
+        cookie3 cookie = 0;
+        uint32_t hash = 0;
+        bool tombstone = false;
+
+        bool is_empty() const
+        {
+            return !name && !tombstone;
+        }
+    };
+
+    static uint64_t name_hash(const char *name)
+    {
+        return std::hash<std::string_view>{}(name);
+    }
+
+    void name_insert(const char *name, cookie3 cookie);
+    void name_erase(const char *name);
+
+    /*
+     * Rehash the name index into a table big enough to hold the names at no
+     * more than 25% load, dropping all tombstones.
+     */
+    void name_rehash();
+
+    /*
+     * dense[cookie-1] is the entry with the given cookie, null for cookies
+     * not cached. Entries whose cookie is not within DIRCACHE_DENSE_MAX_GAP
+     * of dense.size(), or would make dense less than 1 in
+     * DIRCACHE_DENSE_MIN_FILL full, are stored in sparse. num_dense is the
+     * number of entries in dense.
+     */
+    std::vector<std::shared_ptr<struct directory_entry>> dense;
+    std::map<cookie3, std::shared_ptr<struct directory_entry>> sparse;
+    size_t num_dense = 0;
+
+    std::vector<name_slot> name_slots;
+    size_t num_names = 0;
+    size_t num_tombstones = 0;
+
+    size_t num_entries = 0;
+};
+
 /**
  * This is our unified readdir and DNLC cache.
  */
@@ -250,11 +429,59 @@ private:
      */
     std::atomic<uint64_t> confirmed_msecs = 0;
 
+    /*
+     * Absolute time in msecs since epoch when this directory cache was last
+     * looked up or added to. Used to find cold directories whose cache can
+     * be purged when we have too many inodes.
+     */
+    mutable std::atomic<uint64_t> last_access_msecs = 0;
+
+    /*
+     * Bulk attribute revalidation state, see on_child_attr_expired().
+     * expired_children is the number of distinct children found with
+     * expired attributes since expired_window_msecs, and bulk_revalidating
+     * is set while the children attributes are being refreshed.
+     */
+    std::atomic<uint64_t> expired_window_msecs = 0;
+    std::atomic<uint32_t> expired_children = 0;
+    std::atomic<bool> bulk_revalidating = false;
+
+    /*
+     * READDIRPLUS prefetch state, see nfs_client::readdirplus_prefetch().
+     * app_cookie is the cookie upto which the application has enumerated
+     * the directory, rpc_entries is the number of entries returned by the
+     * last READDIRPLUS and prefetching is set while a prefetch READDIRPLUS
+     * is in flight.
+     */
+    std::atomic<uint64_t> app_cookie = 0;
+    std::atomic<uint32_t> rpc_entries = 0;
+    std::atomic<bool> prefetching = false;
+
+    /*
+     * Number of readdir/readdirplus being served from the cache, see
+     * start_enumeration().
+     */
+    std::atomic<int> enumerators = 0;
+
+    /*
+     * Inodes of the entries dropped by the last clear(keep_inodes=true),
+     * with a lookupcnt ref held so that they are not freed. When we read
+     * the directory again, READDIRPLUS finds these inodes for the entries
+     * that have not changed and re-adds them to the cache with refreshed
+     * attributes, instead of creating new inodes. The refs are dropped once
+     * READDIRPLUS reaches eof (or the cache is purged), which frees the
+     * inodes of the entries that were deleted from the directory. Since the
+     * application may stop reading the directory before eof, they are also
+     * dropped once held for HELD_INODES_MAX_MSECS (held_msecs is when they
+     * were held), see clear_if_needed().
+     */
+    std::vector<struct nfs_inode*> held_inodes;
+    uint64_t held_msecs = 0;
+
     /*
      * dir_entries is the readdir cache, indexed by cookie value.
-     * We double readdir cache as DNLC cache too. dnlc_map is used to convert
-     * filename (which is the index into the DNLC cache) to cookie (which is
-     * the index into the readdir cache).
+     * We double readdir cache as DNLC cache too, dir_entries also indexes
+     * the entries by filename (which is the index into the DNLC cache).
      * dir_entries contains shared_ptr of directory_entry objects, thus
      * lookup_dircache() can safely return a vector of directory_entry objects
      * w/o worrying of them being deleted by an unlink() or some other call
@@ -262,8 +489,19 @@ private:
      * Original ref to the shared_ptr is held when directory_entry is added to
      * dir_entries by readdirectory_cache::add().
      */
-    std::map<cookie3, std::shared_ptr<struct directory_entry>> dir_entries;
-    std::unordered_map<std::string, cookie3> dnlc_map;
+    dircache_entries dir_entries;
+
+    /*
+     * Negative DNLC, names which LOOKUP found to not exist in this directory.
+     * All of them were found missing when the directory ctime was
+     * neg_dir_ctime (nsecs), so they are valid only till the directory
+     * ctime doesn't change. neg_fifo has the same names in the order they
+     * were added, used for evicting the oldest once we have more than
+     * cache.attr.user.negative_max_per_dir names.
+     */
+    uint64_t neg_dir_ctime = 0;
+    std::unordered_set<std::string> neg_names;
+    std::deque<std::string> neg_fifo;
 
     /*
      * This lock protects all the members of this readdirectory_cache.
@@ -321,15 +559,9 @@ public:
     {
         // Take shared lock on the map.
         std::shared_lock<std::shared_mutex> lock(readdircache_lock_2);
-        auto it = dir_entries.find(cookie);
-
-        if (it != dir_entries.end())
-        {
-            dirent = it->second;
-            return true;
-        }
+        dirent = dir_entries.find(cookie);
 
-        return false;
+        return dirent != nullptr;
     }
 
     /**
@@ -354,6 +586,68 @@ public:
      */
     bool is_confirmed() const;
 
+    /**
+     * Called when child, a child of this directory, is found to have expired
+     * attributes. Returns true if the caller should now refresh attributes
+     * of all the children with READDIRPLUS, see BULK_REVALIDATE_WINDOW_MSECS.
+     * Each child is counted once per window, so that one file looked at
+     * repeatedly doesn't trigger it.
+     * Only one thread is asked to do it at a time, it must call
+     * end_bulk_revalidate() once done.
+     */
+    bool on_child_attr_expired(struct nfs_inode *child, uint32_t threshold);
+    void end_bulk_revalidate();
+
+    /**
+     * Called when the application reads the directory from cookie, and
+     * when a READDIRPLUS returns num_entries entries, to keep track of how
+     * much to prefetch.
+     */
+    void set_app_cookie(uint64_t cookie)
+    {
+        app_cookie = cookie;
+    }
+
+    void set_rpc_entries(uint32_t num_entries)
+    {
+        if (num_entries > 0) {
+            rpc_entries = num_entries;
+        }
+    }
+
+    /**
+     * Returns true if the caller should prefetch more entries, i.e., we
+     * have less than max_rpcs READDIRPLUS worth of entries cached beyond
+     * what the application has read. cookie is set to the cookie to read
+     * from. Only one prefetch runs at a time, the caller must call
+     * end_prefetch() once done.
+     */
+    bool start_prefetch(int max_rpcs, cookie3& cookie);
+
+    void end_prefetch()
+    {
+        assert(prefetching);
+        prefetching = false;
+    }
+
+    /**
+     * Last cookie of the sequence of cookies, starting at the start of the
+     * directory, that we have cached.
+     */
+    uint64_t get_seq_last_cookie() const
+    {
+        std::shared_lock<std::shared_mutex> lock(readdircache_lock_2);
+        return seq_last_cookie;
+    }
+
+    /**
+     * Time (msecs since epoch) this cache was last looked up or added to.
+     */
+    uint64_t get_last_access_msecs() const
+    {
+        return last_access_msecs;
+    }
+
     /**
      * add() will add entry to dir_entries after bumping the shared_ptr ref.
      */
@@ -397,8 +691,7 @@ public:
      */
     cookie3 filename_to_cookie(const char *filename) const
     {
-        const auto it = dnlc_map.find(filename);
-        const cookie3 cookie = (it == dnlc_map.end()) ? 0 : it->second;
+        const cookie3 cookie = dir_entries.find_cookie(filename);
 
 #ifndef ENABLE_NON_AZURE_NFS
         /*
@@ -431,6 +724,16 @@ public:
             const char *filename_hint = nullptr,
             bool acquire_lock = true) const;
 
+    /**
+     * Like lookup() but returns the cached entry with the smallest cookie
+     * greater than cookie and not greater than max_cookie, for enumerating
+     * the cached entries without assuming anything about the cookie values.
+     * Same as lookup(), it holds a dircachecnt ref on the inode.
+     */
+    std::shared_ptr<struct directory_entry> lookup_next(
+            cookie3 cookie,
+            cookie3 max_cookie) const;
+
     struct nfs_inode *dnlc_lookup(const char *filename,
                                   bool *negative_confirmed = nullptr) const;
 
@@ -452,12 +755,91 @@ public:
         return remove(0, filename);
     }
 
+    /**
+     * Add filename to the negative DNLC, after LOOKUP failed with NOENT
+     * and returned dir_ctime (nsecs) as the directory ctime.
+     * If the directory ctime has changed since the other names were added,
+     * they are dropped. Oldest names are evicted to keep at most
+     * max_entries names.
+     */
+    void negative_add(const char *filename,
+                      uint64_t dir_ctime,
+                      size_t max_entries);
+
+    /**
+     * Return true if filename is known to not exist in the directory,
+     * given that its current ctime is dir_ctime (nsecs).
+     */
+    bool negative_lookup(const char *filename, uint64_t dir_ctime) const;
+
+    /**
+     * Drop all names from the negative DNLC.
+     * Caller MUST hold readdircache_lock_2 exclusive.
+     */
+    void negative_clear_nolock()
+    {
+        assert(neg_names.size() == neg_fifo.size());
+        neg_names.clear();
+        neg_fifo.clear();
+    }
+
     /**
      * Remove all entries from the cache.
      * Also delete the inodes for those entries for which this was the last
      * ref.
+     * If kernel_names is not null, names of the removed entries whose inodes
+     * are known to fuse (forget_expected > 0) are returned in it, so that the
+     * caller can ask the kernel to drop those dentries.
+     * If keep_inodes is true the inodes are not freed, but kept in
+     * held_inodes till the directory is read again. This is used when the
+     * cache is purged because the directory has changed, as most of the
+     * entries are likely to still be there.
+     * If only_if_idle is true the cache is not purged if the directory is
+     * open or being enumerated (see start_enumeration()), this is checked
+     * under readdircache_lock_2. Returns true if the cache was purged.
      */
-    void clear();
+    bool clear(std::vector<std::string> *kernel_names = nullptr,
+               bool keep_inodes = false,
+               bool only_if_idle = false);
+
+    /**
+     * Called around serving a readdir/readdirplus from the cache, i.e.,
+     * from before lookup_dircache() till the directory_entry objects it
+     * returned are released. clear(only_if_idle=true) doesn't purge the
+     * cache while there are enumerations in progress, as that would leave
+     * the inodes of the returned entries with no dircachecnt and lookupcnt
+     * refs, but still in the inode_table.
+     */
+    void start_enumeration()
+    {
+        std::shared_lock<std::shared_mutex> lock(readdircache_lock_2);
+        enumerators++;
+    }
+
+    void end_enumeration()
+    {
+        assert(enumerators > 0);
+        enumerators--;
+    }
+
+    /**
+     * Drop the refs on held_inodes, see clear().
+     * READDIRPLUS callers call this once they reach eof. READDIR doesn't,
+     * as its entries have no filehandles to find the held inodes with,
+     * LOOKUPs of the names find them instead.
+     */
+    void release_held_inodes();
+
+    /**
+     * Are there inodes held by clear(keep_inodes=true)?
+     * The inode reclaimer purges such directories even if their cache is
+     * empty, to release them.
+     */
+    bool has_held_inodes() const
+    {
+        std::shared_lock<std::shared_mutex> lock(readdircache_lock_2);
+        return !held_inodes.empty();
+    }
 
     void invalidate()
     {
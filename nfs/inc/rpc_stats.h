@@ -6,6 +6,7 @@
 
 #include "aznfsc.h"
 #include "libnfs-raw.h"
+#include "connection.h"
 
 namespace aznfsc {
 
@@ -129,12 +130,46 @@ public:
         opstats[optype].pending++;
     }
 
+    /**
+     * Call this with the connection the RPC is being issued over, after
+     * on_rpc_issue(). The RPC is accounted against the connection, and the
+     * conn_pin (if any) that picked the connection, till it completes.
+     */
+    void on_rpc_conn(struct nfs_connection *_conn,
+                     struct conn_pin *_pin = nullptr)
+    {
+        assert(stamp.issue != 0);
+        assert(conn == nullptr);
+        assert(pin == nullptr);
+        conn = _conn;
+        pin = _pin;
+        conn->on_rpc_issue();
+    }
+
+    /**
+     * Undo on_rpc_conn(), once the RPC is done with the connection.
+     */
+    void put_conn(uint64_t rtt_usec = 0)
+    {
+        if (pin) {
+            pin->put();
+            pin = nullptr;
+        }
+
+        if (conn) {
+            conn->on_rpc_done(rtt_usec);
+            conn = nullptr;
+        }
+    }
+
     /**
      * Call this to undo the effects of on_rpc_issue() if the async request
      * fails to issue for some reason.
      */
     void on_rpc_cancel()
     {
+        put_conn();
+
         assert(stamp.issue != 0);
         assert((int64_t) stamp.issue <= get_current_usecs());
         assert(stamp.dispatch == 0);
@@ -172,6 +207,8 @@ public:
         stamp.complete = get_current_usecs();
         assert(stamp.complete > stamp.dispatch);
 
+        put_conn(stamp.complete - stamp.dispatch);
+
         assert(optype > 0 && optype <= FUSE_OPCODE_MAX);
         assert(opstats[optype].pending > 0);
         opstats[optype].pending--;
@@ -197,6 +234,12 @@ public:
      */
     void on_rpc_free()
     {
+        /*
+         * RPC issued but we never got a completion, don't leave it
+         * accounted against the connection.
+         */
+        put_conn();
+
         /*
          * stamp.issue won't be set for requests which were not sent to
          * the server. Most likely reason is that the request was served from
@@ -258,11 +301,40 @@ public:
      */
     static void dump_stats();
 
+    /**
+     * Record latency of one application flush (close/fsync), i.e., the time
+     * taken to write all the dirty data of the file and wait for it.
+     */
+    static void on_flush_complete(uint64_t flush_usec)
+    {
+        int bucket = 0;
+
+        while (flush_usec > 1 && bucket < (FLUSH_LAT_BUCKETS - 1)) {
+            flush_usec >>= 1;
+            bucket++;
+        }
+
+        flush_lat_hist[bucket]++;
+    }
+
 private:
+    /**
+     * Return the upper bound (in usecs) of the flush latency histogram
+     * bucket that contains the given percentile.
+     */
+    static uint64_t get_flush_lat_percentile(double pct);
+
     enum fuse_opcode optype = (fuse_opcode) 0;
     size_t req_size = 0;
     size_t resp_size = 0;
 
+    /*
+     * Connection the RPC was issued over and the file's conn_pin, see
+     * on_rpc_conn().
+     */
+    struct nfs_connection *conn = nullptr;
+    struct conn_pin *pin = nullptr;
+
     /*
      * Timestamp in microseconds for various stages of the RPC.
      *
@@ -310,6 +382,41 @@ public:
      * bytes_read_ahead: How many bytes were read ahead.
      * tot_getattr_reqs: How many getattr requests were received from fuse.
      * getattr_served_from_cache: How many were served from inode->attr cache.
+     * write_gaps_filled: How many gaps b/w dirty extents were filled with
+     *                    cached data to coalesce writes.
+     * bytes_write_gap_filled: Total bytes written for filling those gaps.
+     * stream_writes: How many application writes were handled as streaming
+     *                writes.
+     * write_retries: How many background WRITEs were retried after failing
+     *                with a transient error.
+     * write_errors: How many background WRITEs failed and could not be
+     *               retried. Those ranges are left dirty in the cache.
+     * dircaches_reclaimed: How many readdir caches of cold directories were
+     *                      purged as we had more than cache.inode.max_count
+     *                      inodes.
+     * inodes_reclaimed: How many inodes were freed by those purges.
+     * kernel_entries_invalidated: How many dentries the kernel was asked to
+     *                             drop by those purges.
+     * bulk_revalidations: How many times attributes of the children of a
+     *                     directory were refreshed with READDIRPLUS.
+     * bulk_revalidate_rpcs: READDIRPLUS RPCs issued for those.
+     * getattrs_saved: How many GETATTRs were served by attributes refreshed
+     *                 by those, instead of going to the server.
+     * readdir_prefetch_rpcs: How many READDIRPLUS were issued to prefetch
+     *                        directory entries ahead of the application.
+     * readdir_prefetch_entries: Directory entries added to the readdir cache
+     *                           by those.
+     * readdir_inodes_preserved: How many inodes of entries of changed
+     *                           directories were found again when the
+     *                           directory was read again, instead of
+     *                           being created afresh.
+     * negative_lookups_saved: How many lookups for non-existent names were
+     *                         served from the negative DNLC, w/o a LOOKUP.
+     * bulkstat_calls: How many bulk stat ioctls were served.
+     * bulkstat_entries: Entries returned by those, see aznfsc_ioctl.h.
+     * flush_lat_hist: Histogram of application flush latencies. Bucket N
+     *                 counts flushes that took [2^N, 2^(N+1)) usecs, with
+     *                 bucket 0 also counting flushes that took 0 usecs.
      */
     static std::atomic<uint64_t> tot_bytes_read;
     static std::atomic<uint64_t> bytes_read_from_cache;
@@ -319,6 +426,26 @@ public:
     static std::atomic<uint64_t> tot_lookup_reqs;
     static std::atomic<uint64_t> lookup_served_from_cache;
     static std::atomic<uint64_t> inline_writes;
+    static std::atomic<uint64_t> write_gaps_filled;
+    static std::atomic<uint64_t> bytes_write_gap_filled;
+    static std::atomic<uint64_t> stream_writes;
+    static std::atomic<uint64_t> write_retries;
+    static std::atomic<uint64_t> write_errors;
+    static std::atomic<uint64_t> dircaches_reclaimed;
+    static std::atomic<uint64_t> inodes_reclaimed;
+    static std::atomic<uint64_t> kernel_entries_invalidated;
+    static std::atomic<uint64_t> bulk_revalidations;
+    static std::atomic<uint64_t> bulk_revalidate_rpcs;
+    static std::atomic<uint64_t> getattrs_saved;
+    static std::atomic<uint64_t> negative_lookups_saved;
+    static std::atomic<uint64_t> readdir_prefetch_rpcs;
+    static std::atomic<uint64_t> readdir_prefetch_entries;
+    static std::atomic<uint64_t> readdir_inodes_preserved;
+    static std::atomic<uint64_t> bulkstat_calls;
+    static std::atomic<uint64_t> bulkstat_entries;
+
+    static constexpr int FLUSH_LAT_BUCKETS = 40;
+    static std::atomic<uint64_t> flush_lat_hist[FLUSH_LAT_BUCKETS];
 };
 
 #define INC_GBL_STATS(var, inc)  rpc_stats_az::var += (inc)
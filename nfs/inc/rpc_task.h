@@ -4,11 +4,12 @@
 #include <cstddef>
 #include <string>
 #include <mutex>
-#include <stack>
-#include <shared_mutex>
+#include <condition_variable>
 #include <vector>
 #include <set>
 #include <thread>
+#include <functional>
+#include <atomic>
 
 #include "nfs_client.h"
 #include "file_cache.h"
@@ -18,6 +19,75 @@
 // Maximum number of simultaneous rpc tasks (sync + async).
 #define MAX_OUTSTANDING_RPC_TASKS 65536
 
+/*
+ * rpc_tasks are allocated on demand, these many at a time, upto
+ * aznfsc_cfg.max_rpc_tasks. We start with RPC_TASK_MIN_TASKS.
+ */
+#define RPC_TASK_SLAB_SIZE 1024
+#define RPC_TASK_MIN_TASKS (2 * RPC_TASK_SLAB_SIZE)
+static_assert(MAX_OUTSTANDING_RPC_TASKS % RPC_TASK_SLAB_SIZE == 0);
+
+/*
+ * These many rpc_tasks are kept free for alloc_rpc_task_reserved() callers.
+ */
+#define RPC_TASK_RESERVED 1000
+static_assert(RPC_TASK_RESERVED < RPC_TASK_MIN_TASKS);
+static_assert(RPC_TASK_RESERVED < MAX_OUTSTANDING_RPC_TASKS / 4);
+
+/*
+ * rpc_tasks not needed for the peak usage seen in the last these many
+ * seconds are freed.
+ */
+#define RPC_TASK_POOL_IDLE_SECS 60
+
+/**
+ * Priority classes for rpc_tasks, from highest to lowest priority.
+ * When we run out of rpc_tasks, waiters are woken up in weighted round robin
+ * order of their class (see RPC_PRIO_WEIGHTS), so that a flood of low
+ * priority RPCs doesn't hold up interactive ones, while low priority ones
+ * still get their share and don't starve. The lower classes are also capped
+ * to a fraction of the pool (see RPC_PRIO_CAP_DIV), which bounds how deep
+ * they can make the libnfs queues, that higher priority RPCs wait behind.
+ */
+typedef enum
+{
+    /*
+     * Use the default priority for the fuse opcode, see
+     * rpc_task_helper::default_prio().
+     */
+    RPC_PRIO_DEFAULT    = -1,
+
+    /*
+     * Interactive metadata operations (LOOKUP, GETATTR, READDIR, ...).
+     */
+    RPC_PRIO_META       = 0,
+
+    /*
+     * Application reads and writes, and flushes that the application is
+     * waiting for (close/fsync/inline writes).
+     */
+    RPC_PRIO_FG         = 1,
+
+    /*
+     * Readahead reads.
+     */
+    RPC_PRIO_READAHEAD  = 2,
+
+    /*
+     * Background writeback of dirty data.
+     */
+    RPC_PRIO_BG_FLUSH   = 3,
+
+    RPC_PRIO_MAX        = 4,
+} rpc_prio_t;
+
+/*
+ * Relative share of wakeups and the max fraction (1/N) of max_rpc_tasks that
+ * each priority class can use, indexed by rpc_prio_t.
+ */
+#define RPC_PRIO_WEIGHTS    { 8, 4, 2, 1 }
+#define RPC_PRIO_CAP_DIV    { 1, 1, 8, 4 }
+
 // Maximum number of simultaneous async rpc tasks.
 #define MAX_ASYNC_RPC_TASKS 1024
 
@@ -254,6 +324,205 @@ private:
     struct fuse_bufvec *write_bufv;
 };
 
+/**
+ * Join for operations that need more than one RPC to complete, f.e. a fuse
+ * read which is served by multiple backend READs, or a flush which issues
+ * multiple WRITEs (see flush_waiter).
+ * The issuer arm()s the join with the continuation to run once all the RPCs
+ * complete, add()s one for every RPC it issues and every RPC completion calls
+ * done() with its status. The continuation is called exactly once, by the
+ * thread completing last, with the first non-zero status seen (or 0 if all
+ * RPCs succeeded).
+ * arm() holds one ref on behalf of the issuer, so that RPCs completing while
+ * the issuer is still issuing cannot run the continuation early. The issuer
+ * drops it by calling done(0) once it's done issuing, which runs the
+ * continuation inline if all issued RPCs have already completed.
+ *
+ * Steps that depend on the previous one, f.e. a GETATTR which needs the
+ * filehandle returned by a LOOKUP, are run one after the other on the same
+ * join: the continuation of a step calls chain() with the continuation of
+ * the next step and issues its RPCs as above.
+ *
+ * This lets multi-RPC operations be written as "issue these, then do that"
+ * w/o every callback carrying its own pending count and error bookkeeping.
+ */
+struct rpc_join
+{
+public:
+    /*
+     * Arm the join with the continuation, holding the issuer ref.
+     * Must be called before any add().
+     */
+    void arm(std::function<void(int)> _cont)
+    {
+        assert(_cont);
+        assert(!cont);
+        assert(pending == 0);
+        assert(status == 0);
+
+        cont = std::move(_cont);
+        pending = 1;
+    }
+
+    /*
+     * Add n more RPCs to wait for.
+     * Must be called before the RPC is issued, while the caller holds a ref,
+     * i.e., the issuer ref or the ref of the RPC being retried/continued.
+     */
+    void add(int n = 1)
+    {
+        assert(n > 0);
+        [[maybe_unused]] const int prev = pending.fetch_add(n);
+        assert(prev > 0);
+    }
+
+    /*
+     * Drop one ref with the given status.
+     * Returns true if this was the last ref, in which case the continuation
+     * has been run and the caller must not access the join (or the object
+     * containing it) anymore as the continuation may have freed it.
+     */
+    bool done(int _status)
+    {
+        if (_status != 0) {
+            // Once failed, status remains at the first failure.
+            int expected = 0;
+            status.compare_exchange_strong(expected, _status);
+        }
+
+        const int prev = pending--;
+        assert(prev > 0);
+
+        if (prev != 1) {
+            return false;
+        }
+
+        /*
+         * Move the continuation and status out before calling it, as it
+         * may free (and reuse) the object containing this join.
+         */
+        assert(cont);
+        std::function<void(int)> _cont = std::move(cont);
+        cont = nullptr;
+
+        _cont(status.load());
+        return true;
+    }
+
+    int get_pending() const
+    {
+        return pending;
+    }
+
+    int get_status() const
+    {
+        return status;
+    }
+
+    /*
+     * Reset the join so that it can be armed again.
+     * Must be called only after the continuation has run, or if it was
+     * never armed.
+     */
+    void reset()
+    {
+        assert(pending == 0);
+        cont = nullptr;
+        status = 0;
+    }
+
+    /*
+     * Re-arm the join for the next step, with a fresh status.
+     * Must be called only from the continuation, which then add()s the
+     * RPCs of the next step and drops the issuer ref with done(0). Status of
+     * the previous step is what the continuation was called with, it decides
+     * whether to chain the next step or to complete the operation.
+     */
+    void chain(std::function<void(int)> _cont)
+    {
+        reset();
+        arm(std::move(_cont));
+    }
+
+private:
+    std::atomic<int> pending = 0;
+    std::atomic<int> status = 0;
+    std::function<void(int)> cont;
+};
+
+/**
+ * Used by a flusher to wait for all the WRITE RPCs that it issued.
+ * Every bc_iovec created on behalf of the flusher holds one ref on the join
+ * which is dropped when the bc_iovec is destroyed, i.e., after the write
+ * completes (successfully or not) and the cache chunks are released.
+ * The flusher holds the issuer ref while it's issuing the writes, so that
+ * the join cannot complete before all writes are issued, and drops it in
+ * wait(), which then blocks till the continuation has run.
+ */
+struct flush_waiter
+{
+    flush_waiter()
+    {
+        /*
+         * Signal with the lock held, as the waiter may destroy the
+         * flush_waiter as soon as it finds completed set.
+         */
+        join.arm([this](int status)
+        {
+            std::unique_lock<std::mutex> _lock(fw_lock_45);
+            assert(!completed);
+            completed = true;
+            cv.notify_all();
+        });
+    }
+
+    ~flush_waiter()
+    {
+        assert(completed);
+        assert(join.get_pending() == 0);
+    }
+
+    /**
+     * Add one more outstanding write.
+     */
+    void get()
+    {
+        join.add();
+    }
+
+    /**
+     * One outstanding write completed.
+     * Write errors are recorded in the membufs, and reported by the flusher
+     * from there, so we don't pass a status.
+     */
+    void put()
+    {
+        join.done(0);
+    }
+
+    /**
+     * Drop the flusher's ref and wait for all the issued writes to
+     * complete.
+     */
+    void wait()
+    {
+        join.done(0);
+
+        std::unique_lock<std::mutex> _lock(fw_lock_45);
+        cv.wait(_lock, [this] { return completed; });
+    }
+
+private:
+    rpc_join join;
+
+    /*
+     * Set by the join continuation, protected by fw_lock_45.
+     */
+    bool completed = false;
+    std::mutex fw_lock_45;
+    std::condition_variable cv;
+};
+
 /**
  * This is an io vector of bytes_chunks.
  * Anyone trying to perform IOs to/from a vector of bytes_chunks should use
@@ -285,11 +554,15 @@ struct bc_iovec
      * will issue to the file using this bc_iovec.
      * It takes nfs_inode for releasing the cache chunks as IOs get completed
      * for the queued bytes_chunks.
+     * If waiter is passed it's held till this bc_iovec is destroyed, so
+     * that the flusher can wait for the write to complete.
      *
      * Note: This takes shared lock on ilock_1.
      */
-    bc_iovec(struct nfs_inode *_inode) :
+    bc_iovec(struct nfs_inode *_inode,
+             struct flush_waiter *_waiter = nullptr) :
         inode(_inode),
+        waiter(_waiter),
         max_iosize(inode->get_client()->mnt_options.wsize_adj)
     {
         assert(inode->magic == NFS_INODE_MAGIC);
@@ -306,6 +579,10 @@ struct bc_iovec
          */
         inode->incref();
 
+        if (waiter) {
+            waiter->get();
+        }
+
         assert(max_iosize > 0);
         /*
          * TODO: Currently we don't support wsize smaller than 1MB.
@@ -334,6 +611,14 @@ struct bc_iovec
         assert(inode->has_filecache());
         inode->get_filecache()->release(orig_offset, orig_length);
         inode->decref();
+
+        /*
+         * This must be the last thing we do, as the flusher may return as
+         * soon as the last write completes.
+         */
+        if (waiter) {
+            waiter->put();
+        }
     }
 
     /**
@@ -515,9 +800,14 @@ struct bc_iovec
 
     /**
      * Call on IO failure.
+     * error is the +ve errno value the IO failed with, it's recorded in all
+     * the membufs that remain to be written, except the gap fill membufs
+     * (see nfs_inode::fill_write_gap()) which the application never wrote.
      */
-    void on_io_fail()
+    void on_io_fail(int error)
     {
+        assert(error > 0);
+
         /*
          * There's one iov per bytes_chunk.
          */
@@ -556,6 +846,19 @@ struct bc_iovec
             assert(mb->is_inuse() && mb->is_locked());
             assert(mb->is_flushing() && mb->is_dirty() && mb->is_uptodate());
 
+            /*
+             * Remember the error against this range, the next flush
+             * will retry the write and report the error if that also
+             * fails.
+             * Gap fill membufs still hold the same data as the Blob, make
+             * them clean again so that the error is not charged to them and
+             * they are not retried or dropped as failed writes.
+             */
+            if (bc.is_gap_fill) {
+                mb->clear_dirty();
+            } else {
+                mb->set_write_error(error);
+            }
             mb->clear_flushing();
             mb->clear_locked();
             mb->clear_inuse();
@@ -601,8 +904,20 @@ struct bc_iovec
      */
     std::queue<bytes_chunk> bcq;
 
+    /*
+     * How many times the write was retried after failing with a transient
+     * error. See MAX_WRITE_RETRIES.
+     */
+    int num_retries = 0;
+
 private:
     struct nfs_inode *const inode;
+
+    /*
+     * Flusher waiting for this write to complete, if any.
+     */
+    struct flush_waiter *const waiter;
+
     /*
      * Fixed iovec array, iov points into it.
      *
@@ -1667,6 +1982,11 @@ private:
      */
     conn_sched_t csched = CONN_SCHED_INVALID;
 
+    /*
+     * Priority class this rpc_task was allocated for.
+     */
+    rpc_prio_t prio = RPC_PRIO_META;
+
     /*
      * FH hash to be used for connection scheduling if/for CONN_SCHED_FH_HASH.
      */
@@ -1678,16 +1998,14 @@ public:
      * To serve single client read call we may issue multiple NFS reads
      * depending on the chunks returned by bytes_chunk_cache::get().
      *
-     * num_ongoing_backend_reads tracks how many of the backend reads are
-     * currently pending. We cannot complete the application read until all
-     * reads complete (either success or failure).
-     *
-     * read_status is the final read status we need to send to fuse.
-     * This is set when we get an error, so that even if later reads complete
-     * successfully we fail the fuse read.
+     * backend_reads tracks the backend reads that are currently pending.
+     * We cannot complete the application read until all reads complete
+     * (either success or failure), its continuation then sends the read
+     * response to fuse. Its status is the final read status, set when we get
+     * an error, so that even if later reads complete successfully we fail
+     * the fuse read.
      */
-    std::atomic<int> num_ongoing_backend_reads = 0;
-    std::atomic<int> read_status = 0;
+    rpc_join backend_reads;
 
     /*
      * This is currently valid only for reads.
@@ -1978,17 +2296,23 @@ public:
     void set_csched(conn_sched_t _csched)
     {
         assert(_csched > CONN_SCHED_INVALID &&
-               _csched <= CONN_SCHED_FH_HASH);
+               _csched <= CONN_SCHED_CPU_LOCAL);
         csched = _csched;
     }
 
     conn_sched_t get_csched() const
     {
         assert(csched > CONN_SCHED_INVALID &&
-               csched <= CONN_SCHED_FH_HASH);
+               csched <= CONN_SCHED_CPU_LOCAL);
         return csched;
     }
 
+    rpc_prio_t get_prio() const
+    {
+        assert(prio >= RPC_PRIO_META && prio < RPC_PRIO_MAX);
+        return prio;
+    }
+
     uint32_t get_fh_hash() const
     {
         // When get_fh_hash() is called, fh_hash must be set.
@@ -2040,9 +2364,19 @@ public:
 
     struct nfs_context *get_nfs_context() const;
 
-    struct rpc_context *get_rpc_ctx() const
+    /*
+     * Pick the connection for the RPC being issued and return its libnfs
+     * rpc_context. This must be called once per RPC, after
+     * stats.on_rpc_issue(), as it accounts the RPC against the connection.
+     */
+    struct rpc_context *get_rpc_ctx()
     {
-        return nfs_get_rpc_context(get_nfs_context());
+        struct conn_pin *pin = nullptr;
+        struct nfs_connection *conn =
+            client->get_transport().get_connection(csched, fh_hash, &pin);
+
+        stats.on_rpc_conn(conn, pin);
+        return nfs_get_rpc_context(conn->get_nfs_context());
     }
 
     nfs_client *get_client() const
@@ -2138,7 +2472,7 @@ public:
             assert(e->generation == inode->get_generation());
 
             /*
-             * This might be an existing inode from inode_map which we didn't
+             * This might be an existing inode from inode_table which we didn't
              * free earlier as it was in use when fuse called forget and then
              * some other thread looked up the inode. It could be a fresh inode
              * too. In any case increment forget_expected as we are now letting
@@ -2320,14 +2654,79 @@ public:
 class rpc_task_helper
 {
 private:
-    // Mutex for synchronizing access to free_task_index stack.
-    std::shared_mutex task_index_lock_41;
+    /*
+     * Free rpc_task indices are kept in a lock-free stack (Treiber stack).
+     * free_head packs the index of the top free rpc_task in the low 32 bits
+     * and a tag in the high 32 bits. The tag is incremented on every push
+     * and pop, so that a pop that read a stale top (which was popped and
+     * pushed back by other threads in the meantime) fails the CAS instead
+     * of corrupting the stack (ABA problem).
+     * next_free[i] is the index of the free rpc_task below rpc_task i in the
+     * stack, valid only while rpc_task i is free.
+     * FREE_INDEX_NONE marks the end of the stack.
+     */
+    static constexpr uint32_t FREE_INDEX_NONE = UINT32_MAX;
+    std::atomic<uint64_t> free_head = FREE_INDEX_NONE;
+    std::atomic<uint32_t> next_free[MAX_OUTSTANDING_RPC_TASKS];
 
-    // Stack containing index into the rpc_task_list vector.
-    std::stack<int> free_task_index;
+    /*
+     * Number of free rpc_tasks. This is what callers reserve (decrement)
+     * before popping an index, so it also implements the reserved pool
+     * semantics w/o taking any lock. An index is pushed before free_count
+     * is incremented, so a caller that reserved a count is guaranteed to
+     * find an index to pop.
+     */
+    std::atomic<int> free_count = 0;
+
+    /*
+     * rpc_tasks are allocated lazily, RPC_TASK_SLAB_SIZE at a time, and
+     * num_tasks is the number of rpc_tasks currently allocated. rpc_tasks
+     * [0, num_tasks) are allocated, and we never allocate more than
+     * max_tasks. Growing and shrinking the pool is done with
+     * task_index_lock_41 held.
+     * num_tasks_hwm is the highest num_tasks ever.
+     * outstanding_hwm is the highest number of outstanding rpc_tasks ever,
+     * while window_hwm is the same for the current RPC_TASK_POOL_IDLE_SECS
+     * window, used for deciding how many rpc_tasks we can free.
+     */
+    struct nfs_client *const client;
+    const int max_tasks;
+    std::atomic<int> num_tasks = 0;
+    std::atomic<int> num_tasks_hwm = 0;
+    std::atomic<int> outstanding_hwm = 0;
+    std::atomic<int> window_hwm = 0;
+    uint64_t last_shrink_check_usecs = 0;
+
+    /*
+     * Callers find the pool exhausted only in the rare case when we have
+     * max_tasks (minus reserved) outstanding, or when their priority class
+     * is at its cap, only then we take task_index_lock_41 and wait on the
+     * cv for their class. num_waiters tells release_free_index() if it needs
+     * to wake up anyone.
+     * prio_waiters, prio_reserved_waiters and prio_credits are protected by
+     * task_index_lock_41. prio_reserved_waiters are the waiters that can
+     * use the reserved pool, they are not subject to their class cap.
+     * prio_credits are the wakeups left for each class in the current
+     * weighted round, see wakeup_waiter().
+     */
+    std::mutex task_index_lock_41;
+    std::condition_variable prio_cv[RPC_PRIO_MAX];
+    std::atomic<int> num_waiters = 0;
+    int prio_waiters[RPC_PRIO_MAX] = {};
+    int prio_reserved_waiters[RPC_PRIO_MAX] = {};
+    int prio_credits[RPC_PRIO_MAX] = RPC_PRIO_WEIGHTS;
+
+    /*
+     * Outstanding rpc_tasks for each priority class, and the max allowed.
+     */
+    std::atomic<int> prio_outstanding[RPC_PRIO_MAX] = {};
+    int prio_limit[RPC_PRIO_MAX];
 
 #ifdef ENABLE_PARANOID
-    // Set for catching double free.
+    /*
+     * Set for catching double free.
+     * This is protected by task_index_lock_41.
+     */
     std::set<int> free_task_index_set;
 #endif
 
@@ -2337,35 +2736,346 @@ private:
      * restrictions on the members of rpc_task. With rpc_task being the
      * element type, it needs to be move constructible, so we cannot have
      * atomic members f.e.
-     * Anyway these rpc_task once allocated live for the life of the program.
+     * This has MAX_OUTSTANDING_RPC_TASKS entries from the start so that it's
+     * never resized, entries are null for rpc_tasks not allocated.
+     * An rpc_task once allocated lives till the pool is shrunk, and it's
+     * only freed while it's not in use.
      */
     std::vector<struct rpc_task*> rpc_task_list;
 
-    // Condition variable to wait for free task index availability.
-    std::condition_variable_any cv;
-
     // This is a singleton class, hence make the constructor private.
-    rpc_task_helper(struct nfs_client *client)
+    rpc_task_helper(struct nfs_client *_client) :
+        client(_client),
+        max_tasks(aznfsc_cfg.max_rpc_tasks > 0 ?
+                  aznfsc_cfg.max_rpc_tasks : AZNFSCFG_MAX_RPC_TASKS_DEF),
+        rpc_task_list(MAX_OUTSTANDING_RPC_TASKS, nullptr)
     {
         assert(client != nullptr);
+        assert(max_tasks >= RPC_TASK_MIN_TASKS);
+        assert(max_tasks <= MAX_OUTSTANDING_RPC_TASKS);
+        assert(max_tasks % RPC_TASK_SLAB_SIZE == 0);
+
+        static const int cap_div[RPC_PRIO_MAX] = RPC_PRIO_CAP_DIV;
+        for (int i = 0; i < RPC_PRIO_MAX; i++) {
+            prio_limit[i] = max_tasks / cap_div[i];
+        }
 
         // There should be no elements in the stack.
-        assert(free_task_index.empty());
+        assert(free_count == 0);
+
+        // Start with the minimum, grow on demand.
+        while (num_tasks < RPC_TASK_MIN_TASKS) {
+            grow_pool(RPC_TASK_MIN_TASKS);
+        }
+
+        assert(free_count == RPC_TASK_MIN_TASKS);
+        last_shrink_check_usecs = get_current_usecs();
+    }
+
+    /**
+     * Allocate one more slab of rpc_tasks, if we are not already at
+     * max_tasks. Returns true if the caller should retry, i.e., either we
+     * grew the pool or there are more than spare_count free rpc_tasks now.
+     */
+    bool grow_pool(int spare_count)
+    {
+        std::unique_lock<std::mutex> lock(task_index_lock_41);
 
-        // Initialize the index stack.
-        for (int i = 0; i < MAX_OUTSTANDING_RPC_TASKS; i++) {
-            free_task_index.push(i);
+        // Someone freed or grew while we were waiting for the lock.
+        if (free_count > spare_count) {
+            return true;
+        }
+
+        const int cur_tasks = num_tasks;
+        if (cur_tasks >= max_tasks) {
+            return false;
+        }
+
+        const int new_tasks = std::min(cur_tasks + RPC_TASK_SLAB_SIZE,
+                                       max_tasks);
+
+        for (int i = cur_tasks; i < new_tasks; i++) {
+            assert(rpc_task_list[i] == nullptr);
+            rpc_task_list[i] = new rpc_task(client, i);
 
 #ifdef ENABLE_PARANOID
             const auto p = free_task_index_set.insert(i);
             assert(p.second);
-            assert(free_task_index_set.size() == free_task_index.size());
 #endif
-            rpc_task_list.emplace_back(new rpc_task(client, i));
+            push_free_index(i);
+        }
+
+        num_tasks = new_tasks;
+        if (new_tasks > num_tasks_hwm) {
+            num_tasks_hwm = new_tasks;
+        }
+        free_count += (new_tasks - cur_tasks);
+
+        AZLogDebug("rpc_task pool grown {} -> {}", cur_tasks, new_tasks);
+
+        if (num_waiters > 0) {
+            wakeup_all();
+        }
+
+        return true;
+    }
+
+    /**
+     * Free rpc_tasks in excess of target_tasks, a slab at a time, starting
+     * from the last slab. A slab can be freed only if all its rpc_tasks are
+     * free. This briefly takes all the free rpc_tasks out of the free stack,
+     * so it must only be called when the pool is mostly idle.
+     */
+    void shrink_pool(int target_tasks)
+    {
+        std::unique_lock<std::mutex> lock(task_index_lock_41);
+
+        assert(target_tasks >= RPC_TASK_MIN_TASKS);
+        assert(target_tasks % RPC_TASK_SLAB_SIZE == 0);
+
+        const int cur_tasks = num_tasks;
+        if (cur_tasks <= target_tasks) {
+            return;
+        }
+
+        // Take out all free rpc_tasks.
+        int nfree = free_count.load();
+        while (!free_count.compare_exchange_weak(nfree, 0))
+            ;
+
+        std::vector<int> free_idx;
+        std::vector<bool> is_free(cur_tasks, false);
+        free_idx.reserve(nfree);
+        for (int i = 0; i < nfree; i++) {
+            const int idx = pop_free_index();
+            assert(idx < cur_tasks);
+            free_idx.push_back(idx);
+            is_free[idx] = true;
+        }
+
+        int new_tasks = cur_tasks;
+        while (new_tasks > target_tasks) {
+            bool slab_free = true;
+            for (int i = new_tasks - RPC_TASK_SLAB_SIZE; i < new_tasks; i++) {
+                if (!is_free[i]) {
+                    slab_free = false;
+                    break;
+                }
+            }
+
+            if (!slab_free) {
+                break;
+            }
+            new_tasks -= RPC_TASK_SLAB_SIZE;
+        }
+
+        // Free the rpc_tasks beyond new_tasks and put back the rest.
+        int npushed = 0;
+        for (const int idx : free_idx) {
+            if (idx >= new_tasks) {
+#ifdef ENABLE_PARANOID
+                const size_t cnt = free_task_index_set.erase(idx);
+                assert(cnt == 1);
+#endif
+                assert(rpc_task_list[idx]->index == idx);
+                delete rpc_task_list[idx]->rpc_api;
+                delete rpc_task_list[idx];
+                rpc_task_list[idx] = nullptr;
+            } else {
+                push_free_index(idx);
+                npushed++;
+            }
+        }
+
+        num_tasks = new_tasks;
+        free_count += npushed;
+
+        if (new_tasks != cur_tasks) {
+            AZLogInfo("rpc_task pool shrunk {} -> {}", cur_tasks, new_tasks);
+        }
+
+        if (num_waiters > 0) {
+            wakeup_all();
+        }
+    }
+
+    /**
+     * Can a caller of class prio get an rpc_task now, if one is free?
+     */
+    bool prio_can_alloc(rpc_prio_t prio) const
+    {
+        return prio_outstanding[prio] < prio_limit[prio];
+    }
+
+    /**
+     * Account a new rpc_task against class prio, if the class cap allows.
+     * The cap check and the increment are done atomically, so that racing
+     * callers cannot together overshoot the cap. use_reserved callers are
+     * not subject to the cap.
+     * Returns false if the class is at its cap.
+     */
+    bool prio_get(rpc_prio_t prio, bool use_reserved)
+    {
+        if (use_reserved) {
+            prio_outstanding[prio]++;
+            return true;
+        }
+
+        int outstanding = prio_outstanding[prio];
+        while (outstanding < prio_limit[prio]) {
+            if (prio_outstanding[prio].compare_exchange_weak(outstanding,
+                                                             outstanding + 1)) {
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    /**
+     * Undo prio_get().
+     * A waiter may have found the class at its cap due to our prio_get(),
+     * so wake up one if needed.
+     */
+    void prio_put(rpc_prio_t prio)
+    {
+        assert(prio_outstanding[prio] > 0);
+        prio_outstanding[prio]--;
+
+        if (num_waiters > 0) {
+            std::unique_lock<std::mutex> lock(task_index_lock_41);
+            wakeup_waiter();
+        }
+    }
+
+    /**
+     * Wake up one waiter, picking the class in weighted round robin order.
+     * Every class with waiters that can allocate gets upto its weight
+     * wakeups in a round, so lower classes are not starved.
+     * A class at its cap can still have waiters that can allocate, the ones
+     * that can use the reserved pool. We cannot wake up just those, so all
+     * waiters of the class are woken up and the others go back to waiting.
+     * Caller must hold task_index_lock_41.
+     */
+    void wakeup_waiter()
+    {
+        static const int weights[RPC_PRIO_MAX] = RPC_PRIO_WEIGHTS;
+
+        for (int round = 0; round < 2; round++) {
+            for (int i = 0; i < RPC_PRIO_MAX; i++) {
+                if (prio_waiters[i] == 0 || prio_credits[i] == 0) {
+                    continue;
+                }
+
+                if (prio_can_alloc((rpc_prio_t) i)) {
+                    prio_credits[i]--;
+                    prio_cv[i].notify_one();
+                    return;
+                } else if (prio_reserved_waiters[i] > 0) {
+                    prio_credits[i]--;
+                    prio_cv[i].notify_all();
+                    return;
+                }
+            }
+
+            // Round over, start a new one.
+            for (int i = 0; i < RPC_PRIO_MAX; i++) {
+                prio_credits[i] = weights[i];
+            }
+        }
+    }
+
+    /**
+     * Wake up all waiters, used when the pool is resized.
+     * Caller must hold task_index_lock_41.
+     */
+    void wakeup_all()
+    {
+        for (int i = 0; i < RPC_PRIO_MAX; i++) {
+            prio_cv[i].notify_all();
+        }
+    }
+
+    /**
+     * Update the high water marks after allocating an rpc_task.
+     */
+    void update_hwm()
+    {
+        const int outstanding = num_tasks - free_count;
+
+        int hwm = window_hwm.load(std::memory_order_relaxed);
+        while (outstanding > hwm &&
+               !window_hwm.compare_exchange_weak(hwm, outstanding))
+            ;
+
+        hwm = outstanding_hwm.load(std::memory_order_relaxed);
+        while (outstanding > hwm &&
+               !outstanding_hwm.compare_exchange_weak(hwm, outstanding))
+            ;
+    }
+
+    /**
+     * Push index on the free stack.
+     */
+    void push_free_index(int index)
+    {
+        uint64_t head = free_head.load(std::memory_order_relaxed);
+        uint64_t new_head;
+
+        do {
+            next_free[index].store((uint32_t) head,
+                                   std::memory_order_relaxed);
+            new_head = (((head >> 32) + 1) << 32) | (uint32_t) index;
+        } while (!free_head.compare_exchange_weak(head, new_head,
+                                                  std::memory_order_release,
+                                                  std::memory_order_relaxed));
+    }
+
+    /**
+     * Pop an index from the free stack.
+     * Caller must have reserved it by decrementing free_count.
+     */
+    int pop_free_index()
+    {
+        uint64_t head = free_head.load(std::memory_order_acquire);
+        uint64_t new_head;
+
+        do {
+            const uint32_t index = (uint32_t) head;
+
+            // Caller reserved an index so stack cannot be empty.
+            assert(index != FREE_INDEX_NONE);
+            assert(index < MAX_OUTSTANDING_RPC_TASKS);
+
+            /*
+             * If head changed after we read it, next_free[index] may not be
+             * valid, but then the tag will not match and the CAS will fail.
+             */
+            const uint32_t next =
+                next_free[index].load(std::memory_order_relaxed);
+            new_head = (((head >> 32) + 1) << 32) | next;
+        } while (!free_head.compare_exchange_weak(head, new_head,
+                                                  std::memory_order_acquire,
+                                                  std::memory_order_acquire));
+
+        return (int) (uint32_t) head;
+    }
+
+    /**
+     * Try to reserve one free rpc_task, leaving at least spare_count free
+     * rpc_tasks in the pool. Returns false if it cannot.
+     */
+    bool try_reserve_free_index(int spare_count)
+    {
+        int cnt = free_count.load();
+
+        while (cnt > spare_count) {
+            if (free_count.compare_exchange_weak(cnt, cnt - 1)) {
+                return true;
+            }
         }
 
-        // There should be MAX_OUTSTANDING_RPC_TASKS index available.
-        assert(free_task_index.size() == MAX_OUTSTANDING_RPC_TASKS);
+        return false;
     }
 
 public:
@@ -2374,19 +3084,15 @@ public:
         AZLogInfo("~rpc_task_helper() called");
 
 #ifdef ENABLE_PARANOID
-        assert(free_task_index_set.size() == free_task_index.size());
+        assert(free_task_index_set.size() == (size_t) free_count);
 #endif
 
         /*
          * We should be called when there are no outstanding tasks.
          */
-        assert(free_task_index.size() == MAX_OUTSTANDING_RPC_TASKS);
+        assert(free_count == num_tasks);
 
-        while (!free_task_index.empty()) {
-            free_task_index.pop();
-        }
-
-        for (int i = 0; i < MAX_OUTSTANDING_RPC_TASKS; i++) {
+        for (int i = 0; i < num_tasks; i++) {
             assert(rpc_task_list[i]);
             delete rpc_task_list[i]->rpc_api;
             delete rpc_task_list[i];
@@ -2394,24 +3100,98 @@ public:
         rpc_task_list.clear();
     }
 
+    /**
+     * Called periodically, this frees rpc_tasks that were not needed in the
+     * last RPC_TASK_POOL_IDLE_SECS. We keep enough for the peak usage in
+     * that period plus the reserved tasks and one slab of headroom.
+     */
+    void maybe_shrink()
+    {
+        const uint64_t now_usecs = get_current_usecs();
+
+        if ((now_usecs - last_shrink_check_usecs) <
+            (RPC_TASK_POOL_IDLE_SECS * 1000000ULL)) {
+            return;
+        }
+        last_shrink_check_usecs = now_usecs;
+
+        // Start the next window with the current outstanding count.
+        const int peak = window_hwm.exchange(num_tasks - free_count);
+        int target_tasks = peak + RPC_TASK_RESERVED + RPC_TASK_SLAB_SIZE;
+        target_tasks = ((target_tasks + RPC_TASK_SLAB_SIZE - 1) /
+                        RPC_TASK_SLAB_SIZE) * RPC_TASK_SLAB_SIZE;
+        target_tasks = std::max(target_tasks, RPC_TASK_MIN_TASKS);
+
+        if (target_tasks < num_tasks) {
+            shrink_pool(target_tasks);
+        }
+    }
+
+    int get_num_tasks() const
+    {
+        return num_tasks;
+    }
+
+    int get_num_tasks_hwm() const
+    {
+        return num_tasks_hwm;
+    }
+
+    int get_outstanding() const
+    {
+        return num_tasks - free_count;
+    }
+
+    int get_outstanding_hwm() const
+    {
+        return outstanding_hwm;
+    }
+
     static rpc_task_helper *get_instance(struct nfs_client *client = nullptr)
     {
         static rpc_task_helper helper(client);
         return &helper;
     }
 
+    /**
+     * Default priority class for rpc_tasks of the given type.
+     */
+    static rpc_prio_t default_prio(fuse_opcode optype)
+    {
+        switch (optype) {
+            case FUSE_READ:
+            case FUSE_WRITE:
+            case FUSE_FLUSH:
+                return RPC_PRIO_FG;
+            default:
+                return RPC_PRIO_META;
+        }
+    }
+
     /**
      * This returns a free rpc task instance from the pool of rpc tasks.
-     * This call will block till a free rpc task is available.
+     * This call will block till a free rpc task is available for the given
+     * priority class.
      *
-     * Also see alloc_rpc_task_reserved().
+     * Also see alloc_rpc_task_reserved() and try_alloc_rpc_task().
      */
     struct rpc_task *alloc_rpc_task(fuse_opcode optype,
-                                    bool use_reserved = false)
+                                    rpc_prio_t prio = RPC_PRIO_DEFAULT,
+                                    bool use_reserved = false,
+                                    bool nowait = false)
     {
+        if (prio == RPC_PRIO_DEFAULT) {
+            prio = default_prio(optype);
+        }
+        assert(prio >= RPC_PRIO_META && prio < RPC_PRIO_MAX);
+
         // get_free_idx() can block, collect start time before that.
         const uint64_t start_usec = get_current_usecs();
-        const int free_index = get_free_idx(use_reserved);
+        const int free_index = get_free_idx(prio, use_reserved, nowait);
+        if (free_index == -1) {
+            assert(nowait);
+            return nullptr;
+        }
         struct rpc_task *task = rpc_task_list[free_index];
 
         assert(task->magic == RPC_TASK_MAGIC);
@@ -2431,6 +3211,7 @@ public:
         }
 
         task->set_op_type(optype);
+        task->prio = prio;
         task->stats.on_rpc_create(optype, start_usec);
 
         // No task starts as a child task.
@@ -2445,7 +3226,7 @@ public:
          * used. Later init_*() method can set it to a more appropriate value.
          */
         task->csched = (task->client->mnt_options.nfs_port == 2047) ?
-                        CONN_SCHED_RR : CONN_SCHED_FH_HASH;
+                        CONN_SCHED_LEAST_LOADED : CONN_SCHED_FH_HASH;
 
         return task;
     }
@@ -2456,77 +3237,148 @@ public:
      * if the regular pool of rpc_task is exhausted.
      * Note that it's important to not block libnfs threads as they help
      * complete RPC requests and thus free up rpc_task structures.
+     * For the same reason these are not held to the priority class caps,
+     * but they are still accounted against their class.
      */
-    struct rpc_task *alloc_rpc_task_reserved(fuse_opcode optype)
+    struct rpc_task *alloc_rpc_task_reserved(fuse_opcode optype,
+                                             rpc_prio_t prio = RPC_PRIO_DEFAULT)
     {
-        return alloc_rpc_task(optype, true /* use_reserved */);
+        return alloc_rpc_task(optype, prio, true /* use_reserved */);
     }
 
-    int get_free_idx(bool use_reserved = false)
+    /**
+     * Non-blocking variant of alloc_rpc_task(), for optional work like
+     * readahead and prefetch, which is better skipped than waited for.
+     * Returns nullptr if no rpc_task can be allocated for the given priority
+     * class right now. This never eats into the reserved pool, so it's also
+     * safe to use from libnfs callbacks.
+     */
+    struct rpc_task *try_alloc_rpc_task(fuse_opcode optype,
+                                        rpc_prio_t prio = RPC_PRIO_DEFAULT)
+    {
+        return alloc_rpc_task(optype, prio, false /* use_reserved */,
+                              true /* nowait */);
+    }
+
+    /**
+     * Returns the index of a free rpc_task, waiting for one if needed.
+     * If nowait is true it returns -1 instead of waiting.
+     */
+    int get_free_idx(rpc_prio_t prio, bool use_reserved = false,
+                     bool nowait = false)
     {
         /*
          * If caller is special allow them to eat into the reserved pool
          * of tasks. We should keep as many tasks in the reserved pool as
          * there are libnfs threads, so that in the worst case if every libnfs
          * callback allocates a task they don't have to block.
-         * Don't allow more than 25% of total tasks as reserved tasks.
          */
-        static const size_t RESERVED_TASKS = 1000;
-        static_assert(RESERVED_TASKS < MAX_OUTSTANDING_RPC_TASKS / 4);
-        const size_t spare_count = use_reserved ? 0 : RESERVED_TASKS;
+        const int spare_count = use_reserved ? 0 : RPC_TASK_RESERVED;
 
-        std::unique_lock<std::shared_mutex> lock(task_index_lock_41);
+        /*
+         * Fast path, lock-free.
+         * If we have run out of free rpc_tasks, grow the pool, and if it's
+         * already at max_tasks, wait for some ongoing RPC to complete and
+         * free its rpc_task.
+         */
+        while (true) {
+            if (prio_get(prio, use_reserved)) {
+                if (try_reserve_free_index(spare_count)) {
+                    break;
+                }
 
-        // Wait until a free rpc task is available.
-        while (free_task_index.size() <= spare_count) {
-#ifdef ENABLE_PARANOID
-            assert(free_task_index_set.size() == free_task_index.size());
-#endif
-            if (!cv.wait_for(lock, std::chrono::seconds(30),
-                             [this, spare_count] {
-                                return free_task_index.size() > spare_count;
+                prio_put(prio);
+
+                if (grow_pool(spare_count)) {
+                    continue;
+                }
+            }
+
+            if (nowait) {
+                return -1;
+            }
+
+            std::unique_lock<std::mutex> lock(task_index_lock_41);
+
+            /*
+             * Must be incremented before we check free_count (again), see
+             * release_free_index().
+             */
+            num_waiters++;
+            prio_waiters[prio]++;
+            if (use_reserved) {
+                prio_reserved_waiters[prio]++;
+            }
+            if (!prio_cv[prio].wait_for(lock, std::chrono::seconds(30),
+                             [this, spare_count, prio, use_reserved] {
+                                return (use_reserved ||
+                                        prio_can_alloc(prio)) &&
+                                       ((free_count > spare_count) ||
+                                        (num_tasks < max_tasks));
                              })) {
                 AZLogError("Timed out waiting for free rpc_task ({}), "
-                           "re-trying!", free_task_index.size());
+                           "prio {} outstanding {}, re-trying!",
+                           free_count.load(), (int) prio,
+                           prio_outstanding[prio].load());
             }
+            if (use_reserved) {
+                prio_reserved_waiters[prio]--;
+            }
+            prio_waiters[prio]--;
+            num_waiters--;
         }
 
-        const int free_index = free_task_index.top();
-        free_task_index.pop();
+        // prio_get() has accounted us against prio.
+        update_hwm();
+
+        const int free_index = pop_free_index();
 
 #ifdef ENABLE_PARANOID
-        // Must also be free as per free_task_index_set.
-        const size_t cnt = free_task_index_set.erase(free_index);
-        assert(cnt == 1);
-        assert(free_task_index_set.size() == free_task_index.size());
+        {
+            std::unique_lock<std::mutex> lock(task_index_lock_41);
+            // Must also be free as per free_task_index_set.
+            const size_t cnt = free_task_index_set.erase(free_index);
+            assert(cnt == 1);
+        }
 #endif
 
         // Must be a valid index.
-        assert(free_index >= 0 && free_index < MAX_OUTSTANDING_RPC_TASKS);
+        assert(free_index >= 0 && free_index < num_tasks);
 
         return free_index;
     }
 
-    void release_free_index(int index)
+    void release_free_index(int index, rpc_prio_t prio)
     {
         // Must be a valid index.
-        assert(index >= 0 && index < MAX_OUTSTANDING_RPC_TASKS);
-
-        {
-            std::unique_lock<std::shared_mutex> lock(task_index_lock_41);
+        assert(index >= 0 && index < num_tasks);
 
 #ifdef ENABLE_PARANOID
-            assert(free_task_index_set.size() == free_task_index.size());
+        {
+            std::unique_lock<std::mutex> lock(task_index_lock_41);
             // Must not already be free.
             const auto p = free_task_index_set.insert(index);
             assert(p.second);
+        }
 #endif
 
-            free_task_index.push(index);
-        }
+        assert(prio_outstanding[prio] > 0);
+        prio_outstanding[prio]--;
+
+        push_free_index(index);
+        free_count++;
 
-        // Notify any waiters blocked in alloc_rpc_task().
-        cv.notify_one();
+        /*
+         * Notify any waiters blocked in alloc_rpc_task().
+         * A waiter increments num_waiters before checking free_count, so
+         * either it sees the above increment or we see it waiting. Taking
+         * the lock ensures it's not between checking free_count and waiting
+         * on its cv.
+         */
+        if (num_waiters > 0) {
+            std::unique_lock<std::mutex> lock(task_index_lock_41);
+            wakeup_waiter();
+        }
     }
 
     void free_rpc_task(struct rpc_task *task)
@@ -2534,7 +3386,7 @@ public:
         assert(task->magic == RPC_TASK_MAGIC);
         task->is_async_task = false;
 
-        release_free_index(task->get_index());
+        release_free_index(task->get_index(), task->get_prio());
     }
 };
 
@@ -2557,16 +3409,24 @@ struct jukebox_seedinfo
      */
     api_task_info *rpc_api;
 
+    /*
+     * Priority class of the failed rpc_task, the retried task is allocated
+     * with the same priority.
+     */
+    rpc_prio_t prio;
+
     /*
      * When to rerun the task.
      */
     int64_t run_at_msecs;
 
-    jukebox_seedinfo(api_task_info *_rpc_api) :
+    jukebox_seedinfo(api_task_info *_rpc_api, rpc_prio_t _prio) :
         rpc_api(_rpc_api),
+        prio(_prio),
         run_at_msecs(get_current_msecs() + JUKEBOX_DELAY_SECS*1000)
     {
         assert(rpc_api != nullptr);
+        assert(prio >= RPC_PRIO_META && prio < RPC_PRIO_MAX);
     }
 };
 
@@ -1,6 +1,10 @@
 #ifndef __RPC_TRANSPORT_H__
 #define __RPC_TRANSPORT_H__
 
+#include <thread>
+#include <atomic>
+#include <memory>
+
 #include "aznfsc.h"
 #include "connection.h"
 
@@ -29,6 +33,24 @@ typedef enum
      * will use different connections.
      */
     CONN_SCHED_FH_HASH  = 3,
+
+    /*
+     * Send over the least loaded connection, i.e., the one with the lowest
+     * expected wait, going by the number of outstanding RPCs and the recent
+     * RTT seen on that connection. See nfs_connection::get_load().
+     * A slow or stalled connection thus gets less (or no) new requests.
+     * Use this for requests that don't need any connection affinity.
+     */
+    CONN_SCHED_LEAST_LOADED = 4,
+
+    /*
+     * Prefer connections whose service thread runs on the requester's cpu,
+     * then ones on the requester's NUMA node, and pick the least loaded
+     * among those, so that the response data is processed on a cpu that
+     * shares cache with the consumer. Same as CONN_SCHED_LEAST_LOADED if
+     * service threads are not pinned (see aznfsc_cfg.service_thread_cpus).
+     */
+    CONN_SCHED_CPU_LOCAL = 5,
 } conn_sched_t;
 
 /*
@@ -56,10 +78,122 @@ private:
     /*
      * All connections that make the transport.
      * It'll have as many connections as the nconnect config/mount option.
-     *
-     * TODO: Check if we need a lock over this vector.
+     * An entry can be null if we failed to create that connection, when
+     * running in degraded mode (see nconnect_min). The health monitor
+     * thread keeps trying to create those, and it also replaces connections
+     * that stay unhealthy.
+     * The vector itself is never resized after construction, only the
+     * entries change. The health monitor publishes a new connection with an
+     * atomic store, and RPC issuers load an entry once and use that
+     * connection. A replaced connection is put on retired_connections and
+     * destroyed only once it has no outstanding RPCs and
+     * CONN_RETIRE_GRACE_SECS have passed since it was replaced, which is
+     * the grace period for issuers that loaded the old pointer right
+     * before it was replaced, to account their RPC against it. RPCs that
+     * may need the connection later (f.e. sync RPCs that may cancel their
+     * pdu) must stay accounted against it till then, see
+     * rpc_task::get_rpc_ctx().
+     */
+    std::vector<std::atomic<struct nfs_connection*>> nfs_connections;
+
+    /*
+     * Number of connections RPCs are scheduled over, nfs_connections[0] to
+     * nfs_connections[nconn_active-1]. This is nconnect, unless dynamic
+     * nconnect is enabled, in which case this varies b/w nconnect_min and
+     * nconnect with the load, see scale_connections().
+     */
+    std::atomic<uint32_t> nconn_active;
+
+    /*
+     * Consecutive seconds the load was above the scale up threshold or below
+     * the scale down threshold. Only accessed by the health monitor thread.
+     */
+    int scale_up_secs = 0;
+    int scale_down_secs = 0;
+
+    /*
+     * Connections replaced or scaled down by the health monitor, with the
+     * time (usecs) they were last seen with RPCs outstanding (or retired).
+     * They may still have RPCs outstanding, and files pinned to them (see
+     * conn_pin) can still issue new ones, so they are destroyed only after
+     * they have been idle, and w/o pins, for CONN_RETIRE_GRACE_SECS. Only
+     * accessed by the health monitor thread and close().
+     */
+    std::vector<std::pair<struct nfs_connection*, uint64_t>> retired_connections;
+
+    /*
+     * Health monitor thread, see health_monitor().
+     */
+    std::thread health_thread;
+    std::atomic<bool> stop_health_thread = false;
+
+    /*
+     * Keep files on their connection across connection changes, till
+     * their outstanding RPCs drain (bounded, see conn_pin).
+     */
+    std::unique_ptr<conn_pin[]> conn_pins;
+
+    /*
+     * Uncorks connections corked for RPC batching after rpc_batch_usecs,
+     * see batch_flusher(). Only started if rpc_batch_usecs is non-zero.
+     * Also stopped by stop_health_thread.
+     */
+    std::thread batch_thread;
+
+    /*
+     * Health monitor thread function. It calls check_connections() every
+     * CONN_HEALTH_CHECK_SECS and scale_connections() every second, if
+     * dynamic nconnect is enabled.
+     */
+    void health_monitor();
+
+    /*
+     * Check the health of all active connections, create missing connections
+     * and replace ones that stay unhealthy. Also destroys retired connections
+     * once they have drained.
+     */
+    void check_connections();
+
+    /*
+     * Add a connection if the average number of outstanding RPCs per active
+     * connection stays above CONN_SCALE_UP_QDEPTH for CONN_SCALE_UP_SECS, and
+     * retire the last connection if it stays below CONN_SCALE_DOWN_QDEPTH
+     * for CONN_SCALE_DOWN_SECS.
+     */
+    void scale_connections();
+
+    /*
+     * Unpin all conn_pin buckets pinned to conn, see conn_pin::release().
+     */
+    void release_pins(struct nfs_connection *conn);
+
+    /*
+     * Batch flusher thread function.
+     */
+    void batch_flusher();
+
+    static uint32_t jump_hash(uint64_t key, uint32_t num_buckets);
+
+    /*
+     * NUMA node of every cpu, used by CONN_SCHED_CPU_LOCAL.
+     * Only populated if service threads are pinned.
      */
-    std::vector<struct nfs_connection*> nfs_connections;
+    std::vector<int> cpu_to_node;
+
+    /*
+     * Pick the connection for CONN_SCHED_CPU_LOCAL, nullptr if none of the
+     * usable connections is local to the calling thread's cpu/node or the
+     * local ones are much more loaded than the least loaded connection.
+     */
+    struct nfs_connection *get_local_connection(uint32_t nconn) const;
+
+    /*
+     * Can new RPCs be sent over this connection?
+     */
+    static bool is_usable(const struct nfs_connection *conn)
+    {
+        return (conn != nullptr) && conn->is_healthy();
+    }
 
     /*
      * Last context on which the request was sent.
@@ -67,20 +201,27 @@ private:
      * Note: We initialize it to UINT32_MAX-1 to force wraparound and catch
      *       if it's not properly handled.
      *
-     * Note: Note that this is updated by multiple threads w/o any lock, and
-     *       hence TSAN complains, but we are ok with occassional inaccuracy,
-     *       in favour of performance.
-     *       Following TSAN suppression suppresses it:
-     *       - race:rpc_transport::last_context
+     * Note: This is updated by multiple threads w/o any lock. We only need
+     *       each caller to get a distinct value, so relaxed fetch_add() is
+     *       enough and it costs no more than the plain increment.
      */
-    mutable uint32_t last_context = UINT32_MAX - 2;
+    mutable std::atomic<uint32_t> last_context = UINT32_MAX - 2;
 
 public:
     rpc_transport(struct nfs_client* _client):
         client(_client),
-        nfs_connections(aznfsc_cfg.nconnect, nullptr)
+        nfs_connections(aznfsc_cfg.nconnect),
+        nconn_active(aznfsc_cfg.nconnect),
+        conn_pins(new conn_pin[CONN_PIN_BUCKETS])
     {
         assert(client != nullptr);
+
+        if (!aznfsc_cfg.service_thread_cpu_list.empty()) {
+            const int ncpus = ::sysconf(_SC_NPROCESSORS_CONF);
+            for (int i = 0; i < ncpus; i++) {
+                cpu_to_node.push_back(get_numa_node_of_cpu(i));
+            }
+        }
     }
 
     /*
@@ -90,8 +231,9 @@ public:
      * nconnect option and call open for each of them.
      * It opens 'x' connections to the server and adds the nfs_connection to
      * the nfs_connections vector.
-     * If we are unable to create any connection, then the method will return
-     * false.
+     * If we are unable to create at least nconnect_min connections, then the
+     * method will return false, else the transport runs in degraded mode till
+     * the remaining connections are created in the background.
      *
      * TODO: See if we want to open connections only when needed.
      */
@@ -121,9 +263,30 @@ public:
     struct nfs_context *get_nfs_context(conn_sched_t csched = CONN_SCHED_FIRST,
                                         uint32_t fh_hash = 0) const;
 
-    const std::vector<struct nfs_connection*>& get_all_connections() const
+    /*
+     * Same as get_nfs_context() but returns the nfs_connection, for callers
+     * who want to account the RPC against the connection.
+     * If pin is not null and csched is CONN_SCHED_FH_HASH, the file is
+     * pinned to the returned connection and *pin is set to the conn_pin,
+     * which the caller must put() once the RPC completes. Other callers get
+     * null in *pin.
+     */
+    struct nfs_connection *get_connection(conn_sched_t csched = CONN_SCHED_FIRST,
+                                          uint32_t fh_hash = 0,
+                                          struct conn_pin **pin = nullptr) const;
+
+    /*
+     * Snapshot of all the connection slots, entries can be null.
+     */
+    std::vector<struct nfs_connection*> get_all_connections() const
+    {
+        return std::vector<struct nfs_connection*>(nfs_connections.begin(),
+                                                   nfs_connections.end());
+    }
+
+    uint32_t get_num_active_connections() const
     {
-        return nfs_connections;
+        return nconn_active;
     }
 };
 
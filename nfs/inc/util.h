@@ -10,6 +10,7 @@
 #include <zlib.h>
 
 #include <string>
+#include <vector>
 #include <regex>
 #include <chrono>
 #include <random>
@@ -97,6 +98,31 @@ bool is_valid_cachedir(const std::string& cachedir)
     return true;
 }
 
+/**
+ * Parse a cpu list in the Linux cpu list format, f.e., "0-3,8,10-11", as
+ * used in /sys/devices/system/node/node<N>/cpulist, into cpus.
+ * Returns false if str is not a valid cpu list.
+ */
+bool parse_cpu_list(const std::string& str, std::vector<int>& cpus);
+
+/**
+ * Get the cpus of NUMA node node.
+ * Returns false if there's no such node.
+ */
+bool get_numa_node_cpus(int node, std::vector<int>& cpus);
+
+/**
+ * Return the NUMA node of cpu, -1 if it cannot be found.
+ */
+int get_numa_node_of_cpu(int cpu);
+
+static inline
+bool is_valid_service_thread_cpus(const std::string& service_thread_cpus)
+{
+    std::vector<int> cpus;
+    return parse_cpu_list(service_thread_cpus, cpus);
+}
+
 static inline
 bool is_valid_lookupcache(const std::string& lookupcache)
 {
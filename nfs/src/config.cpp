@@ -110,6 +110,8 @@ do { \
         }
 
         _CHECK_INT(nconnect, AZNFSCFG_NCONNECT_MIN, AZNFSCFG_NCONNECT_MAX);
+        _CHECK_INT(nconnect_min, AZNFSCFG_NCONNECT_MIN, AZNFSCFG_NCONNECT_MAX);
+        _CHECK_BOOL(nconnect_dynamic);
         _CHECK_INT(timeo, AZNFSCFG_TIMEO_MIN, AZNFSCFG_TIMEO_MAX);
         _CHECK_INT(acregmin, AZNFSCFG_ACTIMEO_MIN, AZNFSCFG_ACTIMEO_MAX);
         _CHECK_INT(acregmax, AZNFSCFG_ACTIMEO_MIN, AZNFSCFG_ACTIMEO_MAX);
@@ -131,16 +133,37 @@ do { \
 
         _CHECK_INT(retrans, AZNFSCFG_RETRANS_MIN, AZNFSCFG_RETRANS_MAX);
         _CHECK_INT(readdir_maxcount, AZNFSCFG_READDIR_MIN, AZNFSCFG_READDIR_MAX);
+        _CHECK_INTZ(readdir_prefetch, AZNFSCFG_READDIR_PREFETCH_MIN, AZNFSCFG_READDIR_PREFETCH_MAX);
         /*
          * Allow special value of 0 to disable readahead.
          * Mostly useful for testing.
          */
         _CHECK_INTZ(readahead_kb, AZNFSCFG_READAHEAD_KB_MIN, AZNFSCFG_READAHEAD_KB_MAX);
+        /*
+         * 0 disables write gap filling, which is the default.
+         */
+        _CHECK_INTZ(write_gap_fill_kb, AZNFSCFG_WRITE_GAP_FILL_KB_MIN, AZNFSCFG_WRITE_GAP_FILL_KB_MAX);
         _CHECK_INT(fuse_max_background, AZNFSCFG_FUSE_MAX_BG_MIN, AZNFSCFG_FUSE_MAX_BG_MAX);
+        _CHECK_INT(max_rpc_tasks, AZNFSCFG_MAX_RPC_TASKS_MIN, AZNFSCFG_MAX_RPC_TASKS_MAX);
+        _CHECK_STR(service_thread_cpus);
+        _CHECK_INT(service_thread_numa_node,
+                   AZNFSCFG_NUMA_NODE_MIN, AZNFSCFG_NUMA_NODE_MAX);
+        _CHECK_INT(rpc_batch_usecs,
+                   AZNFSCFG_RPC_BATCH_USECS_MIN, AZNFSCFG_RPC_BATCH_USECS_MAX);
+        _CHECK_INT(rpc_batch_qdepth,
+                   AZNFSCFG_RPC_BATCH_QDEPTH_MIN, AZNFSCFG_RPC_BATCH_QDEPTH_MAX);
 
         _CHECK_BOOL(cache.attr.user.enable);
+        _CHECK_BOOL(cache.attr.user.adaptive_actimeo);
+        _CHECK_INTZ(cache.attr.user.bulk_revalidate_threshold,
+                    AZNFSCFG_BULK_REVALIDATE_THRESHOLD_MIN,
+                    AZNFSCFG_BULK_REVALIDATE_THRESHOLD_MAX);
+        _CHECK_INTZ(cache.attr.user.negative_max_per_dir,
+                    AZNFSCFG_NEGATIVE_MAX_PER_DIR_MIN,
+                    AZNFSCFG_NEGATIVE_MAX_PER_DIR_MAX);
         _CHECK_BOOL(cache.readdir.kernel.enable);
         _CHECK_BOOL(cache.readdir.user.enable);
+        _CHECK_BOOL(cache.readdir.user.incremental);
         _CHECK_BOOL(cache.data.kernel.enable);
 
         _CHECK_BOOL(cache.data.user.enable);
@@ -149,6 +172,30 @@ do { \
                        AZNFSCFG_CACHE_MAX_MB_MIN, AZNFSCFG_CACHE_MAX_MB_MAX);
         }
 
+        _CHECK_INTZ(cache.inode.max_count,
+                    AZNFSCFG_INODE_MAX_COUNT_MIN, AZNFSCFG_INODE_MAX_COUNT_MAX);
+
+        _CHECK_BOOL(stream_write.enable);
+        if (stream_write.enable) {
+            _CHECK_INT(stream_write.max_dirty_mb,
+                       AZNFSCFG_STREAM_WRITE_MAX_DIRTY_MB_MIN,
+                       AZNFSCFG_STREAM_WRITE_MAX_DIRTY_MB_MAX);
+        }
+
+        _CHECK_BOOL(loopback_server.enable);
+        if (loopback_server.enable) {
+            _CHECK_INT(loopback_server.port, 2047, 2048);
+            _CHECK_INTZ(loopback_server.latency_usecs,
+                        AZNFSCFG_LOOPBACK_LATENCY_USECS_MIN,
+                        AZNFSCFG_LOOPBACK_LATENCY_USECS_MAX);
+            _CHECK_INTZ(loopback_server.bandwidth_mbps,
+                        AZNFSCFG_LOOPBACK_BANDWIDTH_MBPS_MIN,
+                        AZNFSCFG_LOOPBACK_BANDWIDTH_MBPS_MAX);
+            _CHECK_INTZ(loopback_server.error_pct,
+                        AZNFSCFG_LOOPBACK_ERROR_PCT_MIN,
+                        AZNFSCFG_LOOPBACK_ERROR_PCT_MAX);
+        }
+
         _CHECK_BOOL(filecache.enable);
         if (filecache.enable) {
             _CHECK_STR2(filecache.cachedir, is_valid_cachedir);
@@ -204,6 +251,8 @@ void aznfsc_cfg::set_defaults_and_sanitize()
         port = 2048;
     if (nconnect == -1)
         nconnect = 1;
+    if (nconnect_min == -1 || nconnect_min > nconnect)
+        nconnect_min = nconnect;
     if (rsize == -1)
         rsize = 1048576;
     if (wsize == -1)
@@ -255,12 +304,31 @@ void aznfsc_cfg::set_defaults_and_sanitize()
 
     if (readdir_maxcount == -1)
         readdir_maxcount = 1048576;
+    if (readdir_prefetch == -1)
+        readdir_prefetch = AZNFSCFG_READDIR_PREFETCH_DEF;
     if (readahead_kb == -1)
         readahead_kb = 16384;
+    if (write_gap_fill_kb == -1)
+        write_gap_fill_kb = 0;
+    if (max_rpc_tasks == -1)
+        max_rpc_tasks = AZNFSCFG_MAX_RPC_TASKS_DEF;
+    // rpc_tasks are allocated in slabs of 1024, see RPC_TASK_SLAB_SIZE.
+    max_rpc_tasks = (max_rpc_tasks / 1024) * 1024;
     if (cache.data.user.enable) {
         if (cache.data.user.max_size_mb == -1)
             cache.data.user.max_size_mb = AZNFSCFG_CACHE_MAX_MB_DEF;
     }
+    if (cache.attr.user.bulk_revalidate_threshold == -1)
+        cache.attr.user.bulk_revalidate_threshold = 0;
+    if (cache.attr.user.negative_max_per_dir == -1)
+        cache.attr.user.negative_max_per_dir =
+            AZNFSCFG_NEGATIVE_MAX_PER_DIR_DEF;
+    if (cache.inode.max_count == -1)
+        cache.inode.max_count = 0;
+    if (stream_write.enable) {
+        if (stream_write.max_dirty_mb == -1)
+            stream_write.max_dirty_mb = AZNFSCFG_STREAM_WRITE_MAX_DIRTY_MB_DEF;
+    }
     if (filecache.enable) {
         if (filecache.max_size_gb == -1)
             filecache.max_size_gb = AZNFSCFG_FILECACHE_MAX_GB_DEF;
@@ -301,6 +369,30 @@ void aznfsc_cfg::set_defaults_and_sanitize()
             (int) consistency_standardnfs +
             (int) consistency_azurempa) == 1);
 
+    if (rpc_batch_usecs == -1)
+        rpc_batch_usecs = 0;
+    if (rpc_batch_qdepth == -1)
+        rpc_batch_qdepth = 8;
+
+    if (service_thread_cpus) {
+        if (service_thread_numa_node != -1) {
+            AZLogWarn("Both service_thread_cpus and service_thread_numa_node "
+                      "set, ignoring service_thread_numa_node");
+            service_thread_numa_node = -1;
+        }
+        [[maybe_unused]] const bool ok =
+            parse_cpu_list(service_thread_cpus, service_thread_cpu_list);
+        // Validated by parse_config_yaml().
+        assert(ok);
+    } else if (service_thread_numa_node != -1) {
+        if (!get_numa_node_cpus(service_thread_numa_node,
+                                service_thread_cpu_list)) {
+            AZLogWarn("Cannot get cpus of NUMA node {}, not pinning service "
+                      "threads", service_thread_numa_node);
+            service_thread_numa_node = -1;
+        }
+    }
+
     if (cloud_suffix == nullptr)
         cloud_suffix = ::strdup("blob.core.windows.net");
 
@@ -311,6 +403,23 @@ void aznfsc_cfg::set_defaults_and_sanitize()
     server = std::string(account) + "." + std::string(cloud_suffix);
     export_path = "/" + std::string(account) + "/" + std::string(container);
 
+    /*
+     * Mount from the loopback server instead of Blob NFS.
+     */
+    if (loopback_server.enable) {
+        if (loopback_server.port == -1)
+            loopback_server.port = 2048;
+        if (loopback_server.latency_usecs == -1)
+            loopback_server.latency_usecs = 0;
+        if (loopback_server.bandwidth_mbps == -1)
+            loopback_server.bandwidth_mbps = 0;
+        if (loopback_server.error_pct == -1)
+            loopback_server.error_pct = 0;
+
+        server = "127.0.0.1";
+        port = loopback_server.port;
+    }
+
     // Dump the final config values for debugging.
     AZLogDebug("===== config start =====");
 #ifdef ENABLE_PRESSURE_POINTS
@@ -318,6 +427,8 @@ void aznfsc_cfg::set_defaults_and_sanitize()
 #endif
     AZLogDebug("port = {}", port);
     AZLogDebug("nconnect = {}", nconnect);
+    AZLogDebug("nconnect_min = {}", nconnect_min);
+    AZLogDebug("nconnect_dynamic = {}", nconnect_dynamic);
     AZLogDebug("rsize = {}", rsize);
     AZLogDebug("wsize = {}", wsize);
     AZLogDebug("retrans = {}", retrans);
@@ -330,14 +441,38 @@ void aznfsc_cfg::set_defaults_and_sanitize()
     AZLogDebug("lookupcache = <{}> ({})", lookupcache, lookupcache_int);
     AZLogDebug("consistency = <{}> ({})", consistency, (int) consistency_int);
     AZLogDebug("readdir_maxcount = {}", readdir_maxcount);
+    AZLogDebug("readdir_prefetch = {}", readdir_prefetch);
     AZLogDebug("readahead_kb = {}", readahead_kb);
+    AZLogDebug("write_gap_fill_kb = {}", write_gap_fill_kb);
     AZLogDebug("fuse_max_background = {}", fuse_max_background);
+    AZLogDebug("max_rpc_tasks = {}", max_rpc_tasks);
+    AZLogDebug("service_thread_cpus = {}",
+               service_thread_cpus ? service_thread_cpus : "");
+    AZLogDebug("service_thread_numa_node = {}", service_thread_numa_node);
+    AZLogDebug("rpc_batch_usecs = {}", rpc_batch_usecs);
+    AZLogDebug("rpc_batch_qdepth = {}", rpc_batch_qdepth);
     AZLogDebug("cache.attr.user.enable = {}", cache.attr.user.enable);
+    AZLogDebug("cache.attr.user.adaptive_actimeo = {}",
+               cache.attr.user.adaptive_actimeo);
+    AZLogDebug("cache.attr.user.bulk_revalidate_threshold = {}",
+               cache.attr.user.bulk_revalidate_threshold);
+    AZLogDebug("cache.attr.user.negative_max_per_dir = {}",
+               cache.attr.user.negative_max_per_dir);
     AZLogDebug("cache.readdir.kernel.enable = {}", cache.readdir.kernel.enable);
     AZLogDebug("cache.readdir.user.enable = {}", cache.readdir.user.enable);
+    AZLogDebug("cache.readdir.user.incremental = {}",
+               cache.readdir.user.incremental);
     AZLogDebug("cache.data.kernel.enable = {}", cache.data.kernel.enable);
     AZLogDebug("cache.data.user.enable = {}", cache.data.user.enable);
     AZLogDebug("cache.data.user.max_size_mb = {}", cache.data.user.max_size_mb);
+    AZLogDebug("cache.inode.max_count = {}", cache.inode.max_count);
+    AZLogDebug("stream_write.enable = {}", stream_write.enable);
+    AZLogDebug("stream_write.max_dirty_mb = {}", stream_write.max_dirty_mb);
+    AZLogDebug("loopback_server.enable = {}", loopback_server.enable);
+    AZLogDebug("loopback_server.port = {}", loopback_server.port);
+    AZLogDebug("loopback_server.latency_usecs = {}", loopback_server.latency_usecs);
+    AZLogDebug("loopback_server.bandwidth_mbps = {}", loopback_server.bandwidth_mbps);
+    AZLogDebug("loopback_server.error_pct = {}", loopback_server.error_pct);
     AZLogDebug("filecache.enable = {}", filecache.enable);
     AZLogDebug("filecache.cachedir = {}", filecache.cachedir ? filecache.cachedir : "");
     AZLogDebug("filecache.max_size_gb = {}", filecache.max_size_gb);
@@ -4,6 +4,60 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
+#include <pthread.h>
+#include <sched.h>
+
+bool nfs_connection::start_service_thread()
+{
+    const std::vector<int>& cpus = aznfsc_cfg.service_thread_cpu_list;
+
+    if (cpus.empty()) {
+        return (nfs_mt_service_thread_start_ss(nfs_context,
+                                               16ULL * 1024 * 1024) == 0);
+    }
+
+    /*
+     * libnfs doesn't let us set the service thread's affinity, but a new
+     * thread inherits the cpu affinity of its creator, so pin ourselves to
+     * the target cpu while creating the service thread and then restore our
+     * affinity.
+     */
+    cpu_set_t old_cpuset, cpuset;
+    pthread_t self = ::pthread_self();
+    bool pinned = false;
+
+    cpu = cpus[idx % cpus.size()];
+    numa_node = get_numa_node_of_cpu(cpu);
+
+    CPU_ZERO(&cpuset);
+    CPU_SET(cpu, &cpuset);
+
+    if (::pthread_getaffinity_np(self, sizeof(old_cpuset), &old_cpuset) != 0) {
+        AZLogWarn("[{}] Failed to get cpu affinity, not pinning service "
+                  "thread", (void *) nfs_context);
+    } else if (::pthread_setaffinity_np(self, sizeof(cpuset), &cpuset) != 0) {
+        AZLogWarn("[{}] Failed to set cpu affinity to cpu {}, not pinning "
+                  "service thread", (void *) nfs_context, cpu);
+    } else {
+        pinned = true;
+    }
+
+    const int ret = nfs_mt_service_thread_start_ss(nfs_context,
+                                                   16ULL * 1024 * 1024);
+
+    if (pinned) {
+        [[maybe_unused]] const int ret2 =
+            ::pthread_setaffinity_np(self, sizeof(old_cpuset), &old_cpuset);
+        assert(ret2 == 0);
+
+        AZLogInfo("[{}] Connection #{} service thread pinned to cpu {} "
+                  "(NUMA node {})", (void *) nfs_context, idx, cpu, numa_node);
+    } else {
+        cpu = numa_node = -1;
+    }
+
+    return (ret == 0);
+}
 
 bool nfs_connection::open()
 {
@@ -137,7 +191,7 @@ bool nfs_connection::open()
      *       is recursive.
      * TODO: See if we need to making this a config option.
      */
-    if (nfs_mt_service_thread_start_ss(nfs_context, 16ULL * 1024 * 1024)) {
+    if (!start_service_thread()) {
         AZLogError("[{}] Failed to start libnfs service thread.",
                    (void *) nfs_context);
         goto unmount_and_destroy_context;
@@ -162,3 +216,143 @@ destroy_context:
     nfs_context = nullptr;
     return false;
 }
+
+bool nfs_connection::check_health(uint64_t median_rtt_usec)
+{
+    assert(nfs_context != nullptr);
+
+    struct rpc_stats stats;
+    rpc_get_stats(nfs_get_rpc_context(nfs_context), &stats);
+
+    const uint64_t new_timedout = stats.num_timedout - last_timedout;
+    const uint64_t new_major_timedout =
+        stats.num_major_timedout - last_major_timedout;
+    const uint64_t new_reconnects = stats.num_reconnects - last_reconnects;
+    const uint64_t rtt_usec = rtt_ewma_usec;
+
+    last_timedout = stats.num_timedout;
+    last_major_timedout = stats.num_major_timedout;
+    last_reconnects = stats.num_reconnects;
+
+    const bool rtt_spike =
+        (median_rtt_usec != 0) &&
+        (rtt_usec > CONN_RTT_SPIKE_MIN_USEC) &&
+        (rtt_usec > (median_rtt_usec * CONN_RTT_SPIKE_FACTOR));
+
+    const bool is_bad = (new_timedout >= CONN_UNHEALTHY_TIMEOUTS) ||
+                        (new_major_timedout > 0) ||
+                        (new_reconnects > 0) ||
+                        rtt_spike;
+
+    if (is_bad) {
+        good_checks = 0;
+        bad_checks++;
+
+        if (healthy) {
+            AZLogWarn("[{}] Connection #{} unhealthy: {} timeouts, "
+                      "{} major timeouts, {} reconnects, RTT {} usec "
+                      "(median {} usec), {} RPCs outstanding",
+                      (void *) nfs_context, idx,
+                      new_timedout, new_major_timedout, new_reconnects,
+                      rtt_usec, median_rtt_usec,
+                      outstanding_rpcs.load());
+            healthy = false;
+        }
+    } else {
+        bad_checks = 0;
+
+        if (!healthy && (++good_checks >= CONN_RECOVER_CHECKS)) {
+            AZLogInfo("[{}] Connection #{} healthy again",
+                      (void *) nfs_context, idx);
+            /*
+             * We don't send new RPCs on an unhealthy connection so the RTT
+             * would be stale, start afresh.
+             */
+            rtt_ewma_usec = 0;
+            good_checks = 0;
+            healthy = true;
+        }
+    }
+
+    return (bad_checks >= CONN_REPLACE_CHECKS);
+}
+
+bool nfs_connection::set_cork(int fd, bool cork)
+{
+    const int val = cork ? 1 : 0;
+
+    if (::setsockopt(fd, IPPROTO_TCP, TCP_CORK, &val, sizeof(val)) != 0) {
+        AZLogWarn("[{}] Cannot set TCP_CORK={} for fd {}: {}",
+                  (void *) nfs_context, val, fd, strerror(errno));
+        return false;
+    }
+
+    return true;
+}
+
+void nfs_connection::cork()
+{
+    std::unique_lock<std::mutex> _lock(cork_lock_46);
+
+    if (corked || retired || nfs_context == nullptr) {
+        return;
+    }
+
+    /*
+     * libnfs replaces the socket when it reconnects, so always use the
+     * current one and remember which one we corked, see uncork_if_expired().
+     * Don't cork while libnfs has no socket.
+     */
+    const int fd = nfs_get_fd(nfs_context);
+    if (fd < 0 || !set_cork(fd, true)) {
+        return;
+    }
+
+    corked_fd = fd;
+    corked_usecs = get_current_usecs();
+    corked = true;
+    num_batches++;
+}
+
+void nfs_connection::uncork()
+{
+    std::unique_lock<std::mutex> _lock(cork_lock_46);
+
+    if (!corked) {
+        return;
+    }
+
+    assert(nfs_context != nullptr);
+
+    /*
+     * Clearing TCP_CORK sends out whatever is pending.
+     * Clear it on the current socket, even if libnfs has reconnected since
+     * we corked. The socket we corked has then been closed, which sends out
+     * what was pending on it, and the new socket may have the old fd number,
+     * so clearing it on the old fd could hit the new socket anyway. Clearing
+     * TCP_CORK on a socket that's not corked is harmless.
+     */
+    const int fd = nfs_get_fd(nfs_context);
+    if (fd >= 0) {
+        set_cork(fd, false);
+    }
+
+    corked = false;
+    corked_fd = -1;
+}
+
+void nfs_connection::uncork_if_expired(uint64_t now_usecs)
+{
+    if (!corked) {
+        return;
+    }
+
+    /*
+     * If libnfs has reconnected since we corked, corked no longer describes
+     * the socket, uncork right away so that we start afresh.
+     */
+    if ((now_usecs >= (corked_usecs + aznfsc_cfg.rpc_batch_usecs)) ||
+        (nfs_get_fd(nfs_context) != corked_fd)) {
+        uncork();
+    }
+}
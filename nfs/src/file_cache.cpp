@@ -360,15 +360,11 @@ void membuf::clear_flushing()
     assert(is_flushing());
 
     /*
-     * clear_flushing() must be called after clear_dirty().
-     * In case WRITE RPC fails, we don't clear dirty flag, in that case this
-     * assert will fail. We still leave it as it helps catch workflow bugs and
-     * we mostly do hard mount where write never fails.
-     *
-     * TODO: Remove me once we have enough testing.
-     *       Don't release it to production.
+     * clear_flushing() must be called after clear_dirty(), unless the WRITE
+     * RPC failed, in which case the membuf stays dirty with the error saved
+     * by set_write_error(), see bc_iovec::on_io_fail().
      */
-    assert(!is_dirty());
+    assert(!is_dirty() || write_error > 0);
 
     flag &= ~MB_Flag::Flushing;
 
@@ -527,6 +523,7 @@ void membuf::clear_dirty()
     assert(is_flushing());
 
     flag &= ~MB_Flag::Dirty;
+    write_error = 0;
 
     assert(bcc->bytes_dirty >= length);
     assert(bcc->bytes_dirty_g >= length);
@@ -537,6 +534,27 @@ void membuf::clear_dirty()
                offset, offset+length, backing_file_fd);
 }
 
+void membuf::clear_dirty_on_error()
+{
+    assert(is_locked());
+    assert(is_inuse());
+
+    // Only a failed write leaves a membuf dirty w/o flushing.
+    assert(is_dirty() && !is_flushing());
+    assert(write_error > 0);
+
+    flag &= ~MB_Flag::Dirty;
+    write_error = 0;
+
+    assert(bcc->bytes_dirty >= length);
+    assert(bcc->bytes_dirty_g >= length);
+    bcc->bytes_dirty -= length;
+    bcc->bytes_dirty_g -= length;
+
+    AZLogWarn("Dropped dirty membuf [{}, {}) after failed write, fd={}",
+              offset, offset+length, backing_file_fd);
+}
+
 void membuf::set_inuse()
 {
     bcc->bytes_inuse_g += length;
@@ -2028,6 +2046,48 @@ std::vector<bytes_chunk> bytes_chunk_cache::get_dirty_bc_range(uint64_t start_of
     return bc_vec;
 }
 
+std::vector<bytes_chunk> bytes_chunk_cache::get_clean_bc_range(uint64_t start_off, uint64_t end_off) const
+{
+    std::vector<bytes_chunk> bc_vec;
+    uint64_t next_off = start_off;
+
+    assert(start_off < end_off);
+
+    // TODO: Make it shared lock.
+    const std::unique_lock<std::mutex> _lock(chunkmap_lock_43);
+    auto it = chunkmap.find(start_off);
+
+    while (it != chunkmap.cend() && next_off < end_off) {
+        const struct bytes_chunk& bc = it->second;
+        struct membuf *mb = bc.get_membuf();
+
+        /*
+         * Chunks must be contiguous and must not extend beyond end_off.
+         */
+        if ((bc.offset != next_off) ||
+            ((bc.offset + bc.length) > end_off) ||
+            !mb->is_uptodate() || mb->is_dirty() || mb->is_flushing()) {
+            break;
+        }
+
+        mb->set_inuse();
+        bc_vec.emplace_back(bc);
+        next_off += bc.length;
+
+        ++it;
+    }
+
+    // Could not find the entire range, drop the inuse counts held above.
+    if (next_off != end_off) {
+        for (const struct bytes_chunk& bc : bc_vec) {
+            bc.get_membuf()->clear_inuse();
+        }
+        bc_vec.clear();
+    }
+
+    return bc_vec;
+}
+
 #ifdef DEBUG_FILE_CACHE
 static bool is_read()
 {
@@ -0,0 +1,216 @@
+#include "aznfsc.h"
+#include "inode_table.h"
+
+struct nfs_inode *inode_table::find_nolock(const struct nfs_fh3 *fh,
+                                           uint64_t fileid,
+                                           uint32_t crc) const
+{
+    const uint64_t h = hash(fileid, crc);
+    const inode_table_shard& shard = get_shard(h);
+    const size_t nslots = shard.slots.size();
+
+    /*
+     * Probe till the first empty slot. There's always one as we rehash
+     * before the shard gets more than half full.
+     */
+    for (size_t i = get_slot(h, nslots); ; i = (i + 1) & (nslots - 1)) {
+        const inode_table_shard::slot& s = shard.slots[i];
+
+        if (s.is_empty()) {
+            return nullptr;
+        }
+
+        if (!s.inode || (s.fileid != fileid) || (s.crc != crc)) {
+            continue;
+        }
+
+        assert(s.inode->magic == NFS_INODE_MAGIC);
+        assert(s.inode->get_fileid() == fileid);
+
+        if (FH_EQUAL(&(s.inode->get_fh()), fh)) {
+            return s.inode;
+        }
+    }
+}
+
+struct nfs_inode *inode_table::get_held(const struct nfs_inode *inode,
+                                        uint64_t fileid,
+                                        uint32_t crc) const
+{
+    const uint64_t h = hash(fileid, crc);
+    const inode_table_shard& shard = get_shard(h);
+    std::shared_lock<std::shared_mutex> lock(shard.shard_lock_0);
+    const size_t nslots = shard.slots.size();
+
+    for (size_t i = get_slot(h, nslots); ; i = (i + 1) & (nslots - 1)) {
+        const inode_table_shard::slot& s = shard.slots[i];
+
+        if (s.is_empty()) {
+            return nullptr;
+        }
+
+        if ((s.inode != inode) || (s.fileid != fileid) || (s.crc != crc)) {
+            continue;
+        }
+
+        assert(s.inode->magic == NFS_INODE_MAGIC);
+
+        /*
+         * A ref taken under the shard lock keeps the inode from being freed,
+         * see inode_table.
+         */
+        if (s.inode->is_forgotten()) {
+            return nullptr;
+        }
+
+        s.inode->incref();
+        return s.inode;
+    }
+}
+
+void inode_table::insert_nolock(struct nfs_inode *inode)
+{
+    assert(inode->magic == NFS_INODE_MAGIC);
+
+    const uint64_t h = hash(inode->get_fileid(), inode->get_crc());
+    inode_table_shard& shard = get_shard(h);
+
+    /*
+     * Keep at least half the slots empty, so that probe sequences stay
+     * short and find_nolock() always finds an empty slot.
+     */
+    if ((shard.num_inodes + shard.num_tombstones + 1) * 2 >
+            shard.slots.size()) {
+        rehash_nolock(shard);
+    }
+
+    const size_t nslots = shard.slots.size();
+
+    for (size_t i = get_slot(h, nslots); ; i = (i + 1) & (nslots - 1)) {
+        inode_table_shard::slot& s = shard.slots[i];
+
+        // Same inode must not be added twice.
+        assert(s.inode != inode);
+
+        if (s.inode) {
+            continue;
+        }
+
+        if (s.tombstone) {
+            s.tombstone = false;
+            shard.num_tombstones--;
+        }
+
+        s.fileid = inode->get_fileid();
+        s.crc = inode->get_crc();
+        s.inode = inode;
+        shard.num_inodes++;
+        num_inodes++;
+        return;
+    }
+}
+
+bool inode_table::erase_nolock(struct nfs_inode *inode)
+{
+    assert(inode->magic == NFS_INODE_MAGIC);
+
+    const uint64_t h = hash(inode->get_fileid(), inode->get_crc());
+    inode_table_shard& shard = get_shard(h);
+    const size_t nslots = shard.slots.size();
+
+    for (size_t i = get_slot(h, nslots); ; i = (i + 1) & (nslots - 1)) {
+        inode_table_shard::slot& s = shard.slots[i];
+
+        if (s.is_empty()) {
+            return false;
+        }
+
+        if (s.inode != inode) {
+            continue;
+        }
+
+        s.inode = nullptr;
+        s.tombstone = true;
+        shard.num_tombstones++;
+        assert(shard.num_inodes > 0);
+        shard.num_inodes--;
+        assert(num_inodes > 0);
+        num_inodes--;
+
+        /*
+         * Shrink the shard once it's mostly empty, so that a burst of inodes
+         * (f.e. a big directory enumerated once) doesn't leave us with large
+         * mostly empty shards.
+         */
+        if ((nslots > INODE_TABLE_SHARD_MIN_SLOTS) &&
+            (shard.num_inodes * 16 < nslots)) {
+            rehash_nolock(shard);
+        }
+
+        return true;
+    }
+}
+
+std::vector<struct nfs_inode*> inode_table::get_all() const
+{
+    std::vector<struct nfs_inode*> inodes;
+    inodes.reserve(num_inodes);
+
+    for (const inode_table_shard& shard : shards) {
+        std::shared_lock<std::shared_mutex> lock(shard.shard_lock_0);
+
+        for (const inode_table_shard::slot& s : shard.slots) {
+            if (s.inode) {
+                inodes.emplace_back(s.inode);
+            }
+        }
+    }
+
+    return inodes;
+}
+
+size_t inode_table::get_mem_bytes() const
+{
+    size_t bytes = sizeof(*this);
+
+    for (const inode_table_shard& shard : shards) {
+        std::shared_lock<std::shared_mutex> lock(shard.shard_lock_0);
+        bytes += shard.slots.capacity() * sizeof(inode_table_shard::slot);
+    }
+
+    return bytes;
+}
+
+/* static */
+void inode_table::rehash_nolock(inode_table_shard& shard)
+{
+    size_t nslots = INODE_TABLE_SHARD_MIN_SLOTS;
+    while (nslots < (shard.num_inodes + 1) * 4) {
+        nslots *= 2;
+    }
+
+    AZLogDebug("Rehashing inode table shard, {} -> {} slots "
+               "(inodes: {}, tombstones: {})",
+               shard.slots.size(), nslots,
+               shard.num_inodes, shard.num_tombstones);
+
+    std::vector<inode_table_shard::slot> old_slots(nslots);
+    old_slots.swap(shard.slots);
+
+    for (const inode_table_shard::slot& os : old_slots) {
+        if (!os.inode) {
+            continue;
+        }
+
+        const uint64_t h = hash(os.fileid, os.crc);
+        size_t i = get_slot(h, nslots);
+
+        while (shard.slots[i].inode) {
+            i = (i + 1) & (nslots - 1);
+        }
+
+        shard.slots[i] = os;
+    }
+
+    shard.num_tombstones = 0;
+}
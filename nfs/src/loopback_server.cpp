@@ -0,0 +1,1744 @@
+#include "loopback_server.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+
+/*
+ * ONC RPC constants (RFC 5531).
+ */
+#define RPC_MSG_CALL            0
+#define RPC_MSG_REPLY           1
+#define RPC_MSG_ACCEPTED        0
+#define RPC_SUCCESS             0
+#define RPC_PROG_UNAVAIL        1
+#define RPC_PROG_MISMATCH       2
+#define RPC_PROC_UNAVAIL        3
+#define RPC_GARBAGE_ARGS        4
+#define RPC_AUTH_NONE           0
+#define RPC_AUTH_UNIX           1
+
+/*
+ * Return value of NFS procedure handlers for undecodable arguments.
+ */
+#define LB_GARBAGE_ARGS         -1
+
+/*
+ * Largest filehandle, name and path we accept.
+ */
+#define LB_FH_SIZE              16
+#define LB_NAME_MAX             255
+#define LB_PATH_MAX             4096
+
+/**
+ * XDR encoder, appends to buf.
+ */
+struct lb_xdr_writer
+{
+    std::vector<uint8_t> buf;
+
+    void u32(uint32_t val)
+    {
+        val = htonl(val);
+        const uint8_t *p = (const uint8_t *) &val;
+        buf.insert(buf.end(), p, p + 4);
+    }
+
+    void u64(uint64_t val)
+    {
+        u32(val >> 32);
+        u32(val & 0xffffffff);
+    }
+
+    void fixed(const void *data, uint32_t len)
+    {
+        const uint8_t *p = (const uint8_t *) data;
+        buf.insert(buf.end(), p, p + len);
+        buf.insert(buf.end(), (4 - (len & 3)) & 3, 0);
+    }
+
+    void opaque(const void *data, uint32_t len)
+    {
+        u32(len);
+        fixed(data, len);
+    }
+
+    void str(const std::string& s)
+    {
+        opaque(s.data(), s.size());
+    }
+
+    void time(const struct timespec& ts)
+    {
+        u32(ts.tv_sec);
+        u32(ts.tv_nsec);
+    }
+};
+
+/**
+ * XDR decoder over [p, p+left). ok is cleared on underrun or invalid data
+ * and all further reads return 0/empty.
+ */
+struct lb_xdr_reader
+{
+    const uint8_t *p;
+    size_t left;
+    bool ok = true;
+
+    lb_xdr_reader(const uint8_t *_p, size_t _left):
+        p(_p),
+        left(_left)
+    {
+    }
+
+    bool consume(size_t len)
+    {
+        if (!ok || left < len) {
+            ok = false;
+            return false;
+        }
+        p += len;
+        left -= len;
+        return true;
+    }
+
+    uint32_t u32()
+    {
+        uint32_t val;
+        const uint8_t *q = p;
+
+        if (!consume(4)) {
+            return 0;
+        }
+        ::memcpy(&val, q, 4);
+        return ntohl(val);
+    }
+
+    uint64_t u64()
+    {
+        const uint64_t hi = u32();
+        return (hi << 32) | u32();
+    }
+
+    bool boolean()
+    {
+        return u32() != 0;
+    }
+
+    void fixed(void *data, uint32_t len)
+    {
+        const uint8_t *q = p;
+
+        if (consume((len + 3) & ~3U)) {
+            ::memcpy(data, q, len);
+        }
+    }
+
+    /*
+     * Decode variable length opaque data of upto max_len bytes, returning
+     * a pointer to the data in the record.
+     */
+    const uint8_t *opaque(uint32_t& len, uint32_t max_len)
+    {
+        len = u32();
+        const uint8_t *q = p;
+
+        if (len > max_len) {
+            ok = false;
+        }
+        if (!consume((len + 3ULL) & ~3ULL)) {
+            len = 0;
+            return nullptr;
+        }
+        return q;
+    }
+
+    std::string str(uint32_t max_len)
+    {
+        uint32_t len;
+        const uint8_t *q = opaque(len, max_len);
+        return q ? std::string((const char *) q, len) : std::string();
+    }
+
+    void time(struct timespec& ts)
+    {
+        ts.tv_sec = u32();
+        ts.tv_nsec = u32();
+    }
+};
+
+static struct timespec lb_now()
+{
+    struct timespec ts;
+    ::clock_gettime(CLOCK_REALTIME, &ts);
+    return ts;
+}
+
+static bool lb_send_all(int fd, const uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        const ssize_t ret = ::send(fd, buf, len, MSG_NOSIGNAL);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+static bool lb_recv_all(int fd, uint8_t *buf, size_t len)
+{
+    while (len > 0) {
+        const ssize_t ret = ::recv(fd, buf, len, 0);
+        if (ret <= 0) {
+            if (ret < 0 && errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        buf += ret;
+        len -= ret;
+    }
+    return true;
+}
+
+void lb_file_data::read(uint64_t offset, uint32_t count, char *buf) const
+{
+    assert((offset + count) <= size);
+
+    ::memset(buf, 0, count);
+
+    const uint64_t end = offset + count;
+    for (auto it = chunks.lower_bound(offset / LB_DATA_CHUNK_SIZE);
+         it != chunks.end(); ++it) {
+        const uint64_t chunk_off = it->first * LB_DATA_CHUNK_SIZE;
+        if (chunk_off >= end) {
+            break;
+        }
+
+        const uint64_t from = std::max(offset, chunk_off);
+        const uint64_t to = std::min(end, chunk_off + it->second.size());
+        if (from < to) {
+            ::memcpy(buf + (from - offset),
+                     it->second.data() + (from - chunk_off), to - from);
+        }
+    }
+}
+
+uint64_t lb_file_data::write(uint64_t offset, uint32_t count, const void *buf)
+{
+    const char *p = (const char *) buf;
+    const uint64_t old_bytes = bytes;
+
+    while (count > 0) {
+        const uint64_t in_chunk = offset % LB_DATA_CHUNK_SIZE;
+        const uint32_t n =
+            std::min<uint64_t>(count, LB_DATA_CHUNK_SIZE - in_chunk);
+        std::vector<char>& chunk = chunks[offset / LB_DATA_CHUNK_SIZE];
+
+        if (chunk.size() < (in_chunk + n)) {
+            bytes += (in_chunk + n) - chunk.size();
+            chunk.resize(in_chunk + n);
+        }
+        ::memcpy(chunk.data() + in_chunk, p, n);
+
+        p += n;
+        offset += n;
+        count -= n;
+        size = std::max(size, offset);
+    }
+
+    return bytes - old_bytes;
+}
+
+uint64_t lb_file_data::truncate(uint64_t new_size)
+{
+    const uint64_t old_bytes = bytes;
+
+    if (new_size < size) {
+        auto it = chunks.lower_bound(new_size / LB_DATA_CHUNK_SIZE);
+
+        // Chunk new_size falls in keeps the data before new_size.
+        if (it != chunks.end() &&
+            (it->first == (new_size / LB_DATA_CHUNK_SIZE))) {
+            const uint64_t keep = new_size % LB_DATA_CHUNK_SIZE;
+            if (it->second.size() > keep) {
+                bytes -= it->second.size() - keep;
+                it->second.resize(keep);
+                it->second.shrink_to_fit();
+            }
+            ++it;
+        }
+
+        while (it != chunks.end()) {
+            bytes -= it->second.size();
+            it = chunks.erase(it);
+        }
+    }
+
+    size = new_size;
+    return old_bytes - bytes;
+}
+
+/**
+ * NFS v3 procedure handlers (RFC 1813).
+ * Each handler decodes its arguments from args, and on success encodes the
+ * resok body (w/o the status) into res and returns NFS3_OK. On failure it
+ * returns the NFS status, or LB_GARBAGE_ARGS if args cannot be decoded,
+ * and the caller encodes the resfail body with no attributes.
+ * All are called with fs_lock_47 held.
+ */
+struct lb_handlers
+{
+    typedef int (*handler_t)(loopback_server& srv,
+                             lb_xdr_reader& args,
+                             lb_xdr_writer& res,
+                             const loopback_server::lb_cred& cred);
+
+    /*
+     * Pre-operation attributes for wcc_data.
+     */
+    struct lb_wcc_attr
+    {
+        bool valid = false;
+        uint64_t size = 0;
+        struct timespec mtime = {};
+        struct timespec ctime = {};
+    };
+
+    /*
+     * Decoded sattr3.
+     */
+    struct lb_sattr
+    {
+        bool set_mode = false;
+        uint32_t mode = 0;
+        bool set_uid = false;
+        uint32_t uid = 0;
+        bool set_gid = false;
+        uint32_t gid = 0;
+        bool set_size = false;
+        uint64_t size = 0;
+        uint32_t atime_how = DONT_CHANGE;
+        struct timespec atime = {};
+        uint32_t mtime_how = DONT_CHANGE;
+        struct timespec mtime = {};
+    };
+
+    static lb_wcc_attr get_wcc_attr(const lb_inode *ino)
+    {
+        lb_wcc_attr wa;
+
+        if (ino) {
+            wa.valid = true;
+            wa.size = ino->data.size;
+            wa.mtime = ino->mtime;
+            wa.ctime = ino->ctime;
+        }
+        return wa;
+    }
+
+    static void put_fh(loopback_server& srv, lb_xdr_writer& w, uint64_t fileid)
+    {
+        uint8_t fh[LB_FH_SIZE];
+        const uint64_t gen = srv.boot_usecs;
+
+        ::memcpy(fh, &fileid, 8);
+        ::memcpy(fh + 8, &gen, 8);
+        w.opaque(fh, sizeof(fh));
+    }
+
+    /*
+     * Decode a filehandle and find its inode.
+     * Returns NFS3_OK and sets ino, else the NFS error to return.
+     */
+    static int get_fh(loopback_server& srv, lb_xdr_reader& r, lb_inode *& ino)
+    {
+        uint32_t len;
+        const uint8_t *fh = r.opaque(len, NFS3_FHSIZE);
+        uint64_t fileid, gen;
+
+        ino = nullptr;
+        if (!r.ok) {
+            return LB_GARBAGE_ARGS;
+        } else if (len != LB_FH_SIZE) {
+            return NFS3ERR_BADHANDLE;
+        }
+
+        ::memcpy(&fileid, fh, 8);
+        ::memcpy(&gen, fh + 8, 8);
+
+        if (gen != srv.boot_usecs ||
+            (ino = srv.find_inode(fileid)) == nullptr) {
+            return NFS3ERR_STALE;
+        }
+        return NFS3_OK;
+    }
+
+    /*
+     * Decode diropargs3, returning the directory inode in dir.
+     */
+    static int get_dirop(loopback_server& srv, lb_xdr_reader& r,
+                         lb_inode *& dir, std::string& name)
+    {
+        const int status = get_fh(srv, r, dir);
+        name = r.str(LB_PATH_MAX);
+
+        if (!r.ok) {
+            return LB_GARBAGE_ARGS;
+        } else if (status != NFS3_OK) {
+            return status;
+        } else if (dir->type != NF3DIR) {
+            return NFS3ERR_NOTDIR;
+        } else if (name.size() > LB_NAME_MAX) {
+            return NFS3ERR_NAMETOOLONG;
+        } else if (name.empty() ||
+                   name.find('/') != std::string::npos) {
+            return NFS3ERR_INVAL;
+        }
+        return NFS3_OK;
+    }
+
+    static void get_sattr(lb_xdr_reader& r, lb_sattr& sa)
+    {
+        if ((sa.set_mode = r.boolean())) {
+            sa.mode = r.u32();
+        }
+        if ((sa.set_uid = r.boolean())) {
+            sa.uid = r.u32();
+        }
+        if ((sa.set_gid = r.boolean())) {
+            sa.gid = r.u32();
+        }
+        if ((sa.set_size = r.boolean())) {
+            sa.size = r.u64();
+        }
+        if ((sa.atime_how = r.u32()) == SET_TO_CLIENT_TIME) {
+            r.time(sa.atime);
+        }
+        if ((sa.mtime_how = r.u32()) == SET_TO_CLIENT_TIME) {
+            r.time(sa.mtime);
+        }
+    }
+
+    static int apply_sattr(loopback_server& srv, lb_inode *ino,
+                           const lb_sattr& sa)
+    {
+        const struct timespec now = lb_now();
+
+        if (sa.set_size) {
+            if (ino->type == NF3DIR) {
+                return NFS3ERR_ISDIR;
+            } else if (ino->type != NF3REG) {
+                return NFS3ERR_INVAL;
+            } else if (sa.size > INT64_MAX) {
+                return NFS3ERR_FBIG;
+            }
+            srv.data_bytes -= ino->data.truncate(sa.size);
+            ino->mtime = now;
+        }
+        if (sa.set_mode) {
+            ino->mode = sa.mode & 07777;
+        }
+        if (sa.set_uid) {
+            ino->uid = sa.uid;
+        }
+        if (sa.set_gid) {
+            ino->gid = sa.gid;
+        }
+        if (sa.atime_how != DONT_CHANGE) {
+            ino->atime = (sa.atime_how == SET_TO_CLIENT_TIME) ? sa.atime : now;
+        }
+        if (sa.mtime_how != DONT_CHANGE) {
+            ino->mtime = (sa.mtime_how == SET_TO_CLIENT_TIME) ? sa.mtime : now;
+        }
+        ino->ctime = now;
+        return NFS3_OK;
+    }
+
+    static void put_fattr(lb_xdr_writer& w, const lb_inode *ino)
+    {
+        const uint64_t size = (ino->type == NF3REG) ? ino->data.size :
+                              (ino->type == NF3LNK) ? ino->symlink.size() :
+                              4096;
+
+        w.u32(ino->type);
+        w.u32(ino->mode);
+        w.u32(ino->nlink);
+        w.u32(ino->uid);
+        w.u32(ino->gid);
+        w.u64(size);
+        w.u64((size + 4095) & ~4095ULL);
+        w.u32(0);       // rdev.specdata1
+        w.u32(0);       // rdev.specdata2
+        w.u64(1);       // fsid
+        w.u64(ino->fileid);
+        w.time(ino->atime);
+        w.time(ino->mtime);
+        w.time(ino->ctime);
+    }
+
+    static void put_post_op_attr(lb_xdr_writer& w, const lb_inode *ino)
+    {
+        w.u32(ino != nullptr);
+        if (ino) {
+            put_fattr(w, ino);
+        }
+    }
+
+    static void put_wcc(lb_xdr_writer& w, const lb_wcc_attr& pre,
+                        const lb_inode *ino)
+    {
+        w.u32(pre.valid);
+        if (pre.valid) {
+            w.u64(pre.size);
+            w.time(pre.mtime);
+            w.time(pre.ctime);
+        }
+        put_post_op_attr(w, ino);
+    }
+
+    static int getattr(loopback_server& srv, lb_xdr_reader& args,
+                       lb_xdr_writer& res,
+                       const loopback_server::lb_cred& cred)
+    {
+        lb_inode *ino;
+        const int status = get_fh(srv, args, ino);
+
+        if (status == NFS3_OK) {
+            put_fattr(res, ino);
+        }
+        return status;
+    }
+
+    static int setattr(loopback_server& srv, lb_xdr_reader& args,
+                       lb_xdr_writer& res,
+                       const loopback_server::lb_cred& cred)
+    {
+        lb_inode *ino;
+        lb_sattr sa;
+        int status = get_fh(srv, args, ino);
+        get_sattr(args, sa);
+
+        struct timespec guard = {};
+        const bool check_guard = args.boolean();
+        if (check_guard) {
+            args.time(guard);
+        }
+
+        if (!args.ok) {
+            return LB_GARBAGE_ARGS;
+        } else if (status != NFS3_OK) {
+            return status;
+        } else if (check_guard &&
+                   (guard.tv_sec != ino->ctime.tv_sec ||
+                    guard.tv_nsec != ino->ctime.tv_nsec)) {
+            return NFS3ERR_NOT_SYNC;
+        }
+
+        const lb_wcc_attr pre = get_wcc_attr(ino);
+        if ((status = apply_sattr(srv, ino, sa)) != NFS3_OK) {
+            return status;
+        }
+
+        put_wcc(res, pre, ino);
+        return NFS3_OK;
+    }
+
+    static int lookup(loopback_server& srv, lb_xdr_reader& args,
+                      lb_xdr_writer& res,
+                      const loopback_server::lb_cred& cred)
+    {
+        lb_inode *dir;
+        std::string name;
+        const int status = get_dirop(srv, args, dir, name);
+
+        if (status != NFS3_OK) {
+            return status;
+        }
+
+        lb_inode *ino = nullptr;
+        if (name == ".") {
+            ino = dir;
+        } else if (name == "..") {
+            ino = srv.find_inode(dir->parent);
+        } else {
+            const auto it = dir->entries.find(name);
+            if (it != dir->entries.end()) {
+                ino = srv.find_inode(it->second);
+            }
+        }
+
+        if (ino == nullptr) {
+            return NFS3ERR_NOENT;
+        }
+
+        put_fh(srv, res, ino->fileid);
+        put_post_op_attr(res, ino);
+        put_post_op_attr(res, dir);
+        return NFS3_OK;
+    }
+
+    static int access(loopback_server& srv, lb_xdr_reader& args,
+                      lb_xdr_writer& res,
+                      const loopback_server::lb_cred& cred)
+    {
+        lb_inode *ino;
+        const int status = get_fh(srv, args, ino);
+        const uint32_t access = args.u32();
+
+        if (!args.ok) {
+            return LB_GARBAGE_ARGS;
+        } else if (status != NFS3_OK) {
+            return status;
+        }
+
+        // No permission checks, grant whatever is asked.
+        put_post_op_attr(res, ino);
+        res.u32(access);
+        return NFS3_OK;
+    }
+
+    static int readlink(loopback_server& srv, lb_xdr_reader& args,
+                        lb_xdr_writer& res,
+                        const loopback_server::lb_cred& cred)
+    {
+        lb_inode *ino;
+        const int status = get_fh(srv, args, ino);
+
+        if (status != NFS3_OK) {
+            return status;
+        } else if (ino->type != NF3LNK) {
+            return NFS3ERR_INVAL;
+        }
+
+        put_post_op_attr(res, ino);
+        res.str(ino->symlink);
+        return NFS3_OK;
+    }
+
+    static int read(loopback_server& srv, lb_xdr_reader& args,
+                    lb_xdr_writer& res,
+                    const loopback_server::lb_cred& cred)
+    {
+        lb_inode *ino;
+        const int status = get_fh(srv, args, ino);
+        const uint64_t offset = args.u64();
+        uint32_t count = args.u32();
+
+        if (!args.ok) {
+            return LB_GARBAGE_ARGS;
+        } else if (status != NFS3_OK) {
+            return status;
+        } else if (ino->type == NF3DIR) {
+            return NFS3ERR_ISDIR;
+        } else if (ino->type != NF3REG) {
+            return NFS3ERR_INVAL;
+        }
+
+        /*
+         * count comes from the client, don't read more than the rtmax we
+         * advertise in FSINFO, else a large count makes us allocate that much
+         * for the reply.
+         */
+        if (count > AZNFSCFG_RSIZE_MAX) {
+            count = AZNFSCFG_RSIZE_MAX;
+        }
+
+        const uint64_t size = ino->data.size;
+        if (offset >= size) {
+            count = 0;
+        } else if (count > (size - offset)) {
+            count = size - offset;
+        }
+
+        ino->atime = lb_now();
+
+        put_post_op_attr(res, ino);
+        res.u32(count);
+        res.u32((offset + count) >= size);
+
+        // Read the data straight into the reply.
+        res.u32(count);
+        const size_t data_off = res.buf.size();
+        res.buf.resize(data_off + (((size_t) count + 3) & ~((size_t) 3)));
+        ino->data.read(offset, count, (char *) &res.buf[data_off]);
+        return NFS3_OK;
+    }
+
+    static int write(loopback_server& srv, lb_xdr_reader& args,
+                     lb_xdr_writer& res,
+                     const loopback_server::lb_cred& cred)
+    {
+        lb_inode *ino;
+        const int status = get_fh(srv, args, ino);
+        const uint64_t offset = args.u64();
+        const uint32_t count = args.u32();
+        [[maybe_unused]] const uint32_t stable = args.u32();
+        uint32_t len;
+        const uint8_t *data = args.opaque(len, LB_MAX_RECORD_SIZE);
+
+        if (!args.ok || len != count) {
+            return LB_GARBAGE_ARGS;
+        } else if (status != NFS3_OK) {
+            return status;
+        } else if (ino->type == NF3DIR) {
+            return NFS3ERR_ISDIR;
+        } else if (ino->type != NF3REG) {
+            return NFS3ERR_INVAL;
+        }
+
+        if ((offset > INT64_MAX) || (count > (INT64_MAX - offset))) {
+            return NFS3ERR_FBIG;
+        }
+
+        /*
+         * Writing count bytes allocates at most count bytes, plus the part
+         * of the first chunk before offset.
+         */
+        if ((srv.data_bytes + count + LB_DATA_CHUNK_SIZE) >
+            srv.max_data_bytes) {
+            return NFS3ERR_NOSPC;
+        }
+
+        const lb_wcc_attr pre = get_wcc_attr(ino);
+
+        srv.data_bytes += ino->data.write(offset, count, data);
+        ino->mtime = ino->ctime = lb_now();
+
+        // Everything is "stable" in memory.
+        put_wcc(res, pre, ino);
+        res.u32(count);
+        res.u32(FILE_SYNC);
+        res.fixed(&srv.boot_usecs, NFS3_WRITEVERFSIZE);
+        return NFS3_OK;
+    }
+
+    /*
+     * Common part of CREATE, MKDIR and SYMLINK, after the arguments have
+     * been decoded. Creates a new inode of type in dir and encodes the
+     * resok body.
+     */
+    static int create_common(loopback_server& srv, lb_xdr_writer& res,
+                             const loopback_server::lb_cred& cred,
+                             lb_inode *dir, const std::string& name,
+                             ftype3 type, const lb_sattr& sa,
+                             lb_inode **pino = nullptr)
+    {
+        if (name == "." || name == "..") {
+            return NFS3ERR_EXIST;
+        } else if (dir->entries.count(name)) {
+            return NFS3ERR_EXIST;
+        }
+
+        const lb_wcc_attr pre = get_wcc_attr(dir);
+        lb_inode *ino = srv.new_inode(type, cred, dir);
+
+        dir->entries[name] = ino->fileid;
+        dir->mtime = dir->ctime = ino->ctime;
+
+        apply_sattr(srv, ino, sa);
+
+        res.u32(1);
+        put_fh(srv, res, ino->fileid);
+        put_post_op_attr(res, ino);
+        put_wcc(res, pre, dir);
+
+        if (pino) {
+            *pino = ino;
+        }
+        return NFS3_OK;
+    }
+
+    static int create(loopback_server& srv, lb_xdr_reader& args,
+                      lb_xdr_writer& res,
+                      const loopback_server::lb_cred& cred)
+    {
+        lb_inode *dir;
+        std::string name;
+        lb_sattr sa;
+        char verf[NFS3_CREATEVERFSIZE] = {};
+        const int status = get_dirop(srv, args, dir, name);
+        const uint32_t how = args.u32();
+
+        if (how == EXCLUSIVE) {
+            args.fixed(verf, sizeof(verf));
+        } else {
+            get_sattr(args, sa);
+        }
+
+        if (!args.ok) {
+            return LB_GARBAGE_ARGS;
+        } else if (status != NFS3_OK) {
+            return status;
+        }
+
+        const auto it = dir->entries.find(name);
+        if (it != dir->entries.end()) {
+            lb_inode *ino = srv.find_inode(it->second);
+            assert(ino != nullptr);
+
+            /*
+             * UNCHECKED create of an existing file works like SETATTR and
+             * a retried EXCLUSIVE create must succeed.
+             */
+            if (how == GUARDED || ino->type != NF3REG) {
+                return NFS3ERR_EXIST;
+            } else if (how == EXCLUSIVE &&
+                       (!ino->has_createverf ||
+                        ::memcmp(ino->createverf, verf, sizeof(verf)))) {
+                return NFS3ERR_EXIST;
+            } else if (how == UNCHECKED && sa.set_size) {
+                lb_sattr size_only;
+                size_only.set_size = true;
+                size_only.size = sa.size;
+                apply_sattr(srv, ino, size_only);
+            }
+
+            const lb_wcc_attr pre = get_wcc_attr(dir);
+            res.u32(1);
+            put_fh(srv, res, ino->fileid);
+            put_post_op_attr(res, ino);
+            put_wcc(res, pre, dir);
+            return NFS3_OK;
+        }
+
+        if (how != EXCLUSIVE && !sa.set_mode) {
+            sa.set_mode = true;
+            sa.mode = 0644;
+        }
+
+        lb_inode *ino = nullptr;
+        const int ret = create_common(srv, res, cred, dir, name, NF3REG, sa,
+                                      &ino);
+        if (ret == NFS3_OK && how == EXCLUSIVE) {
+            ino->mode = 0644;
+            ino->has_createverf = true;
+            ::memcpy(ino->createverf, verf, sizeof(verf));
+        }
+        return ret;
+    }
+
+    static int mkdir(loopback_server& srv, lb_xdr_reader& args,
+                     lb_xdr_writer& res,
+                     const loopback_server::lb_cred& cred)
+    {
+        lb_inode *dir;
+        std::string name;
+        lb_sattr sa;
+        const int status = get_dirop(srv, args, dir, name);
+        get_sattr(args, sa);
+
+        if (!args.ok) {
+            return LB_GARBAGE_ARGS;
+        } else if (status != NFS3_OK) {
+            return status;
+        }
+
+        if (!sa.set_mode) {
+            sa.set_mode = true;
+            sa.mode = 0755;
+        }
+
+        const int ret = create_common(srv, res, cred, dir, name, NF3DIR, sa);
+        if (ret == NFS3_OK) {
+            // New directory's ".." entry.
+            dir->nlink++;
+        }
+        return ret;
+    }
+
+    static int symlink(loopback_server& srv, lb_xdr_reader& args,
+                       lb_xdr_writer& res,
+                       const loopback_server::lb_cred& cred)
+    {
+        lb_inode *dir;
+        std::string name;
+        lb_sattr sa;
+        const int status = get_dirop(srv, args, dir, name);
+        get_sattr(args, sa);
+        const std::string target = args.str(LB_PATH_MAX);
+
+        if (!args.ok) {
+            return LB_GARBAGE_ARGS;
+        } else if (status != NFS3_OK) {
+            return status;
+        }
+
+        sa.set_mode = true;
+        sa.mode = 0777;
+
+        lb_inode *ino = nullptr;
+        const int ret = create_common(srv, res, cred, dir, name, NF3LNK, sa,
+                                      &ino);
+        if (ret == NFS3_OK) {
+            ino->symlink = target;
+        }
+        return ret;
+    }
+
+    static int mknod(loopback_server& srv, lb_xdr_reader& args,
+                     lb_xdr_writer& res,
+                     const loopback_server::lb_cred& cred)
+    {
+        return NFS3ERR_NOTSUPP;
+    }
+
+    static int remove(loopback_server& srv, lb_xdr_reader& args,
+                      lb_xdr_writer& res,
+                      const loopback_server::lb_cred& cred)
+    {
+        lb_inode *dir;
+        std::string name;
+        const int status = get_dirop(srv, args, dir, name);
+
+        if (status != NFS3_OK) {
+            return status;
+        }
+
+        const auto it = dir->entries.find(name);
+        if (it == dir->entries.end()) {
+            return NFS3ERR_NOENT;
+        }
+
+        lb_inode *ino = srv.find_inode(it->second);
+        assert(ino != nullptr);
+        if (ino->type == NF3DIR) {
+            return NFS3ERR_ISDIR;
+        }
+
+        const lb_wcc_attr pre = get_wcc_attr(dir);
+
+        dir->entries.erase(it);
+        dir->mtime = dir->ctime = lb_now();
+        srv.unlink_inode(ino);
+
+        put_wcc(res, pre, dir);
+        return NFS3_OK;
+    }
+
+    static int rmdir(loopback_server& srv, lb_xdr_reader& args,
+                     lb_xdr_writer& res,
+                     const loopback_server::lb_cred& cred)
+    {
+        lb_inode *dir;
+        std::string name;
+        const int status = get_dirop(srv, args, dir, name);
+
+        if (status != NFS3_OK) {
+            return status;
+        } else if (name == "." || name == "..") {
+            return NFS3ERR_INVAL;
+        }
+
+        const auto it = dir->entries.find(name);
+        if (it == dir->entries.end()) {
+            return NFS3ERR_NOENT;
+        }
+
+        lb_inode *ino = srv.find_inode(it->second);
+        assert(ino != nullptr);
+        if (ino->type != NF3DIR) {
+            return NFS3ERR_NOTDIR;
+        } else if (!ino->entries.empty()) {
+            return NFS3ERR_NOTEMPTY;
+        }
+
+        const lb_wcc_attr pre = get_wcc_attr(dir);
+
+        dir->entries.erase(it);
+        dir->nlink--;
+        dir->mtime = dir->ctime = lb_now();
+        srv.inodes.erase(ino->fileid);
+
+        put_wcc(res, pre, dir);
+        return NFS3_OK;
+    }
+
+    static int rename(loopback_server& srv, lb_xdr_reader& args,
+                      lb_xdr_writer& res,
+                      const loopback_server::lb_cred& cred)
+    {
+        lb_inode *fdir, *tdir;
+        std::string fname, tname;
+        int status = get_dirop(srv, args, fdir, fname);
+        const int tstatus = get_dirop(srv, args, tdir, tname);
+
+        if (!args.ok) {
+            return LB_GARBAGE_ARGS;
+        } else if (status != NFS3_OK) {
+            return status;
+        } else if (tstatus != NFS3_OK) {
+            return tstatus;
+        } else if (fname == "." || fname == ".." ||
+                   tname == "." || tname == "..") {
+            return NFS3ERR_INVAL;
+        }
+
+        const auto fit = fdir->entries.find(fname);
+        if (fit == fdir->entries.end()) {
+            return NFS3ERR_NOENT;
+        }
+
+        lb_inode *ino = srv.find_inode(fit->second);
+        assert(ino != nullptr);
+
+        /*
+         * A directory cannot be moved under itself.
+         */
+        if (ino->type == NF3DIR) {
+            for (lb_inode *d = tdir; d != nullptr;
+                 d = (d->fileid == LB_ROOT_FILEID) ?
+                     nullptr : srv.find_inode(d->parent)) {
+                if (d == ino) {
+                    return NFS3ERR_INVAL;
+                }
+            }
+        }
+
+        const lb_wcc_attr fpre = get_wcc_attr(fdir);
+        const lb_wcc_attr tpre = get_wcc_attr(tdir);
+
+        const auto tit = tdir->entries.find(tname);
+        if (tit != tdir->entries.end()) {
+            lb_inode *target = srv.find_inode(tit->second);
+            assert(target != nullptr);
+
+            if (target == ino) {
+                // Renaming to itself is a no-op.
+                goto done;
+            } else if (ino->type == NF3DIR && target->type != NF3DIR) {
+                return NFS3ERR_NOTDIR;
+            } else if (ino->type != NF3DIR && target->type == NF3DIR) {
+                return NFS3ERR_ISDIR;
+            } else if (target->type == NF3DIR) {
+                if (!target->entries.empty()) {
+                    return NFS3ERR_NOTEMPTY;
+                }
+                tdir->entries.erase(tit);
+                tdir->nlink--;
+                srv.inodes.erase(target->fileid);
+            } else {
+                tdir->entries.erase(tit);
+                srv.unlink_inode(target);
+            }
+        }
+
+        fdir->entries.erase(fname);
+        tdir->entries[tname] = ino->fileid;
+
+        if (ino->type == NF3DIR && fdir != tdir) {
+            fdir->nlink--;
+            tdir->nlink++;
+            ino->parent = tdir->fileid;
+        }
+
+        ino->ctime = fdir->mtime = fdir->ctime =
+            tdir->mtime = tdir->ctime = lb_now();
+
+done:
+        put_wcc(res, fpre, fdir);
+        put_wcc(res, tpre, tdir);
+        return NFS3_OK;
+    }
+
+    static int link(loopback_server& srv, lb_xdr_reader& args,
+                    lb_xdr_writer& res,
+                    const loopback_server::lb_cred& cred)
+    {
+        lb_inode *ino, *dir;
+        std::string name;
+        int status = get_fh(srv, args, ino);
+        const int dstatus = get_dirop(srv, args, dir, name);
+
+        if (!args.ok) {
+            return LB_GARBAGE_ARGS;
+        } else if (status != NFS3_OK) {
+            return status;
+        } else if (dstatus != NFS3_OK) {
+            return dstatus;
+        } else if (ino->type == NF3DIR) {
+            return NFS3ERR_ISDIR;
+        } else if (name == "." || name == ".." || dir->entries.count(name)) {
+            return NFS3ERR_EXIST;
+        }
+
+        const lb_wcc_attr pre = get_wcc_attr(dir);
+
+        dir->entries[name] = ino->fileid;
+        ino->nlink++;
+        ino->ctime = dir->mtime = dir->ctime = lb_now();
+
+        put_post_op_attr(res, ino);
+        put_wcc(res, pre, dir);
+        return NFS3_OK;
+    }
+
+    /*
+     * READDIR and READDIRPLUS.
+     * Entries are ".", ".." and then the directory entries in name order.
+     * The cookie of an entry is its position in that list plus 1, so a
+     * cookie is only stable till the directory is modified, which is fine
+     * for our use.
+     */
+    static int readdir_common(loopback_server& srv, lb_xdr_reader& args,
+                              lb_xdr_writer& res, bool plus)
+    {
+        lb_inode *dir;
+        const int status = get_fh(srv, args, dir);
+        const uint64_t cookie = args.u64();
+        char cookieverf[NFS3_COOKIEVERFSIZE];
+        args.fixed(cookieverf, sizeof(cookieverf));
+        [[maybe_unused]] const uint32_t dircount = plus ? args.u32() : 0;
+        const uint32_t maxcount = args.u32();
+
+        if (!args.ok) {
+            return LB_GARBAGE_ARGS;
+        } else if (status != NFS3_OK) {
+            return status;
+        } else if (dir->type != NF3DIR) {
+            return NFS3ERR_NOTDIR;
+        } else if (cookie > (dir->entries.size() + 2)) {
+            return NFS3ERR_BAD_COOKIE;
+        }
+
+        /*
+         * status, dir_attributes, cookieverf, end of list and eof.
+         */
+        size_t bytes = 4 + 88 + 4 + NFS3_COOKIEVERFSIZE + 4 + 4;
+        uint64_t pos = 0;
+        int nentries = 0;
+        bool eof = true;
+
+        put_post_op_attr(res, dir);
+        ::memset(cookieverf, 0, sizeof(cookieverf));
+        res.fixed(cookieverf, sizeof(cookieverf));
+
+        auto it = dir->entries.begin();
+        for (; pos < (dir->entries.size() + 2); pos++) {
+            const std::string *name;
+            const lb_inode *ino;
+            static const std::string dot = ".", dotdot = "..";
+
+            if (pos == 0) {
+                name = &dot;
+                ino = dir;
+            } else if (pos == 1) {
+                name = &dotdot;
+                ino = srv.find_inode(dir->parent);
+            } else {
+                name = &it->first;
+                ino = srv.find_inode(it->second);
+                ++it;
+            }
+
+            if (pos < cookie) {
+                continue;
+            }
+
+            assert(ino != nullptr);
+
+            const size_t entry_bytes =
+                4 + 8 + 4 + ((name->size() + 3) & ~3) + 8 +
+                (plus ? (4 + 84 + 4 + 4 + LB_FH_SIZE) : 0);
+
+            if ((bytes + entry_bytes) > maxcount) {
+                eof = false;
+                break;
+            }
+
+            bytes += entry_bytes;
+            nentries++;
+
+            res.u32(1);
+            res.u64(ino->fileid);
+            res.str(*name);
+            res.u64(pos + 1);
+            if (plus) {
+                put_post_op_attr(res, ino);
+                res.u32(1);
+                put_fh(srv, res, ino->fileid);
+            }
+        }
+
+        if (nentries == 0 && !eof) {
+            return NFS3ERR_TOOSMALL;
+        }
+
+        res.u32(0);
+        res.u32(eof);
+        return NFS3_OK;
+    }
+
+    static int readdir(loopback_server& srv, lb_xdr_reader& args,
+                       lb_xdr_writer& res,
+                       const loopback_server::lb_cred& cred)
+    {
+        return readdir_common(srv, args, res, false);
+    }
+
+    static int readdirplus(loopback_server& srv, lb_xdr_reader& args,
+                           lb_xdr_writer& res,
+                           const loopback_server::lb_cred& cred)
+    {
+        return readdir_common(srv, args, res, true);
+    }
+
+    static int fsstat(loopback_server& srv, lb_xdr_reader& args,
+                      lb_xdr_writer& res,
+                      const loopback_server::lb_cred& cred)
+    {
+        lb_inode *ino;
+        const int status = get_fh(srv, args, ino);
+
+        if (status != NFS3_OK) {
+            return status;
+        }
+
+        const uint64_t used = srv.data_bytes;
+        const uint64_t tbytes = srv.max_data_bytes;
+        const uint64_t tfiles = 1ULL << 32;
+
+        put_post_op_attr(res, ino);
+        res.u64(tbytes);
+        res.u64(tbytes - used);
+        res.u64(tbytes - used);
+        res.u64(tfiles);
+        res.u64(tfiles - srv.inodes.size());
+        res.u64(tfiles - srv.inodes.size());
+        res.u32(0);     // invarsec
+        return NFS3_OK;
+    }
+
+    static int fsinfo(loopback_server& srv, lb_xdr_reader& args,
+                      lb_xdr_writer& res,
+                      const loopback_server::lb_cred& cred)
+    {
+        lb_inode *ino;
+        const int status = get_fh(srv, args, ino);
+
+        if (status != NFS3_OK) {
+            return status;
+        }
+
+        put_post_op_attr(res, ino);
+        res.u32(AZNFSCFG_RSIZE_MAX);    // rtmax
+        res.u32(AZNFSCFG_RSIZE_MIN);    // rtpref
+        res.u32(4096);                  // rtmult
+        res.u32(AZNFSCFG_WSIZE_MAX);    // wtmax
+        res.u32(AZNFSCFG_WSIZE_MIN);    // wtpref
+        res.u32(4096);                  // wtmult
+        res.u32(AZNFSCFG_READDIR_MAX);  // dtpref
+        res.u64(INT64_MAX);             // maxfilesize
+        res.u32(0);                     // time_delta.seconds
+        res.u32(1);                     // time_delta.nseconds
+        res.u32(FSF3_LINK | FSF3_SYMLINK | FSF3_HOMOGENEOUS | FSF3_CANSETTIME);
+        return NFS3_OK;
+    }
+
+    static int pathconf(loopback_server& srv, lb_xdr_reader& args,
+                        lb_xdr_writer& res,
+                        const loopback_server::lb_cred& cred)
+    {
+        lb_inode *ino;
+        const int status = get_fh(srv, args, ino);
+
+        if (status != NFS3_OK) {
+            return status;
+        }
+
+        put_post_op_attr(res, ino);
+        res.u32(UINT32_MAX);    // linkmax
+        res.u32(LB_NAME_MAX);   // name_max
+        res.u32(1);             // no_trunc
+        res.u32(1);             // chown_restricted
+        res.u32(0);             // case_insensitive
+        res.u32(1);             // case_preserving
+        return NFS3_OK;
+    }
+
+    static int commit(loopback_server& srv, lb_xdr_reader& args,
+                      lb_xdr_writer& res,
+                      const loopback_server::lb_cred& cred)
+    {
+        lb_inode *ino;
+        const int status = get_fh(srv, args, ino);
+
+        if (status != NFS3_OK) {
+            return status;
+        }
+
+        put_wcc(res, get_wcc_attr(ino), ino);
+        res.fixed(&srv.boot_usecs, NFS3_WRITEVERFSIZE);
+        return NFS3_OK;
+    }
+
+    /*
+     * Handler and the number of XDR words in the resfail body (all
+     * attributes absent) for every NFS v3 procedure, indexed by procedure
+     * number.
+     */
+    struct proc_info
+    {
+        const char *name;
+        handler_t handler;
+        int fail_words;
+    };
+
+    static const proc_info procs[NFS3_COMMIT + 1];
+};
+
+const lb_handlers::proc_info lb_handlers::procs[NFS3_COMMIT + 1] = {
+    {"NULL",        nullptr,                    0},
+    {"GETATTR",     lb_handlers::getattr,       0},
+    {"SETATTR",     lb_handlers::setattr,       2},
+    {"LOOKUP",      lb_handlers::lookup,        1},
+    {"ACCESS",      lb_handlers::access,        1},
+    {"READLINK",    lb_handlers::readlink,      1},
+    {"READ",        lb_handlers::read,          1},
+    {"WRITE",       lb_handlers::write,         2},
+    {"CREATE",      lb_handlers::create,        2},
+    {"MKDIR",       lb_handlers::mkdir,         2},
+    {"SYMLINK",     lb_handlers::symlink,       2},
+    {"MKNOD",       lb_handlers::mknod,         2},
+    {"REMOVE",      lb_handlers::remove,        2},
+    {"RMDIR",       lb_handlers::rmdir,         2},
+    {"RENAME",      lb_handlers::rename,        4},
+    {"LINK",        lb_handlers::link,          3},
+    {"READDIR",     lb_handlers::readdir,       1},
+    {"READDIRPLUS", lb_handlers::readdirplus,   1},
+    {"FSSTAT",      lb_handlers::fsstat,        1},
+    {"FSINFO",      lb_handlers::fsinfo,        1},
+    {"PATHCONF",    lb_handlers::pathconf,      1},
+    {"COMMIT",      lb_handlers::commit,        2},
+};
+
+loopback_server::loopback_server():
+    max_data_bytes(((uint64_t) ::sysconf(_SC_PHYS_PAGES) *
+                    ::sysconf(_SC_PAGESIZE)) / 2),
+    boot_usecs(get_current_usecs())
+{
+    // Create the root directory.
+    auto root = std::make_unique<lb_inode>();
+
+    root->fileid = LB_ROOT_FILEID;
+    root->type = NF3DIR;
+    root->mode = 0777;
+    root->nlink = 2;
+    root->parent = LB_ROOT_FILEID;
+    root->atime = root->mtime = root->ctime = lb_now();
+
+    inodes[LB_ROOT_FILEID] = std::move(root);
+}
+
+lb_inode *loopback_server::find_inode(uint64_t fileid)
+{
+    const auto it = inodes.find(fileid);
+    return (it == inodes.end()) ? nullptr : it->second.get();
+}
+
+lb_inode *loopback_server::new_inode(ftype3 type, const lb_cred& cred,
+                                     lb_inode *dir)
+{
+    auto ino = std::make_unique<lb_inode>();
+    lb_inode *const ret = ino.get();
+
+    ino->fileid = next_fileid++;
+    ino->type = type;
+    ino->nlink = (type == NF3DIR) ? 2 : 1;
+    ino->uid = cred.uid;
+    ino->gid = cred.gid;
+    ino->parent = dir->fileid;
+    ino->atime = ino->mtime = ino->ctime = lb_now();
+
+    inodes[ret->fileid] = std::move(ino);
+    return ret;
+}
+
+void loopback_server::unlink_inode(lb_inode *ino)
+{
+    assert(ino->type != NF3DIR);
+    assert(ino->nlink > 0);
+
+    if (--ino->nlink == 0) {
+        assert(data_bytes >= ino->data.bytes);
+        data_bytes -= ino->data.bytes;
+        inodes.erase(ino->fileid);
+    } else {
+        ino->ctime = lb_now();
+    }
+}
+
+bool loopback_server::start()
+{
+    const int port = aznfsc_cfg.loopback_server.port;
+    const int on = 1;
+    struct sockaddr_in addr = {};
+
+    assert(listen_fd == -1);
+
+    listen_fd = ::socket(AF_INET, SOCK_STREAM, 0);
+    if (listen_fd == -1) {
+        AZLogError("[loopback] socket() failed: {}", ::strerror(errno));
+        return false;
+    }
+
+    ::setsockopt(listen_fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+    if (::bind(listen_fd, (struct sockaddr *) &addr, sizeof(addr)) != 0 ||
+        ::listen(listen_fd, 128) != 0) {
+        AZLogError("[loopback] Cannot listen on 127.0.0.1:{}: {}",
+                   port, ::strerror(errno));
+        ::close(listen_fd);
+        listen_fd = -1;
+        return false;
+    }
+
+    accept_thread = std::thread(&loopback_server::accept_loop, this);
+
+    AZLogInfo("[loopback] NFS server listening on 127.0.0.1:{}, "
+              "latency={} usecs, bandwidth={} Mbps, error_pct={}",
+              port,
+              aznfsc_cfg.loopback_server.latency_usecs,
+              aznfsc_cfg.loopback_server.bandwidth_mbps,
+              aznfsc_cfg.loopback_server.error_pct);
+    return true;
+}
+
+void loopback_server::stop()
+{
+    if (listen_fd == -1) {
+        return;
+    }
+
+    stopping = true;
+    ::shutdown(listen_fd, SHUT_RDWR);
+    accept_thread.join();
+    ::close(listen_fd);
+    listen_fd = -1;
+
+    /*
+     * Take the connections out of conns, so that their reader_loop()s,
+     * which remove themselves from conns, leave the cleanup to us.
+     */
+    std::vector<std::unique_ptr<lb_conn>> old_conns;
+    {
+        std::unique_lock<std::mutex> _lock(conns_lock_48);
+        old_conns.swap(conns);
+    }
+
+    for (auto& conn : old_conns) {
+        ::shutdown(conn->fd, SHUT_RDWR);
+        conn->reader.join();
+        conn->writer.join();
+        ::close(conn->fd);
+    }
+
+    AZLogInfo("[loopback] NFS server stopped");
+}
+
+void loopback_server::accept_loop()
+{
+    while (!stopping) {
+        const int fd = ::accept(listen_fd, nullptr, nullptr);
+        if (fd == -1) {
+            if (!stopping && errno != EINTR) {
+                AZLogWarn("[loopback] accept() failed: {}",
+                          ::strerror(errno));
+                ::usleep(1000);
+            }
+            continue;
+        }
+
+        const int on = 1;
+        ::setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+
+        auto conn = std::make_unique<lb_conn>();
+        conn->fd = fd;
+
+        AZLogDebug("[loopback] Accepted connection, fd {}", fd);
+
+        /*
+         * Start the threads with conns_lock_48 held, so that reader_loop()
+         * finds conn in conns if the connection is closed right away.
+         */
+        std::unique_lock<std::mutex> _lock(conns_lock_48);
+        conn->reader = std::thread(&loopback_server::reader_loop, this,
+                                   conn.get());
+        conn->writer = std::thread(&loopback_server::writer_loop, this,
+                                   conn.get());
+        conns.push_back(std::move(conn));
+    }
+}
+
+void loopback_server::reader_loop(lb_conn *conn)
+{
+    std::vector<uint8_t> call;
+
+    while (!stopping) {
+        uint32_t marker;
+
+        if (!lb_recv_all(conn->fd, (uint8_t *) &marker, 4)) {
+            break;
+        }
+
+        marker = ntohl(marker);
+        const bool last_fragment = (marker & 0x80000000U);
+        const size_t len = (marker & 0x7fffffffU);
+
+        if ((call.size() + len) > LB_MAX_RECORD_SIZE) {
+            AZLogError("[loopback] RPC record too big ({} bytes), closing "
+                       "connection", call.size() + len);
+            break;
+        }
+
+        const size_t off = call.size();
+        call.resize(off + len);
+        if (!lb_recv_all(conn->fd, call.data() + off, len)) {
+            break;
+        }
+
+        if (!last_fragment) {
+            continue;
+        }
+
+        std::vector<uint8_t> reply = process_call(call);
+        const size_t call_bytes = call.size();
+        call.clear();
+
+        if (reply.empty()) {
+            continue;
+        }
+
+        const uint64_t due_usecs =
+            get_reply_due_usecs(call_bytes, reply.size());
+
+        std::unique_lock<std::mutex> _lock(conn->reply_lock_49);
+        conn->replies.push_back({due_usecs, std::move(reply)});
+        conn->reply_cv.notify_one();
+    }
+
+    {
+        std::unique_lock<std::mutex> _lock(conn->reply_lock_49);
+        conn->closing = true;
+        conn->reply_cv.notify_one();
+    }
+
+    /*
+     * The client closed the connection (or sent garbage), free it unless
+     * stop() has taken it, in which case stop() cleans it up.
+     */
+    std::unique_ptr<lb_conn> self;
+    {
+        std::unique_lock<std::mutex> _lock(conns_lock_48);
+        for (auto it = conns.begin(); it != conns.end(); ++it) {
+            if (it->get() == conn) {
+                self = std::move(*it);
+                conns.erase(it);
+                break;
+            }
+        }
+    }
+
+    if (!self) {
+        return;
+    }
+
+    // Unblock the writer if it's stuck sending to the client.
+    ::shutdown(conn->fd, SHUT_RDWR);
+    conn->writer.join();
+    ::close(conn->fd);
+
+    AZLogDebug("[loopback] Closed connection, fd {}", conn->fd);
+
+    // We are the reader thread, it cannot be joined from here.
+    conn->reader.detach();
+}
+
+void loopback_server::writer_loop(lb_conn *conn)
+{
+    std::unique_lock<std::mutex> _lock(conn->reply_lock_49);
+
+    while (true) {
+        if (conn->replies.empty()) {
+            if (conn->closing) {
+                break;
+            }
+            conn->reply_cv.wait(_lock);
+            continue;
+        }
+
+        const uint64_t now_usecs = get_current_usecs();
+        const uint64_t due_usecs = conn->replies.front().due_usecs;
+
+        if (now_usecs < due_usecs && !conn->closing) {
+            conn->reply_cv.wait_for(
+                _lock, std::chrono::microseconds(due_usecs - now_usecs));
+            continue;
+        }
+
+        std::vector<uint8_t> rec = std::move(conn->replies.front().rec);
+        conn->replies.pop_front();
+        _lock.unlock();
+
+        const uint32_t marker = htonl(0x80000000U | rec.size());
+        const bool sent =
+            lb_send_all(conn->fd, (const uint8_t *) &marker, 4) &&
+            lb_send_all(conn->fd, rec.data(), rec.size());
+
+        _lock.lock();
+        if (!sent) {
+            // Make the reader see the connection as closed too.
+            ::shutdown(conn->fd, SHUT_RDWR);
+            break;
+        }
+    }
+}
+
+uint64_t loopback_server::get_reply_due_usecs(size_t call_bytes,
+                                              size_t reply_bytes)
+{
+    const uint64_t now_usecs = get_current_usecs();
+    const uint64_t mbps = aznfsc_cfg.loopback_server.bandwidth_mbps;
+    uint64_t done_usecs = now_usecs;
+
+    /*
+     * Both the call and reply go over one shared link, so transfers are
+     * serialized. 1 Mbps carries 1 bit per usec.
+     */
+    if (mbps > 0) {
+        const uint64_t xfer_usecs = ((call_bytes + reply_bytes) * 8) / mbps;
+        uint64_t link_free = link_free_usecs;
+
+        do {
+            done_usecs = std::max(now_usecs, link_free) + xfer_usecs;
+        } while (!link_free_usecs.compare_exchange_weak(link_free,
+                                                        done_usecs));
+    }
+
+    return done_usecs + aznfsc_cfg.loopback_server.latency_usecs;
+}
+
+std::vector<uint8_t> loopback_server::process_call(
+        const std::vector<uint8_t>& call)
+{
+    lb_xdr_reader r(call.data(), call.size());
+    lb_xdr_writer body;
+    lb_cred cred;
+
+    const uint32_t xid = r.u32();
+    const uint32_t msg_type = r.u32();
+    const uint32_t rpcvers = r.u32();
+    const uint32_t prog = r.u32();
+    const uint32_t vers = r.u32();
+    const uint32_t proc = r.u32();
+
+    // Credentials, only AUTH_UNIX is used.
+    const uint32_t cred_flavor = r.u32();
+    uint32_t cred_len;
+    const uint8_t *cred_body = r.opaque(cred_len, 400);
+    if (r.ok && cred_flavor == RPC_AUTH_UNIX) {
+        lb_xdr_reader cr(cred_body, cred_len);
+        cr.u32();                       // stamp
+        cr.str(LB_NAME_MAX);            // machinename
+        cred.uid = cr.u32();
+        cred.gid = cr.u32();
+        if (!cr.ok) {
+            cred = lb_cred();
+        }
+    }
+
+    // Verifier, ignored.
+    r.u32();
+    uint32_t verf_len;
+    r.opaque(verf_len, 400);
+
+    if (!r.ok || msg_type != RPC_MSG_CALL || rpcvers != 2) {
+        AZLogWarn("[loopback] Dropping bad RPC call (xid {:#x})", xid);
+        return {};
+    }
+
+    int accept_stat = RPC_SUCCESS;
+
+    if (prog == LB_MOUNT_PROGRAM) {
+        if (vers != LB_MOUNT_V3) {
+            accept_stat = RPC_PROG_MISMATCH;
+        } else if (proc == 1 /* MNT */) {
+            // Any export path is ok, they all map to our root.
+            r.str(LB_PATH_MAX);
+            if (!r.ok) {
+                accept_stat = RPC_GARBAGE_ARGS;
+            } else {
+                body.u32(0);    // MNT3_OK
+                lb_handlers::put_fh(*this, body, LB_ROOT_FILEID);
+                body.u32(1);    // auth_flavors
+                body.u32(RPC_AUTH_UNIX);
+            }
+        } else if (proc != 0 /* NULL */ && proc != 3 /* UMNT */) {
+            accept_stat = RPC_PROC_UNAVAIL;
+        }
+    } else if (prog == LB_NFS_PROGRAM) {
+        if (vers != LB_NFS_V3) {
+            accept_stat = RPC_PROG_MISMATCH;
+        } else if (proc > NFS3_COMMIT) {
+            accept_stat = RPC_PROC_UNAVAIL;
+        } else if (proc != NFS3_NULL) {
+            const lb_handlers::proc_info& pi = lb_handlers::procs[proc];
+            const int error_pct = aznfsc_cfg.loopback_server.error_pct;
+            lb_xdr_writer res;
+            int status;
+
+            if (error_pct > 0 &&
+                random_number(1, 100) <= (uint64_t) error_pct) {
+                status = NFS3ERR_JUKEBOX;
+            } else {
+                std::unique_lock<std::mutex> _lock(fs_lock_47);
+                status = pi.handler(*this, r, res, cred);
+            }
+
+            if (status == LB_GARBAGE_ARGS) {
+                accept_stat = RPC_GARBAGE_ARGS;
+            } else {
+                AZLogVerbose("[loopback] {} -> {}", pi.name, status);
+
+                body.u32(status);
+                if (status == NFS3_OK) {
+                    body.buf.insert(body.buf.end(),
+                                    res.buf.begin(), res.buf.end());
+                } else {
+                    for (int i = 0; i < pi.fail_words; i++) {
+                        body.u32(0);
+                    }
+                }
+            }
+        }
+    } else {
+        accept_stat = RPC_PROG_UNAVAIL;
+    }
+
+    lb_xdr_writer reply;
+    reply.u32(xid);
+    reply.u32(RPC_MSG_REPLY);
+    reply.u32(RPC_MSG_ACCEPTED);
+    reply.u32(RPC_AUTH_NONE);   // verf
+    reply.u32(0);
+    reply.u32(accept_stat);
+
+    if (accept_stat == RPC_SUCCESS) {
+        reply.buf.insert(reply.buf.end(), body.buf.begin(), body.buf.end());
+    } else if (accept_stat == RPC_PROG_MISMATCH) {
+        reply.u32(3);           // low
+        reply.u32(3);           // high
+    }
+
+    return std::move(reply.buf);
+}
@@ -438,6 +438,8 @@ int main(int argc, char *argv[])
         goto err_out4;
     }
 
+    nfs_client::get_instance().set_fuse_session(se);
+
     /*
      * Initialize nfs_client singleton.
      * This creates the libnfs polling thread(s) and hence it MUST be called
@@ -467,6 +469,7 @@ int main(int argc, char *argv[])
     AZLogInfo("Shutting down!");
 
 err_out4:
+    nfs_client::get_instance().set_fuse_session(nullptr);
     fuse_loop_cfg_destroy(loop_config);
     /*
      * Note: fuse_session_unmount() calls kernel umount which causes a statfs()
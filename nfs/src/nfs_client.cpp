@@ -3,6 +3,9 @@
 #include "nfs_internal.h"
 #include "rpc_task.h"
 #include "rpc_readdir.h"
+#include "loopback_server.h"
+
+#include <algorithm>
 
 #define NFS_STATUS(r) ((r) ? (r)->status : NFS3ERR_SERVERFAULT)
 
@@ -12,6 +15,15 @@ bool nfs_client::init()
     // init() must be called only once.
     assert(root_fh == nullptr);
 
+    /*
+     * Start the in-process server before we connect to it.
+     */
+    if (aznfsc_cfg.loopback_server.enable &&
+        !loopback_server::get_instance().start()) {
+        AZLogError("Failed to start the loopback NFS server.");
+        return false;
+    }
+
     /*
      * Setup RPC transport.
      * This will create all required connections and perform NFS mount on
@@ -65,6 +77,13 @@ bool nfs_client::init()
      */
     jukebox_thread = std::thread(&nfs_client::jukebox_runner, this);
 
+    /*
+     * Start the inode_reclaimer thread if user has capped the inode count.
+     */
+    if (aznfsc_cfg.cache.inode.max_count > 0) {
+        reclaim_thread = std::thread(&nfs_client::inode_reclaimer, this);
+    }
+
     return true;
 }
 
@@ -80,17 +99,35 @@ void nfs_client::shutdown()
     transport.close();
     AZLogInfo("Stopped transport!");
 
-    auto end_delete = inode_map.end();
-    for (auto it = inode_map.begin(), next_it = it; it != end_delete; it = next_it) {
-        ++next_it;
-        struct nfs_inode *inode = it->second;
+    if (aznfsc_cfg.loopback_server.enable) {
+        loopback_server::get_instance().stop();
+    }
+
+    /*
+     * inode_reclaimer must not be purging directory caches while we free
+     * the inodes below.
+     */
+    if (reclaim_thread.joinable()) {
+        reclaim_thread.join();
+    }
+
+    /*
+     * Take a lookupcnt ref on all inodes (other than root_fh which we
+     * handle below) so that none of them is freed while we go over them.
+     * Forgetting a directory inode purges its readdir cache, which may
+     * otherwise free other inodes only present in inode_table because of
+     * the dircachecnt held by the readdir cache.
+     */
+    std::vector<struct nfs_inode*> inodes = inode_table.get_all();
+
+    for (struct nfs_inode *inode : inodes) {
         assert(inode->magic == NFS_INODE_MAGIC);
         const bool unexpected_refs =
             ((inode->lookupcnt + inode->dircachecnt) == 0);
 
         if (unexpected_refs) {
             AZLogError("[BUG] [{}:{}] Inode with 0 ref still present in "
-                       "inode_map at shutdown: lookupcnt={}, "
+                       "inode_table at shutdown: lookupcnt={}, "
                        "dircachecnt={}, forget_expected={}, "
                        "is_cache_empty={}",
                        inode->get_filetype_coding(),
@@ -110,56 +147,43 @@ void nfs_client::shutdown()
                        inode->forget_expected.load(),
                        inode->is_cache_empty());
         }
+
+        if (inode != root_fh) {
+            inode->incref();
+        }
+    }
+
+    for (struct nfs_inode *inode : inodes) {
+        /*
+         * root_fh is forgotten below, after all other inodes.
+         * We do not expect forget_expected to be non-zero for root
+         * inode, so we have the assert to confirm.
+         * XXX If the assert hits, just remove it.
+         */
+        if (inode == root_fh) {
+            assert(inode->forget_expected == 0);
+            continue;
+        }
+
         /*
          * Fuse wants to treat an unmount as an implicit forget for
          * all inodes. Fuse does not gurantee that it will call forget
          * for each inode, hence we have to implicity forget all inodes.
+         * This won't free the inode as we hold a ref on it.
          */
         if (inode->forget_expected) {
             assert(!inode->is_forgotten());
-
-            /*
-             * 'next_it' might get removed as a result of decref() of the
-             * current inode, if 'it' corresponds to a directory inode and
-             * 'next_it' corresponds to a file in that directory and
-             * 'next_it' is present in inode_map only because of the
-             * dircachecnt held by the readdir cache of the current dir.
-             * To prevent next_it from being removed, we hold a lookupcnt
-             * ref on next_inode and then drop that ref after the decref()
-             * call.
-             */
-            struct nfs_inode *next_inode = nullptr;
-
-            if (next_it != end_delete) {
-                next_inode = next_it->second;
-                assert(next_inode->magic == NFS_INODE_MAGIC);
-                assert((next_inode->lookupcnt +
-                        next_inode->dircachecnt) > 0);
-                next_inode->incref();
-            }
             inode->decref(inode->forget_expected, true /* from_forget */);
-            if (next_inode) {
-                /*
-                 * If the following decref() is going to cause next_it to
-                 * be removed, increment it before that.
-                 */
-                if (next_inode->lookupcnt == 1 &&
-                    next_inode->dircachecnt == 0) {
-                    ++next_it;
-                }
-                next_inode->decref();
-            }
+        }
+    }
 
-            /*
-             * root_fh is not valid anymore, clear it now.
-             * We do not expect forget_expected to be non-zero for root
-             * inode, so we have the assert to confirm.
-             * XXX If the assert hits, just remove it.
-             */
-            if (inode == root_fh) {
-                assert(0);
-                root_fh = nullptr;
-            }
+    /*
+     * Now drop the refs we took above, this frees the inodes not held by
+     * any readdir cache.
+     */
+    for (struct nfs_inode *inode : inodes) {
+        if (inode != root_fh) {
+            inode->decref();
         }
     }
 
@@ -179,8 +203,7 @@ void nfs_client::shutdown()
     /*
      * Now we shouldn't have any left.
      */
-    for (auto it : inode_map) {
-        struct nfs_inode *inode = it.second;
+    for (struct nfs_inode *inode : inode_table.get_all()) {
         AZLogWarn("[BUG] [{}:{}] Inode still present at shutdown: "
                    "lookupcnt={}, dircachecnt={}, forget_expected={}, "
                    "is_cache_empty={}",
@@ -192,7 +215,7 @@ void nfs_client::shutdown()
                    inode->is_cache_empty());
     }
 
-    assert(inode_map.size() == 0);
+    assert(inode_table.size() == 0);
 
     jukebox_thread.join();
 }
@@ -219,6 +242,12 @@ void nfs_client::jukebox_runner()
             ::sleep(1);
         }
 
+        /*
+         * Piggyback on the jukebox thread for freeing rpc_tasks not needed
+         * anymore.
+         */
+        rpc_task_helper->maybe_shrink();
+
         {
             std::unique_lock<std::mutex> lock(jukebox_seeds_lock_39);
             jukebox_requests = jukebox_seeds.size();
@@ -441,7 +470,7 @@ void nfs_client::jukebox_runner()
                     AZLogWarn("[JUKEBOX REISSUE] flush(req={}, ino={})",
                               fmt::ptr(js->rpc_api->req),
                               js->rpc_api->flush_task.get_ino());
-                    jukebox_flush(js->rpc_api);
+                    jukebox_flush(js);
                     break;
                 /* TODO: Add other request types */
                 default:
@@ -455,10 +484,195 @@ void nfs_client::jukebox_runner()
     } while (!shutting_down);
 }
 
-struct nfs_inode *nfs_client::__inode_from_inode_map(const nfs_fh3 *fh,
-                                                     const struct fattr3 *fattr,
-                                                     bool acquire_lock,
-                                                     bool *is_forgotten)
+void nfs_client::inode_reclaimer()
+{
+    const size_t max_count = aznfsc_cfg.cache.inode.max_count;
+
+    /*
+     * Once over the limit, reclaim down to 90% of it, so that we don't have
+     * to reclaim again as soon as a few more inodes are added.
+     */
+    const size_t target = max_count - (max_count / 10);
+
+    /*
+     * If nothing could be purged (f.e. all directories are open, or the
+     * inodes are held by the kernel), scanning again every second only
+     * burns CPU, back off upto a minute till some purge succeeds.
+     */
+    constexpr int max_interval_secs = 60;
+    int interval_secs = 1;
+
+    AZLogDebug("Started inode_reclaimer (max_count: {}, target: {})",
+               max_count, target);
+
+    while (!shutting_down) {
+        for (int i = 0; (i < interval_secs) && !shutting_down; i++) {
+            ::sleep(1);
+        }
+
+        if (shutting_down || (inode_table.size() <= max_count)) {
+            interval_secs = 1;
+            continue;
+        }
+
+        if (reclaim_inodes(target) > 0) {
+            interval_secs = 1;
+        } else {
+            interval_secs = std::min(interval_secs * 2, max_interval_secs);
+            AZLogDebug("Nothing to reclaim, next scan in {} secs",
+                       interval_secs);
+        }
+    }
+}
+
+size_t nfs_client::reclaim_inodes(size_t target)
+{
+    const size_t num_inodes = inode_table.size();
+
+    /*
+     * Most inodes on a huge scan are held only by the readdir cache of their
+     * parent directory (dircachecnt), so purging directory caches is what
+     * frees inodes. Pick directories which are not open, as fuse enumerates
+     * a directory (nfs_inode::lookup_dircache()) only after opening it and
+     * purging a directory cache while it's being enumerated can orphan
+     * inodes. This is only a hint, clear(only_if_idle=true) checks it again
+     * under readdircache_lock_2.
+     */
+    std::vector<struct nfs_inode*> dirs = inode_table.get_if_held(
+        [](const struct nfs_inode *inode) {
+            /*
+             * An empty cache may still have inodes held since it was
+             * purged, see readdirectory_cache::held_inodes.
+             */
+            return inode->is_dir() &&
+                   inode->has_dircache() &&
+                   !inode->is_open() &&
+                   (!inode->is_cache_empty() ||
+                    inode->get_dircache()->has_held_inodes());
+        });
+
+    AZLogInfo("Reclaiming inodes: {} inodes, target {}, {} candidate "
+              "directory caches", num_inodes, target, dirs.size());
+
+    /*
+     * Coldest first.
+     */
+    std::vector<std::pair<uint64_t, struct nfs_inode*>> cold_dirs;
+    cold_dirs.reserve(dirs.size());
+
+    for (struct nfs_inode *inode : dirs) {
+        cold_dirs.emplace_back(
+                inode->get_dircache()->get_last_access_msecs(), inode);
+    }
+
+    std::sort(cold_dirs.begin(), cold_dirs.end());
+
+    uint64_t dircaches_purged = 0;
+    uint64_t entries_invalidated = 0;
+
+    /*
+     * Dentries to ask the kernel to drop, as (directory, name).
+     */
+    std::vector<std::pair<fuse_ino_t, std::string>> kernel_entries;
+
+    for (const auto& [last_access_msecs, inode] : cold_dirs) {
+        if (shutting_down || (inode_table.size() <= target)) {
+            break;
+        }
+
+        const size_t before = inode_table.size();
+        std::vector<std::string> kernel_names;
+
+        /*
+         * Directory may have been opened, or started being enumerated,
+         * after we picked it, clear() skips it then.
+         */
+        if (!inode->get_dircache()->clear(&kernel_names,
+                                          false /* keep_inodes */,
+                                          true /* only_if_idle */)) {
+            continue;
+        }
+
+        AZLogDebug("[{}] Purged dircache, last accessed {} msecs ago",
+                   inode->get_fuse_ino(),
+                   get_current_msecs() - last_access_msecs);
+
+        dircaches_purged++;
+
+        const size_t after = inode_table.size();
+        if (after < before) {
+            INC_GBL_STATS(inodes_reclaimed, before - after);
+        }
+
+        for (std::string& name : kernel_names) {
+            kernel_entries.emplace_back(inode->get_fuse_ino(),
+                                        std::move(name));
+        }
+    }
+
+#ifndef ENABLE_NO_FUSE
+    /*
+     * Inodes known to the kernel are not freed till it FORGETs them,
+     * ask it to drop their dentries so that it does that for the ones
+     * not in use.
+     * Note that we must not hold any of our locks while calling into
+     * fuse, as it may send us FORGETs, so only hold a use count on the
+     * session.
+     */
+    struct fuse_session *se = nullptr;
+
+    if (!kernel_entries.empty()) {
+        std::unique_lock<std::mutex> lock(fuse_se_lock_50);
+        se = fuse_se;
+        if (se) {
+            fuse_se_users++;
+        }
+    }
+
+    if (se) {
+        for (const auto& [dir_ino, name] : kernel_entries) {
+            const int ret = fuse_lowlevel_notify_inval_entry(
+                    se, dir_ino, name.c_str(), name.size());
+            if ((ret != 0) && (ret != -ENOENT)) {
+                AZLogDebug("[{}] fuse_lowlevel_notify_inval_entry({}) "
+                           "failed: {}", dir_ino, name, ret);
+                continue;
+            }
+            entries_invalidated++;
+        }
+
+        std::unique_lock<std::mutex> lock(fuse_se_lock_50);
+        assert(fuse_se_users > 0);
+        if (--fuse_se_users == 0) {
+            fuse_se_cv.notify_all();
+        }
+    }
+#endif
+
+    INC_GBL_STATS(dircaches_reclaimed, dircaches_purged);
+    INC_GBL_STATS(kernel_entries_invalidated, entries_invalidated);
+
+    /*
+     * Drop the refs held by get_if_held().
+     */
+    for (struct nfs_inode *inode : dirs) {
+        inode->decref();
+    }
+
+    AZLogInfo("Reclaimed inodes: {} -> {} inodes, {} directory caches "
+              "purged, {} kernel entries invalidated",
+              num_inodes, inode_table.size(), dircaches_purged,
+              entries_invalidated);
+
+    return dircaches_purged;
+}
+
+struct nfs_inode *nfs_client::__inode_from_inode_table(
+        const nfs_fh3 *fh,
+        const struct fattr3 *fattr,
+        uint32_t crc,
+        bool acquire_lock,
+        bool *is_forgotten)
 {
     assert(fh);
     assert(fattr);
@@ -476,35 +690,29 @@ struct nfs_inode *nfs_client::__inode_from_inode_map(const nfs_fh3 *fh,
 
     std::shared_mutex dummy_lock;
     std::shared_lock<std::shared_mutex> lock(
-            acquire_lock ? inode_map_lock_0 : dummy_lock);
+            acquire_lock ? inode_table.get_shard_lock(fattr->fileid, crc) :
+                           dummy_lock);
 
     /*
-     * Search by fileid in the multimap. Since fileid is not guaranteed to be
-     * unique, we need to check for FH match in the matched inode(s) list.
+     * Since neither fileid nor crc is guaranteed to be unique, find_nolock()
+     * matches the FH too.
      */
-    const auto range = inode_map.equal_range(fattr->fileid);
-
-    for (auto i = range.first; i != range.second; ++i) {
-        struct nfs_inode *inode = i->second;
-        assert(i->first == fattr->fileid);
-        assert(inode->magic == NFS_INODE_MAGIC);
-
-        if (!FH_EQUAL(&(inode->get_fh()), fh)) {
-            continue;
-        }
+    struct nfs_inode *inode = inode_table.find_nolock(fh, fattr->fileid, crc);
+    if (!inode) {
+        return nullptr;
+    }
 
-        // File type must not change for an inode.
-        assert(inode->file_type == file_type);
+    assert(inode->magic == NFS_INODE_MAGIC);
 
-        if (is_forgotten) {
-            *is_forgotten = inode->is_forgotten();
-        }
+    // File type must not change for an inode.
+    assert(inode->file_type == file_type);
 
-        inode->incref();
-        return inode;
+    if (is_forgotten) {
+        *is_forgotten = inode->is_forgotten();
     }
 
-    return nullptr;
+    inode->incref();
+    return inode;
 }
 
 /**
@@ -536,10 +744,11 @@ struct nfs_inode *nfs_client::__get_nfs_inode(LOC_PARAMS
      * new one. This is very important as returning multiple inodes for the
      * same file is recipe for disaster.
      */
+    const uint32_t crc = calculate_crc32(*fh);
     bool is_forgotten = false;
     struct nfs_inode *inode =
-        __inode_from_inode_map(fh, fattr, true /* acquire_lock */,
-                               &is_forgotten);
+        __inode_from_inode_table(fh, fattr, crc, true /* acquire_lock */,
+                                 &is_forgotten);
 
     if (inode) {
         std::unique_lock<std::shared_mutex> lock(inode->ilock_1);
@@ -598,7 +807,7 @@ struct nfs_inode *nfs_client::__get_nfs_inode(LOC_PARAMS
 
             nfs_client::stat_from_fattr3(inode->get_attr_nolock(), *fattr);
 
-            inode->attr_timeout_secs = inode->get_actimeo_min();
+            inode->attr_timeout_secs = inode->get_stable_actimeo();
             inode->attr_timeout_timestamp =
                 get_current_msecs() + inode->attr_timeout_secs*1000;
         } else if (fattr_compare > 0) {
@@ -643,7 +852,9 @@ struct nfs_inode *nfs_client::__get_nfs_inode(LOC_PARAMS
                       is_root_inode ? FUSE_ROOT_ID : 0);
 
     {
-        std::unique_lock<std::shared_mutex> lock(inode_map_lock_0);
+        assert(new_inode->get_crc() == crc);
+        std::unique_lock<std::shared_mutex> lock(
+                inode_table.get_shard_lock(new_inode));
 
         /*
          * With the exclusive lock held, check once more if some other thread
@@ -653,14 +864,14 @@ struct nfs_inode *nfs_client::__get_nfs_inode(LOC_PARAMS
          */
 
         struct nfs_inode *inode =
-            __inode_from_inode_map(fh, fattr, false /* acquire_lock */);
+            __inode_from_inode_table(fh, fattr, crc, false /* acquire_lock */);
 
         AZLogDebug(LOC_FMT
-                   "[{}:{} / 0x{:08x}] Allocated new inode (map size: {})",
+                   "[{}:{} / 0x{:08x}] Allocated new inode (table size: {})",
                    LOC_ARGS
                    new_inode->get_filetype_coding(),
                    new_inode->get_fuse_ino(), new_inode->get_crc(),
-                   inode_map.size());
+                   inode_table.size());
 
         if (inode) {
             AZLogWarn(LOC_FMT
@@ -699,7 +910,7 @@ struct nfs_inode *nfs_client::__get_nfs_inode(LOC_PARAMS
 
                 nfs_client::stat_from_fattr3(inode->get_attr_nolock(), *fattr);
 
-                inode->attr_timeout_secs = inode->get_actimeo_min();
+                inode->attr_timeout_secs = inode->get_stable_actimeo();
                 inode->attr_timeout_timestamp =
                     get_current_msecs() + inode->attr_timeout_secs*1000;
             }
@@ -721,14 +932,14 @@ struct nfs_inode *nfs_client::__get_nfs_inode(LOC_PARAMS
 
         new_inode->incref();
 
-        // Ok, insert the newly allocated inode in the global map.
-        inode_map.insert({fattr->fileid, new_inode});
+        // Ok, insert the newly allocated inode in the global table.
+        inode_table.insert_nolock(new_inode);
     }
 
     return new_inode;
 }
 
-// Caller must hold inode_map_lock_0.
+// Caller must hold the inode_table shard lock for inode.
 void nfs_client::put_nfs_inode_nolock(struct nfs_inode *inode,
                                       size_t dropcnt)
 {
@@ -744,7 +955,7 @@ void nfs_client::put_nfs_inode_nolock(struct nfs_inode *inode,
      * We have to reduce the lookupcnt by dropcnt regardless of whether we
      * free the inode or not. After dropping the lookupcnt if it becomes 0
      * then we proceed to perform the other checks for deciding whether the
-     * inode can be safely removed from inode_map and freed.
+     * inode can be safely removed from inode_table and freed.
      */
     inode->lookupcnt -= dropcnt;
 
@@ -766,7 +977,7 @@ void nfs_client::put_nfs_inode_nolock(struct nfs_inode *inode,
 
     /*
      * Caller should call us only for forgotten inodes but it's possible that
-     * after we held inode_map_lock_0 some other thread got a reference on
+     * after we held the shard lock some other thread got a reference on
      * this inode.
      */
     if (inode->lookupcnt > 0) {
@@ -805,29 +1016,21 @@ void nfs_client::put_nfs_inode_nolock(struct nfs_inode *inode,
 
     /*
      * Ok, inode is not referenced by fuse VFS and it's not referenced by
-     * any readdir cache, let's remove it from the inode_map. Once removed
-     * from inode_map, any subsequent get_nfs_inode() calls for this file
+     * any readdir cache, let's remove it from the inode_table. Once removed
+     * from inode_table, any subsequent get_nfs_inode() calls for this file
      * (fh and fileid) will allocate a new nfs_inode, which will most likely
      * result in a new fuse inode number.
      */
-    auto range = inode_map.equal_range(inode->get_fileid());
-
-    for (auto i = range.first; i != range.second; ++i) {
-        assert(i->first == inode->get_fileid());
-        assert(i->second->magic == NFS_INODE_MAGIC);
-
-        if (i->second == inode) {
-            AZLogDebug("[{}:{}] Deleting inode (inode_map size: {})",
-                       inode->get_filetype_coding(),
-                       inode->get_fuse_ino(),
-                       inode_map.size()-1);
-            inode_map.erase(i);
-            delete inode;
-            return;
-        }
+    if (inode_table.erase_nolock(inode)) {
+        AZLogDebug("[{}:{}] Deleting inode (inode_table size: {})",
+                   inode->get_filetype_coding(),
+                   inode->get_fuse_ino(),
+                   inode_table.size());
+        delete inode;
+        return;
     }
 
-    // We must find the inode in inode_map.
+    // We must find the inode in inode_table.
     assert(0);
 }
 
@@ -901,6 +1104,27 @@ static void lookup_sync_callback(
                 *(ctx->fattr) = *fattr;
             }
             AZLogDebug("lookup_sync_callback() got child_ino={}", *child_ino_p);
+        } else if ((rpc_status == RPC_STATUS_SUCCESS) &&
+                   (NFS_STATUS(res) == NFS3ERR_NOENT)) {
+            /*
+             * Remember the missing name in the negative DNLC, same as
+             * lookup_callback().
+             */
+            const post_op_attr& dir_attr =
+                res->LOOKUP3res_u.resfail.dir_attributes;
+
+            if (dir_attr.attributes_follow &&
+                (aznfsc_cfg.lookupcache_int == AZNFSCFG_LOOKUPCACHE_ALL)) {
+                struct nfs_inode *parent_inode =
+                    task->get_client()->get_nfs_inode_from_ino(
+                            task->rpc_api->lookup_task.get_parent_ino());
+
+                UPDATE_INODE_ATTR(parent_inode, dir_attr);
+                parent_inode->negative_add(
+                        task->rpc_api->lookup_task.get_file_name(),
+                        dir_attr.post_op_attr_u.attributes);
+            }
+            AZLogDebug("lookup_sync_callback() got NOENT");
         } else {
             AZLogError("lookup_sync_callback() failed, status={}", status);
         }
@@ -917,14 +1141,12 @@ static void lookup_sync_callback(
 
 bool nfs_client::lookup_sync(fuse_ino_t parent_ino,
                              const char* name,
-                             fuse_ino_t& child_ino)
+                             fuse_ino_t& child_ino,
+                             int *error)
 {
     assert(name != nullptr);
 
     struct nfs_inode *parent_inode = get_nfs_inode_from_ino(parent_ino);
-    const uint32_t fh_hash = parent_inode->get_crc();
-    struct nfs_context *nfs_context =
-        get_nfs_context(CONN_SCHED_FH_HASH, fh_hash);
     struct rpc_task *task = nullptr;
     struct sync_rpc_context *ctx = nullptr;
     struct rpc_pdu *pdu = nullptr;
@@ -933,6 +1155,9 @@ bool nfs_client::lookup_sync(fuse_ino_t parent_ino,
     bool success = false;
 
     child_ino = 0;
+    if (error) {
+        *error = 0;
+    }
     AZLogDebug("lookup_sync({}/{})", parent_ino, name);
 
 try_again:
@@ -947,6 +1172,7 @@ try_again:
 
         task = get_rpc_task_helper()->alloc_rpc_task(FUSE_LOOKUP);
         task->init_lookup(nullptr /* fuse_req */, name, parent_ino);
+        task->set_csched(CONN_SCHED_FH_HASH);
         task->rpc_api->pvt = &child_ino;
 
         if (ctx) {
@@ -954,11 +1180,16 @@ try_again:
         }
 
         ctx = new sync_rpc_context(task, nullptr);
-        rpc = nfs_get_rpc_context(nfs_context);
         assert(!ctx->callback_called);
 
         rpc_retry = false;
         task->get_stats().on_rpc_issue();
+        /*
+         * get_rpc_ctx() accounts the RPC against the connection till it
+         * completes or is cancelled, so that the health monitor doesn't
+         * destroy the connection while we may still cancel the pdu.
+         */
+        rpc = task->get_rpc_ctx();
         if ((pdu = rpc_nfs3_lookup_task(rpc, lookup_sync_callback,
                                         &args, ctx)) == NULL) {
             task->get_stats().on_rpc_cancel();
@@ -1019,6 +1250,9 @@ wait_more:
                            ctx->nfs_status);
                 assert(!success);
                 assert(child_ino == 0);
+                if (error) {
+                    *error = status;
+                }
             }
         }
     }
@@ -1032,95 +1266,1113 @@ wait_more:
     return success;
 }
 
-void nfs_client::access(fuse_req_t req, fuse_ino_t ino, int mask)
+/*
+ * Results of a READDIRPLUS issued by readdirplus_sync(), filled by
+ * readdirplus_sync_callback().
+ */
+struct readdirplus_sync_result
 {
-    struct rpc_task *tsk = rpc_task_helper->alloc_rpc_task(FUSE_ACCESS);
+    cookie3 cookie = 0;
+    cookieverf3 cookieverf = {};
+    bool eof = false;
+    uint64_t num_updated = 0;
+    bool add_to_dircache = false;
+};
+
+static void readdirplus_sync_callback(
+    struct rpc_context *rpc,
+    int rpc_status,
+    void *data,
+    void *private_data)
+{
+    struct sync_rpc_context *ctx = (struct sync_rpc_context *) private_data;
+    assert(ctx->magic == SYNC_RPC_CTX_MAGIC);
 
-    tsk->init_access(req, ino, mask);
-    tsk->run_access();
-}
+    rpc_task *task = ctx->task;
+    assert(task->magic == RPC_TASK_MAGIC);
+    assert(task->rpc_api->optype == FUSE_READDIRPLUS);
 
-void nfs_client::flush(fuse_req_t req, fuse_ino_t ino)
-{
-    struct rpc_task *tsk = rpc_task_helper->alloc_rpc_task(FUSE_FLUSH);
+    struct readdirplus_sync_result *result =
+        (struct readdirplus_sync_result *) task->rpc_api->pvt;
+    assert(result != nullptr);
 
-    tsk->init_flush(req, ino);
-    tsk->run_flush();
-}
+    auto res = (READDIRPLUS3res *) data;
+    const int status = task->status(rpc_status, NFS_STATUS(res));
 
-void nfs_client::write(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, size_t size, off_t off)
-{
-    struct rpc_task *tsk = rpc_task_helper->alloc_rpc_task(FUSE_WRITE);
+    ctx->rpc_status = rpc_status;
+    ctx->nfs_status = NFS_STATUS(res);
 
-    tsk->init_write(req, ino, bufv, size, off);
-    tsk->run_write();
-}
+    task->get_stats().on_rpc_complete(rpc_get_pdu(rpc), NFS_STATUS(res));
 
-void nfs_client::getattr(
-    fuse_req_t req,
-    fuse_ino_t ino,
-    struct fuse_file_info *file)
-{
-    struct nfs_inode *inode = get_nfs_inode_from_ino(ino);
+    {
+        std::unique_lock<std::mutex> lock(ctx->mutex);
 
-    /*
-     * This is to satisfy a POSIX requirement which expects utime/stat to
-     * return updated attributes after sync'ing any pending writes.
-     * If there is lot of dirty data cached this might take very long, as
-     * it'll wait for the entire data to be written and acknowledged by the
-     * NFS server.
-     *
-     * TODO: If it turns out to cause bad user experience, we can explore
-     *       updating nfs_inode::attr during writes and then returning
-     *       attributes from that instead of making a getattr call here.
-     *       We need to think carefully though.
-     */
-    if (inode->is_regfile()) {
-        AZLogDebug("[{}] Flushing file data ahead of getattr",
-                   inode->get_fuse_ino());
-        inode->flush_cache_and_wait();
-    }
+        // Must be called only once.
+        assert(!ctx->callback_called);
+        ctx->callback_called = true;
 
-    struct rpc_task *tsk = rpc_task_helper->alloc_rpc_task(FUSE_GETATTR);
+        if (status == 0) {
+            struct nfs_inode *dir_inode =
+                task->get_client()->get_nfs_inode_from_ino(
+                        task->rpc_api->readdir_task.get_ino());
+
+            UPDATE_INODE_ATTR(dir_inode,
+                              res->READDIRPLUS3res_u.resok.dir_attributes);
+
+            const struct entryplus3 *entry =
+                res->READDIRPLUS3res_u.resok.reply.entries;
+
+            if (result->add_to_dircache) {
+                result->num_updated +=
+                    task->get_client()->add_readdirplus_entries(
+                        dir_inode,
+                        task->rpc_api->readdir_task.get_offset(),
+                        res->READDIRPLUS3res_u.resok);
+            } else {
+                result->num_updated +=
+                    task->get_client()->update_inodes_from_readdirplus(entry);
+            }
 
-    tsk->init_getattr(req, ino);
-    tsk->run_getattr();
-}
+            // Cookie of the last entry, to continue from.
+            for (; entry; entry = entry->nextentry) {
+                result->cookie = entry->cookie;
+            }
 
-void nfs_client::statfs(
-    fuse_req_t req,
-    fuse_ino_t ino)
-{
-    struct rpc_task *tsk = rpc_task_helper->alloc_rpc_task(FUSE_STATFS);
+            ::memcpy(&result->cookieverf,
+                     &res->READDIRPLUS3res_u.resok.cookieverf,
+                     sizeof(result->cookieverf));
+            result->eof = res->READDIRPLUS3res_u.resok.reply.eof;
+        }
 
-    tsk->init_statfs(req, ino);
-    tsk->run_statfs();
+        ctx->cv.notify_one();
+    }
 }
 
-void nfs_client::create(
-    fuse_req_t req,
-    fuse_ino_t parent_ino,
-    const char* name,
-    mode_t mode,
-    struct fuse_file_info* file)
+bool nfs_client::readdirplus_sync(struct nfs_inode *dir,
+                                  cookie3& cookie,
+                                  cookieverf3& cookieverf,
+                                  bool& eof,
+                                  uint64_t& num_updated,
+                                  bool add_to_dircache)
 {
-    struct rpc_task *tsk = rpc_task_helper->alloc_rpc_task(FUSE_CREATE);
+    assert(dir->is_dir());
+    assert(!add_to_dircache || dir->has_dircache());
 
-    tsk->init_create_file(req, parent_ino, name, mode, file);
-    tsk->run_create_file();
-}
+    struct rpc_task *task = nullptr;
+    struct sync_rpc_context *ctx = nullptr;
+    struct rpc_pdu *pdu = nullptr;
+    struct rpc_context *rpc = nullptr;
+    struct readdirplus_sync_result result;
+    bool rpc_retry = false;
+    bool success = false;
 
-void nfs_client::mknod(
-    fuse_req_t req,
-    fuse_ino_t parent_ino,
-    const char* name,
-    mode_t mode)
-{
-    struct rpc_task *tsk = rpc_task_helper->alloc_rpc_task(FUSE_MKNOD);
+    AZLogDebug("[{}] readdirplus_sync(cookie={})", dir->get_fuse_ino(), cookie);
 
-    tsk->init_mknod(req, parent_ino, name, mode);
-    tsk->run_mknod();
-}
+try_again:
+    do {
+        READDIRPLUS3args args;
+        args.dir = dir->get_fh();
+        args.cookie = cookie;
+        ::memcpy(&args.cookieverf, &cookieverf, sizeof(args.cookieverf));
+        args.maxcount = nfs_get_readdir_maxcount(
+                get_nfs_context(CONN_SCHED_FH_HASH, dir->get_crc()));
+        args.dircount = args.maxcount;
+
+        if (task) {
+            task->free_rpc_task();
+        }
+
+        task = get_rpc_task_helper()->alloc_rpc_task(FUSE_READDIRPLUS);
+        task->init_readdirplus(nullptr /* fuse_req */, dir->get_fuse_ino(),
+                               args.maxcount, cookie, 0 /* target_offset */,
+                               nullptr /* fuse_file */);
+        task->set_csched(CONN_SCHED_FH_HASH);
+        result = readdirplus_sync_result();
+        result.cookie = cookie;
+        result.add_to_dircache = add_to_dircache;
+        task->rpc_api->pvt = &result;
+
+        if (ctx) {
+            delete ctx;
+        }
+
+        ctx = new sync_rpc_context(task, nullptr);
+        assert(!ctx->callback_called);
+
+        rpc_retry = false;
+        task->get_stats().on_rpc_issue();
+        /*
+         * get_rpc_ctx() accounts the RPC against the connection till it
+         * completes or is cancelled, so that the health monitor doesn't
+         * destroy the connection while we may still cancel the pdu.
+         */
+        rpc = task->get_rpc_ctx();
+        if ((pdu = rpc_nfs3_readdirplus_task(rpc, readdirplus_sync_callback,
+                                             &args, ctx)) == NULL) {
+            task->get_stats().on_rpc_cancel();
+            /*
+             * This call fails due to internal issues like OOM etc
+             * and not due to an actual error, hence retry.
+             */
+            rpc_retry = true;
+        }
+    } while (rpc_retry);
+
+    /*
+     * If the READDIRPLUS response doesn't come for 60 secs we give up and
+     * send a new one. We must cancel the old one.
+     */
+    {
+        std::unique_lock<std::mutex> lock(ctx->mutex);
+wait_more:
+        if (!ctx->cv.wait_for(lock, std::chrono::seconds(60),
+                              [&ctx] { return (ctx->callback_called == true); })) {
+            if (rpc_cancel_pdu(rpc, pdu) == 0) {
+                task->get_stats().on_rpc_cancel();
+                AZLogWarn("Timed out waiting for readdirplus response, "
+                          "re-issuing readdirplus!");
+                // This goto will cause the above lock to unlock.
+                goto try_again;
+            } else {
+                AZLogWarn("Timed out waiting for readdirplus response, "
+                          "couldn't cancel existing pdu, waiting some more!");
+                // This goto will *not* cause the above lock to unlock.
+                goto wait_more;
+            }
+        } else {
+            assert(ctx->callback_called);
+            assert(ctx->rpc_status != -1);
+            assert(ctx->nfs_status != -1);
+
+            const int status = task->status(ctx->rpc_status, ctx->nfs_status);
+            if (status == 0) {
+                success = true;
+                cookie = result.cookie;
+                ::memcpy(&cookieverf, &result.cookieverf, sizeof(cookieverf));
+                eof = result.eof;
+                num_updated += result.num_updated;
+            } else if (ctx->rpc_status == RPC_STATUS_SUCCESS &&
+                       ctx->nfs_status == NFS3ERR_JUKEBOX) {
+                AZLogInfo("Got NFS3ERR_JUKEBOX for READDIRPLUS, re-issuing "
+                          "after 1 sec!");
+                ::usleep(1000 * 1000);
+                // This goto will cause the above lock to unlock.
+                goto try_again;
+            } else {
+                AZLogWarn("[{}] readdirplus_sync(cookie={}) failed, "
+                          "status={}, rpc_status={}, nfs_status={}",
+                          dir->get_fuse_ino(), cookie, status,
+                          ctx->rpc_status, ctx->nfs_status);
+            }
+        }
+    }
+
+    if (task) {
+        task->free_rpc_task();
+    }
+
+    delete ctx;
+
+    return success;
+}
+
+uint64_t nfs_client::update_inodes_from_readdirplus(
+        const struct entryplus3 *entry)
+{
+    uint64_t num_updated = 0;
+
+    for (; entry; entry = entry->nextentry) {
+        if (!entry->name_attributes.attributes_follow ||
+            !entry->name_handle.handle_follows) {
+            continue;
+        }
+
+        const nfs_fh3 *fh = &entry->name_handle.post_op_fh3_u.handle;
+        const struct fattr3 *fattr =
+            &entry->name_attributes.post_op_attr_u.attributes;
+        const uint32_t crc = calculate_crc32(*fh);
+
+        /*
+         * The shard lock held shared keeps the inode from being freed while
+         * we update it, so we don't need a ref, see inode_table.
+         */
+        std::shared_lock<std::shared_mutex> lock(
+                inode_table.get_shard_lock(fattr->fileid, crc));
+
+        struct nfs_inode *inode =
+            inode_table.find_nolock(fh, fattr->fileid, crc);
+        if (!inode) {
+            continue;
+        }
+
+        /*
+         * update() refreshes the attribute cache timeout if the attributes
+         * have not changed, else it updates them and invalidates the cache
+         * as needed, same as the GETATTR we are saving.
+         */
+        inode->update(fattr);
+        num_updated++;
+
+        /*
+         * These are in dir's readdir cache, so they have bulk revalidation
+         * info, unless they were added before it was enabled.
+         */
+        struct bulk_revalidate_info *bri = inode->get_bulk_revalidate_info();
+        if (bri) {
+            bri->refreshed = true;
+        }
+    }
+
+    return num_updated;
+}
+
+void nfs_client::bulk_revalidate(struct nfs_inode *inode)
+{
+    const int threshold =
+        aznfsc_cfg.cache.attr.user.bulk_revalidate_threshold;
+
+    if ((threshold == 0) || shutting_down) {
+        return;
+    }
+
+    /*
+     * Not in any readdir cache, so we don't know the parent directory.
+     */
+    const struct bulk_revalidate_info *bri =
+        inode->get_bulk_revalidate_info();
+    const struct nfs_inode *bulk_parent = bri ? bri->parent.load() : nullptr;
+    if (!bulk_parent) {
+        return;
+    }
+
+    struct nfs_inode *dir = inode_table.get_held(bulk_parent,
+                                                 bri->parent_fileid,
+                                                 bri->parent_crc);
+    if (!dir) {
+        return;
+    }
+
+    assert(dir->is_dir());
+    assert(dir->has_dircache());
+
+    if (!dir->get_dircache()->on_child_attr_expired(inode, threshold)) {
+        dir->decref();
+        return;
+    }
+
+    AZLogDebug("[{}] Starting bulk revalidation, on behalf of ino {}",
+               dir->get_fuse_ino(), inode->get_fuse_ino());
+
+    INC_GBL_STATS(bulk_revalidations, 1);
+
+    // The ref held by get_held() is dropped once the revalidation is done.
+    const cookieverf3 cookieverf = {};
+    bulk_revalidate_rpc(dir, 0 /* cookie */, cookieverf);
+}
+
+/*
+ * Callback for the READDIRPLUS issued by bulk_revalidate_rpc().
+ * Refreshes the attributes of the inodes we have for the entries and
+ * continues with the next READDIRPLUS till eof.
+ * Errors are not retried, the children will be revalidated with GETATTR.
+ */
+static void bulk_revalidate_callback(
+    struct rpc_context *rpc,
+    int rpc_status,
+    void *data,
+    void *private_data)
+{
+    rpc_task *const task = (rpc_task*) private_data;
+    assert(task->magic == RPC_TASK_MAGIC);
+    assert(task->get_op_type() == FUSE_READDIRPLUS);
+    // Not on behalf of any fuse request.
+    assert(task->rpc_api->req == nullptr);
+
+    READDIRPLUS3res *const res = (READDIRPLUS3res*) data;
+    struct nfs_client *const client = task->get_client();
+    const fuse_ino_t dir_ino = task->rpc_api->readdir_task.get_ino();
+    struct nfs_inode *const dir_inode =
+        client->get_nfs_inode_from_ino(dir_ino);
+    const cookie3 cookie = task->rpc_api->readdir_task.get_offset();
+    const int status = task->status(rpc_status, NFS_STATUS(res));
+
+    task->get_stats().on_rpc_complete(rpc_get_pdu(rpc), NFS_STATUS(res));
+
+    // bulk_revalidate() holds a ref on the directory inode.
+    assert(dir_inode->lookupcnt > 0);
+    assert(dir_inode->has_dircache());
+
+    cookie3 next_cookie = cookie;
+    cookieverf3 cookieverf = {};
+    bool done = true;
+
+    if (status != 0) {
+        AZLogDebug("[{}] Bulk revalidate READDIRPLUS (cookie: {}) failed: {}",
+                   dir_ino, cookie, status);
+    } else {
+        UPDATE_INODE_ATTR(dir_inode,
+                          res->READDIRPLUS3res_u.resok.dir_attributes);
+
+        const struct entryplus3 *entry =
+            res->READDIRPLUS3res_u.resok.reply.entries;
+        const uint64_t num_updated =
+            client->update_inodes_from_readdirplus(entry);
+
+        for (; entry; entry = entry->nextentry) {
+            next_cookie = entry->cookie;
+        }
+
+        ::memcpy(&cookieverf, &res->READDIRPLUS3res_u.resok.cookieverf,
+                 sizeof(cookieverf));
+
+        AZLogDebug("[{}] Bulk revalidated {} inodes (cookie: {}, eof: {})",
+                   dir_ino, num_updated, cookie,
+                   res->READDIRPLUS3res_u.resok.reply.eof);
+
+        // Continue only if we made progress.
+        done = res->READDIRPLUS3res_u.resok.reply.eof ||
+               (next_cookie == cookie);
+    }
+
+    task->free_rpc_task();
+
+    if (!done) {
+        // Passes on our ref on dir_inode.
+        client->bulk_revalidate_rpc(dir_inode, next_cookie, cookieverf);
+        return;
+    }
+
+    dir_inode->get_dircache()->end_bulk_revalidate();
+
+    // Drop the ref held by bulk_revalidate().
+    dir_inode->decref();
+}
+
+void nfs_client::bulk_revalidate_rpc(struct nfs_inode *dir,
+                                     cookie3 cookie,
+                                     const cookieverf3& cookieverf)
+{
+    assert(dir->is_dir());
+    assert(dir->has_dircache());
+    assert(dir->lookupcnt > 0);
+
+    /*
+     * We are called from fuse threads, which must not wait for the
+     * READDIRPLUS, and from bulk_revalidate_callback(), i.e., from libnfs
+     * threads which must not block. Like prefetch this is optional, if we
+     * cannot get an rpc_task right away the children will be revalidated
+     * with GETATTR.
+     */
+    struct rpc_task *task = shutting_down ? nullptr :
+        get_rpc_task_helper()->try_alloc_rpc_task(FUSE_READDIRPLUS,
+                                                  RPC_PRIO_READAHEAD);
+    if (task == nullptr) {
+        AZLogDebug("[{}] Stopping bulk revalidation at cookie {}",
+                   dir->get_fuse_ino(), cookie);
+        dir->get_dircache()->end_bulk_revalidate();
+        dir->decref();
+        return;
+    }
+
+    struct nfs_context *nfs_context =
+        get_nfs_context(CONN_SCHED_FH_HASH, dir->get_crc());
+    const uint32_t maxcount = nfs_get_readdir_maxcount(nfs_context);
+
+    task->init_readdirplus(nullptr /* fuse_req */, dir->get_fuse_ino(),
+                           maxcount, cookie, 0 /* target_offset */,
+                           nullptr /* fuse_file */);
+
+    READDIRPLUS3args args;
+
+    args.dir = dir->get_fh();
+    args.cookie = cookie;
+    ::memcpy(&args.cookieverf, &cookieverf, sizeof(args.cookieverf));
+    args.maxcount = maxcount;
+    args.dircount = args.maxcount;
+
+    task->get_stats().on_rpc_issue();
+    if (rpc_nfs3_readdirplus_task(task->get_rpc_ctx(),
+                                  bulk_revalidate_callback,
+                                  &args,
+                                  task) == NULL) {
+        task->get_stats().on_rpc_cancel();
+        AZLogWarn("[{}] rpc_nfs3_readdirplus_task failed to issue, "
+                  "stopping bulk revalidation!", dir->get_fuse_ino());
+
+        dir->get_dircache()->end_bulk_revalidate();
+        dir->decref();
+        task->free_rpc_task();
+        return;
+    }
+
+    INC_GBL_STATS(bulk_revalidate_rpcs, 1);
+}
+
+/*
+ * Callback for the READDIRPLUS issued by readdirplus_prefetch().
+ * Adds the entries to the readdir cache, like readdirplus_callback() but
+ * w/o conveying them to fuse, and continues the prefetch.
+ * Errors are not retried, the application's readdirplus call will read
+ * the entries from the server and handle the error.
+ */
+static void readdirplus_prefetch_callback(
+    struct rpc_context *rpc,
+    int rpc_status,
+    void *data,
+    void *private_data)
+{
+    rpc_task *const task = (rpc_task*) private_data;
+    assert(task->magic == RPC_TASK_MAGIC);
+    assert(task->get_op_type() == FUSE_READDIRPLUS);
+    // Not on behalf of any fuse request.
+    assert(task->rpc_api->req == nullptr);
+
+    READDIRPLUS3res *const res = (READDIRPLUS3res*) data;
+    struct nfs_client *const client = task->get_client();
+    const fuse_ino_t dir_ino = task->rpc_api->readdir_task.get_ino();
+    struct nfs_inode *const dir_inode =
+        client->get_nfs_inode_from_ino(dir_ino);
+    const cookie3 cookie = task->rpc_api->readdir_task.get_offset();
+    const int status = task->status(rpc_status, NFS_STATUS(res));
+
+    task->get_stats().on_rpc_complete(rpc_get_pdu(rpc), NFS_STATUS(res));
+
+    // readdirplus_prefetch() holds a ref on the directory inode.
+    assert(dir_inode->lookupcnt > 0);
+    assert(dir_inode->has_dircache());
+
+    std::shared_ptr<readdirectory_cache>& dircache_handle =
+        dir_inode->get_dircache();
+    bool done = true;
+
+    if (status != 0) {
+        AZLogDebug("[{}] READDIRPLUS prefetch (cookie: {}) failed: {}",
+                   dir_ino, cookie, status);
+    } else {
+        UPDATE_INODE_ATTR(dir_inode,
+                          res->READDIRPLUS3res_u.resok.dir_attributes);
+
+        const uint32_t num_dirents =
+            client->add_readdirplus_entries(dir_inode, cookie,
+                                            res->READDIRPLUS3res_u.resok);
+        if (num_dirents > 0) {
+            dircache_handle->set_rpc_entries(num_dirents);
+        }
+
+        INC_GBL_STATS(readdir_prefetch_entries, num_dirents);
+
+        // Continue only if we made progress.
+        done = (num_dirents == 0);
+    }
+
+    dircache_handle->end_prefetch();
+
+    if (!done) {
+        client->readdirplus_prefetch(dir_inode);
+    }
+
+    // Drop the ref held by readdirplus_prefetch().
+    dir_inode->decref();
+
+    task->free_rpc_task();
+}
+
+void nfs_client::readdirplus_prefetch(struct nfs_inode *dir)
+{
+    assert(dir->is_dir());
+    assert(dir->has_dircache());
+
+    if ((aznfsc_cfg.readdir_prefetch == 0) || shutting_down) {
+        return;
+    }
+
+    std::shared_ptr<readdirectory_cache>& dircache_handle =
+        dir->get_dircache();
+    cookie3 cookie = 0;
+
+    if (!dircache_handle->start_prefetch(aznfsc_cfg.readdir_prefetch,
+                                         cookie)) {
+        return;
+    }
+
+    /*
+     * We are called from readdirplus_prefetch_callback() and from the
+     * readdirplus callback, i.e., from libnfs threads which must not block.
+     * Prefetch is optional, so skip it if we cannot get an rpc_task right
+     * away, the application's readdirplus will read the entries.
+     */
+    struct rpc_task *task =
+        get_rpc_task_helper()->try_alloc_rpc_task(FUSE_READDIRPLUS,
+                                                  RPC_PRIO_READAHEAD);
+    if (task == nullptr) {
+        AZLogDebug("[{}] Skipping READDIRPLUS prefetch from cookie {}, "
+                   "no free rpc_task", dir->get_fuse_ino(), cookie);
+        dircache_handle->end_prefetch();
+        return;
+    }
+
+    AZLogDebug("[{}] READDIRPLUS prefetch from cookie {}",
+               dir->get_fuse_ino(), cookie);
+
+    struct nfs_context *nfs_context =
+        get_nfs_context(CONN_SCHED_FH_HASH, dir->get_crc());
+    const uint32_t maxcount = nfs_get_readdir_maxcount(nfs_context);
+
+    task->init_readdirplus(nullptr /* fuse_req */, dir->get_fuse_ino(),
+                           maxcount, cookie, 0 /* target_offset */,
+                           nullptr /* fuse_file */);
+
+    /*
+     * Hold a ref on the directory inode till the callback, as the
+     * application may close the directory and fuse forget it, meanwhile.
+     */
+    dir->incref();
+
+    READDIRPLUS3args args;
+
+    args.dir = dir->get_fh();
+    args.cookie = cookie;
+    ::memcpy(&args.cookieverf,
+             dircache_handle->get_cookieverf(),
+             sizeof(args.cookieverf));
+    args.maxcount = maxcount;
+    args.dircount = args.maxcount;
+
+    task->get_stats().on_rpc_issue();
+    if (rpc_nfs3_readdirplus_task(task->get_rpc_ctx(),
+                                  readdirplus_prefetch_callback,
+                                  &args,
+                                  task) == NULL) {
+        task->get_stats().on_rpc_cancel();
+        /*
+         * Most common reason for this is memory allocation failure. Unlike
+         * the application RPCs we don't wait and retry, drop the prefetch.
+         */
+        AZLogWarn("[{}] rpc_nfs3_readdirplus_task failed to issue, "
+                  "skipping prefetch!", dir->get_fuse_ino());
+
+        dircache_handle->end_prefetch();
+        dir->decref();
+        task->free_rpc_task();
+        return;
+    }
+
+    INC_GBL_STATS(readdir_prefetch_rpcs, 1);
+}
+
+uint32_t nfs_client::add_readdirplus_entries(struct nfs_inode *dir,
+                                             cookie3 cookie,
+                                             const READDIRPLUS3resok& resok)
+{
+    assert(dir->is_dir());
+    assert(dir->has_dircache());
+
+    std::shared_ptr<readdirectory_cache>& dircache_handle =
+        dir->get_dircache();
+
+    if (dircache_handle->get_seq_last_cookie() < cookie) {
+        /*
+         * Cache was purged while the READDIRPLUS was in flight, these
+         * entries may be from an older enumeration.
+         */
+        AZLogDebug("[{}] Dropping READDIRPLUS (cookie: {}) results, "
+                   "readdir cache purged", dir->get_fuse_ino(), cookie);
+        return 0;
+    }
+
+    const struct entryplus3 *entry = resok.reply.entries;
+    const bool eof = resok.reply.eof;
+    int64_t eof_cookie = -1;
+    uint32_t num_dirents = 0;
+
+    for (; entry; entry = entry->nextentry) {
+        if (!entry->name_attributes.attributes_follow ||
+            !entry->name_handle.handle_follows) {
+            /*
+             * Blob NFS always sends these, we cannot add the entry to the
+             * cache w/o them. Stop here, the application will read the rest
+             * from the server.
+             */
+            eof_cookie = -1;
+            break;
+        }
+
+        if (eof) {
+            eof_cookie = entry->cookie;
+        }
+
+        const struct fattr3 *fattr =
+            &entry->name_attributes.post_op_attr_u.attributes;
+
+        /*
+         * This holds a lookupcnt ref on the inode, the directory_entry holds
+         * a dircachecnt ref, so we drop the lookupcnt ref once the entry is
+         * added to the cache.
+         */
+        struct nfs_inode *const nfs_inode =
+            get_nfs_inode(&entry->name_handle.post_op_fh3_u.handle, fattr);
+
+        /*
+         * get_nfs_inode() doesn't refresh the attribute cache timeout of an
+         * existing inode whose attributes have not changed.
+         */
+        nfs_inode->update(fattr);
+
+        std::shared_ptr<struct directory_entry> dir_entry =
+            dircache_handle->lookup(entry->cookie);
+
+        if (dir_entry) {
+            assert(dir_entry->cookie == entry->cookie);
+            if (dir_entry->nfs_inode) {
+                // Drop the extra ref held by lookup().
+                assert(dir_entry->nfs_inode->dircachecnt >= 2);
+                dir_entry->nfs_inode->dircachecnt--;
+            }
+
+            dir_entry.reset();
+            dircache_handle->remove(entry->cookie);
+        }
+
+        dir_entry = std::make_shared<struct directory_entry>(
+                                               strdup(entry->name),
+                                               entry->cookie,
+                                               nfs_inode->get_attr(),
+                                               nfs_inode);
+        dircache_handle->add(dir_entry);
+        dir_entry.reset();
+
+        nfs_inode->decref();
+        num_dirents++;
+    }
+
+    AZLogDebug("[{}] READDIRPLUS (cookie: {}) added {} entries, eof: {}, "
+               "eof_cookie: {}",
+               dir->get_fuse_ino(), cookie, num_dirents, eof, eof_cookie);
+
+    dircache_handle->set_cookieverf(&resok.cookieverf);
+
+    if (eof_cookie != -1) {
+        dircache_handle->set_eof(eof_cookie);
+        // See readdirplus_callback().
+        dircache_handle->release_held_inodes();
+    }
+
+    return num_dirents;
+}
+
+/*
+ * Append an entry for name to bs, with attributes of inode, or with error
+ * if inode is null. Returns false if bs has no space left for the entry.
+ */
+static bool bulkstat_add_entry(struct aznfsc_bulkstat& bs,
+                               const char *name,
+                               cookie3 cookie,
+                               const struct nfs_inode *inode,
+                               int error)
+{
+    assert(inode || (error > 0));
+
+    const size_t namelen = ::strlen(name);
+    // Entries are 8 byte aligned.
+    const size_t reclen =
+        (offsetof(struct aznfsc_bulkstat_entry, name) + namelen + 1 + 7) & ~7;
+
+    if ((bs.buflen + reclen) > sizeof(bs.buf)) {
+        return false;
+    }
+
+    struct aznfsc_bulkstat_entry *const e =
+        (struct aznfsc_bulkstat_entry *) (bs.buf + bs.buflen);
+
+    ::memset(e, 0, reclen);
+    e->reclen = reclen;
+    e->namelen = namelen;
+    e->cookie = cookie;
+
+    if (inode) {
+        const struct stat st = inode->get_attr();
+
+        e->ino = st.st_ino;
+        e->size = st.st_size;
+        e->blocks = st.st_blocks;
+        e->rdev = st.st_rdev;
+        e->mode = st.st_mode;
+        e->nlink = st.st_nlink;
+        e->uid = st.st_uid;
+        e->gid = st.st_gid;
+        e->atime_sec = st.st_atim.tv_sec;
+        e->atime_nsec = st.st_atim.tv_nsec;
+        e->mtime_sec = st.st_mtim.tv_sec;
+        e->mtime_nsec = st.st_mtim.tv_nsec;
+        e->ctime_sec = st.st_ctim.tv_sec;
+        e->ctime_nsec = st.st_ctim.tv_nsec;
+    } else {
+        e->error = error;
+    }
+
+    ::memcpy(e->name, name, namelen + 1);
+
+    bs.buflen += reclen;
+    bs.count++;
+
+    return true;
+}
+
+int nfs_client::bulkstat_dir(fuse_ino_t ino,
+                             cookie3 cookie,
+                             struct aznfsc_bulkstat& bs)
+{
+    struct nfs_inode *const dir = get_nfs_inode_from_ino(ino);
+
+    if (!dir->is_dir()) {
+        return ENOTDIR;
+    }
+
+    /*
+     * Like opendir(), revalidate when starting the enumeration, so that we
+     * don't return the cached entries of a directory that has changed.
+     */
+    if (cookie == 0) {
+        dir->revalidate();
+    }
+
+    dir->alloc_dircache();
+
+    std::shared_ptr<readdirectory_cache>& dircache_handle =
+        dir->get_dircache();
+    dircache_handle->clear_if_needed();
+
+    bs.count = 0;
+    bs.flags = 0;
+    bs.buflen = 0;
+
+    /*
+     * Entries upto this cookie were just read from the server, return them
+     * even if their attributes have expired (f.e. actimeo=0), else we would
+     * read them again and again.
+     */
+    cookie3 fresh_cookie = 0;
+
+    /*
+     * Last cookie returned by our own READDIRPLUS, and whether it was the
+     * last entry of the directory. Entries are walked upto the larger of
+     * this and seq_last_cookie, as cached entries beyond those may not be
+     * contiguous with the ones before them.
+     */
+    cookie3 rpc_last_cookie = 0;
+    bool rpc_eof = false;
+
+    /*
+     * Cookie the last READDIRPLUS was sent with. Every READDIRPLUS must
+     * start after the previous one, else we are not making progress (f.e.
+     * the server returns no entries or the cache can't hold them) and we
+     * would loop forever.
+     */
+    cookie3 last_rpc_cookie = 0;
+    uint64_t num_rpcs = 0;
+
+    cookieverf3 cookieverf;
+    ::memcpy(&cookieverf, dircache_handle->get_cookieverf(),
+             sizeof(cookieverf));
+
+    while (!shutting_down) {
+        const cookie3 walk_limit =
+            std::max(dircache_handle->get_seq_last_cookie(), rpc_last_cookie);
+
+        /*
+         * Don't assume the next entry has cookie+1, entries removed from
+         * the cache leave holes and other servers use arbitrary cookies.
+         * lookup_next() holds a dircachecnt ref on the inode, hold a
+         * lookupcnt ref before dropping that, see
+         * readdirectory_cache::dnlc_lookup().
+         */
+        std::shared_ptr<struct directory_entry> entry =
+            dircache_handle->lookup_next(cookie, walk_limit);
+        struct nfs_inode *inode = nullptr;
+
+        if (entry && entry->nfs_inode) {
+            inode = entry->nfs_inode;
+            inode->incref();
+            assert(inode->dircachecnt >= 2);
+            inode->dircachecnt--;
+        }
+
+        if (inode &&
+            (!inode->attr_cache_expired() || (entry->cookie <= fresh_cookie))) {
+            const cookie3 next_cookie = entry->cookie;
+            const bool added =
+                entry->is_dot_or_dotdot() ||
+                bulkstat_add_entry(bs, entry->name, entry->cookie, inode, 0);
+
+            entry.reset();
+            inode->decref();
+
+            if (!added) {
+                break;
+            }
+
+            cookie = next_cookie;
+            continue;
+        }
+
+        /*
+         * Not cached, cached w/o attributes (by READDIR) or with expired
+         * attributes, read from the server.
+         */
+        entry.reset();
+        if (inode) {
+            inode->decref();
+        }
+
+        if ((dircache_handle->get_eof() &&
+             (cookie >= dircache_handle->get_eof_cookie())) ||
+            (rpc_eof && (cookie >= rpc_last_cookie))) {
+            bs.flags |= AZNFSC_BULKSTAT_EOF;
+            break;
+        }
+
+        /*
+         * Entries are only added to the cache after the ones already cached,
+         * see add_readdirplus_entries(), so if the cache was purged since
+         * the caller's last call, read from where it ends. Each READDIRPLUS
+         * brings many more entries than fit in bs, so this is rare.
+         */
+        cookie3 rpc_cookie = std::min(cookie, walk_limit);
+        bool eof = false;
+        uint64_t num_added = 0;
+
+        if ((num_rpcs > 0) && (rpc_cookie <= last_rpc_cookie)) {
+            AZLogWarn("[{}] bulkstat_dir: READDIRPLUS(cookie={}) not making "
+                      "progress, last READDIRPLUS cookie: {}",
+                      ino, rpc_cookie, last_rpc_cookie);
+            if (bs.count == 0) {
+                return EIO;
+            }
+            break;
+        }
+
+        last_rpc_cookie = rpc_cookie;
+        num_rpcs++;
+
+        if (!readdirplus_sync(dir, rpc_cookie, cookieverf, eof, num_added,
+                              true /* add_to_dircache */)) {
+            if (bs.count == 0) {
+                return EIO;
+            }
+            break;
+        }
+
+        /*
+         * readdirplus_sync() updates rpc_cookie to the cookie of the last
+         * entry returned, it's unchanged if no entries were returned.
+         */
+        if (rpc_cookie == last_rpc_cookie) {
+            if (eof) {
+                bs.flags |= AZNFSC_BULKSTAT_EOF;
+            } else if (bs.count == 0) {
+                return EIO;
+            }
+            break;
+        }
+
+        rpc_last_cookie = rpc_cookie;
+        rpc_eof = eof;
+        fresh_cookie = rpc_cookie;
+    }
+
+    bs.cookie = cookie;
+
+    AZLogDebug("[{}] bulkstat_dir returning {} entries ({} bytes), "
+               "cookie: {}, eof: {}, READDIRPLUS: {}",
+               ino, bs.count, bs.buflen, bs.cookie,
+               !!(bs.flags & AZNFSC_BULKSTAT_EOF), num_rpcs);
+
+    INC_GBL_STATS(bulkstat_calls, 1);
+    INC_GBL_STATS(bulkstat_entries, bs.count);
+
+    return 0;
+}
+
+int nfs_client::bulkstat_names(fuse_ino_t ino,
+                               const struct aznfsc_bulkstat& names,
+                               struct aznfsc_bulkstat& bs)
+{
+    struct nfs_inode *const dir = get_nfs_inode_from_ino(ino);
+
+    if (!dir->is_dir()) {
+        return ENOTDIR;
+    }
+
+    // Names must be NUL terminated.
+    if ((names.buflen > sizeof(names.buf)) ||
+        ((names.buflen > 0) && (names.buf[names.buflen - 1] != '\0'))) {
+        return EINVAL;
+    }
+
+    // Revalidate to ensure DNLC can be safely used.
+    dir->revalidate();
+
+    bs.cookie = 0;
+    bs.count = 0;
+    bs.flags = 0;
+    bs.buflen = 0;
+
+    const char *name = names.buf;
+    const char *const end = names.buf + names.buflen;
+
+    while ((name < end) && !shutting_down) {
+        const size_t namelen = ::strlen(name);
+        struct nfs_inode *inode = nullptr;
+        int error = 0;
+
+        if (namelen == 0) {
+            error = EINVAL;
+        } else if (namelen > NAME_MAX) {
+            error = ENAMETOOLONG;
+        } else if ((inode = dir->dnlc_lookup(name)) != nullptr) {
+            if (inode->attr_cache_expired()) {
+                struct fattr3 fattr;
+
+                if (getattr_sync(inode->get_fh(), inode->get_fuse_ino(),
+                                 fattr)) {
+                    inode->update(&fattr);
+                } else {
+                    error = EIO;
+                }
+            }
+        } else if (dir->negative_lookup(name)) {
+            error = ENOENT;
+        } else {
+            fuse_ino_t child_ino = 0;
+
+            /*
+             * On NOENT lookup_sync() adds name to the negative DNLC, so
+             * that asking for it again doesn't go to the server.
+             */
+            if (lookup_sync(ino, name, child_ino, &error)) {
+                inode = get_nfs_inode_from_ino(child_ino);
+                dir->dnlc_add(name, inode);
+            }
+            assert((inode != nullptr) == (error == 0));
+        }
+
+        const bool added =
+            bulkstat_add_entry(bs, name, 0, error ? nullptr : inode, error);
+
+        // Drop the ref held by dnlc_lookup()/lookup_sync().
+        if (inode) {
+            inode->decref();
+        }
+
+        if (!added) {
+            break;
+        }
+
+        name += namelen + 1;
+    }
+
+    AZLogDebug("[{}] bulkstat_names returning {} entries ({} bytes)",
+               ino, bs.count, bs.buflen);
+
+    INC_GBL_STATS(bulkstat_calls, 1);
+    INC_GBL_STATS(bulkstat_entries, bs.count);
+
+    return 0;
+}
+
+void nfs_client::access(fuse_req_t req, fuse_ino_t ino, int mask)
+{
+    struct rpc_task *tsk = rpc_task_helper->alloc_rpc_task(FUSE_ACCESS);
+
+    tsk->init_access(req, ino, mask);
+    tsk->run_access();
+}
+
+void nfs_client::flush(fuse_req_t req, fuse_ino_t ino)
+{
+    struct rpc_task *tsk = rpc_task_helper->alloc_rpc_task(FUSE_FLUSH);
+
+    tsk->init_flush(req, ino);
+    tsk->run_flush();
+}
+
+void nfs_client::write(fuse_req_t req, fuse_ino_t ino, struct fuse_bufvec *bufv, size_t size, off_t off)
+{
+    struct rpc_task *tsk = rpc_task_helper->alloc_rpc_task(FUSE_WRITE);
+
+    tsk->init_write(req, ino, bufv, size, off);
+    tsk->run_write();
+}
+
+void nfs_client::getattr(
+    fuse_req_t req,
+    fuse_ino_t ino,
+    struct fuse_file_info *file)
+{
+    struct nfs_inode *inode = get_nfs_inode_from_ino(ino);
+
+    /*
+     * This is to satisfy a POSIX requirement which expects utime/stat to
+     * return updated attributes after sync'ing any pending writes.
+     * If there is lot of dirty data cached this might take very long, as
+     * it'll wait for the entire data to be written and acknowledged by the
+     * NFS server.
+     *
+     * TODO: If it turns out to cause bad user experience, we can explore
+     *       updating nfs_inode::attr during writes and then returning
+     *       attributes from that instead of making a getattr call here.
+     *       We need to think carefully though.
+     */
+    if (inode->is_regfile()) {
+        AZLogDebug("[{}] Flushing file data ahead of getattr",
+                   inode->get_fuse_ino());
+        /*
+         * getattr cannot convey write errors, any error is saved by
+         * flush_cache_and_wait() and reported by the next flush/close.
+         */
+        inode->flush_cache_and_wait();
+    }
+
+    struct rpc_task *tsk = rpc_task_helper->alloc_rpc_task(FUSE_GETATTR);
+
+    tsk->init_getattr(req, ino);
+    tsk->run_getattr();
+}
+
+void nfs_client::statfs(
+    fuse_req_t req,
+    fuse_ino_t ino)
+{
+    struct rpc_task *tsk = rpc_task_helper->alloc_rpc_task(FUSE_STATFS);
+
+    tsk->init_statfs(req, ino);
+    tsk->run_statfs();
+}
+
+void nfs_client::create(
+    fuse_req_t req,
+    fuse_ino_t parent_ino,
+    const char* name,
+    mode_t mode,
+    struct fuse_file_info* file)
+{
+    struct rpc_task *tsk = rpc_task_helper->alloc_rpc_task(FUSE_CREATE);
+
+    tsk->init_create_file(req, parent_ino, name, mode, file);
+    tsk->run_create_file();
+}
+
+void nfs_client::mknod(
+    fuse_req_t req,
+    fuse_ino_t parent_ino,
+    const char* name,
+    mode_t mode)
+{
+    struct rpc_task *tsk = rpc_task_helper->alloc_rpc_task(FUSE_MKNOD);
+
+    tsk->init_mknod(req, parent_ino, name, mode);
+    tsk->run_mknod();
+}
 
 void nfs_client::mkdir(
     fuse_req_t req,
@@ -1385,10 +2637,15 @@ void nfs_client::read(
 /*
  * This function will be called only to retry the write requests that failed
  * with JUKEBOX error.
- * rpc_api defines the RPC request that need to be retried.
+ * js->rpc_api defines the RPC request that need to be retried. The retry is
+ * issued with the priority of the failed rpc_task, so that f.e. a WRITE
+ * issued by an application flush is not demoted to background flush
+ * priority on retry.
  */
-void nfs_client::jukebox_flush(struct api_task_info *rpc_api)
+void nfs_client::jukebox_flush(struct jukebox_seedinfo *js)
 {
+    struct api_task_info *rpc_api = js->rpc_api;
+
     /*
      * For write task pvt has write_iov_context, which has copy of byte_chunk vector.
      * To proceed it should be valid.
@@ -1397,7 +2654,7 @@ void nfs_client::jukebox_flush(struct api_task_info *rpc_api)
     assert(rpc_api->optype == FUSE_FLUSH);
 
     struct rpc_task *flush_task =
-        get_rpc_task_helper()->alloc_rpc_task(FUSE_FLUSH);
+        get_rpc_task_helper()->alloc_rpc_task(FUSE_FLUSH, js->prio);
     flush_task->init_flush(nullptr /* fuse_req */,
                            rpc_api->flush_task.get_ino());
     // Any new task should start fresh as a parent task.
@@ -1457,7 +2714,7 @@ void nfs_client::jukebox_read(struct api_task_info *rpc_api)
      * Since we are retrying this child task, the parent read task should have
      * atleast 1 ongoing read.
      */
-    assert(parent_task->num_ongoing_backend_reads > 0);
+    assert(parent_task->backend_reads.get_pending() > 0);
 
     /*
      * Child task should always read a subset of the parent task.
@@ -1645,7 +2902,8 @@ void nfs_client::jukebox_retry(struct rpc_task *task)
          * Transfer ownership of rpc_api from rpc_task to jukebox_seedinfo.
          */
         std::unique_lock<std::mutex> lock(jukebox_seeds_lock_39);
-        jukebox_seeds.emplace(new jukebox_seedinfo(task->rpc_api));
+        jukebox_seeds.emplace(new jukebox_seedinfo(task->rpc_api,
+                                                    task->get_prio()));
 
         task->rpc_api = nullptr;
     }
@@ -1831,7 +3089,6 @@ bool nfs_client::getattr_sync(const struct nfs_fh3& fh,
 {
     const uint32_t fh_hash = calculate_crc32(
             (const unsigned char *) fh.data.data_val, fh.data.data_len);
-    struct nfs_context *nfs_context = get_nfs_context(CONN_SCHED_FH_HASH, fh_hash);
     struct rpc_task *task = nullptr;
     struct sync_rpc_context *ctx = nullptr;
     struct rpc_pdu *pdu = nullptr;
@@ -1855,6 +3112,7 @@ try_again:
             }
             task = get_rpc_task_helper()->alloc_rpc_task(FUSE_GETATTR);
             task->init_getattr(nullptr /* fuse_req */, ino);
+            task->set_csched(CONN_SCHED_FH_HASH);
         } else {
             assert(ino == FUSE_ROOT_ID);
         }
@@ -1864,11 +3122,20 @@ try_again:
         }
 
         ctx = new sync_rpc_context(task, &fattr);
-        rpc = nfs_get_rpc_context(nfs_context);
 
         rpc_retry = false;
         if (task) {
             task->get_stats().on_rpc_issue();
+            /*
+             * get_rpc_ctx() accounts the RPC against the connection till it
+             * completes or is cancelled, so that the health monitor doesn't
+             * destroy the connection while we may still cancel the pdu.
+             */
+            rpc = task->get_rpc_ctx();
+        } else {
+            // Called from init(), no health monitor yet.
+            rpc = nfs_get_rpc_context(
+                    get_nfs_context(CONN_SCHED_FH_HASH, fh_hash));
         }
         if ((pdu = rpc_nfs3_getattr_task(rpc, getattr_sync_callback,
                                          &args, ctx)) == NULL) {
@@ -3,6 +3,12 @@
 #include "file_cache.h"
 #include "rpc_task.h"
 
+/* static */ std::atomic<uint64_t> nfs_inode::num_inodes_g = 0;
+/* static */ std::atomic<uint64_t> nfs_inode::num_dircache_g = 0;
+/* static */ std::atomic<uint64_t> nfs_inode::num_rastate_g = 0;
+/* static */ std::atomic<uint64_t> nfs_inode::num_silly_rename_g = 0;
+/* static */ std::atomic<uint64_t> nfs_inode::num_bulk_revalidate_g = 0;
+
 /**
  * Constructor.
  * nfs_client must be known when nfs_inode is being created.
@@ -16,11 +22,11 @@ nfs_inode::nfs_inode(const struct nfs_fh3 *filehandle,
                      uint32_t _file_type,
                      fuse_ino_t _ino) :
     file_type(_file_type),
-    fh(*filehandle),
-    crc(calculate_crc32(fh.get_fh())),
     ino(_ino == 0 ? (fuse_ino_t) this : _ino),
     generation(get_current_usecs()),
-    client(_client)
+    client(_client),
+    crc(calculate_crc32(*filehandle)),
+    fh(*filehandle)
 {
     // Sanity asserts.
     assert(magic == NFS_INODE_MAGIC);
@@ -28,7 +34,6 @@ nfs_inode::nfs_inode(const struct nfs_fh3 *filehandle,
     assert(fattr != nullptr);
     assert(client != nullptr);
     assert(client->magic == NFS_CLIENT_MAGIC);
-    assert(write_error == 0);
 
 #ifndef ENABLE_NON_AZURE_NFS
     // Blob NFS supports only these file types.
@@ -51,7 +56,7 @@ nfs_inode::nfs_inode(const struct nfs_fh3 *filehandle,
     // file type as per fattr should match the one passed explicitly..
     assert((attr.st_mode & S_IFMT) == file_type);
 
-    attr_timeout_secs = get_actimeo_min();
+    attr_timeout_secs = get_stable_actimeo();
     attr_timeout_timestamp = get_current_msecs() + attr_timeout_secs*1000;
 
     /*
@@ -69,9 +74,10 @@ nfs_inode::nfs_inode(const struct nfs_fh3 *filehandle,
     assert(lookupcnt == 0);
     assert(dircachecnt == 0);
 
-    assert(!is_silly_renamed);
-    assert(silly_renamed_name.empty());
-    assert(parent_ino == 0);
+    assert(!silly_rename_state);
+    assert(!bulk_revalidate_state);
+
+    num_inodes_g++;
 }
 
 nfs_inode::~nfs_inode()
@@ -116,19 +122,45 @@ nfs_inode::~nfs_inode()
     assert(client != nullptr);
     assert(client->magic == NFS_CLIENT_MAGIC);
 
+    struct silly_rename_info *sri = silly_rename_state;
+    if (sri) {
 #ifdef ENABLE_PARANOID
-    if (is_silly_renamed) {
-        assert(!silly_renamed_name.empty());
-        assert(parent_ino != 0);
-    } else {
-        assert(silly_renamed_name.empty());
-        assert(parent_ino == 0);
-    }
+        if (sri->is_silly_renamed) {
+            assert(!sri->name.empty());
+            assert(sri->parent_ino != 0);
+        } else {
+            assert(sri->name.empty());
+            assert(sri->parent_ino == 0);
+        }
 #endif
+        delete sri;
+        assert(num_silly_rename_g > 0);
+        num_silly_rename_g--;
+    }
+
+    struct bulk_revalidate_info *bri = bulk_revalidate_state;
+    if (bri) {
+        delete bri;
+        assert(num_bulk_revalidate_g > 0);
+        num_bulk_revalidate_g--;
+    }
+
+    if (dircache_alloced) {
+        assert(num_dircache_g > 0);
+        num_dircache_g--;
+    }
+
+    if (rastate_alloced) {
+        assert(num_rastate_g > 0);
+        num_rastate_g--;
+    }
+
+    assert(num_inodes_g > 0);
+    num_inodes_g--;
 }
 
 /**
- * LOCKS: inode_map_lock_0.
+ * LOCKS: inode_table shard_lock_0.
  *        readdircache_lock_2 for directory.
  *        chunkmap_lock_43 for file.
  */
@@ -201,7 +233,7 @@ try_again:
         /*
          * Reduce the extra refcnt and revert the cnt.
          * After this the inode will have 'cnt' references that need to be
-         * dropped by put_nfs_inode() call below, with inode_map_lock_0 held.
+         * dropped by put_nfs_inode() call below, with the shard lock held.
          */
         lookupcnt += (cnt - 1);
         assert(lookupcnt >= cnt);
@@ -224,10 +256,10 @@ try_again:
         /*
          * This FORGET would drop the lookupcnt to 0, fuse vfs should not send
          * any more forgets, delete the inode. Note that before we grab the
-         * inode_map_lock_0 in put_nfs_inode() some other thread can reuse the
+         * shard lock in put_nfs_inode() some other thread can reuse the
          * forgotten inode, in which case put_nfs_inode() will just skip it.
          *
-         * TODO: In order to avoid taking inode_map_lock_0 for every forget,
+         * TODO: In order to avoid taking the shard lock for every forget,
          *       see if we should batch them in a threadlocal vector and call
          *       put_nfs_inodes() for a batch.
          */
@@ -272,6 +304,45 @@ bool nfs_inode::in_ra_window(uint64_t offset, uint64_t length) const
     return get_rastate()->in_ra_window(offset, length);
 }
 
+bool nfs_inode::negative_lookup(const char *filename) const
+{
+    assert(is_dir());
+    assert(filename != nullptr);
+
+    if (!has_dircache() || attr_cache_expired()) {
+        return false;
+    }
+
+    /*
+     * get_attr() takes shared ilock_1, release it before
+     * readdirectory_cache::negative_lookup() takes readdircache_lock_2.
+     */
+    const struct stat attr = get_attr();
+    const uint64_t dir_ctime =
+        (attr.st_ctim.tv_sec * 1000'000'000ULL) + attr.st_ctim.tv_nsec;
+
+    return dircache_handle->negative_lookup(filename, dir_ctime);
+}
+
+void nfs_inode::negative_add(const char *filename,
+                             const struct fattr3& dir_attr)
+{
+    assert(is_dir());
+    assert(filename != nullptr);
+
+    const int max_entries = aznfsc_cfg.cache.attr.user.negative_max_per_dir;
+    if (max_entries == 0) {
+        return;
+    }
+
+    const uint64_t dir_ctime =
+        (dir_attr.ctime.seconds * 1000'000'000ULL) + dir_attr.ctime.nseconds;
+
+    alloc_dircache();
+
+    dircache_handle->negative_add(filename, dir_ctime, max_entries);
+}
+
 /**
  * Note: nfs_inode::lookup() method currently has limited usage.
  *       It is only meant to be called from silly_rename() where we know
@@ -281,7 +352,7 @@ bool nfs_inode::in_ra_window(uint64_t offset, uint64_t length) const
  *       and depend on the kernel holding a use count on the inode.
  *       Even if the parent dir mtime changes and we do a revalidate() and
  *       lookup_sync(), the corresponding nfs_inode will still be present in
- *       our inode_map since kernel wouldn't have called forget on the inode.
+ *       our inode_table since kernel wouldn't have called forget on the inode.
  */
 struct nfs_inode *nfs_inode::lookup(const char *filename)
 {
@@ -360,7 +431,145 @@ int nfs_inode::get_actimeo_max() const
     }
 }
 
-void nfs_inode::sync_membufs(std::vector<bytes_chunk> &bc_vec, bool is_flush)
+int nfs_inode::get_stable_actimeo() const
+{
+    const int actimeo_min = get_actimeo_min();
+
+    if (!aznfsc_cfg.cache.attr.user.adaptive_actimeo) {
+        return actimeo_min;
+    }
+
+    const int64_t last_change_secs =
+        std::max(attr.st_mtim.tv_sec, attr.st_ctim.tv_sec);
+    const int64_t age_secs = (get_current_msecs() / 1000) - last_change_secs;
+
+    /*
+     * Changed in the future as per our clock, can't tell much.
+     */
+    if (age_secs <= 0) {
+        return actimeo_min;
+    }
+
+    return std::clamp((int64_t) (age_secs / ATTR_AGE_DIVISOR),
+                      (int64_t) actimeo_min,
+                      (int64_t) get_actimeo_max());
+}
+
+bool nfs_inode::fill_write_gap(struct rpc_task *flush_task,
+                               const struct bytes_chunk& bc)
+{
+    static const uint64_t max_gap = aznfsc_cfg.write_gap_fill_kb * 1024ULL;
+
+    if (max_gap == 0) {
+        return false;
+    }
+
+    /*
+     * Don't fill gaps while writes to this file are failing, the write would
+     * most likely fail again and there's no point in making it larger.
+     * bc is locked by the caller.
+     */
+    if (filecache_handle->get_write_error() != 0 ||
+        bc.get_membuf()->get_write_error() != 0) {
+        return false;
+    }
+
+    const struct bc_iovec *bciov = (struct bc_iovec *) flush_task->rpc_api->pvt;
+    assert(bciov->magic == BC_IOVEC_MAGIC);
+
+    // Gap filling is done only before the write is dispatched.
+    assert(bciov->iovcnt > 0);
+    assert(bciov->offset == bciov->orig_offset);
+
+    const uint64_t gap_start = bciov->offset + bciov->length;
+    if (bc.offset <= gap_start) {
+        return false;
+    }
+
+    const uint64_t gap_len = bc.offset - gap_start;
+    if (gap_len > max_gap) {
+        return false;
+    }
+
+    // Whole thing must fit in a single WRITE.
+    if ((bciov->length + gap_len + bc.length) >
+        (uint64_t) get_client()->mnt_options.wsize_adj) {
+        return false;
+    }
+
+    std::vector<bytes_chunk> gap_vec =
+        filecache_handle->get_clean_bc_range(gap_start, bc.offset);
+    if (gap_vec.empty()) {
+        return false;
+    }
+
+    bool can_fill =
+        ((bciov->iovcnt + gap_vec.size() + 1) <= BC_IOVEC_MAX_VECTORS);
+
+    /*
+     * Lock the gap membufs. We are holding the lock on the already queued
+     * membufs and bc, so use try_lock() to avoid deadlocking with other
+     * threads. Membufs found locked are being read/written by someone else,
+     * just skip gap filling in that case.
+     */
+    size_t nlocked = 0;
+    for (; can_fill && (nlocked < gap_vec.size()); nlocked++) {
+        struct membuf *mb = gap_vec[nlocked].get_membuf();
+
+        if (!mb->try_lock()) {
+            can_fill = false;
+            break;
+        }
+
+        // Recheck after getting the lock.
+        if (!mb->is_uptodate() || mb->is_dirty() || mb->is_flushing()) {
+            mb->clear_locked();
+            can_fill = false;
+            break;
+        }
+    }
+
+    if (!can_fill) {
+        for (size_t i = 0; i < gap_vec.size(); i++) {
+            if (i < nlocked) {
+                gap_vec[i].get_membuf()->clear_locked();
+            }
+            gap_vec[i].get_membuf()->clear_inuse();
+        }
+        return false;
+    }
+
+    AZLogDebug("[{}] Filling write gap [{}, {}) with {} cached chunk(s)",
+               ino, gap_start, bc.offset, gap_vec.size());
+
+    /*
+     * Gap membufs hold the same data as the Blob, mark them dirty so that
+     * they are written and cleaned like any other dirty membuf. If the write
+     * fails they are made clean again and not charged with the error, see
+     * bc_iovec::on_io_fail().
+     * The inuse count and lock are now owned by the flush_task and will be
+     * dropped by write_iov_callback().
+     */
+    for (struct bytes_chunk& gap_bc : gap_vec) {
+        gap_bc.get_membuf()->set_dirty();
+        gap_bc.is_gap_fill = true;
+
+        [[maybe_unused]] const bool res = flush_task->add_bc(gap_bc);
+        assert(res == true);
+    }
+
+    [[maybe_unused]] const bool res = flush_task->add_bc(bc);
+    assert(res == true);
+
+    INC_GBL_STATS(write_gaps_filled, 1);
+    INC_GBL_STATS(bytes_write_gap_filled, gap_len);
+
+    return true;
+}
+
+void nfs_inode::sync_membufs(std::vector<bytes_chunk> &bc_vec,
+                             bool is_flush,
+                             struct flush_waiter *waiter)
 {
     if (bc_vec.empty()) {
         return;
@@ -368,8 +577,29 @@ void nfs_inode::sync_membufs(std::vector<bytes_chunk> &bc_vec, bool is_flush)
 
     /*
      * Create the flush task to carry out the write.
+     * Writeback that no one is waiting for is low priority, while flush
+     * (close/fsync/inline write) holds up the application.
      */
     struct rpc_task *flush_task = nullptr;
+    const rpc_prio_t prio = is_flush ? RPC_PRIO_FG : RPC_PRIO_BG_FLUSH;
+
+    /*
+     * alloc_rpc_task() may block, so we must not call it while holding a
+     * membuf lock, else writers/flushers waiting on that membuf wait for an
+     * rpc_task too. We allocate the rpc_task for the next WRITE before
+     * locking the membuf and keep it in spare_task till it's needed.
+     */
+    struct rpc_task *spare_task = nullptr;
+    auto take_spare_task = [&]() {
+        assert(spare_task != nullptr);
+        struct rpc_task *task = spare_task;
+        spare_task = nullptr;
+
+        task->init_flush(nullptr /* fuse_req */, ino);
+        assert(task->rpc_api->pvt == nullptr);
+        task->rpc_api->pvt = new bc_iovec(this, waiter);
+        return task;
+    };
 
     // Flush dirty membufs to backend.
     for (bytes_chunk &bc : bc_vec) {
@@ -426,7 +656,6 @@ void nfs_inode::sync_membufs(std::vector<bytes_chunk> &bc_vec, bool is_flush)
          *
          * Note that we allocate the rpc_task for flush before the lock as it may
          * block.
-         * TODO: We don't do it currently, fix this!
          */
         if (mb->is_flushing() || !mb->is_dirty()) {
             mb->clear_inuse();
@@ -434,6 +663,12 @@ void nfs_inode::sync_membufs(std::vector<bytes_chunk> &bc_vec, bool is_flush)
             continue;
         }
 
+        if (spare_task == nullptr) {
+            spare_task =
+                get_client()->get_rpc_task_helper()->alloc_rpc_task(
+                    FUSE_FLUSH, prio);
+        }
+
         mb->set_locked();
         if (mb->is_flushing() || !mb->is_dirty()) {
             mb->clear_locked();
@@ -443,11 +678,7 @@ void nfs_inode::sync_membufs(std::vector<bytes_chunk> &bc_vec, bool is_flush)
         }
 
         if (flush_task == nullptr) {
-            flush_task =
-                get_client()->get_rpc_task_helper()->alloc_rpc_task(FUSE_FLUSH);
-            flush_task->init_flush(nullptr /* fuse_req */, ino);
-            assert(flush_task->rpc_api->pvt == nullptr);
-            flush_task->rpc_api->pvt = new bc_iovec(this);
+            flush_task = take_spare_task();
         }
 
         /*
@@ -456,6 +687,12 @@ void nfs_inode::sync_membufs(std::vector<bytes_chunk> &bc_vec, bool is_flush)
          */
         if (flush_task->add_bc(bc)) {
             continue;
+        } else if (fill_write_gap(flush_task, bc)) {
+            /*
+             * Gap b/w the last queued bytes_chunk and bc filled with cached
+             * data, bc is added to flush_task.
+             */
+            continue;
         } else {
             /*
              * This flush_task will orchestrate this write.
@@ -466,11 +703,7 @@ void nfs_inode::sync_membufs(std::vector<bytes_chunk> &bc_vec, bool is_flush)
              * Create the new flush task to carry out the write for next bc,
              * which we failed to add to the existing flush_task.
              */
-            flush_task =
-                get_client()->get_rpc_task_helper()->alloc_rpc_task(FUSE_FLUSH);
-            flush_task->init_flush(nullptr /* fuse_req */, ino);
-            assert(flush_task->rpc_api->pvt == nullptr);
-            flush_task->rpc_api->pvt = new bc_iovec(this);
+            flush_task = take_spare_task();
 
             // Single bc addition should not fail.
             [[maybe_unused]] bool res = flush_task->add_bc(bc);
@@ -482,6 +715,11 @@ void nfs_inode::sync_membufs(std::vector<bytes_chunk> &bc_vec, bool is_flush)
     if (flush_task) {
         flush_task->issue_write_rpc();
     }
+
+    // Membufs we allocated it for were flushed by someone else.
+    if (spare_task) {
+        spare_task->free_rpc_task();
+    }
 }
 
 /**
@@ -678,18 +916,6 @@ int nfs_inode::flush_cache_and_wait(uint64_t start_off, uint64_t end_off)
         return 0;
     }
 
-    /*
-     * Check if any write error set, if set don't attempt the flush and fail
-     * the flush operation.
-     */
-    const int error_code = get_write_error();
-    if (error_code != 0) {
-        AZLogWarn("[{}] Previous write to this Blob failed with error={}, "
-                  "skipping new flush!", ino, error_code);
-
-        return error_code;
-    }
-
     /*
      * If flush() is called w/o open(), there won't be any cache, skip.
      */
@@ -709,76 +935,145 @@ int nfs_inode::flush_cache_and_wait(uint64_t start_off, uint64_t end_off)
     /*
      * sync_membufs() iterate over the bc_vec and start flushing the dirty membufs.
      * It batches the contigious dirty membufs and issues a single write RPC for them.
+     * All the writes are issued before we wait for any of them, so that they
+     * can all be in flight together (across all connections), and we then
+     * wait for all of them to complete on the flush_waiter.
      */
-    sync_membufs(bc_vec, true);
+    struct flush_waiter waiter;
+    sync_membufs(bc_vec, true, &waiter);
+    waiter.wait();
 
     /*
      * Our caller expects us to return only after the flush completes.
-     * Wait for all the membufs to flush and get result back.
+     * All the writes issued by us have completed, but some membufs may be
+     * getting flushed by other threads, wait for those and get result back.
+     * For membufs flushed by us the lock will be uncontended.
      */
+    int error = 0;
     for (bytes_chunk &bc : bc_vec) {
-        struct membuf *mb = bc.get_membuf();
+        const int err = wait_for_flush(bc);
+        if (error == 0) {
+            error = err;
+        }
+    }
 
-        assert(mb != nullptr);
-        assert(mb->is_inuse());
-        mb->set_locked();
+    if (error != 0) {
+        invalidate_cache();
+    }
 
-        /*
+    return error;
+}
+
+int nfs_inode::wait_for_dirty_below(uint64_t max_dirty)
+{
+    assert(is_regfile());
+    assert(has_filecache());
+
+    if (filecache_handle->bytes_dirty <= max_dirty) {
+        return 0;
+    }
+
+    /*
+     * bc_vec is in offset order, for a streaming writer that's the order in
+     * which the WRITEs were issued, so we wait for the oldest WRITEs first
+     * and stop as soon as enough of them have completed. The WRITEs issued
+     * after those stay in flight.
+     */
+    std::vector<bytes_chunk> bc_vec =
+        filecache_handle->get_dirty_bc_range(0, UINT64_MAX);
+
+    int error = 0;
+    for (bytes_chunk &bc : bc_vec) {
+        if ((error == 0) && (filecache_handle->bytes_dirty > max_dirty)) {
+            error = wait_for_flush(bc);
+        } else {
+            bc.get_membuf()->clear_inuse();
+            filecache_handle->release(bc.offset, bc.length);
+        }
+    }
+
+    if (error != 0) {
+        invalidate_cache();
+    }
+
+    return error;
+}
+
+int nfs_inode::wait_for_flush(struct bytes_chunk& bc)
+{
+    struct membuf *mb = bc.get_membuf();
+    int error = 0;
+
+    assert(mb != nullptr);
+    assert(mb->is_inuse());
+    mb->set_locked();
+
+    /*
          * If still dirty after we get the lock, it may mean two things:
-         * - Write failed.
+         * - Write failed, membuf will have the error recorded.
          * - Some other thread got the lock before us and it made the
          *   membuf dirty again.
+         * A failed range is dropped from the dirty data, else it'd be
+         * written again and fail every later flush/close of the file. The
+         * error is saved in the file cache till flush/fsync/close report it
+         * to the application, as our caller may not be one of those. The
+         * cached data no longer matches the Blob, so invalidate the cache
+         * once we are done.
          */
-        if (mb->is_dirty() && get_write_error()) {
-            AZLogError("[{}] Flush [{}, {}) failed with error: {}",
-                       ino,
-                       bc.offset, bc.offset + bc.length,
-                       get_write_error());
-        }
+    if (mb->is_dirty() && mb->get_write_error()) {
+        AZLogError("[{}] Flush [{}, {}) failed with error: {}",
+                   ino,
+                   bc.offset, bc.offset + bc.length,
+                   mb->get_write_error());
+        error = mb->get_write_error();
+        filecache_handle->set_write_error(error);
+        mb->clear_dirty_on_error();
+    }
 
-        mb->clear_locked();
-        mb->clear_inuse();
+    mb->clear_locked();
+    mb->clear_inuse();
 
-        /*
-         * Release the bytes_chunk back to the filecache.
-         * These bytes_chunks are not needed anymore as the flush is done.
-         *
-         * Note: We come here for bytes_chunks which were found dirty by the
-         *       above loop. These writes may or may not have been issued by
-         *       us (if not issued by us it was because some other thread,
-         *       mostly the writer issued the write so we found it flushing
-         *       and hence didn't issue). In any case since we have an inuse
-         *       count, release() called from write_callback() would not have
-         *       released it, so we need to release it now.
-         */
-        filecache_handle->release(bc.offset, bc.length);
-    }
+    /*
+     * Release the bytes_chunk back to the filecache.
+     * These bytes_chunks are not needed anymore as the flush is done.
+     *
+     * Note: We come here for bytes_chunks which were found dirty by our
+     *       caller. These writes may or may not have been issued by
+     *       us (if not issued by us it was because some other thread,
+     *       mostly the writer issued the write so we found it flushing
+     *       and hence didn't issue). In any case since we have an inuse
+     *       count, release() called from write_callback() would not have
+     *       released it, so we need to release it now.
+     */
+    filecache_handle->release(bc.offset, bc.length);
 
-    return get_write_error();
+    return error;
 }
 
 bool nfs_inode::release(fuse_req_t req)
 {
     assert(opencnt > 0);
-    if (--opencnt != 0 || !is_silly_renamed) {
+    if (--opencnt != 0 || !is_silly_renamed()) {
         return false;
     }
 
+    const struct silly_rename_info& sri = get_silly_rename_info();
+
     /*
      * Delete the silly rename file.
      * Note that we will now respond to fuse when the unlink completes.
      * The caller MUST arrange to *not* respond to fuse.
      * Silly rename is done only for regular files.
      */
-    assert(!silly_renamed_name.empty());
-    assert(parent_ino != 0);
+    assert(!sri.name.empty());
+    assert(sri.parent_ino != 0);
     assert(is_regfile());
 
     AZLogInfo("Deleting silly renamed file, {}/{}",
-              parent_ino, silly_renamed_name);
+              sri.parent_ino, sri.name);
 
-    client->unlink(req, parent_ino,
-                   silly_renamed_name.c_str(), true /* for_silly_rename */);
+    client->unlink(req, sri.parent_ino,
+                   sri.name.c_str(), true /* for_silly_rename */);
     return true;
 }
 
@@ -794,6 +1089,9 @@ void nfs_inode::revalidate(bool force)
 
     // Nothing to do, return.
     if (!revalidate_now) {
+        if (clear_bulk_refreshed()) {
+            INC_GBL_STATS(getattrs_saved, 1);
+        }
         AZLogDebug("revalidate_now is false");
         return;
     }
@@ -809,6 +1107,15 @@ void nfs_inode::revalidate(bool force)
         return;
     }
 
+    /*
+     * If many of our siblings need revalidation too, start refreshing all
+     * of them with READDIRPLUS of the parent directory. We don't wait for
+     * that and query our own attributes below.
+     */
+    if (!force) {
+        client->bulk_revalidate(this);
+    }
+
     /*
      * Query the attributes of the file from the server to find out if
      * the file has changed and we need to invalidate the cached data.
@@ -845,7 +1152,9 @@ void nfs_inode::revalidate(bool force)
          */
         if (!force) {
             attr_timeout_secs =
-                std::min((int) attr_timeout_secs*2, get_actimeo_max());
+                std::min(std::max((int) attr_timeout_secs*2,
+                                  get_stable_actimeo()),
+                         get_actimeo_max());
         }
         attr_timeout_timestamp = get_current_msecs() + attr_timeout_secs*1000;
     }
@@ -893,10 +1202,13 @@ bool nfs_inode::update_nolock(const struct fattr3 *postattr,
         if (!postattr_is_newer) {
             /*
              * Attributes haven't changed from the cached ones, refresh the
-             * attribute cache timeout.
+             * attribute cache timeout. The longer they have been stable, the
+             * longer we can cache them.
              */
             assert(attr_timeout_timestamp != -1);
             assert(attr_timeout_secs != -1);
+            attr_timeout_secs = std::max((int) attr_timeout_secs,
+                                         get_stable_actimeo());
             attr_timeout_timestamp =
                 std::max(get_current_msecs() + attr_timeout_secs*1000,
                          attr_timeout_timestamp.load());
@@ -943,7 +1255,7 @@ bool nfs_inode::update_nolock(const struct fattr3 *postattr,
                    attr.st_size, postattr->size);
 
         nfs_client::stat_from_fattr3(attr, *postattr);
-        attr_timeout_secs = get_actimeo_min();
+        attr_timeout_secs = get_stable_actimeo();
         attr_timeout_timestamp = get_current_msecs() + attr_timeout_secs*1000;
 
         // file type should not change.
@@ -1015,7 +1327,7 @@ void nfs_inode::force_update_attr_nolock(const struct fattr3& fattr)
      * attr_timeout_timestamp since the attributes have changed.
      */
     nfs_client::stat_from_fattr3(attr, fattr);
-    attr_timeout_secs = get_actimeo_min();
+    attr_timeout_secs = get_stable_actimeo();
     attr_timeout_timestamp = get_current_msecs() + attr_timeout_secs*1000;
 
     // file type should not change.
@@ -236,7 +236,8 @@ static void readahead_callback (
 
             // Create a new child task to carry out this request.
             struct rpc_task *partial_read_tsk =
-                task->get_client()->get_rpc_task_helper()->alloc_rpc_task(FUSE_READ);
+                task->get_client()->get_rpc_task_helper()->alloc_rpc_task_reserved(
+                    FUSE_READ, RPC_PRIO_READAHEAD);
 
             partial_read_tsk->init_read(
                 task->rpc_api->req,
@@ -531,9 +532,24 @@ int ra_state::issue_readaheads()
 
             /*
              * Ok, now issue READ RPCs to read this byte range.
+             * We are holding the membuf lock, so don't wait for an rpc_task,
+             * if the readahead class is at its cap or the pool is exhausted
+             * skip the readahead, it's not worth holding the membuf locked
+             * (and other readers waiting on it) for.
              */
             struct rpc_task *tsk =
-                client->get_rpc_task_helper()->alloc_rpc_task(FUSE_READ);
+                client->get_rpc_task_helper()->try_alloc_rpc_task(
+                    FUSE_READ, RPC_PRIO_READAHEAD);
+            if (tsk == nullptr) {
+                AZLogDebug("[{}] Skipping readahead at off: {} len: {}. "
+                           "No free rpc_task!",
+                           inode->get_fuse_ino(), bc.offset, bc.length);
+
+                on_readahead_complete(bc.offset, bc.length);
+                bc.get_membuf()->clear_locked();
+                bc.get_membuf()->clear_inuse();
+                continue;
+            }
 
             /*
              * fuse_req is needed to send the fuse response, since we don't
@@ -585,8 +601,8 @@ int ra_state::issue_readaheads()
                        args.count);
 
             /*
-             * tsk->get_rpc_ctx() call below will round robin readahead
-             * requests across all available connections.
+             * tsk->get_rpc_ctx() call below will spread readahead requests
+             * across all available connections, picking the least loaded.
              *
              * TODO: See if issuing a batch of reads over one connection
              *       before moving to the other connection helps.
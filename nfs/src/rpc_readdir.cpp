@@ -1,6 +1,7 @@
 #include "rpc_readdir.h"
 #include "nfs_inode.h"
 #include "nfs_client.h"
+#include "rpc_stats.h"
 
 directory_entry::directory_entry(char *name_,
                                  cookie3 cookie_,
@@ -82,6 +83,277 @@ directory_entry::~directory_entry()
     ::free(name);
 }
 
+/*
+ * Returned by dircache_entries::find() for cookies not present.
+ */
+static const std::shared_ptr<struct directory_entry> null_dirent;
+
+const std::shared_ptr<struct directory_entry>& dircache_entries::find(
+        cookie3 cookie) const
+{
+    if ((cookie > 0) && (cookie <= dense.size()) && dense[cookie - 1]) {
+        return dense[cookie - 1];
+    }
+
+    if (!sparse.empty()) {
+        const auto it = sparse.find(cookie);
+        if (it != sparse.end()) {
+            return it->second;
+        }
+    }
+
+    return null_dirent;
+}
+
+const std::shared_ptr<struct directory_entry>& dircache_entries::find_next(
+        cookie3 cookie, cookie3 max_cookie) const
+{
+    const std::shared_ptr<struct directory_entry> *next = &null_dirent;
+
+    /*
+     * dense[i] holds cookie i+1, so the scan for cookies greater than
+     * cookie starts at dense[cookie].
+     */
+    const cookie3 dense_end = std::min<cookie3>(dense.size(), max_cookie);
+    for (cookie3 i = cookie; i < dense_end; i++) {
+        if (dense[i]) {
+            next = &dense[i];
+            break;
+        }
+    }
+
+    /*
+     * sparse may have cookies lower than dense.size() if dense grew past
+     * them after they were added, so pick the lower of the two.
+     */
+    if (!sparse.empty()) {
+        const auto it = sparse.upper_bound(cookie);
+        if ((it != sparse.end()) && (it->first <= max_cookie) &&
+            (!*next || (it->first < (*next)->cookie))) {
+            next = &it->second;
+        }
+    }
+
+    return *next;
+}
+
+cookie3 dircache_entries::find_cookie(const char *name) const
+{
+    assert(name != nullptr);
+
+    const size_t nslots = name_slots.size();
+    if (nslots == 0) {
+        return 0;
+    }
+
+    const uint64_t h = name_hash(name);
+
+    /*
+     * Probe till the first empty slot. There's always one as we rehash
+     * before the index gets more than half full.
+     */
+    for (size_t i = h & (nslots - 1); ; i = (i + 1) & (nslots - 1)) {
+        const name_slot& s = name_slots[i];
+
+        if (s.is_empty()) {
+            return 0;
+        }
+
+        if (s.name && (s.hash == (uint32_t) h) &&
+            (::strcmp(s.name, name) == 0)) {
+            assert(s.cookie != 0);
+            return s.cookie;
+        }
+    }
+}
+
+bool dircache_entries::insert(
+        const std::shared_ptr<struct directory_entry>& entry)
+{
+    assert(entry);
+    assert(entry->name != nullptr);
+
+    const cookie3 cookie = entry->cookie;
+    assert(cookie != 0);
+
+    if (find(cookie)) {
+        return false;
+    }
+
+    // Caller must have removed the old entry with the same name.
+    assert(find_cookie(entry->name) == 0);
+
+    /*
+     * Grow dense only if the cookies seen so far are dense enough, a few
+     * entries spread over a large range of cookies (f.e. the cache was
+     * filled from a cookie past the start, after being purged) would
+     * otherwise cost a slot per cookie in the range.
+     */
+    const bool use_dense =
+        (cookie <= dense.size()) ||
+        ((cookie <= (dense.size() + DIRCACHE_DENSE_MAX_GAP)) &&
+         (((num_dense + 1) * DIRCACHE_DENSE_MIN_FILL) >= cookie));
+
+    if (use_dense) {
+        if (cookie > dense.size()) {
+            dense.resize(cookie);
+        }
+        dense[cookie - 1] = entry;
+        num_dense++;
+    } else {
+        sparse.emplace(cookie, entry);
+    }
+
+    name_insert(entry->name, cookie);
+    num_entries++;
+
+    return true;
+}
+
+std::shared_ptr<struct directory_entry> dircache_entries::erase(
+        cookie3 cookie)
+{
+    std::shared_ptr<struct directory_entry> entry;
+
+    if ((cookie > 0) && (cookie <= dense.size()) && dense[cookie - 1]) {
+        entry = std::move(dense[cookie - 1]);
+        assert(num_dense > 0);
+        num_dense--;
+
+        // Trim the trailing holes, so that dense can grow again from there.
+        while (!dense.empty() && !dense.back()) {
+            dense.pop_back();
+        }
+    } else {
+        const auto it = sparse.find(cookie);
+        if (it == sparse.end()) {
+            return nullptr;
+        }
+
+        entry = std::move(it->second);
+        sparse.erase(it);
+    }
+
+    name_erase(entry->name);
+    assert(num_entries > 0);
+    num_entries--;
+
+    return entry;
+}
+
+void dircache_entries::clear()
+{
+    /*
+     * Swap with empty containers to free the memory, a huge directory once
+     * cached shouldn't hold on to it after the cache is purged.
+     */
+    std::vector<std::shared_ptr<struct directory_entry>>().swap(dense);
+    sparse.clear();
+    std::vector<name_slot>().swap(name_slots);
+
+    num_names = 0;
+    num_tombstones = 0;
+    num_entries = 0;
+    num_dense = 0;
+}
+
+void dircache_entries::name_insert(const char *name, cookie3 cookie)
+{
+    /*
+     * Keep at least half the slots empty, so that probe sequences stay
+     * short and find_cookie() always finds an empty slot.
+     */
+    if ((num_names + num_tombstones + 1) * 2 > name_slots.size()) {
+        name_rehash();
+    }
+
+    const size_t nslots = name_slots.size();
+    const uint64_t h = name_hash(name);
+
+    for (size_t i = h & (nslots - 1); ; i = (i + 1) & (nslots - 1)) {
+        name_slot& s = name_slots[i];
+
+        if (s.name) {
+            continue;
+        }
+
+        if (s.tombstone) {
+            s.tombstone = false;
+            num_tombstones--;
+        }
+
+        s.name = name;
+        s.cookie = cookie;
+        s.hash = (uint32_t) h;
+        num_names++;
+        return;
+    }
+}
+
+void dircache_entries::name_erase(const char *name)
+{
+    const size_t nslots = name_slots.size();
+    assert(nslots > 0);
+
+    const uint64_t h = name_hash(name);
+
+    /*
+     * name is the one owned by the directory_entry being removed, which is
+     * what we saved in the slot.
+     */
+    for (size_t i = h & (nslots - 1); ; i = (i + 1) & (nslots - 1)) {
+        name_slot& s = name_slots[i];
+
+        // Every entry must have its name in the index.
+        assert(!s.is_empty());
+
+        if (s.name != name) {
+            continue;
+        }
+
+        s.name = nullptr;
+        s.cookie = 0;
+        s.tombstone = true;
+        num_tombstones++;
+        assert(num_names > 0);
+        num_names--;
+
+        // Shrink once mostly empty, f.e. after many files are deleted.
+        if ((nslots > DIRCACHE_NAME_INDEX_MIN_SLOTS) &&
+            (num_names * 16 < nslots)) {
+            name_rehash();
+        }
+        return;
+    }
+}
+
+void dircache_entries::name_rehash()
+{
+    size_t nslots = DIRCACHE_NAME_INDEX_MIN_SLOTS;
+    while (nslots < (num_names + 1) * 4) {
+        nslots *= 2;
+    }
+
+    std::vector<name_slot> old_slots(nslots);
+    old_slots.swap(name_slots);
+
+    for (const name_slot& os : old_slots) {
+        if (!os.name) {
+            continue;
+        }
+
+        size_t i = os.hash & (nslots - 1);
+
+        while (name_slots[i].name) {
+            i = (i + 1) & (nslots - 1);
+        }
+
+        name_slots[i] = os;
+    }
+
+    num_tombstones = 0;
+}
+
 readdirectory_cache::~readdirectory_cache()
 {
     AZLogDebug("[{}] ~readdirectory_cache() called", dir_inode->get_fuse_ino());
@@ -90,6 +362,7 @@ readdirectory_cache::~readdirectory_cache()
      * The cache must have been purged before deleting.
      */
     assert(dir_entries.empty());
+    assert(held_inodes.empty());
 }
 
 void readdirectory_cache::set_lookuponly()
@@ -156,6 +429,86 @@ void readdirectory_cache::set_eof(uint64_t eof_cookie)
     }
 }
 
+bool readdirectory_cache::on_child_attr_expired(struct nfs_inode *child,
+                                                uint32_t threshold)
+{
+    assert(threshold > 0);
+
+    const uint64_t now_msecs = get_current_msecs();
+
+    /*
+     * Start a new window if the current one is too old.
+     * Racing threads may both reset it, that just loses a few counts.
+     */
+    if ((now_msecs - expired_window_msecs) > BULK_REVALIDATE_WINDOW_MSECS) {
+        expired_window_msecs = now_msecs;
+        expired_children = 0;
+    }
+
+    /*
+     * Already counted in this window.
+     * Caller found us through child's bulk revalidation info.
+     */
+    struct bulk_revalidate_info *bri = child->get_bulk_revalidate_info();
+    assert(bri != nullptr);
+
+    const uint64_t window_msecs = expired_window_msecs;
+    if (bri->expired_window_msecs.exchange(window_msecs) == window_msecs) {
+        return false;
+    }
+
+    const uint64_t nexpired = ++expired_children;
+
+    /*
+     * For a huge directory, a few children being looked at doesn't justify
+     * fetching the whole directory.
+     */
+    if ((nexpired < threshold) ||
+        ((nexpired * BULK_REVALIDATE_DIR_FRACTION) < get_num_entries())) {
+        return false;
+    }
+
+    return !bulk_revalidating.exchange(true);
+}
+
+void readdirectory_cache::end_bulk_revalidate()
+{
+    assert(bulk_revalidating);
+
+    expired_window_msecs = get_current_msecs();
+    expired_children = 0;
+    bulk_revalidating = false;
+}
+
+bool readdirectory_cache::start_prefetch(int max_rpcs, cookie3& cookie)
+{
+    assert(max_rpcs > 0);
+
+    {
+        std::shared_lock<std::shared_mutex> lock(readdircache_lock_2);
+
+        /*
+         * Nothing more to read, or the cache is going to be purged, or the
+         * application has gone past what we have cached (and is reading it
+         * from the server).
+         */
+        if (eof || lookuponly || invalidate_pending ||
+            (seq_last_cookie == 0) || (rpc_entries == 0) ||
+            (app_cookie > seq_last_cookie)) {
+            return false;
+        }
+
+        if ((seq_last_cookie - app_cookie) >=
+                ((uint64_t) max_rpcs * rpc_entries)) {
+            return false;
+        }
+
+        cookie = seq_last_cookie;
+    }
+
+    return !prefetching.exchange(true);
+}
+
 bool readdirectory_cache::add(const std::shared_ptr<struct directory_entry>& entry,
                               bool acquire_lock)
 {
@@ -176,12 +529,15 @@ bool readdirectory_cache::add(const std::shared_ptr<struct directory_entry>& ent
         std::unique_lock<std::shared_mutex> lock(
                 acquire_lock ? readdircache_lock_2 : dummy_lock);
 
+        last_access_msecs = get_current_msecs();
+
         // TODO: Fix this.
-        if (cache_size >= MAX_CACHE_SIZE_LIMIT) {
+        const size_t total_size = cache_size + dir_entries.get_index_bytes();
+        if (total_size >= MAX_CACHE_SIZE_LIMIT) {
             AZLogWarn("[{}] Readdir cache exceeded per-directory cache limit "
                       "({} > {}). Not adding entry [name: {}, ino: {}]",
                       dir_inode->get_fuse_ino(),
-                      cache_size, MAX_CACHE_SIZE_LIMIT, entry->name,
+                      total_size, MAX_CACHE_SIZE_LIMIT, entry->name,
                       entry->nfs_inode ? entry->nfs_inode->get_fuse_ino() : -1);
             return false;
         }
@@ -208,8 +564,6 @@ bool readdirectory_cache::add(const std::shared_ptr<struct directory_entry>& ent
                        entry->cookie);
         }
 
-        assert(dir_entries.size() == dnlc_map.size());
-
         /*
          * If entry->name exists with a different cookie, remove that.
          * Note that caller must have removed entry->cookie but entry->name
@@ -221,6 +575,17 @@ bool readdirectory_cache::add(const std::shared_ptr<struct directory_entry>& ent
             remove(cookie, nullptr, false);
         }
 
+        /*
+         * A name we had cached as not existing is now found to exist, the
+         * directory must have changed w/o us noticing its ctime change.
+         * Don't trust any of the -ve entries.
+         */
+        if (!neg_names.empty() && neg_names.count(entry->name)) {
+            AZLogDebug("[{}] \"{}\" found in negative DNLC, clearing it",
+                       dir_inode->get_fuse_ino(), entry->name);
+            negative_clear_nolock();
+        }
+
         AZLogDebug("[{}] Adding dir cache entry {} -> {} (dircachecnt: {}, "
                    "lookupcnt: {})",
                    dir_inode->get_fuse_ino(), entry->cookie,
@@ -228,7 +593,7 @@ bool readdirectory_cache::add(const std::shared_ptr<struct directory_entry>& ent
                    entry->nfs_inode ? entry->nfs_inode->dircachecnt.load() : -1,
                    entry->nfs_inode ? entry->nfs_inode->lookupcnt.load() : -1);
 
-        const auto it = dir_entries.emplace(entry->cookie, entry);
+        const bool added = dir_entries.insert(entry);
 
         /*
          * Caller only calls us after ensuring cookie isn't already cached,
@@ -239,8 +604,8 @@ bool readdirectory_cache::add(const std::shared_ptr<struct directory_entry>& ent
          *       entry->cookie, from readdir{plus}_callback() to here, inside
          *       the lock.
          */
-        if (it.second) {
-            AZLogDebug("[{}] Adding dnlc cache entry {} -> {} "
+        if (added) {
+            AZLogDebug("[{}] Added dnlc cache entry {} -> {} "
                        "(dircachecnt: {}, lookupcnt: {})",
                        dir_inode->get_fuse_ino(), entry->name,
                        entry->cookie,
@@ -249,14 +614,9 @@ bool readdirectory_cache::add(const std::shared_ptr<struct directory_entry>& ent
 
             cache_size += entry->get_cache_size();
 
-            /*
-             * Also add to the DNLC cache.
-             * In the common case the entry must not be present in the DNLC
-             * cache, but in case directory changes, same filename must have
-             * been seen on a different cookie value earlier.
-             * In any case, overwrite that.
-             */
-            dnlc_map[entry->name] = entry->cookie;
+            if (entry->nfs_inode) {
+                entry->nfs_inode->set_bulk_parent(dir_inode);
+            }
 
             /*
              * Update seq_last_cookie as long as the sequence of cookies isn't
@@ -272,8 +632,7 @@ bool readdirectory_cache::add(const std::shared_ptr<struct directory_entry>& ent
             }
         }
 
-        assert(dir_entries.size() == dnlc_map.size());
-        return it.second;
+        return added;
     }
 
     /*
@@ -405,6 +764,8 @@ std::shared_ptr<struct directory_entry> readdirectory_cache::lookup(
     // Either cookie or filename_hint (not both) must be passed.
     assert((cookie == 0) == (filename_hint != nullptr));
 
+    last_access_msecs = get_current_msecs();
+
     // Take shared look to see if the entry exists in the cache.
     /*
      * If acquire_lock is true, get shared lock on the map for looking up the
@@ -428,10 +789,8 @@ std::shared_ptr<struct directory_entry> readdirectory_cache::lookup(
                    dir_inode->ino, filename_hint, cookie);
     }
 
-    const auto it = dir_entries.find(cookie);
-
     const std::shared_ptr<struct directory_entry>& dirent =
-        (it != dir_entries.end()) ? it->second : nullptr;
+        dir_entries.find(cookie);
 
     if (!dirent) {
         AZLogDebug("[{}] cookie: {}, not found",
@@ -468,6 +827,30 @@ std::shared_ptr<struct directory_entry> readdirectory_cache::lookup(
     return dirent;
 }
 
+std::shared_ptr<struct directory_entry> readdirectory_cache::lookup_next(
+        cookie3 cookie,
+        cookie3 max_cookie) const
+{
+    last_access_msecs = get_current_msecs();
+
+    std::shared_lock<std::shared_mutex> lock(readdircache_lock_2);
+
+    const std::shared_ptr<struct directory_entry>& dirent =
+        dir_entries.find_next(cookie, max_cookie);
+
+    AZLogDebug("[{}] lookup_next(cookie: {}, max_cookie: {}), next: {}",
+               dir_inode->ino, cookie, max_cookie,
+               dirent ? dirent->cookie : 0);
+
+    if (dirent && dirent->nfs_inode) {
+        // See lookup().
+        assert(dirent->nfs_inode->dircachecnt > 0);
+        dirent->nfs_inode->dircachecnt++;
+    }
+
+    return dirent;
+}
+
 struct nfs_inode *readdirectory_cache::dnlc_lookup(
         const char *filename,
         bool *negative_confirmed) const
@@ -511,6 +894,70 @@ struct nfs_inode *readdirectory_cache::dnlc_lookup(
     return nullptr;
 }
 
+/**
+ * LOCKS: Exclusive readdircache_lock_2.
+ */
+void readdirectory_cache::negative_add(const char *filename,
+                                       uint64_t dir_ctime,
+                                       size_t max_entries)
+{
+    assert(filename != nullptr);
+    assert(max_entries > 0);
+
+    std::unique_lock<std::shared_mutex> lock(readdircache_lock_2);
+
+    if (dir_ctime != neg_dir_ctime) {
+        /*
+         * LOOKUP that raced with some directory change, it could be that
+         * filename has since been created.
+         */
+        if (dir_ctime < neg_dir_ctime) {
+            return;
+        }
+
+        /*
+         * Directory has changed since the names we have were found missing,
+         * any of them may have been created since.
+         */
+        negative_clear_nolock();
+        neg_dir_ctime = dir_ctime;
+    }
+
+    if (!neg_names.emplace(filename).second) {
+        return;
+    }
+
+    neg_fifo.emplace_back(filename);
+
+    while (neg_fifo.size() > max_entries) {
+        neg_names.erase(neg_fifo.front());
+        neg_fifo.pop_front();
+    }
+
+    assert(neg_names.size() == neg_fifo.size());
+}
+
+/**
+ * LOCKS: Shared readdircache_lock_2.
+ */
+bool readdirectory_cache::negative_lookup(const char *filename,
+                                          uint64_t dir_ctime) const
+{
+    assert(filename != nullptr);
+
+    std::shared_lock<std::shared_mutex> lock(readdircache_lock_2);
+
+    /*
+     * Note: We don't check invalidate_pending as a directory change that
+     *       invalidates the cache also changes the directory ctime.
+     */
+    if (neg_names.empty() || (dir_ctime != neg_dir_ctime)) {
+        return false;
+    }
+
+    return neg_names.count(filename) != 0;
+}
+
 bool readdirectory_cache::remove(cookie3 cookie,
                                  const char *filename_hint,
                                  bool acquire_lock)
@@ -553,9 +1000,8 @@ bool readdirectory_cache::remove(cookie3 cookie,
                        dir_inode->ino, filename_hint, cookie);
         }
 
-        const auto it = dir_entries.find(cookie);
         std::shared_ptr<struct directory_entry> dirent =
-            (it != dir_entries.end()) ? it->second : nullptr;
+            dir_entries.find(cookie);
 
         if (!dirent){
             AZLogDebug("[{}] cookie: {}, not found",
@@ -581,19 +1027,16 @@ bool readdirectory_cache::remove(cookie3 cookie,
         }
 
         /*
-         * Remove the DNLC entry.
-         */
-        [[maybe_unused]] const int cnt = dnlc_map.erase(dirent->name);
-        assert(cnt == 1);
-
-        /*
-         * This just removes it from the cache, no destructor is called at
-         * this point as there is a ref held on this by the dirent shared_ptr.
+         * This removes it from the cache (and the DNLC), no destructor is
+         * called at this point as there is a ref held on this by the dirent
+         * shared_ptr.
          * Also there could be other shared_ptr references to this
          * directory_entry, but no one can take a fresh directory_entry ref
          * after it's removed from dir_entries.
          */
-        dir_entries.erase(it);
+        dir_entries.erase(cookie);
+        assert(cache_size >= dirent->get_cache_size());
+        cache_size -= dirent->get_cache_size();
 
         inode = dirent->nfs_inode;
 
@@ -666,29 +1109,44 @@ bool readdirectory_cache::remove(cookie3 cookie,
 }
 
 /*
- * inode_map_lock_0 must be held by the caller.
+ * LOCKS: readdircache_lock_2, inode_table shard_lock_0 (when freeing inodes).
  */
-void readdirectory_cache::clear()
+bool readdirectory_cache::clear(std::vector<std::string> *kernel_names,
+                                bool keep_inodes,
+                                bool only_if_idle)
 {
     /*
-     * TODO: Later when we implement readdirectory_cache purging due to
-     *       memory pressure, we need to ensure that any directory which
-     *       is currently being enumerated by nfs_inode::lookup_dircache(),
-     *       should not be purged, as that may cause those inodes to be
-     *       orphanned (they will have lookupcnt and dircachecnt of 0 and
-     *       still lying aroung in the inode_map.
+     * Note: Any directory which is currently being enumerated by
+     *       nfs_inode::lookup_dircache() must not be purged, as that may
+     *       cause those inodes to be orphanned (they will have lookupcnt and
+     *       dircachecnt of 0 and still lying aroung in the inode_table).
+     *       nfs_client::inode_reclaimer() which purges caches due to memory
+     *       pressure, takes care of this by passing only_if_idle. Since
+     *       start_enumeration() holds readdircache_lock_2, an enumeration
+     *       either is counted in enumerators here or starts after we are
+     *       done, and finds the cache empty.
      */
     std::vector<struct nfs_inode*> tofree_vec;
+    std::vector<struct nfs_inode*> old_held_vec;
 
     {
         std::unique_lock<std::shared_mutex> lock(readdircache_lock_2);
 
+        if (only_if_idle && ((enumerators > 0) || dir_inode->is_open())) {
+            AZLogDebug("[{}] Not purging dircache, open: {}, "
+                       "enumerators: {}",
+                       dir_inode->get_fuse_ino(), dir_inode->is_open(),
+                       enumerators.load());
+            return false;
+        }
+
         eof = false;
         cache_size = 0;
         ::memset(&cookie_verifier, 0, sizeof(cookie_verifier));
 
-        for (auto it = dir_entries.begin(); it != dir_entries.end(); ++it) {
-            struct nfs_inode *inode = it->second->nfs_inode;
+        dir_entries.for_each(
+                [&](std::shared_ptr<struct directory_entry>& entry) {
+            struct nfs_inode *inode = entry->nfs_inode;
             if (inode) {
                 assert(inode->magic == NFS_INODE_MAGIC);
                 /*
@@ -703,17 +1161,17 @@ void readdirectory_cache::clear()
                            "forget_expected {})",
                            dir_inode->get_fuse_ino(),
                            inode->is_dir() ? "directory" : "file",
-                           it->second->name,
+                           entry->name,
                            inode->get_fuse_ino(),
-                           it->second->cookie,
+                           entry->cookie,
                            inode->dircachecnt.load(),
                            inode->lookupcnt.load(),
                            inode->forget_expected.load());
             } else {
                 AZLogDebug("[{}] Removing \"{}\", cookie {}, from readdir cache",
                            dir_inode->get_fuse_ino(),
-                           it->second->name,
-                           it->second->cookie);
+                           entry->name,
+                           entry->cookie);
             }
             /*
              * If this is the last dircachecnt on this inode, it means
@@ -725,6 +1183,10 @@ void readdirectory_cache::clear()
              * directory_entry, and add the inode to a vector which we later
              * iterate over and call decref() for all the inodes.
              */
+            if (kernel_names && inode && (inode->forget_expected > 0)) {
+                kernel_names->emplace_back(entry->name);
+            }
+
             if (inode && (inode->dircachecnt == 1)) {
                 tofree_vec.emplace_back(inode);
                 inode->incref();
@@ -736,14 +1198,25 @@ void readdirectory_cache::clear()
              * inode so the following decref() will free the inode if that
              * was the only ref.
              */
-            it->second.reset();
-        }
-
-        // For every entry added to dir_entries we add one to dnlc_map.
-        assert(dir_entries.size() == dnlc_map.size());
+            entry.reset();
+        });
 
         dir_entries.clear();
-        dnlc_map.clear();
+        negative_clear_nolock();
+
+        /*
+         * Inodes held by a previous clear(keep_inodes=true) are released
+         * either way. Those that are still needed are either in tofree_vec
+         * (so held again) or have other refs.
+         */
+        old_held_vec.swap(held_inodes);
+
+        if (keep_inodes) {
+            AZLogDebug("[{}] Holding {} inodes for incremental revalidation",
+                       dir_inode->get_fuse_ino(), tofree_vec.size());
+            held_inodes.swap(tofree_vec);
+            held_msecs = get_current_msecs();
+        }
 
         /*
          * No cookies in the cache, hence no sequence.
@@ -753,6 +1226,13 @@ void readdirectory_cache::clear()
         clear_lookuponly();
     }
 
+    for (struct nfs_inode *inode : old_held_vec) {
+        assert(inode->magic == NFS_INODE_MAGIC);
+        assert(inode->lookupcnt > 0);
+
+        inode->decref();
+    }
+
     if (!tofree_vec.empty()) {
         AZLogDebug("[{}] {} inodes to be freed, after readdir cache purge",
                    dir_inode->get_fuse_ino(),
@@ -767,6 +1247,8 @@ void readdirectory_cache::clear()
             inode->decref();
         }
     }
+
+    return true;
 }
 
 /**
@@ -775,14 +1257,72 @@ void readdirectory_cache::clear()
  */
 void readdirectory_cache::clear_if_needed()
 {
+    /*
+     * In both cases the directory has changed, but most of its entries
+     * are likely unchanged, keep their inodes for when we read it again.
+     */
+    const bool keep_inodes = aznfsc_cfg.cache.readdir.user.incremental;
+
+    /*
+     * Held inodes not found again by now (f.e. the application stopped
+     * reading the directory before eof) are not likely to be.
+     */
+    bool held_expired;
+    {
+        std::shared_lock<std::shared_mutex> lock(readdircache_lock_2);
+        held_expired = !held_inodes.empty() &&
+            ((get_current_msecs() - held_msecs) > HELD_INODES_MAX_MSECS);
+    }
+
+    if (held_expired) {
+        release_held_inodes();
+    }
+
     if (invalidate_pending.exchange(false)) {
         AZLogDebug("[{}] (Deferred) Purging invalid dircache",
                    dir_inode->get_fuse_ino());
-        clear();
+        clear(nullptr, keep_inodes);
     } else if (is_lookuponly()) {
         AZLogDebug("[{}] (Deferred) Purging lookuponly dircache",
                    dir_inode->get_fuse_ino());
-        clear();
+        clear(nullptr, keep_inodes);
     }
 }
 
+void readdirectory_cache::release_held_inodes()
+{
+    std::vector<struct nfs_inode*> held_vec;
+
+    {
+        std::unique_lock<std::shared_mutex> lock(readdircache_lock_2);
+        held_vec.swap(held_inodes);
+    }
+
+    if (held_vec.empty()) {
+        return;
+    }
+
+    uint64_t num_preserved = 0;
+
+    for (struct nfs_inode *inode : held_vec) {
+        assert(inode->magic == NFS_INODE_MAGIC);
+        assert(inode->lookupcnt > 0);
+
+        /*
+         * Re-added to the cache by the READDIRPLUS that read the directory
+         * again, this is an inode we didn't have to create again.
+         */
+        if (inode->dircachecnt > 0) {
+            num_preserved++;
+        }
+
+        inode->decref();
+    }
+
+    AZLogDebug("[{}] Released {} held inodes, {} found in the directory "
+               "again", dir_inode->get_fuse_ino(), held_vec.size(),
+               num_preserved);
+
+    INC_GBL_STATS(readdir_inodes_preserved, num_preserved);
+}
+
@@ -19,6 +19,58 @@ namespace aznfsc {
 /* static */ std::atomic<uint64_t> rpc_stats_az::tot_lookup_reqs = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::lookup_served_from_cache = 0;
 /* static */ std::atomic<uint64_t> rpc_stats_az::inline_writes = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::write_gaps_filled = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::bytes_write_gap_filled = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::stream_writes = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::write_retries = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::write_errors = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::dircaches_reclaimed = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::inodes_reclaimed = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::kernel_entries_invalidated = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::bulk_revalidations = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::bulk_revalidate_rpcs = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::getattrs_saved = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::negative_lookups_saved = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::readdir_prefetch_rpcs = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::readdir_prefetch_entries = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::readdir_inodes_preserved = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::bulkstat_calls = 0;
+/* static */ std::atomic<uint64_t> rpc_stats_az::bulkstat_entries = 0;
+/* static */ std::atomic<uint64_t>
+    rpc_stats_az::flush_lat_hist[rpc_stats_az::FLUSH_LAT_BUCKETS];
+
+/* static */
+uint64_t rpc_stats_az::get_flush_lat_percentile(double pct)
+{
+    uint64_t hist[FLUSH_LAT_BUCKETS];
+    uint64_t total = 0;
+
+    for (int i = 0; i < FLUSH_LAT_BUCKETS; i++) {
+        hist[i] = flush_lat_hist[i];
+        total += hist[i];
+    }
+
+    if (total == 0) {
+        return 0;
+    }
+
+    /*
+     * Smallest number of flushes that must be within the returned latency.
+     */
+    const uint64_t target =
+        std::max((uint64_t) ((total * pct) / 100), (uint64_t) 1);
+    uint64_t cum = 0;
+
+    for (int i = 0; i < FLUSH_LAT_BUCKETS; i++) {
+        cum += hist[i];
+        if (cum >= target) {
+            return (1ULL << (i + 1));
+        }
+    }
+
+    // Histogram was updated while we were reading, return the highest.
+    return (1ULL << FLUSH_LAT_BUCKETS);
+}
 
 /* static */
 void rpc_stats_az::dump_stats()
@@ -43,6 +95,11 @@ void rpc_stats_az::dump_stats()
      * them.
      */
     for (struct nfs_connection *conn : connections) {
+        // Missing connection in degraded mode.
+        if (conn == nullptr) {
+            continue;
+        }
+
         struct rpc_stats stats;
         struct rpc_context *rpc = nfs_get_rpc_context(conn->get_nfs_context());
 
@@ -115,6 +172,28 @@ void rpc_stats_az::dump_stats()
     str += "  " + std::to_string(cum_stats.num_reconnects) +
                   " Reconnect attempts\n";
 
+    const int nconn_active = transport.get_num_active_connections();
+    str += "  " + std::to_string(nconn_active) + " of " +
+                  std::to_string(connections.size()) +
+                  " connection(s) active\n";
+    for (int i = 0; i < nconn_active; i++) {
+        const struct nfs_connection *conn = connections[i];
+
+        if (conn == nullptr) {
+            str += "  Connection #" + std::to_string(i) + ": not connected\n";
+            continue;
+        }
+
+        str += "  Connection #" + std::to_string(i) + ": " +
+               std::string(conn->is_healthy() ? "healthy" : "unhealthy") +
+               ", " + std::to_string(conn->get_outstanding_rpcs()) +
+               " RPCs outstanding, RTT (EWMA) " +
+               std::to_string(conn->get_rtt_ewma_usec()) + " usec, " +
+               std::to_string(conn->get_num_batched_rpcs()) +
+               " RPCs sent in " + std::to_string(conn->get_num_batches()) +
+               " batches\n";
+    }
+
     str += "File Cache statistics:\n";
     str += "  " + std::to_string(bytes_chunk_cache::get_num_caches()) +
                   " file caches\n";
@@ -141,6 +220,67 @@ void rpc_stats_az::dump_stats()
     str += "  " + std::to_string(bytes_chunk_cache::bytes_release_g) +
                   " bytes released\n";
 
+    /*
+     * Memory used for inodes, by component. Per-inode state which is
+     * allocated only for some inodes is reported with the number of inodes
+     * that have it. Only the fixed size part of the caches is counted here,
+     * data cached in file caches is reported above.
+     */
+    const uint64_t num_inodes = nfs_inode::num_inodes_g;
+    const uint64_t inode_bytes = num_inodes * sizeof(struct nfs_inode);
+    const uint64_t itable_bytes = client.get_inode_table().get_mem_bytes();
+    const uint64_t dircache_bytes =
+        nfs_inode::num_dircache_g * sizeof(readdirectory_cache);
+    const uint64_t rastate_bytes =
+        nfs_inode::num_rastate_g * sizeof(ra_state);
+    const uint64_t filecache_bytes =
+        bytes_chunk_cache::get_num_caches() * sizeof(bytes_chunk_cache);
+    const uint64_t silly_rename_bytes =
+        nfs_inode::num_silly_rename_g * sizeof(struct silly_rename_info);
+    const uint64_t bulk_revalidate_bytes =
+        nfs_inode::num_bulk_revalidate_g * sizeof(struct bulk_revalidate_info);
+    const uint64_t tot_inode_bytes =
+        inode_bytes + itable_bytes + dircache_bytes + rastate_bytes +
+        filecache_bytes + silly_rename_bytes + bulk_revalidate_bytes;
+
+    str += "Inode statistics:\n";
+    str += "  " + std::to_string(num_inodes) + " inodes, " +
+                  std::to_string(tot_inode_bytes) + " bytes (" +
+                  std::to_string(num_inodes ?
+                                 tot_inode_bytes / num_inodes : 0) +
+                  " bytes per inode)\n";
+    str += "  " + std::to_string(inode_bytes) + " bytes in nfs_inode (" +
+                  std::to_string(sizeof(struct nfs_inode)) + " each: " +
+                  std::to_string(sizeof(nfs_fh3_deep)) + " filehandle, " +
+                  std::to_string(sizeof(struct stat)) + " attributes, " +
+                  std::to_string(sizeof(std::shared_mutex)) + " lock, " +
+                  std::to_string(3 * sizeof(std::shared_ptr<void>)) +
+                  " cache handles)\n";
+    str += "  " + std::to_string(itable_bytes) + " bytes in inode table\n";
+    str += "  " + std::to_string(dircache_bytes) + " bytes in " +
+                  std::to_string(nfs_inode::num_dircache_g) +
+                  " directory caches (w/o entries)\n";
+    str += "  " + std::to_string(filecache_bytes) + " bytes in " +
+                  std::to_string(bytes_chunk_cache::get_num_caches()) +
+                  " file caches (w/o data)\n";
+    str += "  " + std::to_string(rastate_bytes) + " bytes in " +
+                  std::to_string(nfs_inode::num_rastate_g) +
+                  " readahead states\n";
+    str += "  " + std::to_string(silly_rename_bytes) + " bytes in " +
+                  std::to_string(nfs_inode::num_silly_rename_g) +
+                  " silly rename infos\n";
+    str += "  " + std::to_string(bulk_revalidate_bytes) + " bytes in " +
+                  std::to_string(nfs_inode::num_bulk_revalidate_g) +
+                  " bulk revalidation infos\n";
+    str += "  " + std::to_string(GET_GBL_STATS(dircaches_reclaimed)) +
+                  " directory caches purged to free " +
+                  std::to_string(GET_GBL_STATS(inodes_reclaimed)) +
+                  " inodes (" +
+                  std::to_string(GET_GBL_STATS(kernel_entries_invalidated)) +
+                  " kernel entries invalidated)\n";
+    str += "  " + std::to_string(GET_GBL_STATS(readdir_inodes_preserved)) +
+                  " inodes preserved across directory changes\n";
+
     str += "Application statistics:\n";
     str += "  " + std::to_string(GET_GBL_STATS(tot_bytes_read)) +
                   " bytes read by application(s)\n";
@@ -155,6 +295,34 @@ void rpc_stats_az::dump_stats()
                   " bytes read by readahead\n";
     str += "  " + std::to_string(GET_GBL_STATS(inline_writes)) +
                   " writes had to wait inline\n";
+    str += "  " + std::to_string(GET_GBL_STATS(write_gaps_filled)) +
+                  " write gaps filled (" +
+                  std::to_string(GET_GBL_STATS(bytes_write_gap_filled)) +
+                  " bytes)\n";
+    str += "  " + std::to_string(GET_GBL_STATS(stream_writes)) +
+                  " streaming writes\n";
+    str += "  " + std::to_string(GET_GBL_STATS(write_retries)) +
+                  " background writes retried, " +
+                  std::to_string(GET_GBL_STATS(write_errors)) +
+                  " failed\n";
+    const rpc_task_helper *const task_helper = rpc_task_helper::get_instance();
+    str += "  " + std::to_string(task_helper->get_num_tasks()) +
+                  " rpc_tasks allocated (high water mark " +
+                  std::to_string(task_helper->get_num_tasks_hwm()) + "), " +
+                  std::to_string(task_helper->get_outstanding()) +
+                  " outstanding (high water mark " +
+                  std::to_string(task_helper->get_outstanding_hwm()) + ")\n";
+    uint64_t tot_flushes = 0;
+    for (int i = 0; i < FLUSH_LAT_BUCKETS; i++) {
+        tot_flushes += flush_lat_hist[i];
+    }
+    str += "  " + std::to_string(tot_flushes) +
+                  " flushes, latency usec p50 <= " +
+                  std::to_string(get_flush_lat_percentile(50)) +
+                  ", p90 <= " +
+                  std::to_string(get_flush_lat_percentile(90)) +
+                  ", p99 <= " +
+                  std::to_string(get_flush_lat_percentile(99)) + "\n";
     const double getattr_cache_pct =
         tot_getattr_reqs ?
         ((getattr_served_from_cache * 100) / tot_getattr_reqs) : 0;
@@ -163,6 +331,12 @@ void rpc_stats_az::dump_stats()
     str += "  " + std::to_string(GET_GBL_STATS(getattr_served_from_cache)) +
                   " getattr served from cache (" +
                   std::to_string(getattr_cache_pct) + "%)\n";
+    str += "  " + std::to_string(GET_GBL_STATS(getattrs_saved)) +
+                  " getattr saved by " +
+                  std::to_string(GET_GBL_STATS(bulk_revalidations)) +
+                  " bulk revalidations (" +
+                  std::to_string(GET_GBL_STATS(bulk_revalidate_rpcs)) +
+                  " readdirplus RPCs)\n";
     const double lookup_cache_pct =
         tot_lookup_reqs ?
         ((lookup_served_from_cache * 100) / tot_lookup_reqs) : 0;
@@ -171,6 +345,16 @@ void rpc_stats_az::dump_stats()
     str += "  " + std::to_string(GET_GBL_STATS(lookup_served_from_cache)) +
                   " lookup served from cache (" +
                   std::to_string(lookup_cache_pct) + "%)\n";
+    str += "  " + std::to_string(GET_GBL_STATS(negative_lookups_saved)) +
+                  " lookup served from negative DNLC\n";
+    str += "  " + std::to_string(GET_GBL_STATS(readdir_prefetch_entries)) +
+                  " directory entries prefetched with " +
+                  std::to_string(GET_GBL_STATS(readdir_prefetch_rpcs)) +
+                  " readdirplus RPCs\n";
+    str += "  " + std::to_string(GET_GBL_STATS(bulkstat_entries)) +
+                  " entries returned by " +
+                  std::to_string(GET_GBL_STATS(bulkstat_calls)) +
+                  " bulk stat calls\n";
 
 #define DUMP_OP(opcode) \
 do { \
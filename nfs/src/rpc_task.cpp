@@ -604,11 +604,13 @@ void rpc_task::init_read(fuse_req *request,
     fh_hash = get_client()->get_nfs_inode_from_ino(ino)->get_crc();
 
     /*
-     * We can perform round-robin for reads even for port 2048.
+     * Reads don't need connection affinity even for port 2048, send them
+     * over the least loaded connection, preferring one whose service thread
+     * (which copies the read data to the fuse reply) is local to this cpu.
      *
      * TODO: Control this with a config.
      */
-    set_csched(CONN_SCHED_RR);
+    set_csched(CONN_SCHED_CPU_LOCAL);
 }
 
 /*
@@ -701,7 +703,18 @@ static void lookup_callback(
          (NFS_STATUS(res) == NFS3ERR_NOENT)) && cache_negative) {
         /*
          * Special case for creating negative dentry.
+         * Also remember it in the negative DNLC, so that repeated lookups
+         * for the same missing name (f.e. searching for a file in PATH) are
+         * not sent to the server, till the directory changes.
          */
+        const post_op_attr& dir_attr =
+            res->LOOKUP3res_u.resfail.dir_attributes;
+        if (dir_attr.attributes_follow) {
+            UPDATE_INODE_ATTR(inode, dir_attr);
+            inode->negative_add(task->rpc_api->lookup_task.get_file_name(),
+                                dir_attr.post_op_attr_u.attributes);
+        }
+
         task->get_client()->reply_entry(
             task,
             nullptr /* fh */,
@@ -762,6 +775,20 @@ void access_callback(
     }
 }
 
+/*
+ * Is the WRITE failure transient, i.e., can the same WRITE succeed if retried?
+ * JUKEBOX (NFS3ERR_DELAY in RFC 1813 terms) is handled separately, it's
+ * always retried.
+ */
+static bool is_retryable_write_error(int rpc_status, int nfs_status)
+{
+    if (rpc_status != RPC_STATUS_SUCCESS) {
+        return true;
+    }
+
+    return (nfs_status == NFS3ERR_IO) || (nfs_status == NFS3ERR_SERVERFAULT);
+}
+
 /*
  * Called when libnfs completes a WRITE_IOV RPC.
  */
@@ -858,7 +885,8 @@ static void write_iov_callback(
 
             // Create a new flush_task for the remaining bc_iovec.
             struct rpc_task *flush_task =
-                    client->get_rpc_task_helper()->alloc_rpc_task_reserved(FUSE_FLUSH);
+                    client->get_rpc_task_helper()->alloc_rpc_task_reserved(
+                        FUSE_FLUSH, task->get_prio());
             flush_task->init_flush(nullptr /* fuse_req */, ino);
             // Any new task should start fresh as a parent task.
             assert(flush_task->rpc_api->parent_task == nullptr);
@@ -894,23 +922,45 @@ static void write_iov_callback(
                    bciov->length);
         task->get_client()->jukebox_retry(task);
         return;
+    } else if (is_retryable_write_error(rpc_status, NFS_STATUS(res)) &&
+               (bciov->num_retries < MAX_WRITE_RETRIES)) {
+        bciov->num_retries++;
+        AZLogWarn("[{}] Write [{}, {}) failed with status {}: {}, "
+                  "retry #{}",
+                  ino,
+                  bciov->offset,
+                  bciov->offset + bciov->length,
+                  status, errstr, bciov->num_retries);
+
+        INC_GBL_STATS(write_retries, 1);
+
+        /*
+         * Requeue the remaining write, same as JUKEBOX. The membufs stay
+         * locked and flushing so that flushers keep waiting for it.
+         */
+        task->get_client()->jukebox_retry(task);
+        return;
     } else {
         /*
-         * Since the api failed and can no longer be retried, set write_error
-         * and do not clear dirty flag.
+         * The write failed and can no longer be retried. Do not clear the
+         * dirty flag, instead record the error against the failed range.
+         * The data stays in the cache and the next flush will write it
+         * again, if that also fails the error is conveyed to the
+         * application through fsync()/close(). Other writes to the file
+         * are not affected.
          */
         AZLogError("[{}] Write [{}, {}) failed with status {}: {}",
                    ino,
                    bciov->offset,
-                   bciov->length,
+                   bciov->offset + bciov->length,
                    status, errstr);
 
-        inode->set_write_error(status);
+        INC_GBL_STATS(write_errors, 1);
 
         /*
          * on_io_fail() will clear flushing from all remaining membufs.
          */
-        bciov->on_io_fail();
+        bciov->on_io_fail(status);
     }
 
     delete bciov;
@@ -1594,11 +1644,11 @@ void rename_callback(
         // Silly rename has the same source and target dir.
         assert(parent_ino == newparent_ino);
 
-        silly_rename_inode->silly_renamed_name =
-            task->rpc_api->rename_task.get_newname();
-        silly_rename_inode->parent_ino =
-            task->rpc_api->rename_task.get_newparent_ino();
-        silly_rename_inode->is_silly_renamed = true;
+        struct silly_rename_info& sri =
+            silly_rename_inode->get_silly_rename_info();
+        sri.name = task->rpc_api->rename_task.get_newname();
+        sri.parent_ino = task->rpc_api->rename_task.get_newparent_ino();
+        sri.is_silly_renamed = true;
 
         /*
          * Successfully (silly)renamed, hold a ref on the parent directory
@@ -1610,11 +1660,11 @@ void rename_callback(
         AZLogInfo("[{}] Silly rename successfully completed! "
                   "to-delete: {}/{}",
                   silly_rename_ino,
-                  silly_rename_inode->parent_ino,
-                  silly_rename_inode->silly_renamed_name);
+                  sri.parent_ino,
+                  sri.name);
 
 #ifdef ENABLE_PARANOID
-        assert(silly_rename_inode->silly_renamed_name.find(".nfs") == 0);
+        assert(sri.name.find(".nfs") == 0);
 #endif
     }
 
@@ -1721,6 +1771,23 @@ void rpc_task::run_lookup()
                     nullptr /* fattr */,
                     nullptr /* file */);
             return;
+        } else if ((aznfsc_cfg.lookupcache_int == AZNFSCFG_LOOKUPCACHE_ALL) &&
+                   (get_proxy_op_type() == (fuse_opcode) 0) &&
+                   inode->negative_lookup(filename)) {
+            /*
+             * Same as lookup_callback(), we reply with a negative entry
+             * only for original lookup calls.
+             */
+            AZLogDebug("[{}/{}] Returning cached lookup (negative DNLC)",
+                    parent_ino, filename);
+
+            INC_GBL_STATS(lookup_served_from_cache, 1);
+            INC_GBL_STATS(negative_lookups_saved, 1);
+            get_client()->reply_entry(this,
+                    nullptr /* fh */,
+                    nullptr /* fattr */,
+                    nullptr /* file */);
+            return;
         }
     }
 
@@ -1808,24 +1875,6 @@ void rpc_task::run_write()
     // Update cached write timestamp, if needed.
     inode->stamp_cached_write();
 
-    /*
-     * Don't issue new writes if some previous write had failed with error.
-     * Since we store the write_error insid the nfs_inode it'll remain set
-     * till this inode is forgotten and released and then application does
-     * a fresh open to get a new nfs_inode.
-     *
-     * TODO: Shall we clear the write_error after conveying to the application
-     *       once?
-     */
-    int error_code = inode->get_write_error();
-    if (error_code != 0) {
-        AZLogWarn("[{}] Previous write to this Blob failed with error={}, "
-                  "skipping new write!", ino, error_code);
-
-        reply_error(error_code);
-        return;
-    }
-
     /*
      * Fuse doesn't let us decide the max file size supported, so kernel can
      * technically send us a request for an offset larger than we support.
@@ -1857,6 +1906,7 @@ void rpc_task::run_write()
      * membufs. We do it for 10 times before failing the write, as it's highly
      * unlikely that we need to repeat more than that.
      */
+    int error_code = 0;
     for (int i = 0; i < 10; i++) {
         error_code = inode->copy_to_cache(bufv, offset,
                                           &extent_left, &extent_right);
@@ -1881,6 +1931,75 @@ void rpc_task::run_write()
 
     assert(extent_right >= (extent_left + length));
 
+    /*
+     * Streaming writers don't benefit from holding dirty data in the cache,
+     * send the data as soon as we have a full WRITE worth of contiguous
+     * dirty data, and cap the dirty data per stream.
+     */
+    if (aznfsc_cfg.stream_write.enable &&
+        inode->on_write_check_stream(offset, length)) {
+        INC_GBL_STATS(stream_writes, 1);
+
+        static const uint64_t wsize = get_client()->mnt_options.wsize_adj;
+        static const uint64_t max_stream_dirty =
+            aznfsc_cfg.stream_write.max_dirty_mb * 1024 * 1024ULL;
+        /*
+         * Once over max_stream_dirty we wait only till the stream is a couple
+         * of WRITEs below it, so that the stream always has WRITEs in flight.
+         */
+        static const uint64_t stream_dirty_low =
+            max_stream_dirty - std::min(2 * wsize, max_stream_dirty / 2);
+
+        /*
+         * Cache/global memory pressure check says writers must wait, flush
+         * all the dirty data of the file and wait for it. This must be
+         * checked even if the extent is not yet big enough to be sent, else
+         * a stream whose WRITEs are slow can keep adding dirty data under
+         * memory pressure.
+         */
+        if (inode->get_filecache()->do_inline_write()) {
+            INC_GBL_STATS(inline_writes, 1);
+
+            AZLogDebug("[{}] Inline stream write, {} bytes extent @ [{}, {})",
+                       ino, (extent_right - extent_left),
+                       extent_left, extent_right);
+
+            const int err = inode->flush_cache_and_wait();
+            if (err == 0) {
+                reply_write(length);
+            } else {
+                reply_error(err);
+            }
+            return;
+        }
+
+        if ((extent_right - extent_left) >= wsize) {
+            std::vector<bytes_chunk> bc_vec =
+                inode->get_filecache()->get_dirty_bc_range(extent_left,
+                                                           extent_right);
+            inode->sync_membufs(bc_vec, false /* is_flush */);
+        }
+
+        /*
+         * Too much data outstanding for this stream, wait for the oldest
+         * WRITEs to complete before accepting more data.
+         */
+        if (inode->get_filecache()->bytes_dirty > max_stream_dirty) {
+            AZLogDebug("[{}] Stream has {} bytes dirty, waiting till {}",
+                       ino, inode->get_filecache()->bytes_dirty.load(),
+                       stream_dirty_low);
+
+            const int err = inode->wait_for_dirty_below(stream_dirty_low);
+            if (err != 0) {
+                reply_error(err);
+                return;
+            }
+        }
+
+        reply_write(length);
+        return;
+    }
+
     /*
      * If the extent size exceeds the max allowed dirty size as returned by
      * max_dirty_extent_bytes(), then it's time to flush the extent.
@@ -1975,8 +2094,22 @@ void rpc_task::run_flush()
 {
     const fuse_ino_t ino = rpc_api->flush_task.get_ino();
     struct nfs_inode *const inode = get_client()->get_nfs_inode_from_ino(ino);
+    const int64_t start_usec = get_current_usecs();
+    int err = inode->flush_cache_and_wait();
+
+    /*
+     * flush_cache_and_wait() saves any error it returns, so this also picks
+     * up errors seen by earlier flushes which were not reported to the
+     * application, f.e., the one done by getattr.
+     */
+    const int saved_err = inode->clear_write_error();
+    if (err == 0) {
+        err = saved_err;
+    }
 
-    reply_error(inode->flush_cache_and_wait());
+    rpc_stats_az::on_flush_complete(get_current_usecs() - start_usec);
+
+    reply_error(err);
 }
 
 void rpc_task::run_getattr()
@@ -1992,11 +2125,20 @@ void rpc_task::run_getattr()
      */
     if (aznfsc_cfg.cache.attr.user.enable) {
         if (!inode->attr_cache_expired()) {
+            if (inode->clear_bulk_refreshed()) {
+                INC_GBL_STATS(getattrs_saved, 1);
+            }
             INC_GBL_STATS(getattr_served_from_cache, 1);
             AZLogDebug("[{}] Returning cached attributes", ino);
             reply_attr(inode->get_attr(), inode->get_actimeo());
             return;
         }
+
+        /*
+         * If many of the siblings have expired too, start refreshing them
+         * with READDIRPLUS, while we GETATTR this one.
+         */
+        get_client()->bulk_revalidate(inode);
     }
 
     do {
@@ -2520,7 +2662,7 @@ void rpc_task::run_read()
     assert(size > 0);
 
     // There should not be any reads running for this RPC task initially.
-    assert(num_ongoing_backend_reads == 0);
+    assert(backend_reads.get_pending() == 0);
 
     AZLogDebug("[{}] run_read: offset {}, size: {}, chunks: {}",
                ino,
@@ -2535,11 +2677,11 @@ void rpc_task::run_read()
      * parallel. Once all chunks are uptodate we can complete the read to the
      * caller.
      *
-     * Note that we bump num_ongoing_backend_reads by 1 before issuing
-     * the first backend read. This is done to make sure if read_callback()
-     * is called before we could issues all reads, we don't mistake it for
-     * "all issued reads have completed". It is ok to update this without a lock
-     * since this is the only thread at this point which will access this.
+     * Note that arming backend_reads holds a ref for us till we are done
+     * issuing all the backend reads. This is done to make sure if
+     * read_callback() is called before we could issues all reads, we don't
+     * mistake it for "all issued reads have completed". Whoever drops the
+     * last ref sends the read response to fuse.
      *
      * Note: Membufs which are found uptodate here shouldn't suddenly become
      *       non-uptodate when the other reads complete, o/w we have a problem.
@@ -2552,7 +2694,7 @@ void rpc_task::run_read()
     [[maybe_unused]] size_t total_length = 0;
     bool found_in_cache = true;
 
-    num_ongoing_backend_reads = 1;
+    backend_reads.arm([this](int) { send_read_response(); });
 
     for (size_t i = 0; i < size; i++) {
         /*
@@ -2683,29 +2825,6 @@ void rpc_task::run_read()
     // get() must return bytes_chunks exactly covering the requested range.
     assert(total_length == rpc_api->read_task.get_size());
 
-    /*
-     * Decrement the read ref incremented above.
-     * Each completing child task will also update the parent task's
-     * num_ongoing_backend_reads, so we check for that.
-     */
-    assert(num_ongoing_backend_reads >= 1);
-    if (--num_ongoing_backend_reads != 0) {
-        assert(!found_in_cache);
-        /*
-         * Not all backend reads have completed yet. When the last backend
-         * read completes read_callback() will arrange to send the read
-         * response to fuse.
-         * This is the more common case as backend READs will take time to
-         * complete.
-         */
-        return;
-    }
-
-    /*
-     * Either no chunk needed backend read (likely) or all backend reads issued
-     * above completed (unlikely).
-     */
-
     if (found_in_cache) {
         AZLogDebug("[{}] Data read from cache, offset: {}, size: {}",
                    ino,
@@ -2713,8 +2832,16 @@ void rpc_task::run_read()
                    rpc_api->read_task.get_size());
     }
 
-    // Send the response.
-    send_read_response();
+    /*
+     * Drop the ref held by arm() above.
+     * If no chunk needed backend read (likely) or all backend reads issued
+     * above completed (unlikely), this sends the read response. Else when
+     * the last backend read completes read_callback() will send it.
+     * Note that we cannot access this task after this, as the response may
+     * have been sent and the task freed.
+     */
+    [[maybe_unused]] const bool sent = backend_reads.done(0);
+    assert(sent || !found_in_cache);
 }
 
 void rpc_task::send_read_response()
@@ -2728,11 +2855,12 @@ void rpc_task::send_read_response()
      * We must send response only after all component reads complete, they may
      * succeed or fail.
      */
-    assert(num_ongoing_backend_reads == 0);
+    assert(backend_reads.get_pending() == 0);
 
+    const int read_status = backend_reads.get_status();
     if (read_status != 0) {
         // Non-zero status indicates failure, reply with error in such cases.
-        AZLogDebug("[{}] Sending failed read response {}", ino, read_status.load());
+        AZLogDebug("[{}] Sending failed read response {}", ino, read_status);
 
         reply_error(read_status);
         return;
@@ -2743,6 +2871,12 @@ void rpc_task::send_read_response()
      * Note that only the last chunk can be partial.
      * XXX No, in case of multiple chunks and short read, multiple can be
      *     partial.
+     *
+     * Note: We don't reply with fuse_reply_data()/FUSE_BUF_SPLICE_MOVE.
+     *       Our membufs are heap allocated and libfuse write()s memory
+     *       buffers into its splice pipe, so that still copies the data
+     *       once, same as fuse_reply_iov(). Splice helps only for fd backed
+     *       buffers, revisit once file backed membufs are usable.
      */
     size_t count = bc_vec.size();
 
@@ -2826,12 +2960,12 @@ static void read_callback(
     assert(parent_task->magic == RPC_TASK_MAGIC);
 
     /*
-     * num_ongoing_backend_reads is updated only for the parent task and it
-     * counts how many child rpc tasks are ongoing for this parent task.
-     * num_ongoing_backend_reads will always be 0 for child tasks.
+     * backend_reads is used only for the parent task and it counts how many
+     * child rpc tasks are ongoing for this parent task.
+     * It will always be unused for child tasks.
      */
-    assert(parent_task->num_ongoing_backend_reads > 0);
-    assert(task->num_ongoing_backend_reads == 0);
+    assert(parent_task->backend_reads.get_pending() > 0);
+    assert(task->backend_reads.get_pending() == 0);
 
     struct bytes_chunk *bc = ctx->bc;
     assert(bc->length > 0);
@@ -3154,28 +3288,16 @@ static void read_callback(
     // For failed status we must never mark the buffer uptodate.
     assert(!status || !bc->get_membuf()->is_uptodate());
 
-    // Once failed, read_status remains at failed.
-    int expected = 0;
-    parent_task->read_status.compare_exchange_weak(expected, status);
-
     /*
-     * Decrement the number of reads issued atomically and if it becomes zero
-     * it means this is the last read completing. We send the response if all
-     * the reads have completed or the read failed.
+     * Drop this read's ref on the parent. If this is the last read
+     * completing, this sends the read response to fuse (with the first
+     * failure status, if any read failed), which also frees parent_task.
      */
-    if (--parent_task->num_ongoing_backend_reads == 0) {
-        /*
-         * Parent task must send the read response to fuse.
-         * This will also free parent_task.
-         */
-        parent_task->send_read_response();
-
+    if (parent_task->backend_reads.done(status)) {
         // Free the child task after sending the response.
         task->free_rpc_task();
     } else {
-        AZLogDebug("No response sent, waiting for more reads to complete."
-                   " num_ongoing_backend_reads: {}",
-                   parent_task->num_ongoing_backend_reads.load());
+        AZLogDebug("No response sent, waiting for more reads to complete.");
 
         /*
          * This task has completed its part of the read, free it here.
@@ -3254,12 +3376,12 @@ void rpc_task::read_from_server(struct bytes_chunk &bc)
         /*
          * Increment the number of reads issued for the parent task.
          * This should not be incremented for a jukebox retried read since the
-         * original read has already incremented the num_ongoing_backend_reads.
+         * original read has already added itself to backend_reads.
          */
         if (!is_jukebox_read) {
-            rpc_api->parent_task->num_ongoing_backend_reads++;
+            rpc_api->parent_task->backend_reads.add();
         } else {
-            assert(rpc_api->parent_task->num_ongoing_backend_reads > 0);
+            assert(rpc_api->parent_task->backend_reads.get_pending() > 0);
         }
 
         bc.num_backend_calls_issued++;
@@ -3317,23 +3439,23 @@ void rpc_task::free_rpc_task()
         /*
          * rpc_api->parent_task will be nullptr for a parent task.
          * Only parent tasks run the fuse request so only they can have
-         * bc_vec[] non-empty. Also only parent tasks can have read_status as
-         * non-zero as the overall status of the fuse read is tracked by the
+         * bc_vec[] non-empty. Also only parent tasks can have backend_reads
+         * status as non-zero as the overall status of the fuse read is tracked by the
          * parent task.
          * Also, since only child tasks send the actual READ RPC, only they
          * can fail with jukebox error and hence only they can have rpc_api
          * as nullptr.
          *
          * Note: bc_vec.empty() => child task.
-         *       (read_status != 0) => parent_task
+         *       (backend_reads.get_status() != 0) => parent_task
          */
         [[maybe_unused]] const bool is_parent_task =
             (rpc_api && rpc_api->parent_task == nullptr);
         assert(bc_vec.empty() || is_parent_task);
-        assert((read_status == 0) || is_parent_task);
-        assert(num_ongoing_backend_reads == 0);
+        assert((backend_reads.get_status() == 0) || is_parent_task);
+        assert(backend_reads.get_pending() == 0);
 
-        read_status = 0;
+        backend_reads.reset();
         bc_vec.clear();
         break;
     }
@@ -4041,6 +4163,7 @@ static void readdirplus_callback(
                    num_dirents, readdirentries.size(), eof, eof_cookie);
 
         dircache_handle->set_cookieverf(&res->READDIRPLUS3res_u.resok.cookieverf);
+        dircache_handle->set_rpc_entries(num_dirents);
 
         if (eof) {
             /*
@@ -4051,6 +4174,13 @@ static void readdirplus_callback(
             if (eof_cookie != -1) {
                 assert(num_dirents > 0);
                 dircache_handle->set_eof(eof_cookie);
+
+                /*
+                 * We have read the whole directory, all inodes held by
+                 * clear() which are still in the directory have been added
+                 * back to the cache.
+                 */
+                dircache_handle->release_held_inodes();
             } else {
                 assert(readdirentries.size() == 0);
                 if (dircache_handle->get_eof() != true) {
@@ -4075,6 +4205,15 @@ static void readdirplus_callback(
 
         // Only send to fuse if we have seen new entries.
         if (got_new_entry || eof) {
+            /*
+             * Fetch the following entries while the application consumes
+             * these.
+             */
+            if (!readdirentries.empty() && !eof) {
+                dircache_handle->set_app_cookie(readdirentries.back()->cookie);
+                task->get_client()->readdirplus_prefetch(dir_inode);
+            }
+
             task->send_readdir_or_readdirplus_response(readdirentries);
             return;
         }
@@ -4179,7 +4318,13 @@ void rpc_task::get_readdir_entries_from_cache()
      * Requested directory entries are the ones with cookie after the one
      * requested by the client.
      * Note that Blob NFS uses cookie values that increase by 1 for every file.
+     * The cache must not be purged by the inode reclaimer till we are done
+     * with the returned entries.
      */
+    const std::shared_ptr<readdirectory_cache> dircache_handle =
+        nfs_inode->get_dircache();
+    dircache_handle->start_enumeration();
+
     nfs_inode->lookup_dircache(rpc_api->readdir_task.get_offset() + 1,
                                rpc_api->readdir_task.get_size(),
                                readdirentries,
@@ -4196,6 +4341,8 @@ void rpc_task::get_readdir_entries_from_cache()
          * Note: It is okay to send less number of entries than requested since
          *       the Fuse layer will request for more num of entries later.
          */
+        dircache_handle->end_enumeration();
+
         if (readdirplus) {
             fetch_readdirplus_entries_from_server();
         } else {
@@ -4217,7 +4364,23 @@ void rpc_task::get_readdir_entries_from_cache()
          * Note that since the file doesn't really exist now, any lookup() or
          * unlink() call will fail with ENOENT.
          */
+        if (readdirplus && !readdirentries.empty() && !is_eof) {
+            /*
+             * Keep prefetching ahead of the application.
+             * See nfs_client::readdirplus_prefetch().
+             */
+            nfs_inode->get_dircache()->set_app_cookie(
+                    readdirentries.back()->cookie);
+            get_client()->readdirplus_prefetch(nfs_inode);
+        }
+
         send_readdir_or_readdirplus_response(readdirentries);
+
+        /*
+         * send_readdir_or_readdirplus_response() has handed the inode refs
+         * held for the entries over to fuse, or dropped them.
+         */
+        dircache_handle->end_enumeration();
     }
 }
 
@@ -3,6 +3,9 @@
 
 #include <thread>
 #include <vector>
+#include <algorithm>
+
+#include <sched.h>
 
 bool rpc_transport::start()
 {
@@ -22,7 +25,16 @@ bool rpc_transport::start()
     std::vector<std::thread> vt;
     std::atomic<int> successful_connections = 0;
 
-    for (int i = 0; i < client->mnt_options.num_connections; i++) {
+    /*
+     * With dynamic nconnect we start with nconnect_min connections and add
+     * more as the load increases, see scale_connections().
+     */
+    const int nconn_init = aznfsc_cfg.nconnect_dynamic ?
+                            aznfsc_cfg.nconnect_min :
+                            client->mnt_options.num_connections;
+    assert(nconn_init <= client->mnt_options.num_connections);
+
+    for (int i = 0; i < nconn_init; i++) {
         vt.emplace_back(std::thread([&, i]() {
             AZLogDebug("Starting thread for creating connection #{}", i);
 
@@ -65,36 +77,301 @@ bool rpc_transport::start()
     /*
      * Now wait for all connections to mount and setup correctly..
      */
-    AZLogDebug("Waiting for {} nconnect connection(s) to setup",
-               client->mnt_options.num_connections);
+    AZLogDebug("Waiting for {} nconnect connection(s) to setup", nconn_init);
 
     for (auto& t : vt) {
         t.join();
     }
 
     /*
-     * TODO: Continue if we have minimum number of connections?
+     * Continue in degraded mode if we have the minimum number of connections,
+     * the health monitor will create the remaining ones.
      */
-    if (successful_connections != client->mnt_options.num_connections) {
-        AZLogError("One or more connection setup failed, cleaning up!");
+    if (successful_connections < aznfsc_cfg.nconnect_min) {
+        AZLogError("Only {} of {} connection(s) could be setup, need at "
+                   "least {}, cleaning up!",
+                   successful_connections.load(),
+                   client->mnt_options.num_connections,
+                   aznfsc_cfg.nconnect_min);
         close();
         return false;
     }
 
     assert((int) nfs_connections.size() == client->mnt_options.num_connections);
 
-    AZLogDebug("Successfully created all {} nconnect connection(s)",
-               client->mnt_options.num_connections);
+    if (successful_connections != nconn_init) {
+        AZLogWarn("Only {} of {} nconnect connection(s) could be setup, "
+                  "running in degraded mode!",
+                  successful_connections.load(), nconn_init);
+    } else {
+        AZLogDebug("Successfully created all {} nconnect connection(s)",
+                   nconn_init);
+    }
+
+    nconn_active = nconn_init;
+    health_thread = std::thread(&rpc_transport::health_monitor, this);
+
+    if (aznfsc_cfg.rpc_batch_usecs > 0) {
+        batch_thread = std::thread(&rpc_transport::batch_flusher, this);
+    }
+
     return true;
 }
 
+void rpc_transport::batch_flusher()
+{
+    AZLogDebug("Started RPC batch flusher, rpc_batch_usecs={}, "
+               "rpc_batch_qdepth={}",
+               aznfsc_cfg.rpc_batch_usecs, aznfsc_cfg.rpc_batch_qdepth);
+
+    /*
+     * Check at half the batch delay so that no batch is held for more than
+     * 1.5 times rpc_batch_usecs.
+     */
+    const int sleep_usecs = std::max(aznfsc_cfg.rpc_batch_usecs / 2, 1);
+
+    while (!stop_health_thread) {
+        ::usleep(sleep_usecs);
+
+        const uint64_t now_usecs = get_current_usecs();
+
+        /*
+         * Connections retired by the health monitor are uncorked before
+         * retiring, so we only need to look at the active ones.
+         */
+        const int nconn = nconn_active;
+        for (int i = 0; i < nconn; i++) {
+            struct nfs_connection *conn = nfs_connections[i];
+            if (conn != nullptr) {
+                conn->uncork_if_expired(now_usecs);
+            }
+        }
+    }
+
+    AZLogDebug("Stopped RPC batch flusher");
+}
+
+void rpc_transport::health_monitor()
+{
+    AZLogDebug("Started connection health monitor");
+
+    uint64_t ticks = 0;
+
+    while (!stop_health_thread) {
+        ::sleep(1);
+
+        if (stop_health_thread) {
+            break;
+        }
+
+        if (aznfsc_cfg.nconnect_dynamic) {
+            scale_connections();
+        }
+
+        if ((++ticks % CONN_HEALTH_CHECK_SECS) == 0) {
+            check_connections();
+        }
+    }
+
+    AZLogDebug("Stopped connection health monitor");
+}
+
+void rpc_transport::check_connections()
+{
+    /*
+     * Median RTT of the healthy connections, to find connections with
+     * RTT spikes.
+     */
+    std::vector<uint64_t> rtts;
+    for (const struct nfs_connection *conn : nfs_connections) {
+        if (is_usable(conn) && conn->get_rtt_ewma_usec() != 0) {
+            rtts.push_back(conn->get_rtt_ewma_usec());
+        }
+    }
+
+    uint64_t median_rtt_usec = 0;
+    if (rtts.size() > 1) {
+        std::nth_element(rtts.begin(), rtts.begin() + rtts.size() / 2,
+                         rtts.end());
+        median_rtt_usec = rtts[rtts.size() / 2];
+    }
+
+    const uint64_t now_usecs = get_current_usecs();
+
+    /*
+     * Only the active connections, slots beyond these are either unused or
+     * were scaled down.
+     */
+    const int nconn = nconn_active;
+
+    for (int i = 0; i < nconn; i++) {
+        struct nfs_connection *conn = nfs_connections[i];
+
+        if (conn != nullptr && !conn->check_health(median_rtt_usec)) {
+            continue;
+        }
+
+        /*
+         * Connection missing (degraded mode) or it has been unhealthy
+         * for long, create a new one.
+         */
+        if (conn) {
+            AZLogWarn("Replacing unhealthy connection #{}", i);
+        }
+
+        struct nfs_connection *new_conn = new nfs_connection(client, i);
+        if (!new_conn->open()) {
+            AZLogError("Failed to setup connection #{}, will retry", i);
+            delete new_conn;
+            continue;
+        }
+
+        nfs_connections[i] = new_conn;
+        AZLogInfo("Connection #{} setup", i);
+
+        if (conn) {
+            conn->retire();
+            retired_connections.emplace_back(conn, now_usecs);
+        }
+    }
+
+    /*
+     * Destroy replaced connections once they have been idle for
+     * CONN_RETIRE_GRACE_SECS. Files pinned to a retired connection move off
+     * it with their next RPC (see conn_pin::get()), the ones that don't
+     * issue one are unpinned here. An issuer may have loaded the connection
+     * pointer just before it was replaced and pin it again, the grace
+     * period covers those.
+     */
+    for (auto it = retired_connections.begin();
+         it != retired_connections.end();) {
+        struct nfs_connection *conn = it->first;
+
+        if (conn->get_num_pins() != 0) {
+            release_pins(conn);
+        }
+
+        if (conn->get_outstanding_rpcs() != 0 || conn->get_num_pins() != 0) {
+            it->second = now_usecs;
+            ++it;
+        } else if ((now_usecs - it->second) >=
+                        (CONN_RETIRE_GRACE_SECS * 1000000ULL)) {
+            conn->close();
+            delete conn;
+            it = retired_connections.erase(it);
+        } else {
+            ++it;
+        }
+    }
+}
+
+void rpc_transport::scale_connections()
+{
+    const int nconn = nconn_active;
+    int total_outstanding = 0;
+
+    assert(nconn >= aznfsc_cfg.nconnect_min);
+    assert(nconn <= client->mnt_options.num_connections);
+
+    for (int i = 0; i < nconn; i++) {
+        const struct nfs_connection *conn = nfs_connections[i];
+        if (conn != nullptr) {
+            total_outstanding += conn->get_outstanding_rpcs();
+        }
+    }
+
+    /*
+     * Scale up if the average queue depth per connection stays high and
+     * scale down if it stays low. Scaling down needs the load to be low for
+     * much longer, so that bursty workloads don't cause connection churn.
+     */
+    if (total_outstanding >= (nconn * CONN_SCALE_UP_QDEPTH)) {
+        scale_up_secs++;
+        scale_down_secs = 0;
+    } else if (total_outstanding < (nconn * CONN_SCALE_DOWN_QDEPTH)) {
+        scale_down_secs++;
+        scale_up_secs = 0;
+    } else {
+        scale_up_secs = scale_down_secs = 0;
+    }
+
+    if (scale_up_secs >= CONN_SCALE_UP_SECS &&
+        nconn < client->mnt_options.num_connections) {
+        scale_up_secs = 0;
+
+        assert(nfs_connections[nconn] == nullptr);
+        struct nfs_connection *new_conn = new nfs_connection(client, nconn);
+        if (!new_conn->open()) {
+            AZLogError("Failed to setup connection #{} for scaling up",
+                       nconn);
+            delete new_conn;
+            return;
+        }
+
+        /*
+         * Publish the connection before making it schedulable.
+         */
+        nfs_connections[nconn] = new_conn;
+        nconn_active = nconn + 1;
+
+        AZLogInfo("Scaled up to {} connection(s), {} RPCs outstanding",
+                  nconn + 1, total_outstanding);
+    } else if (scale_down_secs >= CONN_SCALE_DOWN_SECS &&
+               nconn > aznfsc_cfg.nconnect_min) {
+        scale_down_secs = 0;
+
+        /*
+         * Stop scheduling new RPCs on the last connection, RPCs already
+         * issued on it complete normally and it's destroyed once drained.
+         * Files pinned to it move to the connection they now map to with
+         * their next RPC, see conn_pin.
+         */
+        struct nfs_connection *conn = nfs_connections[nconn - 1];
+        nconn_active = nconn - 1;
+        nfs_connections[nconn - 1] = nullptr;
+
+        if (conn != nullptr) {
+            conn->retire();
+            retired_connections.emplace_back(conn, get_current_usecs());
+        }
+
+        AZLogInfo("Scaled down to {} connection(s), {} RPCs outstanding",
+                  nconn - 1, total_outstanding);
+    }
+}
+
+void rpc_transport::release_pins(struct nfs_connection *conn)
+{
+    for (int i = 0; i < CONN_PIN_BUCKETS; i++) {
+        conn_pins[i].release(conn);
+    }
+}
+
 void rpc_transport::close()
 {
     assert((int) nfs_connections.size() == client->mnt_options.num_connections);
 
+    stop_health_thread = true;
+
+    if (health_thread.joinable()) {
+        health_thread.join();
+    }
+
+    if (batch_thread.joinable()) {
+        batch_thread.join();
+    }
+
+    for (auto& rc : retired_connections) {
+        release_pins(rc.first);
+        rc.first->close();
+        delete rc.first;
+    }
+    retired_connections.clear();
+
     for (int i = 0; i < (int) nfs_connections.size(); i++) {
         struct nfs_connection *connection = nfs_connections[i];
         if (connection != nullptr) {
+            release_pins(connection);
             connection->close();
             delete connection;
         }
@@ -103,30 +380,210 @@ void rpc_transport::close()
     nfs_connections.clear();
 }
 
+/*
+ * Jump consistent hash (Lamping and Veach), maps key to one of num_buckets
+ * buckets such that when num_buckets changes by one only 1/num_buckets of
+ * the keys move. This keeps most files on their connection when the number
+ * of connections changes.
+ */
+/* static */
+uint32_t rpc_transport::jump_hash(uint64_t key, uint32_t num_buckets)
+{
+    int64_t b = -1, j = 0;
+
+    assert(num_buckets > 0);
+
+    while (j < num_buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (b + 1) * (double(1LL << 31) / double((key >> 33) + 1));
+    }
+
+    return b;
+}
+
 /*
  * This function decides which connection should be chosen for sending
  * the current request.
- * TODO: This is round-robined for now, should be modified later.
  */
-struct nfs_context *rpc_transport::get_nfs_context(conn_sched_t csched,
-                                                   uint32_t fh_hash) const
+struct nfs_connection *rpc_transport::get_connection(conn_sched_t csched,
+                                                     uint32_t fh_hash,
+                                                     struct conn_pin **pin) const
 {
+    if (pin) {
+        *pin = nullptr;
+    }
+
+    /*
+     * Only schedule over the active connections, which can change with
+     * dynamic nconnect. Note that nfs_connections[] entries can also change
+     * under us, so read every entry only once.
+     */
+    const uint32_t nconn = nconn_active;
     uint32_t idx = 0;
 
+    assert(nconn > 0);
+
     switch (csched) {
         case CONN_SCHED_FIRST:
             idx = 0;
             break;
         case CONN_SCHED_RR:
-            idx = (last_context++ % client->mnt_options.num_connections);
+            idx = (last_context.fetch_add(1, std::memory_order_relaxed) %
+                   nconn);
             break;
         case CONN_SCHED_FH_HASH:
             assert(fh_hash != 0);
-            idx = fh_hash % client->mnt_options.num_connections;
+            idx = jump_hash(fh_hash, nconn);
             break;
+        case CONN_SCHED_CPU_LOCAL:
+        {
+            struct nfs_connection *conn =
+                cpu_to_node.empty() ? nullptr : get_local_connection(nconn);
+            if (conn) {
+                return conn;
+            }
+            [[fallthrough]];
+        }
+        case CONN_SCHED_LEAST_LOADED:
+        {
+            /*
+             * Start the scan from the next round robin connection so that
+             * ties (f.e. when idle) are broken round robin.
+             */
+            const uint32_t start =
+                (last_context.fetch_add(1, std::memory_order_relaxed) % nconn);
+            uint64_t min_load = UINT64_MAX;
+
+            idx = start;
+            for (uint32_t i = 0; i < nconn; i++) {
+                const uint32_t j = (start + i) % nconn;
+                const struct nfs_connection *conn = nfs_connections[j];
+
+                if (!is_usable(conn)) {
+                    continue;
+                }
+
+                const uint64_t load = conn->get_load();
+
+                if (load < min_load) {
+                    min_load = load;
+                    idx = j;
+                }
+            }
+            break;
+        }
         default:
             assert(0);
     }
 
-    return nfs_connections[idx]->get_nfs_context();
+    assert(idx < nconn);
+
+    /*
+     * If the chosen connection is missing or unhealthy, use the next usable
+     * one. If no connection is healthy, use any connection we have.
+     *
+     * FH_HASH requests must stay on the file's own connection, as the
+     * server expects all requests for a file over the same connection, so
+     * they never fail over to another connection because their connection
+     * is unhealthy. The health monitor replaces a connection that stays
+     * unhealthy, in the same slot. Only if the slot has no connection
+     * (degraded mode) do they use the fallback connection, which is the
+     * same for all requests of the file.
+     */
+    struct nfs_connection *conn = nfs_connections[idx];
+    const bool need_fallback = (csched == CONN_SCHED_FH_HASH) ?
+                               (conn == nullptr) : !is_usable(conn);
+
+    if (need_fallback) {
+        struct nfs_connection *fallback = nullptr;
+
+        for (uint32_t i = 1; i <= nconn; i++) {
+            struct nfs_connection *c = nfs_connections[(idx + i) % nconn];
+
+            if (is_usable(c)) {
+                fallback = c;
+                break;
+            } else if (fallback == nullptr && c != nullptr) {
+                fallback = c;
+            }
+        }
+
+        // start() ensures we have at least one connection.
+        assert(fallback != nullptr);
+        conn = fallback;
+    }
+
+    /*
+     * A file that has RPCs outstanding stays on the connection they were
+     * issued over, even if it maps to another connection now, unless that
+     * connection is retired/unhealthy or the pin is too old, see conn_pin.
+     */
+    if (pin && csched == CONN_SCHED_FH_HASH) {
+        *pin = &conn_pins[fh_hash % CONN_PIN_BUCKETS];
+        conn = (*pin)->get(conn);
+    }
+
+    return conn;
+}
+
+struct nfs_connection *rpc_transport::get_local_connection(
+        uint32_t nconn) const
+{
+    const int cur_cpu = ::sched_getcpu();
+    const int cur_node =
+        (cur_cpu >= 0 && cur_cpu < (int) cpu_to_node.size()) ?
+        cpu_to_node[cur_cpu] : -1;
+
+    /*
+     * Find the least loaded connection in each locality tier:
+     * 0 - service thread on our cpu.
+     * 1 - service thread on our NUMA node.
+     * 2 - any.
+     */
+    struct nfs_connection *best[3] = {nullptr, nullptr, nullptr};
+    uint64_t best_load[3] = {UINT64_MAX, UINT64_MAX, UINT64_MAX};
+
+    if (cur_cpu < 0) {
+        return nullptr;
+    }
+
+    for (uint32_t i = 0; i < nconn; i++) {
+        struct nfs_connection *conn = nfs_connections[i];
+
+        if (!is_usable(conn)) {
+            continue;
+        }
+
+        const uint64_t load = conn->get_load();
+        const int tier = (conn->get_cpu() == cur_cpu) ? 0 :
+                         (cur_node != -1 &&
+                          conn->get_numa_node() == cur_node) ? 1 : 2;
+
+        for (int t = tier; t < 3; t++) {
+            if (load < best_load[t]) {
+                best_load[t] = load;
+                best[t] = conn;
+            }
+        }
+    }
+
+    /*
+     * Don't pile up on a local connection if it's much more loaded than the
+     * least loaded connection.
+     */
+    for (int t = 0; t < 2; t++) {
+        if (best[t] &&
+            best_load[t] <= (best_load[2] * CONN_LOCAL_MAX_LOAD_FACTOR)) {
+            return best[t];
+        }
+    }
+
+    return nullptr;
+}
+
+struct nfs_context *rpc_transport::get_nfs_context(conn_sched_t csched,
+                                                   uint32_t fh_hash) const
+{
+    return get_connection(csched, fh_hash)->get_nfs_context();
 }
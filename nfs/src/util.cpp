@@ -2,6 +2,11 @@
 #include "util.h"
 
 #include <sys/sysmacros.h>
+#include <dirent.h>
+#include <sched.h>
+
+#include <fstream>
+#include <sstream>
 
 namespace aznfsc {
 
@@ -92,6 +97,82 @@ void set_kernel_readahead()
     thr.detach();
 }
 
+bool parse_cpu_list(const std::string& str, std::vector<int>& cpus)
+{
+    const std::regex rexpr("^\\s*(\\d+)(-(\\d+))?\\s*$");
+    std::stringstream ss(str);
+    std::string range;
+
+    cpus.clear();
+
+    while (std::getline(ss, range, ',')) {
+        std::smatch m;
+
+        if (!std::regex_match(range, m, rexpr)) {
+            AZLogWarn("Invalid cpu range \"{}\" in cpu list \"{}\"",
+                      range, str);
+            return false;
+        }
+
+        const int first = std::stoi(m[1]);
+        const int last = m[3].matched ? std::stoi(m[3]) : first;
+
+        if (first > last || last >= CPU_SETSIZE) {
+            AZLogWarn("Invalid cpu range \"{}\" in cpu list \"{}\"",
+                      range, str);
+            return false;
+        }
+
+        for (int cpu = first; cpu <= last; cpu++) {
+            cpus.push_back(cpu);
+        }
+    }
+
+    return !cpus.empty();
+}
+
+bool get_numa_node_cpus(int node, std::vector<int>& cpus)
+{
+    const std::string path =
+        "/sys/devices/system/node/node" + std::to_string(node) + "/cpulist";
+    std::ifstream ifs(path);
+    std::string cpulist;
+
+    if (!ifs || !std::getline(ifs, cpulist)) {
+        AZLogWarn("Failed to read {}", path);
+        return false;
+    }
+
+    return parse_cpu_list(cpulist, cpus);
+}
+
+int get_numa_node_of_cpu(int cpu)
+{
+    const std::string path =
+        "/sys/devices/system/cpu/cpu" + std::to_string(cpu);
+    DIR *dir = ::opendir(path.c_str());
+    int node = -1;
+
+    if (dir == nullptr) {
+        return -1;
+    }
+
+    /*
+     * cpu<N> directory has a node<M> symlink for the NUMA node it belongs to.
+     */
+    struct dirent *de;
+    while ((de = ::readdir(dir)) != nullptr) {
+        if (::strncmp(de->d_name, "node", 4) == 0 &&
+            ::isdigit(de->d_name[4])) {
+            node = ::atoi(de->d_name + 4);
+            break;
+        }
+    }
+
+    ::closedir(dir);
+    return node;
+}
+
 #ifdef ENABLE_PRESSURE_POINTS
 bool inject_error(double pct_prob)
 {
@@ -0,0 +1,297 @@
+#include "aznfsc.h"
+#include "nfs_client.h"
+#include "nfs_inode.h"
+#include "rpc_readdir.h"
+#include "rpc_stats.h"
+
+#include <getopt.h>
+
+/*
+ * Benchmark for directory enumeration, run against the in-process loopback
+ * server (see loopback_server), so it needs no Blob NFS endpoint and no
+ * fuse mount.
+ *
+ * It creates a directory with many files and reads it like fuse does:
+ * - cold: application enumeration with an empty readdir cache, served from
+ *   the cache where possible else with a READDIRPLUS, same as
+ *   rpc_task::get_readdir_entries_from_cache(). Each batch of entries
+ *   (one fuse readdirplus buffer) is followed by think_usecs of application
+ *   time, which the READDIRPLUS prefetch (readdir_prefetch) overlaps with
+ *   the server latency.
+ * - warm: the same enumeration again, all from the cache, this measures
+ *   walking the cookie index (dircache_entries).
+ * - dnlc: lookup of every name in the DNLC, this measures the name index.
+ *
+ * Run it with -p 0 and -p <n> to compare enumeration with and w/o prefetch.
+ */
+
+static void usage(const char *argv0)
+{
+    printf("usage: %s [options]\n\n", argv0);
+    printf("    -n <number of files, default 100000>\n");
+    printf("    -b <entries per application readdir, default 32>\n");
+    printf("    -l <loopback server latency usecs, default 500>\n");
+    printf("    -t <application think time usecs per readdir, default 100>\n");
+    printf("    -p <READDIRPLUS to prefetch ahead (readdir_prefetch), "
+           "default 2>\n");
+    printf("    -r <warm passes, default 10>\n");
+}
+
+/*
+ * Drop the dircachecnt ref held by readdirectory_cache::lookup_next(), see
+ * readdirectory_cache::dnlc_lookup().
+ */
+static void put_dirent(const std::shared_ptr<struct directory_entry>& entry)
+{
+    if (entry->nfs_inode) {
+        entry->nfs_inode->incref();
+        assert(entry->nfs_inode->dircachecnt >= 2);
+        entry->nfs_inode->dircachecnt--;
+        entry->nfs_inode->decref();
+    }
+}
+
+/*
+ * Enumerate dir, batch entries at a time, like fuse readdirplus does.
+ * Returns the number of entries seen, and in num_reads the number of
+ * READDIRPLUS the application had to wait for.
+ */
+static uint64_t enumerate(struct nfs_client& client,
+                          struct nfs_inode *dir,
+                          int batch,
+                          int think_usecs,
+                          uint64_t& num_reads)
+{
+    std::shared_ptr<readdirectory_cache>& dircache = dir->get_dircache();
+    cookieverf3 cookieverf = {};
+    cookie3 cookie = 0;
+    uint64_t num_entries = 0;
+
+    num_reads = 0;
+
+    while (true) {
+        int n = 0;
+
+        while (n < batch) {
+            const std::shared_ptr<struct directory_entry> entry =
+                dircache->lookup_next(cookie, dircache->get_seq_last_cookie());
+            if (!entry) {
+                break;
+            }
+
+            put_dirent(entry);
+            cookie = entry->cookie;
+            n++;
+        }
+
+        if (n == 0) {
+            if (dircache->get_eof() && (cookie >= dircache->get_eof_cookie())) {
+                break;
+            }
+
+            /*
+             * Cache miss, the application waits for the READDIRPLUS, same
+             * as rpc_task::fetch_readdirplus_entries_from_server().
+             */
+            cookie3 rpc_cookie = cookie;
+            bool eof = false;
+            uint64_t num_added = 0;
+
+            num_reads++;
+            if (!client.readdirplus_sync(dir, rpc_cookie, cookieverf, eof,
+                                         num_added, true /* add_to_dircache */)) {
+                fprintf(stderr, "READDIRPLUS failed at cookie %lu\n",
+                        (unsigned long) cookie);
+                break;
+            }
+
+            if ((num_added == 0) && eof) {
+                break;
+            }
+            continue;
+        }
+
+        num_entries += n;
+
+        dircache->set_app_cookie(cookie);
+        client.readdirplus_prefetch(dir);
+
+        if (think_usecs > 0) {
+            ::usleep(think_usecs);
+        }
+    }
+
+    return num_entries;
+}
+
+static void report(const char *phase, uint64_t count, uint64_t usecs)
+{
+    printf("%-6s %10lu in %8.3f secs, %12.0f/sec\n",
+           phase, (unsigned long) count, usecs / 1e6,
+           usecs ? (count * 1e6) / usecs : 0.0);
+}
+
+/*
+ * Create nfiles files in /bench with libnfs sync calls, over a connection
+ * of our own so that the client's caches don't see them.
+ */
+static bool populate(struct nfs_client& client, int nfiles)
+{
+    struct nfs_context *nfs = nfs_init_context();
+    bool ok = false;
+
+    if (nfs == nullptr) {
+        return false;
+    }
+
+    struct nfs_url *url = nfs_parse_url_full(
+            nfs, client.mnt_options.get_url_str().c_str());
+    if (url == nullptr) {
+        fprintf(stderr, "Bad url: %s\n", nfs_get_error(nfs));
+        goto out;
+    }
+
+    if (nfs_mount(nfs, url->server, url->path) != 0) {
+        fprintf(stderr, "Mount failed: %s\n", nfs_get_error(nfs));
+        nfs_destroy_url(url);
+        goto out;
+    }
+    nfs_destroy_url(url);
+
+    if (nfs_mkdir(nfs, "/bench") != 0) {
+        fprintf(stderr, "mkdir failed: %s\n", nfs_get_error(nfs));
+        goto out;
+    }
+
+    for (int i = 0; i < nfiles; i++) {
+        char path[64];
+        struct nfsfh *fh;
+
+        ::snprintf(path, sizeof(path), "/bench/file_%08d", i);
+        if (nfs_creat(nfs, path, 0644, &fh) != 0) {
+            fprintf(stderr, "creat(%s) failed: %s\n", path,
+                    nfs_get_error(nfs));
+            goto out;
+        }
+        nfs_close(nfs, fh);
+    }
+
+    ok = true;
+out:
+    nfs_destroy_context(nfs);
+    return ok;
+}
+
+int main(int argc, char *argv[])
+{
+    int nfiles = 100000;
+    int batch = 32;
+    int latency_usecs = 500;
+    int think_usecs = 100;
+    int prefetch = 2;
+    int passes = 10;
+    int opt;
+
+    while ((opt = ::getopt(argc, argv, "n:b:l:t:p:r:h")) != -1) {
+        switch (opt) {
+            case 'n': nfiles = ::atoi(optarg); break;
+            case 'b': batch = ::atoi(optarg); break;
+            case 'l': latency_usecs = ::atoi(optarg); break;
+            case 't': think_usecs = ::atoi(optarg); break;
+            case 'p': prefetch = ::atoi(optarg); break;
+            case 'r': passes = ::atoi(optarg); break;
+            default:
+                usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    if ((nfiles <= 0) || (batch <= 0) || (latency_usecs < 0) ||
+        (think_usecs < 0) || (prefetch < 0) || (passes < 0)) {
+        usage(argv[0]);
+        return 1;
+    }
+
+    aznfsc_cfg.account = ::strdup("bench");
+    aznfsc_cfg.container = ::strdup("bench");
+    aznfsc_cfg.mountpoint = "/readdir_bench";
+    aznfsc_cfg.loopback_server.enable = true;
+    aznfsc_cfg.readdir_prefetch = prefetch;
+    aznfsc_cfg.set_defaults_and_sanitize();
+
+    /*
+     * Populate w/o latency, it's not what we measure.
+     */
+    aznfsc_cfg.loopback_server.latency_usecs = 0;
+
+    struct nfs_client& client = nfs_client::get_instance();
+    if (!client.init()) {
+        fprintf(stderr, "Failed to init the NFS client\n");
+        return 1;
+    }
+
+    int ret = 1;
+    fuse_ino_t dir_ino = 0;
+    struct nfs_inode *dir = nullptr;
+    uint64_t num_reads = 0;
+    uint64_t count;
+    uint64_t start_usecs;
+
+    if (!populate(client, nfiles)) {
+        goto out;
+    }
+
+    if (!client.lookup_sync(FUSE_ROOT_ID, "bench", dir_ino)) {
+        fprintf(stderr, "Failed to lookup /bench\n");
+        goto out;
+    }
+
+    dir = client.get_nfs_inode_from_ino(dir_ino);
+    dir->alloc_dircache();
+
+    aznfsc_cfg.loopback_server.latency_usecs = latency_usecs;
+
+    printf("%d files, %d entries per readdir, latency %d usecs, "
+           "think time %d usecs, readdir_prefetch %d\n",
+           nfiles, batch, latency_usecs, think_usecs, prefetch);
+
+    start_usecs = get_current_usecs();
+    count = enumerate(client, dir, batch, think_usecs, num_reads);
+    report("cold", count, get_current_usecs() - start_usecs);
+    printf("       %lu READDIRPLUS waited for, %lu prefetched\n",
+           (unsigned long) num_reads,
+           (unsigned long) GET_GBL_STATS(readdir_prefetch_rpcs));
+
+    count = 0;
+    start_usecs = get_current_usecs();
+    for (int i = 0; i < passes; i++) {
+        count += enumerate(client, dir, batch, 0 /* think_usecs */,
+                           num_reads);
+        assert(num_reads == 0);
+    }
+    report("warm", count, get_current_usecs() - start_usecs);
+
+    count = 0;
+    start_usecs = get_current_usecs();
+    for (int i = 0; i < nfiles; i++) {
+        char name[64];
+
+        ::snprintf(name, sizeof(name), "file_%08d", i);
+        struct nfs_inode *inode = dir->dnlc_lookup(name);
+        if (inode) {
+            inode->decref();
+            count++;
+        }
+    }
+    report("dnlc", count, get_current_usecs() - start_usecs);
+
+    ret = 0;
+out:
+    if (dir) {
+        dir->get_dircache()->clear();
+        dir->decref();
+    }
+
+    client.shutdown();
+    return ret;
+}